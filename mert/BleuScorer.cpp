@@ -2,11 +2,14 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cfloat>
 #include <cmath>
 #include <climits>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <stdint.h>
 
 #include "util/exception.hh"
 #include "Ngram.h"
@@ -16,6 +19,11 @@
 #include "FeatureDataIterator.h"
 #include "Vocabulary.h"
 
+#if defined(__SSE2__)
+#define MERT_BLEU_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 namespace
@@ -263,19 +271,16 @@ float smoothedSentenceBleu
   return exp(logbleu);
 }
 
-float sentenceLevelBackgroundBleu(const std::vector<float>& sent, const std::vector<float>& bg)
+namespace
 {
-  // Sum sent and background
-  UTIL_THROW_IF(sent.size()!=bg.size(), util::Exception, "Error");
-  UTIL_THROW_IF(sent.size() != kBleuNgramOrder * 2 + 1, util::Exception, "Error");
-  std::vector<float> stats(sent.size());
-
-  for(size_t i=0; i<sent.size(); i++)
-    stats[i] = sent[i]+bg[i];
+const size_t kBleuStats = kBleuNgramOrder * 2 + 1;
 
+/** Background BLEU of stats, which already include the background */
+inline float BackgroundBleu(const float* stats)
+{
   // Calculate BLEU
   float logbleu = 0.0;
-  for (int j = 0; j < kBleuNgramOrder; j++) {
+  for (size_t j = 0; j < kBleuNgramOrder; j++) {
     logbleu += log(stats[2 * j]) - log(stats[2 * j + 1]);
   }
   logbleu /= kBleuNgramOrder;
@@ -289,6 +294,224 @@ float sentenceLevelBackgroundBleu(const std::vector<float>& sent, const std::vec
   return exp(logbleu) * stats[kBleuNgramOrder*2];
 }
 
+// The approximations are the single precision log and exp of Cephes. The
+// scalar and SSE2 versions do the same float operations in the same
+// order, so give the same results.
+
+const float kSqrtHalf = 0.707106781186547524f;
+const float kLog2e = 1.44269504088896341f;
+const float kLn2Hi = 0.693359375f;
+const float kLn2Lo = -2.12194440e-4f;
+// exp is 0 below this, and is clamped above kExpMax, as 2^n must be normal
+const float kExpMin = -87.3f;
+const float kExpMax = 88.3f;
+
+inline float FloatFromBits(uint32_t bits)
+{
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+/** log of x, which must be positive, finite and normal */
+inline float ApproxLog(float x)
+{
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  // x = m * 2^e, with m in [0.5, 1)
+  float e = static_cast<float>(static_cast<int32_t>(bits >> 23) - 126);
+  float m = FloatFromBits((bits & 0x007fffff) | 0x3f000000);
+  float twice = 0.0f;
+  if (m < kSqrtHalf) {
+    e = e - 1.0f;
+    twice = m;
+  }
+  float f = (m - 1.0f) + twice;
+  float z = f * f;
+  float y = 7.0376836292E-2f;
+  y = y * f - 1.1514610310E-1f;
+  y = y * f + 1.1676998740E-1f;
+  y = y * f - 1.2420140846E-1f;
+  y = y * f + 1.4249322787E-1f;
+  y = y * f - 1.6668057665E-1f;
+  y = y * f + 2.0000714765E-1f;
+  y = y * f - 2.4999993993E-1f;
+  y = y * f + 3.3333331174E-1f;
+  y = (y * f) * z;
+  y = y + e * kLn2Lo;
+  y = y - z * 0.5f;
+  f = f + y;
+  return f + e * kLn2Hi;
+}
+
+inline float ApproxExp(float x)
+{
+  if (x < kExpMin) return 0.0f;
+  if (x > kExpMax) x = kExpMax;
+  // x = n ln 2 + r, with |r| <= ln 2 / 2
+  float fx = x * kLog2e + 0.5f;
+  float n = static_cast<float>(static_cast<int32_t>(fx));
+  if (n > fx) n = n - 1.0f;
+  x = x - n * kLn2Hi;
+  x = x - n * kLn2Lo;
+  float z = x * x;
+  float y = 1.9875691500E-4f;
+  y = y * x + 1.3981999507E-3f;
+  y = y * x + 8.3334519073E-3f;
+  y = y * x + 4.1665795894E-2f;
+  y = y * x + 1.6666665459E-1f;
+  y = y * x + 5.0000001201E-1f;
+  y = (y * z + x) + 1.0f;
+  return y * FloatFromBits(static_cast<uint32_t>(static_cast<int32_t>(n) + 127) << 23);
+}
+
+/**
+ * Background BLEU of hypothesis i, with the sum of the log precisions
+ * taken as the log of the ratio of products, so one log and one exp.
+ * Falls back to the exact computation where that ratio is not a
+ * positive normal number, as when there are no matches.
+ */
+inline float ApproxBackgroundBleu(const BleuStatsBlock& block, const vector<float>& bg, size_t i)
+{
+  float matches = 1.0f, totals = 1.0f;
+  for (size_t j = 0; j < kBleuNgramOrder; ++j) {
+    matches = matches * (block.stats[2 * j][i] + bg[2 * j]);
+    totals = totals * (block.stats[2 * j + 1][i] + bg[2 * j + 1]);
+  }
+  float ratio = matches / totals;
+  if (!(ratio >= FLT_MIN && ratio <= FLT_MAX)) {
+    float stats[kBleuStats];
+    for (size_t k = 0; k < kBleuStats; ++k) stats[k] = block.stats[k][i] + bg[k];
+    return BackgroundBleu(stats);
+  }
+  float length = block.stats[1][i] + bg[1];
+  float reference = block.stats[kBleuNgramOrder * 2][i] + bg[kBleuNgramOrder * 2];
+  float brevity = 1.0f - reference / length;
+  float logbleu = ApproxLog(ratio) / static_cast<float>(kBleuNgramOrder);
+  logbleu = logbleu + (brevity < 0.0f ? brevity : 0.0f);
+  return ApproxExp(logbleu) * reference;
+}
+
+#ifdef MERT_BLEU_SSE2
+
+inline __m128 SseApproxLog(__m128 x)
+{
+  __m128i bits = _mm_castps_si128(x);
+  __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+  __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                           _mm_set1_epi32(0x3f000000)));
+  __m128 small = _mm_cmplt_ps(m, _mm_set1_ps(kSqrtHalf));
+  e = _mm_sub_ps(e, _mm_and_ps(small, _mm_set1_ps(1.0f)));
+  __m128 f = _mm_add_ps(_mm_sub_ps(m, _mm_set1_ps(1.0f)), _mm_and_ps(small, m));
+  __m128 z = _mm_mul_ps(f, f);
+  __m128 y = _mm_set1_ps(7.0376836292E-2f);
+  y = _mm_sub_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.1514610310E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.1676998740E-1f));
+  y = _mm_sub_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.2420140846E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.4249322787E-1f));
+  y = _mm_sub_ps(_mm_mul_ps(y, f), _mm_set1_ps(1.6668057665E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(2.0000714765E-1f));
+  y = _mm_sub_ps(_mm_mul_ps(y, f), _mm_set1_ps(2.4999993993E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, f), _mm_set1_ps(3.3333331174E-1f));
+  y = _mm_mul_ps(_mm_mul_ps(y, f), z);
+  y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(kLn2Lo)));
+  y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+  f = _mm_add_ps(f, y);
+  return _mm_add_ps(f, _mm_mul_ps(e, _mm_set1_ps(kLn2Hi)));
+}
+
+inline __m128 SseApproxExp(__m128 x)
+{
+  __m128 inRange = _mm_cmpge_ps(x, _mm_set1_ps(kExpMin));
+  x = _mm_min_ps(x, _mm_set1_ps(kExpMax));
+  __m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(kLog2e)), _mm_set1_ps(0.5f));
+  __m128i ni = _mm_cvttps_epi32(fx);
+  __m128 n = _mm_cvtepi32_ps(ni);
+  __m128 over = _mm_cmpgt_ps(n, fx);
+  n = _mm_sub_ps(n, _mm_and_ps(over, _mm_set1_ps(1.0f)));
+  ni = _mm_add_epi32(ni, _mm_castps_si128(over));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(kLn2Hi)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(kLn2Lo)));
+  __m128 z = _mm_mul_ps(x, x);
+  __m128 y = _mm_set1_ps(1.9875691500E-4f);
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507E-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073E-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894E-2f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201E-1f));
+  y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, z), x), _mm_set1_ps(1.0f));
+  __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(ni, _mm_set1_epi32(127)), 23));
+  return _mm_and_ps(inRange, _mm_mul_ps(y, scale));
+}
+
+/** ApproxBackgroundBleu of hypotheses i to i + 3 */
+inline void SseApproxBackgroundBleu(const BleuStatsBlock& block, const vector<float>& bg, size_t i, float* out)
+{
+  __m128 matches = _mm_set1_ps(1.0f), totals = _mm_set1_ps(1.0f);
+  for (size_t j = 0; j < kBleuNgramOrder; ++j) {
+    matches = _mm_mul_ps(matches, _mm_add_ps(_mm_loadu_ps(block.stats[2 * j] + i), _mm_set1_ps(bg[2 * j])));
+    totals = _mm_mul_ps(totals, _mm_add_ps(_mm_loadu_ps(block.stats[2 * j + 1] + i), _mm_set1_ps(bg[2 * j + 1])));
+  }
+  __m128 ratio = _mm_div_ps(matches, totals);
+  __m128 normal = _mm_and_ps(_mm_cmpge_ps(ratio, _mm_set1_ps(FLT_MIN)), _mm_cmple_ps(ratio, _mm_set1_ps(FLT_MAX)));
+  // Keep the log away from what it cannot take; those lanes are redone below
+  ratio = _mm_or_ps(_mm_and_ps(normal, ratio), _mm_andnot_ps(normal, _mm_set1_ps(1.0f)));
+  __m128 length = _mm_add_ps(_mm_loadu_ps(block.stats[1] + i), _mm_set1_ps(bg[1]));
+  __m128 reference = _mm_add_ps(_mm_loadu_ps(block.stats[kBleuNgramOrder * 2] + i),
+                                _mm_set1_ps(bg[kBleuNgramOrder * 2]));
+  __m128 brevity = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_div_ps(reference, length));
+  __m128 logbleu = _mm_div_ps(SseApproxLog(ratio), _mm_set1_ps(static_cast<float>(kBleuNgramOrder)));
+  logbleu = _mm_add_ps(logbleu, _mm_min_ps(brevity, _mm_setzero_ps()));
+  _mm_storeu_ps(out + i, _mm_mul_ps(SseApproxExp(logbleu), reference));
+  int mask = _mm_movemask_ps(normal);
+  if (mask == 0xf) return;
+  for (size_t k = 0; k < 4; ++k) {
+    if (!(mask & (1 << k))) out[i + k] = ApproxBackgroundBleu(block, bg, i + k);
+  }
+}
+
+#endif // MERT_BLEU_SSE2
+
+} // namespace
+
+float sentenceLevelBackgroundBleu(const std::vector<float>& sent, const std::vector<float>& bg)
+{
+  UTIL_THROW_IF(sent.size()!=bg.size(), util::Exception, "Error");
+  return sentenceLevelBackgroundBleu(&sent[0], bg);
+}
+
+float sentenceLevelBackgroundBleu(const float* sent, const std::vector<float>& bg)
+{
+  // Sum sent and background
+  UTIL_THROW_IF(bg.size() != kBleuStats, util::Exception, "Error");
+  float stats[kBleuStats];
+
+  for(size_t i=0; i<bg.size(); i++)
+    stats[i] = sent[i]+bg[i];
+
+  return BackgroundBleu(stats);
+}
+
+void sentenceLevelBackgroundBleu(const BleuStatsBlock& block, const std::vector<float>& bg,
+                                 float* out, bool approximate)
+{
+  UTIL_THROW_IF(bg.size() != kBleuStats, util::Exception,
+                "Expected " << kBleuStats << " background BLEU statistics, found " << bg.size());
+  size_t i = 0;
+  if (approximate) {
+#ifdef MERT_BLEU_SSE2
+    for (; i + 4 <= block.size; i += 4) SseApproxBackgroundBleu(block, bg, i, out);
+#endif
+    for (; i < block.size; ++i) out[i] = ApproxBackgroundBleu(block, bg, i);
+    return;
+  }
+  float stats[kBleuStats];
+  for (; i < block.size; ++i) {
+    for (size_t k = 0; k < kBleuStats; ++k) stats[k] = block.stats[k][i] + bg[k];
+    out[i] = BackgroundBleu(stats);
+  }
+}
+
 float unsmoothedBleu(const std::vector<float>& stats)
 {
   UTIL_THROW_IF(stats.size() != kBleuNgramOrder * 2 + 1, util::Exception, "Error");
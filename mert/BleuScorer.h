@@ -93,6 +93,28 @@ float smoothedSentenceBleu
  */
 float sentenceLevelBackgroundBleu(const std::vector<float>& sent, const std::vector<float>& bg);
 
+/** As above, but sent points to bg.size() statistics held elsewhere.
+ */
+float sentenceLevelBackgroundBleu(const float* sent, const std::vector<float>& bg);
+
+/**
+ * The BLEU statistics of the hypotheses of a sentence, statistic by
+ * statistic: stats[k][i] is statistic k of hypothesis i.
+ */
+struct BleuStatsBlock {
+  const float* stats[kBleuNgramOrder * 2 + 1];
+  std::size_t size;
+};
+
+/**
+ * As above, for each hypothesis of block, into out. With approximate,
+ * takes one log and one exp of each hypothesis, by polynomials worked
+ * out four hypotheses at a time, and agrees with the exact value to a
+ * few parts in 10^7.
+ */
+void sentenceLevelBackgroundBleu(const BleuStatsBlock& block, const std::vector<float>& bg,
+                                 float* out, bool approximate = false);
+
 /**
  * Computes plain old BLEU from a vector of stats
  */
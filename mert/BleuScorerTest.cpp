@@ -288,3 +288,102 @@ BOOST_AUTO_TEST_CASE(sentence_level_bleu)
   BOOST_CHECK_CLOSE(0.5624f, smoothedSentenceBleu(stats, 0.5), 0.01 );
   BOOST_CHECK_CLOSE(0.5067f, smoothedSentenceBleu(stats, 1.0, true), 0.01);
 }
+
+namespace
+{
+
+/** Statistics of n hypotheses, as columns, some without matches and some repeated */
+std::vector<std::vector<float> > MakeBleuColumns(std::size_t n)
+{
+  std::vector<std::vector<float> > columns(2 * kBleuNgramOrder + 1, std::vector<float>(n));
+  for (std::size_t i = 0; i < n; ++i) {
+    // Every fifth hypothesis repeats the one before it
+    std::size_t h = (i % 5 == 4) ? i - 1 : i;
+    float length = static_cast<float>(4 + h % 9);
+    for (std::size_t j = 0; j < kBleuNgramOrder; ++j) {
+      float total = length - j;
+      float matches = total - static_cast<float>((h + j) % 4);
+      if (h % 7 == 3) matches = 0;
+      columns[2 * j][i] = matches < 0 ? 0 : matches;
+      columns[2 * j + 1][i] = total;
+    }
+    columns[2 * kBleuNgramOrder][i] = static_cast<float>(5 + h % 6);
+  }
+  return columns;
+}
+
+BleuStatsBlock MakeBleuBlock(const std::vector<std::vector<float> >& columns)
+{
+  BleuStatsBlock block;
+  for (std::size_t k = 0; k < columns.size(); ++k) {
+    block.stats[k] = columns[k].empty() ? NULL : &columns[k][0];
+  }
+  block.size = columns[0].size();
+  return block;
+}
+
+std::vector<std::vector<float> > BackgroundStats()
+{
+  std::vector<std::vector<float> > backgrounds;
+  backgrounds.push_back(std::vector<float>(2 * kBleuNgramOrder + 1, 0.0f));
+  std::vector<float> bg;
+  for (std::size_t k = 0; k < 2 * kBleuNgramOrder + 1; ++k) {
+    bg.push_back(0.9f * (20.0f - k));
+  }
+  backgrounds.push_back(bg);
+  return backgrounds;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(background_bleu_block)
+{
+  std::vector<std::vector<float> > backgrounds = BackgroundStats();
+  for (std::size_t b = 0; b < backgrounds.size(); ++b) {
+    const std::vector<float>& bg = backgrounds[b];
+    // Fewer than, exactly and more than four hypotheses, with every tail
+    for (std::size_t n = 0; n <= 13; ++n) {
+      std::vector<std::vector<float> > columns = MakeBleuColumns(n);
+      BleuStatsBlock block = MakeBleuBlock(columns);
+      std::vector<float> out(n + 1, -1.0f);
+      sentenceLevelBackgroundBleu(block, bg, &out[0]);
+      for (std::size_t i = 0; i < n; ++i) {
+        std::vector<float> sent;
+        for (std::size_t k = 0; k < columns.size(); ++k) sent.push_back(columns[k][i]);
+        BOOST_CHECK_EQUAL(out[i], sentenceLevelBackgroundBleu(sent, bg));
+      }
+      BOOST_CHECK_EQUAL(out[n], -1.0f);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(approximate_background_bleu_block)
+{
+  std::vector<std::vector<float> > backgrounds = BackgroundStats();
+  for (std::size_t b = 0; b < backgrounds.size(); ++b) {
+    const std::vector<float>& bg = backgrounds[b];
+    for (std::size_t n = 0; n <= 13; ++n) {
+      std::vector<std::vector<float> > columns = MakeBleuColumns(n);
+      BleuStatsBlock block = MakeBleuBlock(columns);
+      std::vector<float> exact(n + 1), approximate(n + 1, -1.0f);
+      sentenceLevelBackgroundBleu(block, bg, &exact[0]);
+      sentenceLevelBackgroundBleu(block, bg, &approximate[0], true);
+      for (std::size_t i = 0; i < n; ++i) {
+        if (exact[i] == 0) {
+          BOOST_CHECK_EQUAL(approximate[i], 0.0f);
+        } else {
+          // Within a few parts in 10^7; the tolerance is in percent
+          BOOST_CHECK_CLOSE(approximate[i], exact[i], 1e-4);
+        }
+        // The same whether worked out alone or four at a time
+        BleuStatsBlock one = block;
+        for (std::size_t k = 0; k < columns.size(); ++k) one.stats[k] += i;
+        one.size = 1;
+        float alone;
+        sentenceLevelBackgroundBleu(one, bg, &alone, true);
+        BOOST_CHECK_EQUAL(approximate[i], alone);
+      }
+      BOOST_CHECK_EQUAL(approximate[n], -1.0f);
+    }
+  }
+}
@@ -20,9 +20,35 @@
 #include "util/tokenize_piece.hh"
 #include "util/string_piece.hh"
 #include "FeatureDataIterator.h"
+#include "HypothesisDedup.h"
+#include "MiraFeatureVector.h"
+#include "NbestStore.h"
 
 using namespace std;
 
+namespace
+{
+using namespace MosesTuning;
+
+/** Compares hypothesis k of a sentence with a kept one */
+class SameAsKept
+{
+public:
+  SameAsKept(const FeatureArray& features, const ScoreArray& scores, size_t k)
+    : m_features(features), m_scores(scores), m_k(k) {}
+
+  bool operator()(size_t j) const {
+    return SameHypothesis(m_features.get(m_k), m_scores.get(m_k),
+                          m_features.get(j), m_scores.get(j));
+  }
+
+private:
+  const FeatureArray& m_features;
+  const ScoreArray& m_scores;
+  size_t m_k;
+};
+} // namespace
+
 namespace MosesTuning
 {
 
@@ -46,95 +72,104 @@ Data::Data(Scorer* scorer, const string& sparse_weights_file)
 }
 
 //ADDED BY TS
-// TODO: This is too long; consider creating additional functions to
-// reduce the lines of this function.
 void Data::removeDuplicates()
 {
   size_t nSentences = m_feature_data->size();
   assert(m_score_data->size() == nSentences);
 
+  HypothesisDedup dedup;
   for (size_t s = 0; s < nSentences; s++) {
     FeatureArray& feat_array =  m_feature_data->get(s);
     ScoreArray& score_array =  m_score_data->get(s);
 
     assert(feat_array.size() == score_array.size());
 
-    //serves as a hash-map:
-    map<double, vector<size_t> > lookup;
-
-    size_t end_pos = feat_array.size() - 1;
-
-    size_t nRemoved = 0;
-
-    for (size_t k = 0; k <= end_pos; k++) {
-      const FeatureStats& cur_feats = feat_array.get(k);
-      double sum = 0.0;
-      for (size_t l = 0; l < cur_feats.size(); l++)
-        sum += cur_feats.get(l);
-
-      if (lookup.find(sum) != lookup.end()) {
-
-        //cerr << "hit" << endl;
-        vector<size_t>& cur_list = lookup[sum];
-
-        // TODO: Make sure this is correct because we have already used 'l'.
-        // If this does not impact on the removing duplicates, it is better
-        // to change
-        size_t l = 0;
-        for (l = 0; l < cur_list.size(); l++) {
-          size_t j = cur_list[l];
-
-          if (cur_feats == feat_array.get(j)
-              && score_array.get(k) == score_array.get(j)) {
-            if (k < end_pos) {
-              feat_array.swap(k,end_pos);
-              score_array.swap(k,end_pos);
-              k--;
-            }
-            end_pos--;
-            nRemoved++;
-            break;
-          }
-        }
-        if (l == lookup[sum].size())
-          cur_list.push_back(k);
+    // Duplicates are swapped to the end, then cut off
+    size_t end_pos = feat_array.size();
+    dedup.clear();
+    for (size_t k = 0; k < end_pos; ) {
+      SameAsKept same(feat_array, score_array, k);
+      uint64_t fingerprint = Fingerprint(feat_array.get(k), score_array.get(k));
+      if (dedup.Duplicate(fingerprint, k, same)) {
+        --end_pos;
+        feat_array.swap(k, end_pos);
+        score_array.swap(k, end_pos);
       } else {
-        lookup[sum].push_back(k);
+        ++k;
       }
-      // for (size_t j=0; j < k; j++) {
-
-      // 	if (feat_array.get(k) == feat_array.get(j)
-      // 	    && score_array.get(k) == score_array.get(j)) {
-
-      // 	  if (k < end_pos) {
-
-      // 	    feat_array.swap(k,end_pos);
-      // 	    score_array.swap(k,end_pos);
-
-      // 	    k--;
-      // 	  }
-
-      //          end_pos--;
-      // 	  nRemoved++;
-      //          break;
-      // 	}
-      // }
-    } // end for k
-
-    if (nRemoved > 0) {
-      feat_array.resize(end_pos+1);
-      score_array.resize(end_pos+1);
     }
+
+    feat_array.resize(end_pos);
+    score_array.resize(end_pos);
   }
 }
 //END_ADDED
 
 void Data::load(const std::string &featfile, const std::string &scorefile)
 {
+  if (NbestStore::IsStore(featfile)) {
+    UTIL_THROW_IF(scorefile != featfile, util::Exception, "The n-best store " << featfile
+                  << " holds scores too, so should also be given as the score file, not " << scorefile);
+    loadStore(featfile);
+    return;
+  }
   m_feature_data->load(featfile, m_sparse_weights);
   m_score_data->load(scorefile);
 }
 
+void Data::loadStore(const std::string &file)
+{
+  TRACE_ERR("loading n-best store from " << file << endl);
+  NbestStore store(file);
+  const size_t numDense = store.num_dense();
+  string scoreType = store.score_type();
+  if (m_feature_data->size() == 0)
+    m_feature_data->setFeatureMap(store.feature_names());
+
+  vector<ScoreStatsType> stats(store.num_stats());
+  for (size_t s = 0; s < store.num_sentences(); ++s) {
+    FeatureArray features;
+    features.setIndex(s);
+    features.NumberOfFeatures(numDense);
+    features.Features(store.feature_names());
+    ScoreArray scores;
+    scores.setIndex(s);
+    scores.NumberOfScores(store.num_stats());
+    scores.name(scoreType);
+
+    for (size_t i = 0; i < store.size(s); ++i) {
+      MiraFeatureView view = store.featuresAt(s, i);
+      FeatureStats entry(numDense);
+      entry.reset();
+      SparseVector sparse;
+      for (size_t j = 0; j < view.size(); ++j) {
+        if (j < numDense)
+          entry.add(view.val(j));
+        else
+          sparse.set(view.feat(j) - numDense, view.val(j));
+      }
+      if (m_sparse_weights.size()) {
+        // Merge the sparse features, as when reading text
+        entry.add(inner_product(m_sparse_weights, sparse));
+      } else {
+        vector<size_t> feats = sparse.feats();
+        for (size_t j = 0; j < feats.size(); ++j)
+          entry.addSparse(SparseVector::decode(feats[j]), sparse.get(feats[j]));
+      }
+      features.add(entry);
+
+      ScoreDataView view_stats = store.scoresAt(s, i);
+      for (size_t j = 0; j < stats.size(); ++j)
+        stats[j] = static_cast<ScoreStatsType>(view_stats[j]);
+      ScoreStats entry_stats(stats.size());
+      entry_stats.set(stats);
+      scores.add(entry_stats);
+    }
+    m_feature_data->add(features);
+    m_score_data->add(scores);
+  }
+}
+
 void Data::loadNBest(const string &file)
 {
   TRACE_ERR("loading nbest from " << file << endl);
@@ -205,6 +240,54 @@ void Data::save(const std::string &featfile, const std::string &scorefile, bool
   m_score_data->save(scorefile, bin);
 }
 
+void Data::saveStore(const std::string &file)
+{
+  TRACE_ERR("saving n-best store to " << file << endl);
+  UTIL_THROW_IF(m_feature_data->size() != m_score_data->size(), util::Exception,
+                "Features for " << m_feature_data->size() << " sentences, but scores for "
+                << m_score_data->size());
+  // Dense and statistics counts are those of the first hypothesis
+  size_t numDense = 0;
+  size_t numStats = 0;
+  for (size_t s = 0; s < m_feature_data->size(); ++s) {
+    if (m_feature_data->get(s).size()) {
+      numDense = m_feature_data->get(s, 0).size();
+      numStats = m_score_data->get(s, 0).size();
+      break;
+    }
+  }
+
+  NbestStoreWriter writer(numDense, numStats, m_feature_data->Features(), m_score_type);
+  vector<float> stats(numStats);
+  for (size_t s = 0; s < m_feature_data->size(); ++s) {
+    const FeatureArray& features = m_feature_data->get(s);
+    const ScoreArray& scores = m_score_data->get(s);
+    UTIL_THROW_IF(features.getIndex() != static_cast<int>(s) || scores.getIndex() != static_cast<int>(s),
+                  util::Exception, "Sentence " << features.getIndex() << " is at position " << s
+                  << ", but n-best stores need sentences numbered from 0 in order");
+    UTIL_THROW_IF(features.size() != scores.size(), util::Exception, "For sentence " << s
+                  << " features and scores have different size");
+    for (size_t i = 0; i < features.size(); ++i) {
+      const FeatureStats& feature_stats = features.get(i);
+      UTIL_THROW_IF(feature_stats.size() != numDense, util::Exception,
+                    "Expecting constant number of dense features: " << numDense
+                    << " != " << feature_stats.size());
+      FeatureDataItem item;
+      item.dense.assign(feature_stats.getArray(), feature_stats.getArray() + numDense);
+      item.sparse = feature_stats.getSparse();
+      const ScoreStats& score_stats = scores.get(i);
+      UTIL_THROW_IF(score_stats.size() != numStats, util::Exception,
+                    "Expecting constant number of score statistics: " << numStats
+                    << " != " << score_stats.size());
+      for (size_t j = 0; j < numStats; ++j)
+        stats[j] = score_stats.get(j);
+      writer.AddHypothesis(MiraFeatureVector(item).view(), ScoreDataView(stats));
+    }
+    writer.EndSentence();
+  }
+  writer.Write(file);
+}
+
 void Data::InitFeatureMap(const string& str)
 {
   string buf = str;
@@ -73,6 +73,14 @@ public:
 
   void save(const std::string &featfile, const std::string &scorefile, bool bin=false);
 
+  /**
+   * Load or save features and scores as a binary NbestStore. Sentences
+   * must be numbered from 0, in order. load() reads a store if it is given
+   * as both the feature and the score file.
+   */
+  void loadStore(const std::string &file);
+  void saveStore(const std::string &file);
+
   //ADDED BY TS
   void removeDuplicates();
   //END_ADDED
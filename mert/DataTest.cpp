@@ -75,3 +75,32 @@ BOOST_AUTO_TEST_CASE(add_features_test)
   BOOST_CHECK(IsAlmostEqual(-14.7486f, stats.get(7)));
   BOOST_CHECK(IsAlmostEqual(7.99917f,  stats.get(8)));
 }
+
+BOOST_AUTO_TEST_CASE(remove_duplicates_test)
+{
+  boost::scoped_ptr<Scorer> scorer(ScorerFactory::getScorer("BLEU", ""));
+  Data data(scorer.get());
+
+  // Hypotheses differing in only the sparse features or only the
+  // scores are kept, exact duplicates are removed
+  const float sparse[] = {0, 0, 1, 0, 0};
+  const int stats[] = {1, 1, 1, 2, 1};
+  FeatureArray features;
+  ScoreArray scores;
+  for (size_t i = 0; i < 5; ++i) {
+    FeatureStats f;
+    f.add(-1.5);
+    f.add(2);
+    if (sparse[i]) f.addSparse("s", sparse[i]);
+    features.add(f);
+    ScoreStats s;
+    s.add(stats[i]);
+    scores.add(s);
+  }
+  data.getFeatureData()->add(features);
+  data.getScoreData()->add(scores);
+
+  data.removeDuplicates();
+  BOOST_CHECK_EQUAL(data.getFeatureData()->get(0).size(), (std::size_t)3);
+  BOOST_CHECK_EQUAL(data.getScoreData()->get(0).size(), (std::size_t)3);
+}
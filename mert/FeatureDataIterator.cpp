@@ -25,6 +25,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "FeatureArray.h"
 #include "FeatureDataIterator.h"
+#include "FeatureRegistry.h"
+#include "NbestStore.h"
 
 
 using namespace std;
@@ -57,7 +59,7 @@ float ParseFloat(const StringPiece& str)
 
 bool operator==(FeatureDataItem const& item1, FeatureDataItem const& item2)
 {
-  return item1.dense==item1.dense && item1.sparse==item1.sparse;
+  return item1.dense==item2.dense && item1.sparse==item2.sparse;
 }
 
 size_t hash_value(FeatureDataItem const& item)
@@ -69,11 +71,15 @@ size_t hash_value(FeatureDataItem const& item)
 }
 
 
-FeatureDataIterator::FeatureDataIterator() {}
+FeatureDataIterator::FeatureDataIterator() : m_sentence(0) {}
 
-FeatureDataIterator::FeatureDataIterator(const string& filename)
+FeatureDataIterator::FeatureDataIterator(const string& filename) : m_sentence(0)
 {
-  m_in.reset(new FilePiece(filename.c_str()));
+  if (NbestStore::IsStore(filename)) {
+    m_store.reset(new NbestStore(filename));
+  } else {
+    m_in.reset(new FilePiece(filename.c_str()));
+  }
   readNext();
 }
 
@@ -82,6 +88,10 @@ FeatureDataIterator::~FeatureDataIterator() {}
 void FeatureDataIterator::readNext()
 {
   m_next.clear();
+  if (m_store) {
+    readStore();
+    return;
+  }
   try {
     StringPiece marker = m_in->ReadDelimited();
     if (marker != StringPiece(FEATURES_TXT_BEGIN)) {
@@ -107,7 +117,7 @@ void FeatureDataIterator::readNext()
           //sparse feature
           StringPiece second = *value;
           float floatValue = ParseFloat(second);
-          m_next.back().sparse.set(first.as_string(),floatValue);
+          m_next.back().sparse.set(first,floatValue);
         }
       }
       if (length != m_next.back().dense.size()) {
@@ -123,6 +133,30 @@ void FeatureDataIterator::readNext()
   }
 }
 
+void FeatureDataIterator::readStore()
+{
+  if (m_sentence == m_store->num_sentences()) {
+    m_store.reset();
+    m_sentence = 0;
+    return;
+  }
+  size_t numDense = m_store->num_dense();
+  const FeatureRegistry& registry = FeatureRegistry::Instance();
+  for (size_t i = 0; i < m_store->size(m_sentence); ++i) {
+    MiraFeatureView features = m_store->featuresAt(m_sentence, i);
+    m_next.push_back(FeatureDataItem());
+    FeatureDataItem& item = m_next.back();
+    for (size_t j = 0; j < features.size(); ++j) {
+      if (j < numDense) {
+        item.dense.push_back(features.val(j));
+      } else if (!registry.Dropped(features.feat(j) - numDense)) {
+        item.sparse.set(features.feat(j) - numDense, features.val(j));
+      }
+    }
+  }
+  ++m_sentence;
+}
+
 void FeatureDataIterator::increment()
 {
   readNext();
@@ -130,7 +164,9 @@ void FeatureDataIterator::increment()
 
 bool FeatureDataIterator::equal(const FeatureDataIterator& rhs) const
 {
-  if (!m_in && !rhs.m_in) {
+  if (m_store || rhs.m_store) {
+    return m_store == rhs.m_store && m_sentence == rhs.m_sentence;
+  } else if (!m_in && !rhs.m_in) {
     return true;
   } else if (!m_in) {
     return false;
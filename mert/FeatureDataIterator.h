@@ -45,6 +45,7 @@ class FilePiece;
 namespace MosesTuning
 {
 
+class NbestStore;
 
 class FileFormatException : public util::Exception
 {
@@ -79,6 +80,7 @@ class FeatureDataIterator :
 {
 public:
   FeatureDataIterator();
+  /** Reads text feature data, or the features of an NbestStore */
   explicit FeatureDataIterator(const std::string& filename);
   ~FeatureDataIterator();
 
@@ -95,8 +97,12 @@ private:
   const std::vector<FeatureDataItem>& dereference() const;
 
   void readNext();
+  void readStore();
 
   boost::shared_ptr<util::FilePiece> m_in;
+  // Set instead of m_in when reading an NbestStore
+  boost::shared_ptr<NbestStore> m_store;
+  std::size_t m_sentence;
   std::vector<FeatureDataItem> m_next;
 };
 
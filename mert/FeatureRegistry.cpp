@@ -0,0 +1,182 @@
+#include "FeatureRegistry.h"
+
+#include <cstdlib>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "util/exception.hh"
+#include "util/murmur_hash.hh"
+#include "util/string_piece_hash.hh"
+
+using namespace std;
+
+namespace MosesTuning
+{
+
+
+const char FeatureRegistry::kHashedPrefix[] = "__hash_";
+const size_t FeatureRegistry::kMaxHashBits;
+
+FeatureRegistry& FeatureRegistry::Instance()
+{
+  // Constructed before main, so before any loader threads start
+  static FeatureRegistry instance;
+  return instance;
+}
+
+namespace
+{
+// Makes sure that Instance() runs during static initialisation
+FeatureRegistry& initRegistry = FeatureRegistry::Instance();
+} // namespace
+
+size_t FeatureRegistry::Encode(const StringPiece& name)
+{
+  bool dropped;
+  return Encode(name, &dropped);
+}
+
+size_t FeatureRegistry::Encode(const StringPiece& name, bool* dropped)
+{
+  {
+    boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+    Ids::const_iterator i = FindStringPiece(m_ids, name);
+    if (i != m_ids.end()) {
+      *dropped = IsDropped(i->second);
+      return i->second;
+    }
+    if (m_hashBits) {
+      size_t bucket = Bucket(name);
+      if (!m_keepHashedNames || HasHashedName(bucket, name)) {
+        *dropped = IsDropped(m_names.size() + bucket);
+        return m_names.size() + bucket;
+      }
+    }
+  }
+  boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+  // Another thread may have added it between the locks
+  Ids::const_iterator i = FindStringPiece(m_ids, name);
+  if (i != m_ids.end()) {
+    *dropped = IsDropped(i->second);
+    return i->second;
+  }
+  if (m_hashBits) {
+    size_t bucket = Bucket(name);
+    if (m_keepHashedNames && !HasHashedName(bucket, name)) {
+      m_hashedNames[bucket].push_back(name.as_string());
+    }
+    *dropped = IsDropped(m_names.size() + bucket);
+    return m_names.size() + bucket;
+  }
+  // Only names seen before can have been dropped
+  *dropped = false;
+  size_t id = m_names.size();
+  m_names.push_back(name.as_string());
+  m_ids.insert(make_pair(m_names.back(), id));
+  return id;
+}
+
+bool FeatureRegistry::EncodeKept(const StringPiece& name, size_t* id)
+{
+  bool dropped;
+  *id = Encode(name, &dropped);
+  return !dropped;
+}
+
+size_t FeatureRegistry::Bucket(const StringPiece& name) const
+{
+  const StringPiece prefix(kHashedPrefix);
+  if (name.starts_with(prefix)) {
+    const string bucket = name.substr(prefix.size()).as_string();
+    char* end;
+    size_t parsed = strtoul(bucket.c_str(), &end, 10);
+    if (!bucket.empty() && *end == '\0' && parsed >> m_hashBits == 0) return parsed;
+  }
+  return util::MurmurHashNative(name.data(), name.size()) & ((size_t(1) << m_hashBits) - 1);
+}
+
+bool FeatureRegistry::HasHashedName(size_t bucket, const StringPiece& name) const
+{
+  HashedNames::const_iterator i = m_hashedNames.find(bucket);
+  if (i == m_hashedNames.end()) return false;
+  for (size_t j = 0; j < i->second.size(); ++j) {
+    if (name == StringPiece(i->second[j])) return true;
+  }
+  return false;
+}
+
+void FeatureRegistry::HashNames(size_t bits, bool keepNames)
+{
+  UTIL_THROW_IF(bits == 0 || bits > kMaxHashBits, util::Exception,
+                "Sparse features can be hashed to between 1 and " << kMaxHashBits << " bits, not " << bits);
+  boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+  m_hashBits = bits;
+  m_keepHashedNames = keepNames;
+}
+
+void FeatureRegistry::Drop(const vector<size_t>& ids)
+{
+  boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (m_dropped.size() <= ids[i]) m_dropped.resize(ids[i] + 1, false);
+    m_dropped[ids[i]] = true;
+  }
+}
+
+bool FeatureRegistry::Dropped(size_t id) const
+{
+  boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+  return IsDropped(id);
+}
+
+bool FeatureRegistry::Find(const StringPiece& name, size_t* id) const
+{
+  boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+  Ids::const_iterator i = FindStringPiece(m_ids, name);
+  if (i != m_ids.end()) {
+    *id = i->second;
+    return true;
+  }
+  if (!m_hashBits) return false;
+  *id = m_names.size() + Bucket(name);
+  return true;
+}
+
+string FeatureRegistry::Decode(size_t id) const
+{
+  boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+  if (id < m_names.size()) return m_names[id];
+  size_t bucket = id - m_names.size();
+  UTIL_THROW_IF(!m_hashBits || bucket >> m_hashBits, util::Exception,
+                "No sparse feature has id " << id);
+  HashedNames::const_iterator i = m_hashedNames.find(bucket);
+  if (i != m_hashedNames.end()) return i->second.front();
+  return kHashedPrefix + boost::lexical_cast<string>(bucket);
+}
+
+vector<string> FeatureRegistry::DecodeAll(size_t id) const
+{
+  {
+    boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+    if (id >= m_names.size()) {
+      HashedNames::const_iterator i = m_hashedNames.find(id - m_names.size());
+      if (i != m_hashedNames.end()) return i->second;
+    }
+  }
+  return vector<string>(1, Decode(id));
+}
+
+size_t FeatureRegistry::size() const
+{
+  boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+  return m_names.size() + (m_hashBits ? size_t(1) << m_hashBits : 0);
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
@@ -0,0 +1,111 @@
+/*
+ * FeatureRegistry.h
+ * mert - Minimum Error Rate Training
+ *
+ * The process wide mapping between sparse feature names and ids. Lookups
+ * share a lock, so loaders on several threads only wait for each other
+ * when one of them meets a new name. Ids, once given, never change.
+ *
+ * Alternatively, new names may be hashed into a fixed number of ids, so
+ * that memory does not grow with the number of names, at the price of
+ * names which collide sharing a weight.
+ */
+
+#ifndef MERT_FEATURE_REGISTRY_H
+#define MERT_FEATURE_REGISTRY_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "util/string_piece.hh"
+
+namespace MosesTuning
+{
+
+
+class FeatureRegistry
+{
+public:
+  static FeatureRegistry& Instance();
+
+  /** The id of name, giving it the next one if it has none */
+  std::size_t Encode(const StringPiece& name);
+
+  /** Sets id to that of name and returns whether it has been kept, see Drop */
+  bool EncodeKept(const StringPiece& name, std::size_t* id);
+
+  /** Sets id to that of name and returns true, or returns false if it has none */
+  bool Find(const StringPiece& name, std::size_t* id) const;
+
+  std::string Decode(std::size_t id) const;
+
+  /** Every name with id, more than one only if hashed names collided */
+  std::vector<std::string> DecodeAll(std::size_t id) const;
+
+  /** The number of names, which is one past the largest id */
+  std::size_t size() const;
+
+  /**
+   * From now on, give names not yet seen one of 2^bits ids after those
+   * already given, chosen by hashing the name. If keepNames, every name
+   * to hash to each id is kept, and Decode gives the first; otherwise, and
+   * for ids no name has hit, Decode gives kHashedPrefix followed by the
+   * bucket. Encode maps such names back to their bucket. Keeping names
+   * costs memory growing with them, so is only worth it to write weights.
+   */
+  void HashNames(std::size_t bits, bool keepNames);
+
+  static const char kHashedPrefix[];
+  // Beyond this the ids, and weights over them, take more memory than names
+  static const std::size_t kMaxHashBits = 24;
+
+  /**
+   * Marks the features with these ids as dropped. Readers then leave
+   * them out of the sparse vectors they build.
+   */
+  void Drop(const std::vector<std::size_t>& ids);
+
+  bool Dropped(std::size_t id) const;
+
+private:
+  FeatureRegistry() : m_hashBits(0), m_keepHashedNames(false) {}
+
+  std::size_t Encode(const StringPiece& name, bool* dropped);
+  std::size_t Bucket(const StringPiece& name) const;
+  // Whether name is among those kept for its bucket
+  bool HasHashedName(std::size_t bucket, const StringPiece& name) const;
+  bool IsDropped(std::size_t id) const {
+    return id < m_dropped.size() && m_dropped[id];
+  }
+
+  typedef boost::unordered_map<std::string, std::size_t> Ids;
+
+  Ids m_ids;
+  // Grows at the back without moving the names already there
+  std::deque<std::string> m_names;
+
+  // 0 unless hashing
+  std::size_t m_hashBits;
+  bool m_keepHashedNames;
+  // The names which have hashed to each bucket which has been hit
+  typedef boost::unordered_map<std::size_t, std::vector<std::string> > HashedNames;
+  HashedNames m_hashedNames;
+
+  std::vector<bool> m_dropped;
+
+  mutable boost::shared_mutex m_mutex;
+};
+
+}
+
+#endif // MERT_FEATURE_REGISTRY_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -8,6 +8,7 @@
 
 #include "FeatureStats.h"
 
+#include <algorithm>
 #include <fstream>
 #include <cmath>
 #include <stdexcept>
@@ -16,6 +17,7 @@
 
 #include "util/murmur_hash.hh"
 
+#include "FeatureRegistry.h"
 #include "Util.h"
 
 using namespace std;
@@ -29,55 +31,135 @@ namespace MosesTuning
 {
 
 
-SparseVector::name2id_t SparseVector::m_name_to_id;
-SparseVector::id2name_t SparseVector::m_id_to_name;
+const size_t SparseVector::kInline;
 
-FeatureStatsType SparseVector::get(const string& name) const
+SparseVector::SparseVector()
+  : m_ids(m_inlineIds), m_values(m_inlineValues), m_size(0), m_capacity(kInline) {}
+
+SparseVector::SparseVector(const SparseVector& other)
+  : m_ids(m_inlineIds), m_values(m_inlineValues), m_size(0), m_capacity(kInline)
 {
-  name2id_t::const_iterator name2id_iter = m_name_to_id.find(name);
-  if (name2id_iter == m_name_to_id.end()) return 0;
-  size_t id = name2id_iter->second;
-  return get(id);
+  *this = other;
 }
 
-FeatureStatsType SparseVector::get(size_t id) const
+SparseVector& SparseVector::operator=(const SparseVector& other)
+{
+  if (this == &other) return *this;
+  if (other.m_size > m_capacity) {
+    Release();
+    Allocate(other.m_size);
+  }
+  copy(other.m_ids, other.m_ids + other.m_size, m_ids);
+  copy(other.m_values, other.m_values + other.m_size, m_values);
+  m_size = other.m_size;
+  return *this;
+}
+
+SparseVector::~SparseVector()
 {
-  fvector_t::const_iterator fvector_iter = m_fvector.find(id);
-  if (fvector_iter == m_fvector.end()) return 0;
-  return fvector_iter->second;
+  Release();
 }
 
-void SparseVector::set(const string& name, FeatureStatsType value)
+void SparseVector::Allocate(size_t capacity)
 {
-  name2id_t::const_iterator name2id_iter = m_name_to_id.find(name);
-  size_t id = 0;
-  if (name2id_iter == m_name_to_id.end()) {
-    id = m_id_to_name.size();
-    m_id_to_name.push_back(name);
-    m_name_to_id[name] = id;
+  if (capacity <= kInline) {
+    m_ids = m_inlineIds;
+    m_values = m_inlineValues;
+    m_capacity = kInline;
   } else {
-    id = name2id_iter->second;
+    // Ids and values share one block, values after the ids
+    void* block = ::operator new(capacity * (sizeof(size_t) + sizeof(FeatureStatsType)));
+    m_ids = static_cast<size_t*>(block);
+    m_values = reinterpret_cast<FeatureStatsType*>(m_ids + capacity);
+    m_capacity = capacity;
   }
-  m_fvector[id] = value;
 }
 
-void SparseVector::set(size_t id, FeatureStatsType value) {
-  assert(m_id_to_name.size() > id);
-  m_fvector[id] = value;
+void SparseVector::Release()
+{
+  if (!IsInline()) ::operator delete(m_ids);
+  m_ids = m_inlineIds;
+  m_values = m_inlineValues;
+  m_capacity = kInline;
+}
+
+void SparseVector::Grow()
+{
+  if (m_size < m_capacity) return;
+  size_t* oldIds = m_ids;
+  FeatureStatsType* oldValues = m_values;
+  bool wasInline = IsInline();
+  Allocate(2 * m_capacity);
+  copy(oldIds, oldIds + m_size, m_ids);
+  copy(oldValues, oldValues + m_size, m_values);
+  if (!wasInline) ::operator delete(oldIds);
+}
+
+FeatureStatsType SparseVector::get(const StringPiece& name) const
+{
+  size_t id;
+  if (!FeatureRegistry::Instance().Find(name, &id)) return 0;
+  return get(id);
+}
+
+FeatureStatsType SparseVector::get(size_t id) const
+{
+  const size_t* i = lower_bound(m_ids, m_ids + m_size, id);
+  if (i == m_ids + m_size || *i != id) return 0;
+  return m_values[i - m_ids];
+}
+
+void SparseVector::set(const StringPiece& name, FeatureStatsType value)
+{
+  size_t id;
+  if (FeatureRegistry::Instance().EncodeKept(name, &id)) set(id, value);
+}
+
+void SparseVector::set(size_t id, FeatureStatsType value)
+{
+  // Features mostly arrive in order of id, so try the end first
+  size_t pos = m_size;
+  if (m_size && id <= m_ids[m_size - 1]) {
+    pos = lower_bound(m_ids, m_ids + m_size, id) - m_ids;
+    if (m_ids[pos] == id) {
+      m_values[pos] = value;
+      return;
+    }
+  }
+  Grow();
+  copy_backward(m_ids + pos, m_ids + m_size, m_ids + m_size + 1);
+  copy_backward(m_values + pos, m_values + m_size, m_values + m_size + 1);
+  m_ids[pos] = id;
+  m_values[pos] = value;
+  ++m_size;
 }
 
 void SparseVector::write(ostream& out, const string& sep) const
 {
-  for (fvector_t::const_iterator i = m_fvector.begin(); i != m_fvector.end(); ++i) {
-    if (abs(i->second) < 0.00001) continue;
-    string name = m_id_to_name[i->first];
-    out << name << sep << i->second << " ";
+  for (size_t i = 0; i < m_size; ++i) {
+    if (abs(m_values[i]) < 0.00001) continue;
+    string name = decode(m_ids[i]);
+    out << name << sep << m_values[i] << " ";
   }
 }
 
+void SparseVector::assign(const vector<pair<size_t, FeatureStatsType> >& sorted)
+{
+  if (sorted.size() > m_capacity) {
+    Release();
+    Allocate(sorted.size());
+  }
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    assert(i == 0 || sorted[i - 1].first < sorted[i].first);
+    m_ids[i] = sorted[i].first;
+    m_values[i] = sorted[i].second;
+  }
+  m_size = sorted.size();
+}
+
 void SparseVector::clear()
 {
-  m_fvector.clear();
+  m_size = 0;
 }
 
 void SparseVector::load(const string& file)
@@ -98,32 +180,84 @@ void SparseVector::load(const string& file)
   }
 }
 
-SparseVector& SparseVector::operator+=(const SparseVector& rhs)
+void SparseVector::Merge(const SparseVector& rhs, bool subtract)
 {
+  // Count the ids of rhs which this lacks
+  size_t added = 0;
+  for (size_t i = 0, j = 0; j < rhs.m_size; ) {
+    if (i == m_size || rhs.m_ids[j] < m_ids[i]) {
+      ++added;
+      ++j;
+    } else if (m_ids[i] < rhs.m_ids[j]) {
+      ++i;
+    } else {
+      ++i;
+      ++j;
+    }
+  }
+  if (m_size + added > m_capacity) {
+    size_t* oldIds = m_ids;
+    FeatureStatsType* oldValues = m_values;
+    bool wasInline = IsInline();
+    Allocate(max(m_size + added, 2 * m_capacity));
+    copy(oldIds, oldIds + m_size, m_ids);
+    copy(oldValues, oldValues + m_size, m_values);
+    if (!wasInline) ::operator delete(oldIds);
+  }
 
-  for (fvector_t::const_iterator i = rhs.m_fvector.begin();
-       i != rhs.m_fvector.end(); ++i) {
-    m_fvector[i->first] =  get(i->first) + (i->second);
+  // Merge from the back, so that nothing is overwritten before it is moved
+  size_t i = m_size, j = rhs.m_size, k = m_size + added;
+  while (j) {
+    FeatureStatsType value = rhs.m_values[j - 1];
+    if (i && m_ids[i - 1] > rhs.m_ids[j - 1]) {
+      --k;
+      --i;
+      m_ids[k] = m_ids[i];
+      m_values[k] = m_values[i];
+    } else if (i && m_ids[i - 1] == rhs.m_ids[j - 1]) {
+      --k;
+      --i;
+      --j;
+      m_ids[k] = m_ids[i];
+      m_values[k] = subtract ? m_values[i] - value : m_values[i] + value;
+    } else {
+      --k;
+      --j;
+      m_ids[k] = rhs.m_ids[j];
+      m_values[k] = subtract ? 0 - value : 0 + value;
+    }
   }
+  m_size += added;
+}
+
+SparseVector& SparseVector::operator+=(const SparseVector& rhs)
+{
+  Merge(rhs, false);
   return *this;
 }
 
 SparseVector& SparseVector::operator-=(const SparseVector& rhs)
 {
-
-  for (fvector_t::const_iterator i = rhs.m_fvector.begin();
-       i != rhs.m_fvector.end(); ++i) {
-    m_fvector[i->first] =  get(i->first) - (i->second);
-  }
+  Merge(rhs, true);
   return *this;
 }
 
 FeatureStatsType SparseVector::inner_product(const SparseVector& rhs) const
 {
   FeatureStatsType product = 0.0;
-  for (fvector_t::const_iterator i = m_fvector.begin();
-       i != m_fvector.end(); ++i) {
-    product += ((i->second) * (rhs.get(i->first)));
+  const size_t* rhsIds = rhs.m_ids;
+  const size_t* rhsEnd = rhs.m_ids + rhs.m_size;
+  // Against a much longer rhs, search for each id rather than step to it
+  bool search = rhs.m_size > 8 * m_size;
+  for (size_t i = 0; i < m_size && rhsIds != rhsEnd; ++i) {
+    if (search) {
+      rhsIds = lower_bound(rhsIds, rhsEnd, m_ids[i]);
+    } else {
+      while (rhsIds != rhsEnd && *rhsIds < m_ids[i]) ++rhsIds;
+    }
+    if (rhsIds != rhsEnd && *rhsIds == m_ids[i]) {
+      product += m_values[i] * rhs.m_values[rhsIds - rhs.m_ids];
+    }
   }
   return product;
 }
@@ -144,48 +278,46 @@ FeatureStatsType inner_product(const SparseVector& lhs, const SparseVector& rhs)
   }
 }
 
-std::vector<std::size_t> SparseVector::feats() const
+FeatureStatsType inner_product(const SparseVector& lhs, const std::vector<FeatureStatsType>& rhs)
 {
-  std::vector<std::size_t> toRet;
-  for(fvector_t::const_iterator iter = m_fvector.begin();
-      iter!=m_fvector.end();
-      iter++) {
-    toRet.push_back(iter->first);
+  FeatureStatsType product = 0.0;
+  const size_t* ids = lhs.ids();
+  const FeatureStatsType* values = lhs.values();
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    if (ids[i] < rhs.size()) product += values[i] * rhs[ids[i]];
   }
-  return toRet;
+  return product;
 }
 
-std::size_t SparseVector::encode(const std::string& name)
+std::vector<std::size_t> SparseVector::feats() const
 {
-  name2id_t::const_iterator name2id_iter = m_name_to_id.find(name);
-  size_t id = 0;
-  if (name2id_iter == m_name_to_id.end()) {
-    id = m_id_to_name.size();
-    m_id_to_name.push_back(name);
-    m_name_to_id[name] = id;
-  } else {
-    id = name2id_iter->second;
-  }
-  return id;
+  return std::vector<std::size_t>(m_ids, m_ids + m_size);
+}
+
+std::size_t SparseVector::encode(const StringPiece& name)
+{
+  return FeatureRegistry::Instance().Encode(name);
 }
 
 std::string SparseVector::decode(std::size_t id)
 {
-  return m_id_to_name[id];
+  return FeatureRegistry::Instance().Decode(id);
 }
 
 bool operator==(SparseVector const& item1, SparseVector const& item2)
 {
-  return item1.m_fvector==item2.m_fvector;
+  return item1.m_size == item2.m_size
+         && equal(item1.m_ids, item1.m_ids + item1.m_size, item2.m_ids)
+         && equal(item1.m_values, item1.m_values + item1.m_size, item2.m_values);
 }
 
 
 std::size_t hash_value(SparseVector const& item)
 {
   size_t seed = 0;
-  for (SparseVector::fvector_t::const_iterator i = item.m_fvector.begin(); i != item.m_fvector.end(); ++i) {
-    seed = util::MurmurHashNative(&(i->first), sizeof(i->first), seed);
-    seed = util::MurmurHashNative(&(i->second), sizeof(i->second), seed);
+  for (size_t i = 0; i < item.m_size; ++i) {
+    seed = util::MurmurHashNative(&item.m_ids[i], sizeof(item.m_ids[i]), seed);
+    seed = util::MurmurHashNative(&item.m_values[i], sizeof(item.m_values[i]), seed);
   }
   return seed;
 }
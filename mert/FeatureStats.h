@@ -13,6 +13,7 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <boost/unordered_map.hpp>
@@ -25,22 +26,88 @@ namespace MosesTuning
 {
 
 
-// Minimal sparse vector
+// Minimal sparse vector, kept as parallel arrays of ids and values in order
+// of id. A few entries are held inline, so small vectors need no allocation.
 class SparseVector
 {
 public:
-  typedef std::map<std::size_t,FeatureStatsType> fvector_t;
-  typedef std::map<std::string, std::size_t> name2id_t;
-  typedef std::vector<std::string> id2name_t;
-
-  FeatureStatsType get(const std::string& name) const;
+  // Iterates over (id, value) pairs in order of id
+  class const_iterator
+  {
+  public:
+    typedef std::pair<std::size_t, FeatureStatsType> value_type;
+
+    const_iterator() : m_id(NULL), m_value(NULL) {}
+    const_iterator(const std::size_t* id, const FeatureStatsType* value)
+      : m_id(id), m_value(value) {}
+
+    value_type operator*() const {
+      return value_type(*m_id, *m_value);
+    }
+
+    // Holds the pair which it points at, so that i->first works
+    class Arrow
+    {
+    public:
+      explicit Arrow(const value_type& pair) : m_pair(pair) {}
+      const value_type* operator->() const {
+        return &m_pair;
+      }
+    private:
+      value_type m_pair;
+    };
+    Arrow operator->() const {
+      return Arrow(**this);
+    }
+
+    const_iterator& operator++() {
+      ++m_id;
+      ++m_value;
+      return *this;
+    }
+    bool operator==(const const_iterator& other) const {
+      return m_id == other.m_id;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return m_id != other.m_id;
+    }
+
+  private:
+    const std::size_t* m_id;
+    const FeatureStatsType* m_value;
+  };
+
+  SparseVector();
+  SparseVector(const SparseVector& other);
+  SparseVector& operator=(const SparseVector& other);
+  ~SparseVector();
+
+  FeatureStatsType get(const StringPiece& name) const;
   FeatureStatsType get(std::size_t id) const;
-  void set(const std::string& name, FeatureStatsType value);
+  // Does nothing if the feature has been dropped from the FeatureRegistry
+  void set(const StringPiece& name, FeatureStatsType value);
   void set(size_t id, FeatureStatsType value);
+  // Replaces the contents with entries whose ids are increasing
+  void assign(const std::vector<std::pair<std::size_t, FeatureStatsType> >& sorted);
   void clear();
   void load(const std::string& file);
   std::size_t size() const {
-    return m_fvector.size();
+    return m_size;
+  }
+
+  const_iterator begin() const {
+    return const_iterator(m_ids, m_values);
+  }
+  const_iterator end() const {
+    return const_iterator(m_ids + m_size, m_values + m_size);
+  }
+
+  // The ids, in increasing order, and their values
+  const std::size_t* ids() const {
+    return m_ids;
+  }
+  const FeatureStatsType* values() const {
+    return m_values;
   }
 
   void write(std::ostream& out, const std::string& sep = " ") const;
@@ -53,18 +120,38 @@ public:
   std::vector<std::size_t> feats() const;
   friend bool operator==(SparseVector const& item1, SparseVector const& item2);
   friend std::size_t hash_value(SparseVector const& item);
-  static std::size_t encode(const std::string& feat);
-  static std::string decode(std::size_t feat);
   // End added by cherryc
+  // Names are kept in the FeatureRegistry
+  static std::size_t encode(const StringPiece& feat);
+  static std::string decode(std::size_t feat);
 
 private:
-  static name2id_t m_name_to_id;
-  static id2name_t m_id_to_name;
-  fvector_t m_fvector;
+  // Entries held without allocating
+  static const std::size_t kInline = 4;
+
+  bool IsInline() const {
+    return m_ids == m_inlineIds;
+  }
+  // Points m_ids and m_values at storage for capacity entries, keeping none
+  void Allocate(std::size_t capacity);
+  void Release();
+  // Room for one more entry, keeping those there are
+  void Grow();
+  // Adds rhs to this, or takes it away
+  void Merge(const SparseVector& rhs, bool subtract);
+
+  std::size_t* m_ids;
+  FeatureStatsType* m_values;
+  std::size_t m_size;
+  std::size_t m_capacity;
+  std::size_t m_inlineIds[kInline];
+  FeatureStatsType m_inlineValues[kInline];
 };
 
 SparseVector operator-(const SparseVector& lhs, const SparseVector& rhs);
 FeatureStatsType inner_product(const SparseVector& lhs, const SparseVector& rhs);
+// rhs holds a value for each id, those past its end being 0
+FeatureStatsType inner_product(const SparseVector& lhs, const std::vector<FeatureStatsType>& rhs);
 
 class FeatureStats
 {
@@ -124,20 +124,24 @@ void HgBleuScorer::UpdateMatches(const NgramCounter& counts, vector<FeatureStats
   }
 }
 
-size_t HgBleuScorer::GetTargetLength(const Edge& edge) const {
+size_t HgBleuScorer::GetTargetLength(size_t edge) const {
   size_t targetLength = 0;
-  for (size_t i = 0; i < edge.Words().size(); ++i) {
-    const Vocab::Entry* word = edge.Words()[i];
+  ArrayRange<const Vocab::Entry*> words = graph_.Words(edge);
+  for (size_t i = 0; i < words.size(); ++i) {
+    const Vocab::Entry* word = words[i];
     if (word) ++targetLength;
   }
-  for (size_t i = 0; i < edge.Children().size(); ++i) {
-    const VertexState& state = vertexStates_[edge.Children()[i]];
+  ArrayRange<uint32_t> children = graph_.Children(edge);
+  for (size_t i = 0; i < children.size(); ++i) {
+    const VertexState& state = vertexStates_[children[i]];
     targetLength += state.targetLength;
   }
   return targetLength;
 }
 
-FeatureStatsType HgBleuScorer::Score(const Edge& edge, const Vertex& head, vector<FeatureStatsType>& bleuStats) {
+FeatureStatsType HgBleuScorer::Score(size_t edge, vector<FeatureStatsType>& bleuStats) {
+  ArrayRange<const Vocab::Entry*> words = graph_.Words(edge);
+  ArrayRange<uint32_t> children = graph_.Children(edge);
   NgramCounter ngramCounts;
   size_t childId = 0;
   size_t wordId = 0;
@@ -147,15 +151,15 @@ FeatureStatsType HgBleuScorer::Score(const Edge& edge, const Vertex& head, vecto
   bool inRightContext = false;
   list<WordVec> openNgrams;
   const Vocab::Entry* currentWord = NULL;
-  while (wordId < edge.Words().size()) { 
-    currentWord = edge.Words()[wordId];
+  while (wordId < words.size()) { 
+    currentWord = words[wordId];
     if (currentWord != NULL) {
       ++wordId;
     } else {
       if (!inLeftContext && !inRightContext) {
         //entering a vertex
         assert(!vertexState);
-        vertexState = &(vertexStates_[edge.Children()[childId]]);
+        vertexState = &(vertexStates_[children[childId]]);
         ++childId;
         if (vertexState->leftContext.size()) {
           inLeftContext = true;
@@ -221,15 +225,15 @@ FeatureStatsType HgBleuScorer::Score(const Edge& edge, const Vertex& head, vecto
   UpdateMatches(ngramCounts, bleuStats);
 
   //Child vertexes
-  for (size_t i = 0; i < edge.Children().size(); ++i) {
-    //cerr << "vertex ngrams " << edge.Children()[i] << endl;
+  for (size_t i = 0; i < children.size(); ++i) {
+    //cerr << "vertex ngrams " << children[i] << endl;
     for (size_t j = 0; j < bleuStats.size(); ++j) {
-      bleuStats[j] += vertexStates_[edge.Children()[i]].bleuStats[j];
+      bleuStats[j] += vertexStates_[children[i]].bleuStats[j];
     }
   }
   
 
-  FeatureStatsType sourceLength = head.SourceCovered();
+  FeatureStatsType sourceLength = graph_.SourceCovered(graph_.Head(edge));
   size_t referenceLength = references_.Length(sentenceId_);
   FeatureStatsType effectiveReferenceLength = 
     sourceLength / totalSourceLength_ * referenceLength;
@@ -242,9 +246,11 @@ FeatureStatsType HgBleuScorer::Score(const Edge& edge, const Vertex& head, vecto
   return bleu;
 }
 
-void HgBleuScorer::UpdateState(const Edge& winnerEdge, size_t vertexId, const vector<FeatureStatsType>& bleuStats) {
+void HgBleuScorer::UpdateState(size_t winnerEdge, size_t vertexId, const vector<FeatureStatsType>& bleuStats) {
   //TODO: Maybe more efficient to absorb into the Score() method
   VertexState& vertexState = vertexStates_[vertexId];
+  ArrayRange<const Vocab::Entry*> words = graph_.Words(winnerEdge);
+  ArrayRange<uint32_t> children = graph_.Children(winnerEdge);
   //cerr << "Updating state for " << vertexId << endl;
   
   //leftContext
@@ -253,15 +259,15 @@ void HgBleuScorer::UpdateState(const Edge& winnerEdge, size_t vertexId, const ve
   int contexti = 0; //index within child context
   int childi = 0;
   while (vertexState.leftContext.size() < (kBleuNgramOrder-1)) {
-    if ((size_t)wi >= winnerEdge.Words().size()) break;
-    const Vocab::Entry* word = winnerEdge.Words()[wi];
+    if ((size_t)wi >= words.size()) break;
+    const Vocab::Entry* word = words[wi];
     if (word != NULL) {
       vertexState.leftContext.push_back(word);
       ++wi;
     } else {
       if (childState == NULL) {
         //start of child state
-        childState = &(vertexStates_[winnerEdge.Children()[childi++]]);
+        childState = &(vertexStates_[children[childi++]]);
         contexti = 0;
       } 
       if ((size_t)contexti < childState->leftContext.size()) {
@@ -275,19 +281,19 @@ void HgBleuScorer::UpdateState(const Edge& winnerEdge, size_t vertexId, const ve
   }
 
   //rightContext
-  wi = winnerEdge.Words().size() - 1;
+  wi = words.size() - 1;
   childState = NULL;
-  childi = winnerEdge.Children().size() - 1;
+  childi = children.size() - 1;
   while (vertexState.rightContext.size() < (kBleuNgramOrder-1)) {
     if (wi < 0) break;
-    const Vocab::Entry* word = winnerEdge.Words()[wi];
+    const Vocab::Entry* word = words[wi];
     if (word != NULL) {
       vertexState.rightContext.push_back(word);
       --wi;
     } else {
       if (childState == NULL) {
         //start (ie rhs) of child state
-        childState = &(vertexStates_[winnerEdge.Children()[childi--]]);
+        childState = &(vertexStates_[children[childi--]]);
         contexti = childState->rightContext.size()-1;
       }
       if (contexti >= 0) {
@@ -307,25 +313,29 @@ void HgBleuScorer::UpdateState(const Edge& winnerEdge, size_t vertexId, const ve
 }
 
 
-typedef pair<const Edge*,FeatureStatsType> BackPointer;
+//The edge, or kNoEdge at a dead end, and its score
+typedef pair<size_t,FeatureStatsType> BackPointer;
+static const size_t kNoEdge = static_cast<size_t>(-1);
 
 
 /**
  * Recurse through back pointers
  **/
-static void GetBestHypothesis(size_t vertexId, const Graph& graph, const vector<BackPointer>& bps,
+static void GetBestHypothesis(size_t vertexId, const FrozenGraph& graph, const vector<BackPointer>& bps,
      HgHypothesis* bestHypo) {
   //cerr << "Expanding " << vertexId << endl;
   //UTIL_THROW_IF(bps[vertexId].second == kMinScore+1, HypergraphException, "Landed at vertex " << vertexId << " which is a dead end");
-  if (!bps[vertexId].first) return;
-  const Edge* prevEdge = bps[vertexId].first;
-  bestHypo->featureVector += *(prevEdge->Features().get());
+  if (bps[vertexId].first == kNoEdge) return;
+  size_t prevEdge = bps[vertexId].first;
+  graph.AddFeatures(prevEdge, &bestHypo->featureVector);
+  ArrayRange<const Vocab::Entry*> words = graph.Words(prevEdge);
+  ArrayRange<uint32_t> children = graph.Children(prevEdge);
   size_t childId = 0;
-  for (size_t i = 0; i < prevEdge->Words().size(); ++i) {
-    if (prevEdge->Words()[i] != NULL) {
-      bestHypo->text.push_back(prevEdge->Words()[i]);
+  for (size_t i = 0; i < words.size(); ++i) {
+    if (words[i] != NULL) {
+      bestHypo->text.push_back(words[i]);
     } else {
-      size_t childVertexId = prevEdge->Children()[childId++];
+      size_t childVertexId = children[childId++];
       HgHypothesis childHypo;
       GetBestHypothesis(childVertexId,graph,bps,&childHypo);
       bestHypo->text.insert(bestHypo->text.end(), childHypo.text.begin(), childHypo.text.end());
@@ -334,39 +344,49 @@ static void GetBestHypothesis(size_t vertexId, const Graph& graph, const vector<
   }
 }
 
-void Viterbi(const Graph& graph, const SparseVector& weights, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
+template <class Weights> static FeatureStatsType ModelScore(const FrozenGraph& graph, size_t edge, const Weights& weights)
+{
+  return graph.GetScore(edge, weights);
+}
+
+static FeatureStatsType ModelScore(const FrozenGraph&, size_t edge, const EdgeScores& scores)
+{
+  return scores[edge];
+}
+
+template <class Weights> static void ViterbiWith(const FrozenGraph& graph, const Weights& weights, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
 {
-  BackPointer init(NULL,kMinScore);
+  BackPointer init(kNoEdge,kMinScore);
   vector<BackPointer> backPointers(graph.VertexSize(),init);
   HgBleuScorer bleuScorer(references, graph, sentenceId, backgroundBleu);
   vector<FeatureStatsType> winnerStats(kBleuNgramOrder*2+1);
+  vector<FeatureStatsType> bleuStats(kBleuNgramOrder*2+1);
   for (size_t vi = 0; vi < graph.VertexSize(); ++vi) {
     //cerr << "vertex id " << vi <<  endl;
     FeatureStatsType winnerScore = kMinScore;
-    const Vertex& vertex = graph.GetVertex(vi);
-    const vector<const Edge*>& incoming = vertex.GetIncoming();
-    if (!incoming.size()) {
+    if (graph.IncomingBegin(vi) == graph.IncomingEnd(vi)) {
       //UTIL_THROW(HypergraphException, "Vertex " << vi << " has no incoming edges");
       //If no incoming edges, vertex is a dead end
-      backPointers[vi].first = NULL;
+      backPointers[vi].first = kNoEdge;
       backPointers[vi].second = kMinScore/2;  
     } else {
       //cerr << "\nVertex: " << vi << endl;
-      for (size_t ei = 0; ei < incoming.size(); ++ei) {
+      for (size_t ei = graph.IncomingBegin(vi); ei < graph.IncomingEnd(vi); ++ei) {
         //cerr << "edge id " << ei << endl;
-        FeatureStatsType incomingScore = incoming[ei]->GetScore(weights);
-        for (size_t i = 0; i < incoming[ei]->Children().size(); ++i) {
-          size_t childId = incoming[ei]->Children()[i];
+        FeatureStatsType incomingScore = ModelScore(graph, ei, weights);
+        ArrayRange<uint32_t> children = graph.Children(ei);
+        for (size_t i = 0; i < children.size(); ++i) {
+          size_t childId = children[i];
           UTIL_THROW_IF(backPointers[childId].second == kMinScore,
             HypergraphException, "Graph was not topologically sorted. curr=" << vi << " prev=" << childId);
           incomingScore += backPointers[childId].second;
         }
-        vector<FeatureStatsType> bleuStats(kBleuNgramOrder*2+1);
+        fill(bleuStats.begin(), bleuStats.end(), 0);
        // cerr << "Score: " << incomingScore << " Bleu: ";
        // if (incomingScore > nonbleuscore) {nonbleuscore = incomingScore; nonbleuid = ei;}
         FeatureStatsType totalScore = incomingScore;
         if (bleuWeight) { 
-          FeatureStatsType bleuScore = bleuScorer.Score(*(incoming[ei]), vertex, bleuStats);
+          FeatureStatsType bleuScore = bleuScorer.Score(ei, bleuStats);
           if (isnan(bleuScore)) {
             cerr << "WARN: bleu score undefined" << endl;
             cerr << "\tVertex id : " << vi << endl;
@@ -386,7 +406,7 @@ void Viterbi(const Graph& graph, const SparseVector& weights, float bleuWeight,
           //We only store the feature score (not the bleu score) with the vertex,
           //since the bleu score is always cumulative, ie from counts for the whole span.
           winnerScore = totalScore;
-          backPointers[vi].first = incoming[ei];
+          backPointers[vi].first = ei;
           backPointers[vi].second = incomingScore;
           winnerStats = bleuStats;
         }
@@ -394,7 +414,7 @@ void Viterbi(const Graph& graph, const SparseVector& weights, float bleuWeight,
       //update with winner
       //if (bleuWeight) {
       //TODO: Not sure if we need this when computing max-model solution
-      bleuScorer.UpdateState(*(backPointers[vi].first), vi, winnerStats);
+      bleuScorer.UpdateState(backPointers[vi].first, vi, winnerStats);
 
     }
   }
@@ -428,5 +448,34 @@ void Viterbi(const Graph& graph, const SparseVector& weights, float bleuWeight,
   bestHypo->bleuStats[kBleuNgramOrder*2] = references.Length(sentenceId);
 }
 
+void Viterbi(const FrozenGraph& graph, const SparseVector& weights, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
+{
+  ViterbiWith(graph, weights, bleuWeight, references, sentenceId, backgroundBleu, bestHypo);
+}
+
+void Viterbi(const FrozenGraph& graph, const std::vector<FeatureStatsType>& weights, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
+{
+  ViterbiWith(graph, weights, bleuWeight, references, sentenceId, backgroundBleu, bestHypo);
+}
+
+void Viterbi(const FrozenGraph& graph, const EdgeScores& scores, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
+{
+  ViterbiWith(graph, scores, bleuWeight, references, sentenceId, backgroundBleu, bestHypo);
+}
+
+void Viterbi(const Graph& graph, const SparseVector& weights, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
+{
+  FrozenGraph frozen;
+  frozen.Freeze(graph);
+  ViterbiWith(frozen, weights, bleuWeight, references, sentenceId, backgroundBleu, bestHypo);
+}
+
+void Viterbi(const Graph& graph, const std::vector<FeatureStatsType>& weights, float bleuWeight, const ReferenceSet& references , size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu,  HgHypothesis* bestHypo) 
+{
+  FrozenGraph frozen;
+  frozen.Freeze(graph);
+  ViterbiWith(frozen, weights, bleuWeight, references, sentenceId, backgroundBleu, bestHypo);
+}
+
 
 };
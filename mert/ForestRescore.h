@@ -82,16 +82,17 @@ struct VertexState {
 **/
 class HgBleuScorer {
   public:
-    HgBleuScorer(const ReferenceSet& references, const Graph& graph, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu):
+    HgBleuScorer(const ReferenceSet& references, const FrozenGraph& graph, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu):
     references_(references), sentenceId_(sentenceId), graph_(graph), backgroundBleu_(backgroundBleu),
       backgroundRefLength_(backgroundBleu[kBleuNgramOrder*2]) {
       vertexStates_.resize(graph.VertexSize());
-      totalSourceLength_ = graph.GetVertex(graph.VertexSize()-1).SourceCovered();
+      totalSourceLength_ = graph.SourceCovered(graph.VertexSize()-1);
     }
 
-    FeatureStatsType Score(const Edge& edge, const Vertex& head, std::vector<FeatureStatsType>& bleuStats) ;
+    //Edges are numbered as in the graph
+    FeatureStatsType Score(size_t edge, std::vector<FeatureStatsType>& bleuStats) ;
 
-    void UpdateState(const Edge& winnerEdge, size_t vertexId, const std::vector<FeatureStatsType>& bleuStats);
+    void UpdateState(size_t winnerEdge, size_t vertexId, const std::vector<FeatureStatsType>& bleuStats);
 
 
   private:
@@ -99,12 +100,12 @@ class HgBleuScorer {
     std::vector<VertexState> vertexStates_;
     size_t sentenceId_;
     size_t totalSourceLength_;
-    const Graph& graph_;
+    const FrozenGraph& graph_;
     std::vector<FeatureStatsType> backgroundBleu_;
     FeatureStatsType backgroundRefLength_;
 
     void UpdateMatches(const NgramCounter& counter, std::vector<FeatureStatsType>& bleuStats) const;
-    size_t GetTargetLength(const Edge& edge) const;
+    size_t GetTargetLength(size_t edge) const;
 };
 
 struct HgHypothesis {
@@ -113,7 +114,17 @@ struct HgHypothesis {
   std::vector<FeatureStatsType> bleuStats;
 };
 
+void Viterbi(const FrozenGraph& graph, const SparseVector& weights, float bleuWeight, const ReferenceSet& references, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu, HgHypothesis* bestHypo);
+
+//As above, with a weight for each feature id, those past the end being 0
+void Viterbi(const FrozenGraph& graph, const std::vector<FeatureStatsType>& weights, float bleuWeight, const ReferenceSet& references, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu, HgHypothesis* bestHypo);
+
+//As above, with the model score of each edge already worked out
+void Viterbi(const FrozenGraph& graph, const EdgeScores& scores, float bleuWeight, const ReferenceSet& references, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu, HgHypothesis* bestHypo);
+
+//As above, freezing graph first
 void Viterbi(const Graph& graph, const SparseVector& weights, float bleuWeight, const ReferenceSet& references, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu, HgHypothesis* bestHypo);
+void Viterbi(const Graph& graph, const std::vector<FeatureStatsType>& weights, float bleuWeight, const ReferenceSet& references, size_t sentenceId, const std::vector<FeatureStatsType>& backgroundBleu, HgHypothesis* bestHypo);
 
 };
 
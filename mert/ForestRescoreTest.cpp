@@ -215,6 +215,15 @@ BOOST_AUTO_TEST_CASE(viterbi_3branch_lattice)
   BOOST_CHECK_EQUAL(words[12]->first, modelHypo.text[4]->first);
   BOOST_CHECK_EQUAL(words[1]->first, modelHypo.text[5]->first);
 
+  //same weights, held densely
+  vector<FeatureStatsType> denseWeights(max(SparseVector::encode(f1), SparseVector::encode(f2)) + 1);
+  denseWeights[SparseVector::encode(f1)] = 2;
+  denseWeights[SparseVector::encode(f2)] = 1;
+  HgHypothesis denseModelHypo;
+  Viterbi(graph, denseWeights, 0, references, 0, bg, &denseModelHypo);
+  BOOST_CHECK(modelHypo.featureVector == denseModelHypo.featureVector);
+  BOOST_CHECK(modelHypo.text == denseModelHypo.text);
+
 
   HgHypothesis hopeHypo;
   Viterbi(graph, weights, 1, references, 0, bg, &hopeHypo);
@@ -22,12 +22,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 
 #include "util/exception.hh"
 #include "util/file_piece.hh"
 
 #include "BleuScorer.h"
+#include "FeatureRegistry.h"
 #include "HopeFearDecoder.h"
+#include "HypergraphStore.h"
+#include "MiraKernels.h"
+#include "Timer.h"
+#include "WorkerPool.h"
 
 using namespace std;
 namespace fs = boost::filesystem;
@@ -36,32 +42,98 @@ namespace MosesTuning {
 
 static const ValType BLEU_RATIO = 5;
 
-ValType HopeFearDecoder::Evaluate(const AvgWeightVector& wv) {
+size_t HopeFearDecoder::HopeFearBatch(
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              size_t batchSize,
+              WorkerPool& pool,
+              std::vector<HopeFearData>* hopeFear
+              ) {
+  //Grown before decoding, as moving a HopeFearData would leave its views behind
+  if (hopeFear->size() < batchSize) hopeFear->resize(batchSize);
+  size_t count = 0;
+  for (; count < batchSize && !finished(); next()) {
+    HopeFear(backgroundBleu, wv, &((*hopeFear)[count++]));
+  }
+  return count;
+}
+
+ValType HopeFearDecoder::Evaluate(const AvgWeightVector& wv, WorkerPool& pool) {
   vector<ValType> stats(kBleuNgramOrder*2+1,0);
+  SumMaxModel(wv,pool,&stats);
+  return unsmoothedBleu(stats);
+}
+
+void HopeFearDecoder::SumMaxModel(const AvgWeightVector& wv, WorkerPool& pool, vector<ValType>* stats) {
   for(reset(); !finished(); next()) {
     vector<ValType> sent;
     MaxModel(wv,&sent);
     for(size_t i=0; i<sent.size(); i++) {
-      stats[i]+=sent[i];
+      (*stats)[i]+=sent[i];
     }
   }
-  return unsmoothedBleu(stats);
 }
 
-NbestHopeFearDecoder::NbestHopeFearDecoder(
-      const vector<string>& featureFiles,
-      const vector<string>&  scoreFiles,
-      bool streaming,
-      bool  no_shuffle,
-      bool safe_hope
-      ) : safe_hope_(safe_hope) {
-  if (streaming) {
-    train_.reset(new StreamingHypPackEnumerator(featureFiles, scoreFiles));
-  } else {
-    train_.reset(new RandomAccessHypPackEnumerator(featureFiles, scoreFiles, no_shuffle));
-  }
+void HopeFearDecoder::HopeFear(
+              size_t sentence,
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              HopeFearData* hopeFear
+              ) const {
+  UTIL_THROW(util::Exception, "Decoder does not support access to sentences by index");
+}
+
+void HopeFearDecoder::MaxModel(size_t sentence, const AvgWeightVector& wv, vector<ValType>* stats) const {
+  UTIL_THROW(util::Exception, "Decoder does not support access to sentences by index");
 }
 
+// Sentences per max model task, enough to outweigh handing out the task
+static const size_t kMaxModelRangeSize = 64;
+
+/**
+ * Base for tasks which sum max model stats over a range of sentences. The
+ * ranges are of kMaxModelRangeSize sentences whatever the number of threads,
+ * and are added up in order, so the sum does not depend on the threads.
+ **/
+class MaxModelRangeTask : public WorkerTask {
+public:
+  MaxModelRangeTask(size_t begin, size_t end) :
+    begin_(begin), end_(end), stats_(kBleuNgramOrder*2+1,0) {}
+
+  virtual void Run() {
+    vector<ValType> sent;
+    for (size_t i = begin_; i < end_; ++i) {
+      MaxModel(i, &sent);
+      for (size_t j = 0; j < sent.size(); ++j) {
+        stats_[j] += sent[j];
+      }
+    }
+  }
+
+  const vector<ValType>& Stats() const {return stats_;}
+
+protected:
+  virtual void MaxModel(size_t i, vector<ValType>* stats) = 0;
+
+private:
+  size_t begin_;
+  size_t end_;
+  vector<ValType> stats_;
+};
+
+template <class Task> static void RunAndSum(boost::ptr_vector<Task>& tasks, WorkerPool& pool, vector<ValType>* stats) {
+  vector<WorkerTask*> taskPtrs;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    taskPtrs.push_back(&tasks[i]);
+  }
+  pool.Run(taskPtrs);
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    const vector<ValType>& taskStats = tasks[i].Stats();
+    for (size_t j = 0; j < taskStats.size(); ++j) {
+      (*stats)[j] += taskStats[j];
+    }
+  }
+}
 
 void NbestHopeFearDecoder::next() {
   train_->next();
@@ -75,77 +147,358 @@ void NbestHopeFearDecoder::reset() {
   train_->reset();
 }
 
-void NbestHopeFearDecoder::HopeFear(
+void NbestHopeFearDecoder::SaveState(ostream* os) const {
+  //Streaming always starts again at the top of the files
+  if (randomAccess_) randomAccess_->savebin(os);
+}
+
+void NbestHopeFearDecoder::LoadState(istream* is) {
+  if (randomAccess_) randomAccess_->loadbin(is);
+}
+
+/** Hypotheses of the current sentence of an enumerator */
+class CurrentHyps {
+public:
+  explicit CurrentHyps(HypPackEnumerator& train) : train_(train) {}
+  size_t size() const {return train_.cur_size();}
+  MiraFeatureView featuresAt(size_t i) const {return train_.featuresAt(i);}
+  ScoreDataView scoresAt(size_t i) const {return train_.scoresAt(i);}
+  template <class Weights> void scoreAll(const Weights& wv, vector<ValType>* scores) const {
+    train_.ScoreAll(wv, scores);
+  }
+  /** The features of a hypothesis, copied as they go once the enumerator moves on */
+  MiraFeatureView keep(size_t i, MiraFeatureVector* storage) const {
+    storage->assign(featuresAt(i));
+    return storage->view();
+  }
+private:
+  HypPackEnumerator& train_;
+};
+
+/** Hypotheses of any sentence held in memory */
+class StoredHyps {
+public:
+  StoredHyps(const RandomAccessHypPackEnumerator& train, size_t sentence) :
+    train_(train), sentence_(sentence) {}
+  size_t size() const {return train_.size(sentence_);}
+  MiraFeatureView featuresAt(size_t i) const {return train_.featuresAt(sentence_,i);}
+  ScoreDataView scoresAt(size_t i) const {return train_.scoresAt(sentence_,i);}
+  template <class Weights> void scoreAll(const Weights& wv, vector<ValType>* scores) const {
+    train_.ScoreAll(sentence_, wv, scores);
+  }
+  /** The features of a hypothesis, which stay where they are */
+  MiraFeatureView keep(size_t i, MiraFeatureVector*) const {return featuresAt(i);}
+private:
+  const RandomAccessHypPackEnumerator& train_;
+  size_t sentence_;
+};
+
+/** Scores of the hypotheses of a sentence, kept to save allocating for each sentence */
+struct NbestScores {
+  vector<ValType> model;
+  vector<ValType> bleu;
+  // The BLEU statistics, statistic by statistic
+  vector<float> stats;
+  // Hope or fear score
+  vector<ValType> objective;
+};
+
+template <class Hyps> static void NbestHopeFear(
+              const Hyps& hyps,
               const std::vector<ValType>& backgroundBleu,
               const MiraWeightVector& wv,
+              bool safe_hope,
+              bool approximate_bleu,
+              NbestScores* scores,
               HopeFearData* hopeFear
               ) {
 
-  
-  // Hope / fear decode
-  ValType hope_scale = 1.0;
+  // Score every hypothesis at once, then pick out hope, fear and model
+  size_t size = hyps.size();
+  hyps.scoreAll(wv, &scores->model);
+  scores->bleu.resize(size);
+  scores->objective.resize(size);
+  scores->stats.resize(size * backgroundBleu.size());
   size_t hope_index=0, fear_index=0, model_index=0;
-  ValType hope_score=0, fear_score=0, model_score=0;
-  for(size_t safe_loop=0; safe_loop<2; safe_loop++) {
-    ValType hope_bleu, hope_model;
-    for(size_t i=0; i< train_->cur_size(); i++) {
-      const MiraFeatureVector& vec=train_->featuresAt(i);
-      ValType score = wv.score(vec);
-      ValType bleu = sentenceLevelBackgroundBleu(train_->scoresAt(i),backgroundBleu);
-      // Hope
-      if(i==0 || (hope_scale*score + bleu) > hope_score) {
-        hope_score = hope_scale*score + bleu;
-        hope_index = i;
-        hope_bleu = bleu;
-        hope_model = score;
-      }
-      // Fear
-      if(i==0 || (score - bleu) > fear_score) {
-        fear_score = score - bleu;
-        fear_index = i;
-      }
-      // Model
-      if(i==0 || score > model_score) {
-        model_score = score;
-        model_index = i;
-      }
+  if (size) {
+    BleuStatsBlock block;
+    block.size = size;
+    for(size_t k=0; k<backgroundBleu.size(); k++) block.stats[k] = &scores->stats[k * size];
+    // Checking every hypothesis also covers the hope, fear and model ones below
+    for(size_t i=0; i<size; i++) {
+      ScoreDataView stats = hyps.scoresAt(i);
+      UTIL_THROW_IF(stats.size() != backgroundBleu.size(), util::Exception,
+                    "Expected " << backgroundBleu.size() << " BLEU statistics per hypothesis, found "
+                    << stats.size());
+      for(size_t k=0; k<backgroundBleu.size(); k++) scores->stats[k * size + i] = stats[k];
+    }
+    sentenceLevelBackgroundBleu(block, backgroundBleu, &scores->bleu[0], approximate_bleu);
+    const ValType* model = &scores->model[0];
+    const ValType* bleu = &scores->bleu[0];
+    ValType* objective = &scores->objective[0];
+    model_index = ArgMaxKernel(model, size);
+    for(size_t i=0; i<size; i++) objective[i] = model[i] - bleu[i];
+    fear_index = ArgMaxKernel(objective, size);
+    ValType hope_scale = 1.0;
+    for(size_t safe_loop=0; safe_loop<2; safe_loop++) {
+      for(size_t i=0; i<size; i++) objective[i] = hope_scale*model[i] + bleu[i];
+      hope_index = ArgMaxKernel(objective, size);
+      // Second pass rescales the contribution of model score to 'hope' in antagonistic cases
+      // where model score is having far more influence than BLEU
+      ValType hope_bleu = bleu[hope_index] * BLEU_RATIO; // We only care about cases where model has MUCH more influence than BLEU
+      ValType hope_model = model[hope_index];
+      if(safe_hope && safe_loop==0 && abs(hope_model)>1e-8 && abs(hope_bleu)/abs(hope_model)<hope_scale)
+        hope_scale = abs(hope_bleu) / abs(hope_model);
+      else break;
     }
-    // Outer loop rescales the contribution of model score to 'hope' in antagonistic cases
-    // where model score is having far more influence than BLEU
-    hope_bleu *= BLEU_RATIO; // We only care about cases where model has MUCH more influence than BLEU
-    if(safe_hope_ && safe_loop==0 && abs(hope_model)>1e-8 && abs(hope_bleu)/abs(hope_model)<hope_scale)
-      hope_scale = abs(hope_bleu) / abs(hope_model);
-    else break;
   }
-  hopeFear->modelFeatures = train_->featuresAt(model_index);
-  hopeFear->hopeFeatures = train_->featuresAt(hope_index);
-  hopeFear->fearFeatures = train_->featuresAt(fear_index);
+  hopeFear->hopeFeatures = hyps.keep(hope_index, &hopeFear->hopeStorage);
+  hopeFear->fearFeatures = hyps.keep(fear_index, &hopeFear->fearStorage);
 
-  hopeFear->hopeStats = train_->scoresAt(hope_index);
+  ScoreDataView hope_stats = hyps.scoresAt(hope_index);
+  hopeFear->hopeStats.assign(hope_stats.begin(), hope_stats.end());
   hopeFear->hopeBleu = sentenceLevelBackgroundBleu(hopeFear->hopeStats, backgroundBleu);
-  const vector<float>& fear_stats = train_->scoresAt(fear_index);
-  hopeFear->fearBleu = sentenceLevelBackgroundBleu(fear_stats, backgroundBleu);
+  ScoreDataView fear_stats = hyps.scoresAt(fear_index);
+  hopeFear->fearBleu = sentenceLevelBackgroundBleu(fear_stats.begin(), backgroundBleu);
 
-  hopeFear->modelStats = train_->scoresAt(model_index);
+  ScoreDataView model_stats = hyps.scoresAt(model_index);
+  hopeFear->modelStats.assign(model_stats.begin(), model_stats.end());
   hopeFear->hopeFearEqual = (hope_index == fear_index);
 }
 
-void NbestHopeFearDecoder::MaxModel(const AvgWeightVector& wv, std::vector<ValType>* stats) {
+/** Decodes one in-memory sentence of a batch */
+class NbestHopeFearTask : public WorkerTask {
+public:
+  NbestHopeFearTask(const StoredHyps& hyps, const vector<ValType>& backgroundBleu,
+    const MiraWeightVector& wv, bool safe_hope, bool approximate_bleu, NbestScores* scores,
+    HopeFearData* hopeFear) :
+    hyps_(hyps), backgroundBleu_(backgroundBleu), wv_(wv), safe_hope_(safe_hope),
+    approximate_bleu_(approximate_bleu), scores_(scores), hopeFear_(hopeFear) {}
+
+  virtual void Run() {
+    NbestHopeFear(hyps_, backgroundBleu_, wv_, safe_hope_, approximate_bleu_, scores_, hopeFear_);
+  }
+
+private:
+  StoredHyps hyps_;
+  const vector<ValType>& backgroundBleu_;
+  const MiraWeightVector& wv_;
+  bool safe_hope_;
+  bool approximate_bleu_;
+  NbestScores* scores_;
+  HopeFearData* hopeFear_;
+};
+
+/** The sentences of a batch, and the tasks decoding them */
+struct NbestBatch {
+  vector<size_t> sentences;
+  boost::ptr_vector<NbestHopeFearTask> tasks;
+  vector<WorkerTask*> taskPtrs;
+};
+
+void NbestHopeFearDecoder::HopeFear(
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              HopeFearData* hopeFear
+              ) {
+  NbestHopeFear(CurrentHyps(*train_), backgroundBleu, wv, safe_hope_, approximate_bleu_, &scores_[0], hopeFear);
+}
+
+size_t NbestHopeFearDecoder::HopeFearBatch(
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              size_t batchSize,
+              WorkerPool& pool,
+              std::vector<HopeFearData>* hopeFear
+              ) {
+  //Streamed sentences are gone once we move on, so decode in sequence
+  if (!randomAccess_) {
+    return HopeFearDecoder::HopeFearBatch(backgroundBleu, wv, batchSize, pool, hopeFear);
+  }
+  vector<size_t>& sentences = batch_->sentences;
+  sentences.clear();
+  for (; sentences.size() < batchSize && !finished(); next()) {
+    sentences.push_back(train_->cur_id());
+  }
+  if (hopeFear->size() < sentences.size()) hopeFear->resize(sentences.size());
+  if (numScores_ < sentences.size()) {
+    scores_.reset(new NbestScores[sentences.size()]);
+    numScores_ = sentences.size();
+  }
+  batch_->tasks.clear();
+  batch_->taskPtrs.clear();
+  for (size_t i = 0; i < sentences.size(); ++i) {
+    batch_->tasks.push_back(new NbestHopeFearTask(StoredHyps(*randomAccess_, sentences[i]),
+      backgroundBleu, wv, safe_hope_, approximate_bleu_, &scores_[i], &((*hopeFear)[i])));
+    batch_->taskPtrs.push_back(&batch_->tasks.back());
+  }
+  pool.Run(batch_->taskPtrs);
+  return sentences.size();
+}
+
+template <class Hyps> static void NbestMaxModel(const Hyps& hyps, const AvgWeightVector& wv,
+                                                NbestScores* scores, std::vector<ValType>* stats) {
   // Find max model
-  size_t max_index=0;
-  ValType max_score=0;
-  for(size_t i=0; i<train_->cur_size(); i++) {
-    MiraFeatureVector vec(train_->featuresAt(i));
-    ValType score = wv.score(vec);
-    if(i==0 || score > max_score) {
-      max_index = i;
-      max_score = score;
-    }
+  hyps.scoreAll(wv, &scores->model);
+  size_t max_index = scores->model.empty() ? 0 : ArgMaxKernel(&scores->model[0], scores->model.size());
+  ScoreDataView max_stats = hyps.scoresAt(max_index);
+  stats->assign(max_stats.begin(), max_stats.end());
+}
+
+NbestHopeFearDecoder::NbestHopeFearDecoder(
+      const vector<string>& featureFiles,
+      const vector<string>&  scoreFiles,
+      bool streaming,
+      bool  no_shuffle,
+      bool safe_hope,
+      size_t prefetch,
+      uint64_t memoryBudget,
+      const string& scratch,
+      bool approximate_bleu
+      ) : randomAccess_(NULL), safe_hope_(safe_hope), approximate_bleu_(approximate_bleu),
+      batch_(new NbestBatch), scores_(new NbestScores[1]), numScores_(1) {
+  if (streaming) {
+    train_.reset(new StreamingHypPackEnumerator(featureFiles, scoreFiles, prefetch));
+  } else {
+    randomAccess_ = new RandomAccessHypPackEnumerator(featureFiles, scoreFiles, no_shuffle, memoryBudget, scratch);
+    train_.reset(randomAccess_);
   }
-  *stats = train_->scoresAt(max_index);
 }
 
+NbestHopeFearDecoder::~NbestHopeFearDecoder() {}
+
+void NbestHopeFearDecoder::MaxModel(const AvgWeightVector& wv, std::vector<ValType>* stats) {
+  NbestMaxModel(CurrentHyps(*train_), wv, &scores_[0], stats);
+}
+
+size_t NbestHopeFearDecoder::NumSentences() const {
+  return randomAccess_ ? randomAccess_->num_sentences() : 0;
+}
 
+void NbestHopeFearDecoder::HopeFear(
+              size_t sentence,
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              HopeFearData* hopeFear
+              ) const {
+  UTIL_THROW_IF(!randomAccess_, util::Exception, "Cannot access streamed n-best lists by index");
+  NbestScores scores;
+  NbestHopeFear(StoredHyps(*randomAccess_, sentence), backgroundBleu, wv, safe_hope_, approximate_bleu_, &scores, hopeFear);
+}
+
+void NbestHopeFearDecoder::MaxModel(size_t sentence, const AvgWeightVector& wv, vector<ValType>* stats) const {
+  UTIL_THROW_IF(!randomAccess_, util::Exception, "Cannot access streamed n-best lists by index");
+  NbestScores scores;
+  NbestMaxModel(StoredHyps(*randomAccess_, sentence), wv, &scores, stats);
+}
+
+class NbestMaxModelTask : public MaxModelRangeTask {
+public:
+  NbestMaxModelTask(const RandomAccessHypPackEnumerator& train, const vector<size_t>& sentences,
+    size_t begin, size_t end, const AvgWeightVector& wv) :
+    MaxModelRangeTask(begin,end), train_(train), sentences_(sentences), wv_(wv) {}
+
+protected:
+  virtual void MaxModel(size_t i, vector<ValType>* stats) {
+    NbestMaxModel(StoredHyps(train_, sentences_[i]), wv_, &scores_, stats);
+  }
+
+private:
+  const RandomAccessHypPackEnumerator& train_;
+  const vector<size_t>& sentences_;
+  const AvgWeightVector& wv_;
+  NbestScores scores_;
+};
+
+void NbestHopeFearDecoder::SumMaxModel(const AvgWeightVector& wv, WorkerPool& pool, vector<ValType>* stats) {
+  if (!randomAccess_) {
+    HopeFearDecoder::SumMaxModel(wv, pool, stats);
+    return;
+  }
+  vector<size_t> sentences;
+  for (reset(); !finished(); next()) {
+    sentences.push_back(train_->cur_id());
+  }
+  boost::ptr_vector<NbestMaxModelTask> tasks;
+  for (size_t begin = 0; begin < sentences.size(); begin += kMaxModelRangeSize) {
+    size_t end = min(begin + kMaxModelRangeSize, sentences.size());
+    tasks.push_back(new NbestMaxModelTask(*randomAccess_, sentences, begin, end, wv));
+  }
+  RunAndSum(tasks, pool, stats);
+}
+
+
+
+/** A hypergraph read on a thread of its own, so with words and features still to number */
+struct LoadedGraph : boost::noncopyable {
+  explicit LoadedGraph(const fs::path& path) : path(path), graph(vocab) {}
+
+  fs::path path;
+  Vocab vocab;
+  Graph graph;
+  GraphFeatures features;
+  WordVec entries;
+  vector<size_t> ids;
+  boost::shared_ptr<FrozenGraph> pruned;
+};
+
+class ReadGraphTask : public WorkerTask {
+public:
+  explicit ReadGraphTask(LoadedGraph& loaded) : loaded_(loaded) {}
+
+  virtual void Run() {
+    const string path = loaded_.path.string();
+    if (HypergraphStore::IsStore(path)) {
+      HypergraphStore(path).Load(&loaded_.graph, &loaded_.features);
+      return;
+    }
+    util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+    util::FilePiece file(fd.release());
+    ReadGraph(file, loaded_.graph, &loaded_.features);
+  }
+
+private:
+  LoadedGraph& loaded_;
+};
+
+/** Number the words and features of a loaded graph, then freeze it, pruned unless edgeCount is 0 */
+class PruneGraphTask : public WorkerTask {
+public:
+  PruneGraphTask(LoadedGraph* loaded, Vocab& vocab, const SparseVector& weights, size_t edgeCount,
+                 const string& saveAs) :
+    loaded_(*loaded), vocab_(vocab), weights_(weights), edgeCount_(edgeCount), saveAs_(saveAs) {}
+
+  virtual void Run() {
+    loaded_.graph.Renumber(vocab_, loaded_.entries, loaded_.features, loaded_.ids);
+    if (edgeCount_) {
+      FrozenGraph whole;
+      whole.Freeze(loaded_.graph);
+      whole.Prune(loaded_.pruned.get(), weights_, edgeCount_);
+    } else {
+      loaded_.pruned->Freeze(loaded_.graph);
+    }
+    if (!saveAs_.empty()) {
+      Graph saved(vocab_);
+      loaded_.pruned->Thaw(&saved);
+      HypergraphStore::Write(saved, NULL, saveAs_);
+    }
+  }
+
+private:
+  LoadedGraph& loaded_;
+  Vocab& vocab_;
+  const SparseVector& weights_;
+  size_t edgeCount_;
+  string saveAs_;
+};
+
+/** Run the tasks, then delete them */
+static void RunTasks(WorkerPool& pool, boost::ptr_vector<WorkerTask>* tasks) {
+  vector<WorkerTask*> run;
+  for (size_t i = 0; i < tasks->size(); ++i) run.push_back(&(*tasks)[i]);
+  pool.Run(run);
+  tasks->clear();
+}
 
 HypergraphHopeFearDecoder::HypergraphHopeFearDecoder
                           (
@@ -156,7 +509,9 @@ HypergraphHopeFearDecoder::HypergraphHopeFearDecoder
                             bool no_shuffle,
                             bool safe_hope,
                             size_t hg_pruning,
-                            const MiraWeightVector& wv
+                            const MiraWeightVector& wv,
+                            size_t threads,
+                            const string& prunedDir
                           ) :
                           num_dense_(num_dense) {
 
@@ -164,35 +519,71 @@ HypergraphHopeFearDecoder::HypergraphHopeFearDecoder
   UTIL_THROW_IF(!fs::exists(hypergraphDir), HypergraphException, "Directory '" << hypergraphDir << "' does not exist");
   UTIL_THROW_IF(!referenceFiles.size(), util::Exception, "No reference files supplied");
   references_.Load(referenceFiles, vocab_);
+  if (!prunedDir.empty()) fs::create_directories(prunedDir);
 
   SparseVector weights;
   wv.ToSparse(&weights);
 
   static const string kWeights = "weights";
   fs::directory_iterator dend;
-  size_t fileCount = 0;
-  cerr << "Reading hypergraphs" << endl;
+  vector<fs::path> files;
   for (fs::directory_iterator di(hypergraphDir); di != dend; ++di) {
     if (di->path().filename() == kWeights) continue;
-    Graph graph(vocab_);
-    size_t id = boost::lexical_cast<size_t>(di->path().stem().string());
-    util::scoped_fd fd(util::OpenReadOrThrow(di->path().string().c_str()));
-    //util::FilePiece file(di->path().string().c_str());
-    util::FilePiece file(fd.release()); 
-    ReadGraph(file,graph);
+    files.push_back(di->path());
+  }
 
-    //cerr << "ref length " << references_.Length(id) << endl;
-    size_t edgeCount = hg_pruning * references_.Length(id);
-    boost::shared_ptr<Graph> prunedGraph;
-    prunedGraph.reset(new Graph(vocab_));
-    graph.Prune(prunedGraph.get(), weights, edgeCount);
-    graphs_[id] = prunedGraph;
-    //cerr << "Pruning to v=" << graphs_[id]->VertexSize() << " e=" << graphs_[id]->EdgeSize()  << endl;
-    ++fileCount;
-    if (fileCount % 10 == 0) cerr << ".";
-    if (fileCount % 400 ==  0) cerr << " [count=" << fileCount << "]\n";
+  // Read and prune a few graphs per thread at a time, giving their words
+  // and features ids in between, in the order of a serial read
+  WorkerPool pool(threads);
+  size_t chunk = 4 * pool.Size();
+  FeatureRegistry& registry = FeatureRegistry::Instance();
+  Timer timer;
+  timer.start();
+  cerr << "Reading hypergraphs" << endl;
+  for (size_t begin = 0; begin < files.size(); begin += chunk) {
+    size_t end = min(begin + chunk, files.size());
+    boost::ptr_vector<LoadedGraph> loaded;
+    boost::ptr_vector<WorkerTask> tasks;
+    for (size_t i = begin; i < end; ++i) {
+      loaded.push_back(new LoadedGraph(files[i]));
+      tasks.push_back(new ReadGraphTask(loaded.back()));
+    }
+    RunTasks(pool, &tasks);
+
+    for (size_t i = 0; i < loaded.size(); ++i) {
+      LoadedGraph& graph = loaded[i];
+      vocab_.Add(graph.vocab, &graph.entries);
+      const vector<string>& names = graph.features.Names();
+      graph.ids.resize(names.size());
+      for (size_t n = 0; n < names.size(); ++n) {
+        if (!registry.EncodeKept(names[n], &graph.ids[n])) graph.ids[n] = GraphFeatures::kDropped;
+      }
+      size_t id = boost::lexical_cast<size_t>(graph.path.stem().string());
+      //cerr << "ref length " << references_.Length(id) << endl;
+      size_t edgeCount = hg_pruning * references_.Length(id);
+      // Pruning to 0 edges per word keeps the whole graph
+      graph.pruned.reset(new FrozenGraph());
+      string saveAs;
+      if (!prunedDir.empty()) saveAs = (fs::path(prunedDir) / (graph.path.stem().string() + ".hg")).string();
+      tasks.push_back(new PruneGraphTask(&graph, vocab_, weights, edgeCount, saveAs));
+      graphs_[id] = graph.pruned;
+    }
+    RunTasks(pool, &tasks);
+
+    for (size_t fileCount = begin + 1; fileCount <= end; ++fileCount) {
+      if (fileCount % 10 == 0) cerr << ".";
+      if (fileCount % 400 ==  0) cerr << " [count=" << fileCount << ", "
+        << fileCount / timer.get_elapsed_wall_time() << " graphs/s]\n";
+    }
+  }
+  double seconds = timer.get_elapsed_wall_time();
+  size_t bytes = 0;
+  for (GraphColl::const_iterator gi = graphs_.begin(); gi != graphs_.end(); ++gi) {
+    graphIndex_.push_back(gi);
+    bytes += gi->second->MemoryUsage();
   }
-  cerr << endl << "Done" << endl;
+  cerr << endl << "Done, " << files.size() / seconds << " graphs/s, holding "
+       << (bytes >> 10) << " KB of graphs" << endl;
 
 
 }
@@ -209,28 +600,28 @@ bool HypergraphHopeFearDecoder::finished() {
   return graphIter_ == graphs_.end();
 }
 
-void HypergraphHopeFearDecoder::HopeFear(
+static void HgHopeFear(
+            const FrozenGraph& graph,
+            size_t sentenceId,
+            const ReferenceSet& references,
+            size_t num_dense,
+            const EdgeScores& scores,
             const vector<ValType>& backgroundBleu,
-            const MiraWeightVector& wv,
             HopeFearData* hopeFear
             ) {
-  size_t sentenceId = graphIter_->first;
-  SparseVector weights;
-  wv.ToSparse(&weights);
-  const Graph& graph = *(graphIter_->second);
 
   ValType hope_scale = 1.0;
   HgHypothesis hopeHypo, fearHypo, modelHypo;
   for(size_t safe_loop=0; safe_loop<2; safe_loop++) {
 
     //hope decode
-    Viterbi(graph, weights, 1, references_, sentenceId, backgroundBleu, &hopeHypo);
+    Viterbi(graph, scores, 1, references, sentenceId, backgroundBleu, &hopeHypo);
 
     //fear decode
-    Viterbi(graph, weights, -1, references_, sentenceId, backgroundBleu, &fearHypo);
+    Viterbi(graph, scores, -1, references, sentenceId, backgroundBleu, &fearHypo);
 
     //Model decode
-    Viterbi(graph, weights, 0, references_, sentenceId, backgroundBleu, &modelHypo);
+    Viterbi(graph, scores, 0, references, sentenceId, backgroundBleu, &modelHypo);
 
 
   // Outer loop rescales the contribution of model score to 'hope' in antagonistic cases
@@ -242,21 +633,22 @@ void HypergraphHopeFearDecoder::HopeFear(
     //TODO: Don't currently get model and bleu so commented this out for now.
     break;
   }
-  //modelFeatures, hopeFeatures and fearFeatures
-  hopeFear->modelFeatures = MiraFeatureVector(modelHypo.featureVector, num_dense_);
-  hopeFear->hopeFeatures = MiraFeatureVector(hopeHypo.featureVector, num_dense_);
-  hopeFear->fearFeatures = MiraFeatureVector(fearHypo.featureVector, num_dense_);
+  //hopeFeatures and fearFeatures, built from the hypotheses
+  hopeFear->hopeStorage = MiraFeatureVector(hopeHypo.featureVector, num_dense);
+  hopeFear->fearStorage = MiraFeatureVector(fearHypo.featureVector, num_dense);
+  hopeFear->hopeFeatures = hopeFear->hopeStorage.view();
+  hopeFear->fearFeatures = hopeFear->fearStorage.view();
 
   //Need to know which are to be mapped to dense features!
 
   //Only C++11
   //hopeFear->modelStats.assign(std::begin(modelHypo.bleuStats), std::end(modelHypo.bleuStats));
   vector<ValType> fearStats(kBleuNgramOrder*2+1);
-  hopeFear->hopeStats.reserve(kBleuNgramOrder*2+1);
-  hopeFear->modelStats.reserve(kBleuNgramOrder*2+1);
+  hopeFear->hopeStats.resize(kBleuNgramOrder*2+1);
+  hopeFear->modelStats.resize(kBleuNgramOrder*2+1);
   for (size_t i = 0; i < fearStats.size(); ++i) {
-    hopeFear->modelStats.push_back(modelHypo.bleuStats[i]);
-    hopeFear->hopeStats.push_back(hopeHypo.bleuStats[i]);
+    hopeFear->modelStats[i] = modelHypo.bleuStats[i];
+    hopeFear->hopeStats[i] = hopeHypo.bleuStats[i];
 
     fearStats[i] = fearHypo.bleuStats[i];
   }
@@ -302,17 +694,84 @@ void HypergraphHopeFearDecoder::HopeFear(
       }
     }
   }
-  hopeFear->hopeFearEqual = hopeFear->hopeFearEqual && (hopeFear->fearFeatures == hopeFear->hopeFeatures);
+  hopeFear->hopeFearEqual = hopeFear->hopeFearEqual && (hopeFear->fearStorage == hopeFear->hopeStorage);
 }
 
-void HypergraphHopeFearDecoder::MaxModel(const AvgWeightVector& wv, vector<ValType>* stats) {
-  assert(!finished());
-  HgHypothesis bestHypo;
-  size_t sentenceId = graphIter_->first;
+/** Decodes one hypergraph of a batch, first bringing its edge scores up to date */
+class HgHopeFearTask : public WorkerTask {
+public:
+  HgHopeFearTask(const FrozenGraph& graph, size_t sentenceId, const ReferenceSet& references,
+    size_t num_dense, EdgeScores* scores, const SparseVector& weights,
+    const vector<ValType>& backgroundBleu, HopeFearData* hopeFear) :
+    graph_(graph), sentenceId_(sentenceId), references_(references), num_dense_(num_dense),
+    scores_(scores), weights_(weights), backgroundBleu_(backgroundBleu), hopeFear_(hopeFear) {}
+
+  virtual void Run() {
+    scores_->Update(weights_);
+    HgHopeFear(graph_, sentenceId_, references_, num_dense_, *scores_, backgroundBleu_, hopeFear_);
+  }
+
+private:
+  const FrozenGraph& graph_;
+  size_t sentenceId_;
+  const ReferenceSet& references_;
+  size_t num_dense_;
+  EdgeScores* scores_;
+  const SparseVector& weights_;
+  const vector<ValType>& backgroundBleu_;
+  HopeFearData* hopeFear_;
+};
+
+EdgeScores& HypergraphHopeFearDecoder::CachedScores(GraphColl::const_iterator graph) {
+  boost::shared_ptr<EdgeScores>& scores = edgeScores_[graph->first];
+  if (!scores) scores.reset(new EdgeScores(*(graph->second)));
+  return *scores;
+}
+
+void HypergraphHopeFearDecoder::HopeFear(
+            const vector<ValType>& backgroundBleu,
+            const MiraWeightVector& wv,
+            HopeFearData* hopeFear
+            ) {
+  SparseVector weights;
+  wv.ToSparse(&weights);
+  EdgeScores& scores = CachedScores(graphIter_);
+  scores.Update(weights);
+  HgHopeFear(*(graphIter_->second), graphIter_->first, references_, num_dense_,
+    scores, backgroundBleu, hopeFear);
+}
+
+size_t HypergraphHopeFearDecoder::HopeFearBatch(
+            const vector<ValType>& backgroundBleu,
+            const MiraWeightVector& wv,
+            size_t batchSize,
+            WorkerPool& pool,
+            vector<HopeFearData>* hopeFear
+            ) {
   SparseVector weights;
   wv.ToSparse(&weights);
+  vector<GraphColl::const_iterator> batch;
+  for (; batch.size() < batchSize && !finished(); next()) {
+    batch.push_back(graphIter_);
+  }
+  if (hopeFear->size() < batch.size()) hopeFear->resize(batch.size());
+  vector<HgHopeFearTask> tasks;
+  tasks.reserve(batch.size());
+  vector<WorkerTask*> taskPtrs;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    tasks.push_back(HgHopeFearTask(*(batch[i]->second), batch[i]->first, references_,
+      num_dense_, &CachedScores(batch[i]), weights, backgroundBleu, &((*hopeFear)[i])));
+    taskPtrs.push_back(&tasks.back());
+  }
+  pool.Run(taskPtrs);
+  return batch.size();
+}
+
+template <class Weights> static void HgMaxModel(const FrozenGraph& graph, size_t sentenceId,
+    const ReferenceSet& references, const Weights& weights, vector<ValType>* stats) {
+  HgHypothesis bestHypo;
   vector<ValType> bg(kBleuNgramOrder*2+1);
-  Viterbi(*(graphIter_->second), weights, 0, references_, sentenceId, bg, &bestHypo);
+  Viterbi(graph, weights, 0, references, sentenceId, bg, &bestHypo);
   stats->resize(bestHypo.bleuStats.size());
   /*
   for (size_t i = 0; i < bestHypo.text.size(); ++i) {
@@ -325,6 +784,93 @@ void HypergraphHopeFearDecoder::MaxModel(const AvgWeightVector& wv, vector<ValTy
   }
 }
 
+/**
+ * Averaged weights for max model decoding. Those held in arrays are used
+ * as they are, but if any are in a hash table, all go in a SparseVector.
+ **/
+class HgMaxModelWeights {
+public:
+  explicit HgMaxModelWeights(const AvgWeightVector& wv) : wv_(wv) {
+    if (!wv.sparse().empty()) wv.ToSparse(&sparse_);
+  }
+
+  void MaxModel(const FrozenGraph& graph, size_t sentenceId, const ReferenceSet& references,
+      vector<ValType>* stats) const {
+    if (wv_.sparse().empty()) {
+      HgMaxModel(graph, sentenceId, references, wv_.dense(), stats);
+    } else {
+      HgMaxModel(graph, sentenceId, references, sparse_, stats);
+    }
+  }
+
+private:
+  const AvgWeightVector& wv_;
+  SparseVector sparse_;
+};
+
+void HypergraphHopeFearDecoder::MaxModel(const AvgWeightVector& wv, vector<ValType>* stats) {
+  assert(!finished());
+  HgMaxModelWeights(wv).MaxModel(*(graphIter_->second), graphIter_->first, references_, stats);
+}
+
+size_t HypergraphHopeFearDecoder::NumSentences() const {
+  return graphIndex_.size();
+}
+
+void HypergraphHopeFearDecoder::HopeFear(
+            size_t sentence,
+            const vector<ValType>& backgroundBleu,
+            const MiraWeightVector& wv,
+            HopeFearData* hopeFear
+            ) const {
+  SparseVector weights;
+  wv.ToSparse(&weights);
+  GraphColl::const_iterator graph = graphIndex_[sentence];
+  // Called from several threads, each with weights of its own, so scores are not kept
+  EdgeScores scores(*(graph->second));
+  scores.Score(weights);
+  HgHopeFear(*(graph->second), graph->first, references_, num_dense_,
+    scores, backgroundBleu, hopeFear);
+}
+
+void HypergraphHopeFearDecoder::MaxModel(size_t sentence, const AvgWeightVector& wv, vector<ValType>* stats) const {
+  GraphColl::const_iterator graph = graphIndex_[sentence];
+  HgMaxModelWeights(wv).MaxModel(*(graph->second), graph->first, references_, stats);
+}
+
+class HgMaxModelTask : public MaxModelRangeTask {
+public:
+  typedef map<size_t, boost::shared_ptr<FrozenGraph> >::const_iterator GraphIter;
+
+  HgMaxModelTask(const vector<GraphIter>& graphs, size_t begin, size_t end,
+    const ReferenceSet& references, const HgMaxModelWeights& weights) :
+    MaxModelRangeTask(begin,end), graphs_(graphs), references_(references), weights_(weights) {}
+
+protected:
+  virtual void MaxModel(size_t i, vector<ValType>* stats) {
+    weights_.MaxModel(*(graphs_[i]->second), graphs_[i]->first, references_, stats);
+  }
+
+private:
+  const vector<GraphIter>& graphs_;
+  const ReferenceSet& references_;
+  const HgMaxModelWeights& weights_;
+};
+
+void HypergraphHopeFearDecoder::SumMaxModel(const AvgWeightVector& wv, WorkerPool& pool, vector<ValType>* stats) {
+  vector<GraphColl::const_iterator> graphs;
+  for (reset(); !finished(); next()) {
+    graphs.push_back(graphIter_);
+  }
+  HgMaxModelWeights weights(wv);
+  boost::ptr_vector<HgMaxModelTask> tasks;
+  for (size_t begin = 0; begin < graphs.size(); begin += kMaxModelRangeSize) {
+    size_t end = min(begin + kMaxModelRangeSize, graphs.size());
+    tasks.push_back(new HgMaxModelTask(graphs, begin, end, references_, weights));
+  }
+  RunAndSum(tasks, pool, stats);
+}
+
 
 
 };
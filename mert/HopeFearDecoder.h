@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <vector>
 
+#include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -37,12 +38,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 namespace MosesTuning {
 
-/** To be filled in by the decoder */
+struct NbestBatch;
+struct NbestScores;
+class WorkerPool;
+
+/**
+  * To be filled in by the decoder. The hope and fear features are views,
+  * either of the decoder's stored hypotheses or of the storage below, so
+  * are only valid until the decoder moves past the sentence, and are not
+  * carried over by copying. Reusing one HopeFearData for each sentence
+  * reuses its storage.
+  **/
 struct HopeFearData {
-  MiraFeatureVector modelFeatures;
-  MiraFeatureVector hopeFeatures;
-  MiraFeatureVector fearFeatures;
-  
+  MiraFeatureView hopeFeatures;
+  MiraFeatureView fearFeatures;
+
   std::vector<float> modelStats;
   std::vector<float> hopeStats;
 
@@ -50,6 +60,10 @@ struct HopeFearData {
   ValType fearBleu;
 
   bool hopeFearEqual;
+
+  // For decoders whose hypotheses are not stored elsewhere
+  MiraFeatureVector hopeStorage;
+  MiraFeatureVector fearStorage;
 };
 
 //Abstract base class
@@ -69,12 +83,61 @@ public:
               HopeFearData* hopeFear
               ) = 0;
 
+  /**
+    * Calculate hope, fear and model hypotheses for up to batchSize sentences,
+    * starting at the current one, and advance past them. All sentences in the
+    * batch see the same weights and background, so may be decoded in parallel.
+    * Fills the start of hopeFear, only growing it if it is too short, so its
+    * storage is reused from batch to batch.
+    * \return the number of sentences decoded
+    **/
+  virtual std::size_t HopeFearBatch(
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              std::size_t batchSize,
+              WorkerPool& pool,
+              std::vector<HopeFearData>* hopeFear
+              );
+
   /** Max score decoding */
   virtual void MaxModel(const AvgWeightVector& wv, std::vector<ValType>* stats)
     = 0;
 
-  /** Calculate bleu on training set */
-  ValType Evaluate(const AvgWeightVector& wv);
+  /** Calculate bleu on training set, spreading the sentences over the pool */
+  ValType Evaluate(const AvgWeightVector& wv, WorkerPool& pool);
+
+  /** Save or restore any iteration state (eg shuffle order) between epochs */
+  virtual void SaveState(std::ostream* os) const {}
+  virtual void LoadState(std::istream* is) {}
+
+  /**
+    * Number of sentences which can be decoded by index, independently of the
+    * iterator. Zero if the decoder only allows sequential access.
+    **/
+  virtual std::size_t NumSentences() const {return 0;}
+
+  /**
+    * Calculate hope, fear and model hypotheses for a sentence chosen by
+    * index. Leaves the iterator alone, and is safe to call from several
+    * threads at once.
+    **/
+  virtual void HopeFear(
+              std::size_t sentence,
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              HopeFearData* hopeFear
+              ) const;
+
+  /** Max score decoding for a sentence chosen by index */
+  virtual void MaxModel(std::size_t sentence, const AvgWeightVector& wv,
+                        std::vector<ValType>* stats) const;
+
+  virtual ~HopeFearDecoder() {}
+
+protected:
+  /** Add the stats of each sentence's max model hypothesis to stats */
+  virtual void SumMaxModel(const AvgWeightVector& wv, WorkerPool& pool,
+                           std::vector<ValType>* stats);
 
 };
 
@@ -86,8 +149,13 @@ public:
                          const std::vector<std::string>&  scoreFiles,
                          bool streaming,
                          bool  no_shuffle,
-                         bool safe_hope
+                         bool safe_hope,
+                         std::size_t prefetch = 0,
+                         uint64_t memoryBudget = 0,
+                         const std::string& scratch = "/tmp/",
+                         bool approximate_bleu = false
                          );
+  virtual ~NbestHopeFearDecoder();
 
   virtual void reset();
   virtual void next();
@@ -99,11 +167,47 @@ public:
               HopeFearData* hopeFear
               );
 
+  virtual std::size_t HopeFearBatch(
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              std::size_t batchSize,
+              WorkerPool& pool,
+              std::vector<HopeFearData>* hopeFear
+              );
+
   virtual void MaxModel(const AvgWeightVector& wv, std::vector<ValType>* stats);
 
+  virtual void SaveState(std::ostream* os) const;
+  virtual void LoadState(std::istream* is);
+
+  virtual std::size_t NumSentences() const;
+
+  virtual void HopeFear(
+              std::size_t sentence,
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              HopeFearData* hopeFear
+              ) const;
+
+  virtual void MaxModel(std::size_t sentence, const AvgWeightVector& wv,
+                        std::vector<ValType>* stats) const;
+
+protected:
+  virtual void SumMaxModel(const AvgWeightVector& wv, WorkerPool& pool,
+                           std::vector<ValType>* stats);
+
 private:
   boost::scoped_ptr<HypPackEnumerator> train_;
+  //NULL when streaming
+  RandomAccessHypPackEnumerator* randomAccess_;
   bool safe_hope_;
+  //approximate log and exp in sentence BLEU
+  bool approximate_bleu_;
+  //reused by each batch
+  boost::scoped_ptr<NbestBatch> batch_;
+  //one for each sentence of a batch, the first also for sequential decoding
+  boost::scoped_array<NbestScores> scores_;
+  std::size_t numScores_;
 
 };
 
@@ -120,7 +224,9 @@ public:
                             bool no_shuffle,
                             bool safe_hope,
                             size_t hg_pruning,
-                            const MiraWeightVector& wv
+                            const MiraWeightVector& wv,
+                            size_t threads = 1,
+                            const std::string& prunedDir = ""
                             );
 
   virtual void reset();
@@ -133,14 +239,44 @@ public:
               HopeFearData* hopeFear
               );
 
+  virtual std::size_t HopeFearBatch(
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              std::size_t batchSize,
+              WorkerPool& pool,
+              std::vector<HopeFearData>* hopeFear
+              );
+
   virtual void MaxModel(const AvgWeightVector& wv, std::vector<ValType>* stats);
 
+  virtual std::size_t NumSentences() const;
+
+  virtual void HopeFear(
+              std::size_t sentence,
+              const std::vector<ValType>& backgroundBleu,
+              const MiraWeightVector& wv,
+              HopeFearData* hopeFear
+              ) const;
+
+  virtual void MaxModel(std::size_t sentence, const AvgWeightVector& wv,
+                        std::vector<ValType>* stats) const;
+
+protected:
+  virtual void SumMaxModel(const AvgWeightVector& wv, WorkerPool& pool,
+                           std::vector<ValType>* stats);
+
 private:
   size_t num_dense_;
   //maps sentence Id to graph ptr
-  typedef std::map<size_t, boost::shared_ptr<Graph> > GraphColl;
+  typedef std::map<size_t, boost::shared_ptr<FrozenGraph> > GraphColl;
   GraphColl graphs_;
   GraphColl::const_iterator graphIter_;
+  //graphs in sentence Id order, for access by index
+  std::vector<GraphColl::const_iterator> graphIndex_;
+  //edge scores of each graph under the weights it was last decoded with,
+  //made when it is first decoded in order
+  std::map<size_t, boost::shared_ptr<EdgeScores> > edgeScores_;
+  EdgeScores& CachedScores(GraphColl::const_iterator graph);
   ReferenceSet references_;
   Vocab vocab_;
 };
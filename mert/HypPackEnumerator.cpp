@@ -2,21 +2,78 @@
 
 #include <cassert>
 #include <algorithm>
-#include <boost/unordered_set.hpp>
+#include <sstream>
+#include <stdint.h>
+#include <boost/random/random_number_generator.hpp>
+
+#include "util/exception.hh"
+
+#include "HypothesisDedup.h"
 
 using namespace std;
 
+namespace
+{
+using namespace MosesTuning;
+
+/** Compares hypothesis j of list i with the kept hypotheses */
+class SameAsKept
+{
+public:
+  SameAsKept(const vector<FeatureDataIterator>& features,
+             const vector<ScoreDataIterator>& scores,
+             const vector<pair<size_t,size_t> >& kept,
+             size_t i, size_t j)
+    : m_features(features), m_scores(scores), m_kept(kept), m_i(i), m_j(j) {}
+
+  bool operator()(size_t k) const {
+    const pair<size_t,size_t>& other = m_kept[k];
+    return m_features[m_i]->operator[](m_j) == m_features[other.first]->operator[](other.second)
+           && m_scores[m_i]->operator[](m_j) == m_scores[other.first]->operator[](other.second);
+  }
+
+private:
+  const vector<FeatureDataIterator>& m_features;
+  const vector<ScoreDataIterator>& m_scores;
+  const vector<pair<size_t,size_t> >& m_kept;
+  size_t m_i, m_j;
+};
+
+template <class Weights> void ScoreEach(HypPackEnumerator& train, const Weights& wv,
+                                        vector<ValType>* scores)
+{
+  scores->resize(train.cur_size());
+  for (size_t i = 0; i < scores->size(); ++i) {
+    (*scores)[i] = wv.score(train.featuresAt(i));
+  }
+}
+} // namespace
+
 namespace MosesTuning
 {
 
 
+void HypPackEnumerator::ScoreAll(const MiraWeightVector& wv, vector<ValType>* scores)
+{
+  ScoreEach(*this, wv, scores);
+}
+
+void HypPackEnumerator::ScoreAll(const AvgWeightVector& wv, vector<ValType>* scores)
+{
+  ScoreEach(*this, wv, scores);
+}
+
 StreamingHypPackEnumerator::StreamingHypPackEnumerator
 (
   vector<std::string> const& featureFiles,
-  vector<std::string> const& scoreFiles
+  vector<std::string> const& scoreFiles,
+  size_t prefetch
 )
   : m_featureFiles(featureFiles),
-    m_scoreFiles(scoreFiles)
+    m_scoreFiles(scoreFiles),
+    m_prefetch(prefetch),
+    m_stop(false),
+    m_exhausted(false)
 {
   if (scoreFiles.size() == 0 || featureFiles.size() == 0) {
     cerr << "No data to process" << endl;
@@ -28,12 +85,23 @@ StreamingHypPackEnumerator::StreamingHypPackEnumerator
          ") does not match number of score files (" << scoreFiles.size() << ")" << endl;
     exit(1);
   }
+  for (size_t i = 0; i < featureFiles.size(); ++i) {
+    if (NbestPool::IsPool(featureFiles[i])) {
+      cerr << "Error: The n-best pool " << featureFiles[i] << " can only be read into memory, not streamed" << endl;
+      exit(1);
+    }
+  }
 
   m_num_lists = scoreFiles.size();
   m_primed = false;
   m_iNumDense = -1;
 }
 
+StreamingHypPackEnumerator::~StreamingHypPackEnumerator()
+{
+  stop();
+}
+
 size_t StreamingHypPackEnumerator::num_dense() const
 {
   if(m_iNumDense<0) {
@@ -43,12 +111,15 @@ size_t StreamingHypPackEnumerator::num_dense() const
   return (size_t) m_iNumDense;
 }
 
-void StreamingHypPackEnumerator::prime()
+StreamingHypPackEnumerator::SentencePtr StreamingHypPackEnumerator::read()
 {
-  m_current_indexes.clear();
-  m_current_featureVectors.clear();
-  boost::unordered_set<FeatureDataItem> seen;
-  m_primed = true;
+  if (m_featureDataIters[0] == FeatureDataIterator::end()) {
+    return SentencePtr();
+  }
+  SentencePtr sentence(new Sentence);
+  // Position of each kept hypothesis, as (list, index in list)
+  vector<pair<size_t,size_t> > kept;
+  m_dedup.clear();
 
   for (size_t i = 0; i < m_num_lists; ++i) {
     if (m_featureDataIters[i] == FeatureDataIterator::end()) {
@@ -60,34 +131,94 @@ void StreamingHypPackEnumerator::prime()
       exit(1);
     }
     if (m_featureDataIters[i]->size() != m_scoreDataIters[i]->size()) {
-      cerr << "Error: For sentence " << m_sentenceId << " features and scores have different size" << endl;
+      cerr << "Error: For sentence " << m_readId << " features and scores have different size" << endl;
       exit(1);
     }
     for (size_t j = 0; j < m_featureDataIters[i]->size(); ++j) {
       const FeatureDataItem& item = m_featureDataIters[i]->operator[](j);
-      // Dedup
-      if(seen.find(item)==seen.end()) {
-        seen.insert(item);
+      const ScoreDataItem& scores = m_scoreDataIters[i]->operator[](j);
+      // Dedup on features and scores
+      SameAsKept same(m_featureDataIters, m_scoreDataIters, kept, i, j);
+      if(!m_dedup.Duplicate(Fingerprint(item, scores), kept.size(), same)) {
+        kept.push_back(pair<size_t,size_t>(i,j));
         // Confirm dense features are always the same
         int iDense = item.dense.size();
-        if(m_iNumDense != iDense) {
-          if(m_iNumDense==-1) m_iNumDense = iDense;
+        if(m_readNumDense != iDense) {
+          if(m_readNumDense==-1) m_readNumDense = iDense;
           else {
             cerr << "Error: expecting constant number of dense features: "
-                 << m_iNumDense << " != " << iDense << endl;
+                 << m_readNumDense << " != " << iDense << endl;
             exit(1);
           }
         }
         // Store item for retrieval
-        m_current_indexes.push_back(pair<size_t,size_t>(i,j));
-        m_current_featureVectors.push_back(MiraFeatureVector(item));
+        sentence->featureVectors.push_back(MiraFeatureVector(item));
+        sentence->scores.push_back(scores);
+      }
+    }
+  }
+  sentence->numDense = m_readNumDense;
+
+  for (size_t i = 0; i < m_num_lists; ++i) {
+    ++m_featureDataIters[i];
+    ++m_scoreDataIters[i];
+  }
+  ++m_readId;
+  return sentence;
+}
+
+void StreamingHypPackEnumerator::produce()
+{
+  try {
+    while (true) {
+      {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        if (m_stop) break;
       }
+      SentencePtr sentence = read();
+      m_queue->Produce(sentence);
+      if (!sentence) return;
     }
+  } catch (const std::exception& e) {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_error = e.what();
+  }
+  // An empty sentence tells the consumer there are no more
+  m_queue->Produce(SentencePtr());
+}
+
+void StreamingHypPackEnumerator::stop()
+{
+  if (!m_producer) return;
+  {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  // Drain the queue so that the producer is never left waiting
+  if (!m_exhausted) {
+    while (m_queue->Consume()) {}
   }
+  m_producer->join();
+  m_producer.reset();
+  m_queue.reset();
+  m_stop = false;
+}
+
+StreamingHypPackEnumerator::SentencePtr StreamingHypPackEnumerator::fetch()
+{
+  if (!m_producer) return read();
+  SentencePtr sentence = m_queue->Consume();
+  if (!sentence) {
+    m_exhausted = true;
+    // The producer has finished, so its error can be read without a lock
+    UTIL_THROW_IF(!m_error.empty(), util::Exception, m_error);
+  }
+  return sentence;
 }
 
 void StreamingHypPackEnumerator::reset()
 {
+  stop();
   m_featureDataIters.clear();
   m_scoreDataIters.clear();
   for (size_t i = 0; i < m_num_lists; ++i) {
@@ -95,12 +226,22 @@ void StreamingHypPackEnumerator::reset()
     m_scoreDataIters.push_back(ScoreDataIterator(m_scoreFiles[i]));
   }
   m_sentenceId=0;
-  prime();
+  m_readId=0;
+  m_readNumDense=m_iNumDense;
+  m_error.clear();
+  if (m_prefetch) {
+    m_exhausted = false;
+    m_queue.reset(new util::PCQueue<SentencePtr>(m_prefetch));
+    m_producer.reset(new boost::thread(&StreamingHypPackEnumerator::produce, this));
+  }
+  m_primed = true;
+  m_current = fetch();
+  if (m_current) m_iNumDense = m_current->numDense;
 }
 
 bool StreamingHypPackEnumerator::finished()
 {
-  return m_featureDataIters[0]==FeatureDataIterator::end();
+  return !m_current;
 }
 
 void StreamingHypPackEnumerator::next()
@@ -109,13 +250,9 @@ void StreamingHypPackEnumerator::next()
     cerr << "Enumerating an unprimed HypPackEnumerator" << endl;
     exit(1);
   }
-  for (size_t i = 0; i < m_num_lists; ++i) {
-    ++m_featureDataIters[i];
-    ++m_scoreDataIters[i];
-  }
   m_sentenceId++;
   if(m_sentenceId % 100 == 0) cerr << ".";
-  if(!finished()) prime();
+  m_current = fetch();
 }
 
 size_t StreamingHypPackEnumerator::cur_size()
@@ -124,26 +261,25 @@ size_t StreamingHypPackEnumerator::cur_size()
     cerr << "Querying size from an unprimed HypPackEnumerator" << endl;
     exit(1);
   }
-  return m_current_indexes.size();
+  return m_current->featureVectors.size();
 }
 
-const MiraFeatureVector& StreamingHypPackEnumerator::featuresAt(size_t index)
+MiraFeatureView StreamingHypPackEnumerator::featuresAt(size_t index)
 {
   if(!m_primed) {
     cerr << "Querying features from an unprimed HypPackEnumerator" << endl;
     exit(1);
   }
-  return m_current_featureVectors[index];
+  return m_current->featureVectors[index].view();
 }
 
-const ScoreDataItem& StreamingHypPackEnumerator::scoresAt(size_t index)
+ScoreDataView StreamingHypPackEnumerator::scoresAt(size_t index)
 {
   if(!m_primed) {
     cerr << "Querying scores from an unprimed HypPackEnumerator" << endl;
     exit(1);
   }
-  const pair<size_t,size_t>& pij = m_current_indexes[index];
-  return m_scoreDataIters[pij.first]->operator[](pij.second);
+  return ScoreDataView(m_current->scores[index]);
 }
 
 size_t StreamingHypPackEnumerator::cur_id()
@@ -155,23 +291,45 @@ size_t StreamingHypPackEnumerator::cur_id()
 
 RandomAccessHypPackEnumerator::RandomAccessHypPackEnumerator(vector<string> const& featureFiles,
     vector<string> const& scoreFiles,
-    bool no_shuffle)
-{
-  StreamingHypPackEnumerator train(featureFiles,scoreFiles);
-  size_t index=0;
-  for(train.reset(); !train.finished(); train.next()) {
-    m_features.push_back(vector<MiraFeatureVector>());
-    m_scores.push_back(vector<ScoreDataItem>());
-    for(size_t j=0; j<train.cur_size(); j++) {
-      m_features.back().push_back(train.featuresAt(j));
-      m_scores.back().push_back(train.scoresAt(j));
+    bool no_shuffle,
+    uint64_t memoryBudget,
+    const string& scratch)
+  : m_random(rand())
+{
+  if (featureFiles.size() == 1 && scoreFiles.size() == 1 &&
+      featureFiles[0] == scoreFiles[0] && NbestStore::IsStore(featureFiles[0])) {
+    m_pool.reset(new NbestPool(new NbestStore(featureFiles[0])));
+  } else if (featureFiles.size() == 1 && scoreFiles.size() == 1 &&
+             featureFiles[0] == scoreFiles[0] && NbestPool::IsPool(featureFiles[0])) {
+    m_pool.reset(new NbestPool(featureFiles[0]));
+  } else {
+    StreamingHypPackEnumerator train(featureFiles,scoreFiles);
+    for(train.reset(); !train.finished(); train.next()) {
+      for(size_t j=0; j<train.cur_size(); j++) {
+        ScoreDataView scores = train.scoresAt(j);
+        if (!m_spill) m_spill.reset(new SpillingNbestStore(train.num_dense(), scores.size(), memoryBudget, scratch));
+        m_spill->AddHypothesis(train.featuresAt(j), scores);
+      }
+      if (!m_spill) m_spill.reset(new SpillingNbestStore(train.num_dense(), 0, memoryBudget, scratch));
+      m_spill->EndSentence();
     }
-    m_indexes.push_back(index++);
+    if (!m_spill) {
+      cerr << "Error: No hypotheses in " << featureFiles[0] << endl;
+      exit(1);
+    }
+    m_spill->Finish();
+    if (m_spill->num_resident() < m_spill->num_sentences()) {
+      cerr << "Holding " << m_spill->num_resident() << " of " << m_spill->num_sentences()
+           << " sentences in memory, the rest in a scratch file" << endl;
+    }
+  }
+  m_num_dense = m_pool ? m_pool->num_dense() : m_spill->num_dense();
+  for(size_t i=0; i<num_sentences(); i++) {
+    m_indexes.push_back(i);
   }
 
   m_cur_index = 0;
   m_no_shuffle = no_shuffle;
-  m_num_dense = train.num_dense();
 }
 
 size_t RandomAccessHypPackEnumerator::num_dense() const
@@ -182,7 +340,10 @@ size_t RandomAccessHypPackEnumerator::num_dense() const
 void RandomAccessHypPackEnumerator::reset()
 {
   m_cur_index = 0;
-  if(!m_no_shuffle) random_shuffle(m_indexes.begin(),m_indexes.end());
+  if(!m_no_shuffle) {
+    boost::random_number_generator<boost::mt19937> gen(m_random);
+    random_shuffle(m_indexes.begin(),m_indexes.end(),gen);
+  }
 }
 bool RandomAccessHypPackEnumerator::finished()
 {
@@ -195,22 +356,118 @@ void RandomAccessHypPackEnumerator::next()
 
 size_t RandomAccessHypPackEnumerator::cur_size()
 {
-  assert(m_features[m_indexes[m_cur_index]].size()==m_scores[m_indexes[m_cur_index]].size());
-  return m_features[m_indexes[m_cur_index]].size();
+  return size(m_indexes[m_cur_index]);
 }
-const MiraFeatureVector& RandomAccessHypPackEnumerator::featuresAt(size_t i)
+template <class Weights> void RandomAccessHypPackEnumerator::ScoreSentence(
+  size_t sentence, const Weights& wv, vector<ValType>* scores) const
 {
-  return m_features[m_indexes[m_cur_index]][i];
+  scores->resize(size(sentence));
+  if (scores->empty()) return;
+  ValType* out = &(*scores)[0];
+  if (m_pool) {
+    for (size_t s = 0; s < m_pool->num_segments(); ++s) {
+      MiraFeatureBlock block = m_pool->block(s, sentence);
+      wv.scoreAll(block, out);
+      out += block.size;
+    }
+  } else {
+    wv.scoreAll(m_spill->block(sentence), out);
+  }
 }
-const ScoreDataItem& RandomAccessHypPackEnumerator::scoresAt(size_t i)
+
+void RandomAccessHypPackEnumerator::ScoreAll(const MiraWeightVector& wv, vector<ValType>* scores)
+{
+  ScoreSentence(m_indexes[m_cur_index], wv, scores);
+}
+
+void RandomAccessHypPackEnumerator::ScoreAll(const AvgWeightVector& wv, vector<ValType>* scores)
+{
+  ScoreSentence(m_indexes[m_cur_index], wv, scores);
+}
+
+void RandomAccessHypPackEnumerator::ScoreAll(size_t sentence, const MiraWeightVector& wv,
+    vector<ValType>* scores) const
+{
+  ScoreSentence(sentence, wv, scores);
+}
+
+void RandomAccessHypPackEnumerator::ScoreAll(size_t sentence, const AvgWeightVector& wv,
+    vector<ValType>* scores) const
 {
-  return m_scores[m_indexes[m_cur_index]][i];
+  ScoreSentence(sentence, wv, scores);
+}
+
+MiraFeatureView RandomAccessHypPackEnumerator::featuresAt(size_t i)
+{
+  return featuresAt(m_indexes[m_cur_index], i);
+}
+ScoreDataView RandomAccessHypPackEnumerator::scoresAt(size_t i)
+{
+  return scoresAt(m_indexes[m_cur_index], i);
 }
 
 size_t RandomAccessHypPackEnumerator::cur_id()
 {
   return m_indexes[m_cur_index];
 }
+
+size_t RandomAccessHypPackEnumerator::num_sentences() const
+{
+  return m_pool ? m_pool->num_sentences() : m_spill->num_sentences();
+}
+size_t RandomAccessHypPackEnumerator::size(size_t sentence) const
+{
+  return m_pool ? m_pool->size(sentence) : m_spill->size(sentence);
+}
+MiraFeatureView RandomAccessHypPackEnumerator::featuresAt(size_t sentence, size_t i) const
+{
+  return m_pool ? m_pool->featuresAt(sentence, i) : m_spill->featuresAt(sentence, i);
+}
+ScoreDataView RandomAccessHypPackEnumerator::scoresAt(size_t sentence, size_t i) const
+{
+  return m_pool ? m_pool->scoresAt(sentence, i) : m_spill->scoresAt(sentence, i);
+}
+
+void RandomAccessHypPackEnumerator::savebin(ostream* os) const
+{
+  uint64_t size = m_indexes.size();
+  os->write(reinterpret_cast<const char*>(&size), sizeof(size));
+  for (size_t i = 0; i < m_indexes.size(); ++i) {
+    uint64_t index = m_indexes[i];
+    os->write(reinterpret_cast<const char*>(&index), sizeof(index));
+  }
+  // The generator only has a text representation
+  ostringstream random;
+  random << m_random;
+  size = random.str().size();
+  os->write(reinterpret_cast<const char*>(&size), sizeof(size));
+  os->write(random.str().data(), size);
+}
+
+void RandomAccessHypPackEnumerator::loadbin(istream* is)
+{
+  uint64_t size = 0;
+  is->read(reinterpret_cast<char*>(&size), sizeof(size));
+  if (!*is || size != m_indexes.size()) {
+    cerr << "Error: Saved shuffle order is for " << size << " sentences, but there are "
+         << m_indexes.size() << endl;
+    exit(1);
+  }
+  for (size_t i = 0; i < m_indexes.size(); ++i) {
+    uint64_t index = 0;
+    is->read(reinterpret_cast<char*>(&index), sizeof(index));
+    m_indexes[i] = index;
+  }
+  is->read(reinterpret_cast<char*>(&size), sizeof(size));
+  string random(size, ' ');
+  if (size) is->read(&random[0], size);
+  istringstream randomStream(random);
+  randomStream >> m_random;
+  if (!*is) {
+    cerr << "Error: Failed to read saved shuffle order" << endl;
+    exit(1);
+  }
+}
 // --Emacs trickery--
 // Local Variables:
 // mode:c++
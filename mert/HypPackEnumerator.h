@@ -13,10 +13,23 @@
 #include <vector>
 #include <utility>
 #include <stddef.h>
+#include <stdint.h>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "util/pcqueue.hh"
 
 #include "FeatureDataIterator.h"
+#include "HypothesisDedup.h"
 #include "ScoreDataIterator.h"
 #include "MiraFeatureVector.h"
+#include "MiraWeightVector.h"
+#include "NbestPool.h"
+#include "SpillingNbestStore.h"
 
 namespace MosesTuning
 {
@@ -36,17 +49,29 @@ public:
   virtual std::size_t cur_id() = 0;
   virtual std::size_t cur_size() = 0;
   virtual std::size_t num_dense() const = 0;
-  virtual const MiraFeatureVector& featuresAt(std::size_t i) = 0;
-  virtual const ScoreDataItem& scoresAt(std::size_t i) = 0;
+  virtual MiraFeatureView featuresAt(std::size_t i) = 0;
+  virtual ScoreDataView scoresAt(std::size_t i) = 0;
+
+  /**
+   * Set scores to the model score of each hypothesis of the current
+   * sentence. This scores them one by one; enumerators which keep the
+   * hypotheses of a sentence together score them as a block.
+   */
+  virtual void ScoreAll(const MiraWeightVector& wv, std::vector<ValType>* scores);
+  virtual void ScoreAll(const AvgWeightVector& wv, std::vector<ValType>* scores);
 };
 
 // Instantiation that streams from disk
 // Low-memory, low-speed, sequential access
+// With prefetch > 0, a background thread reads and dedups up to
+// prefetch sentences ahead of the one being used
 class StreamingHypPackEnumerator : public HypPackEnumerator
 {
 public:
   StreamingHypPackEnumerator(std::vector<std::string> const& featureFiles,
-                             std::vector<std::string> const& scoreFiles);
+                             std::vector<std::string> const& scoreFiles,
+                             std::size_t prefetch = 0);
+  ~StreamingHypPackEnumerator();
 
   virtual std::size_t num_dense() const;
 
@@ -56,11 +81,23 @@ public:
 
   virtual std::size_t cur_id();
   virtual std::size_t cur_size();
-  virtual const MiraFeatureVector& featuresAt(std::size_t i);
-  virtual const ScoreDataItem& scoresAt(std::size_t i);
+  virtual MiraFeatureView featuresAt(std::size_t i);
+  virtual ScoreDataView scoresAt(std::size_t i);
 
 private:
-  void prime();
+  // The deduped hypotheses of one sentence
+  struct Sentence {
+    int numDense;
+    std::vector<MiraFeatureVector> featureVectors;
+    std::vector<ScoreDataItem> scores;
+  };
+  typedef boost::shared_ptr<Sentence> SentencePtr;
+
+  SentencePtr read();
+  void produce();
+  void stop();
+  SentencePtr fetch();
+
   std::size_t m_num_lists;
   std::size_t m_sentenceId;
   std::vector<std::string> m_featureFiles;
@@ -68,21 +105,41 @@ private:
 
   bool m_primed;
   int m_iNumDense;
+  SentencePtr m_current;
+
+  // Reading side, owned by the producer thread while it runs
+  std::size_t m_readId;
+  int m_readNumDense;
   std::vector<FeatureDataIterator>  m_featureDataIters;
   std::vector<ScoreDataIterator>    m_scoreDataIters;
-  std::vector<std::pair<std::size_t,std::size_t> > m_current_indexes;
-  std::vector<MiraFeatureVector>    m_current_featureVectors;
+  HypothesisDedup m_dedup;
+
+  std::size_t m_prefetch;
+  boost::scoped_ptr<util::PCQueue<SentencePtr> > m_queue;
+  boost::scoped_ptr<boost::thread> m_producer;
+  boost::mutex m_mutex;
+  bool m_stop;
+  bool m_exhausted; // Whether the end of the queue has been consumed
+  std::string m_error;
 };
 
 // Instantiation that reads into memory
 // High-memory, high-speed, random access
 // (Actually randomizes with each call to reset)
+// Hypotheses are stored in columns shared by all sentences,
+// rather than as one set of small vectors per hypothesis.
+// A single NbestStore or NbestPool, given as both feature and
+// score file, is mapped rather than read. Other data is read
+// into memory up to memoryBudget bytes, and the rest into a
+// mapped scratch file; shuffling only reorders the index.
 class RandomAccessHypPackEnumerator : public HypPackEnumerator
 {
 public:
   RandomAccessHypPackEnumerator(std::vector<std::string> const& featureFiles,
                                 std::vector<std::string> const& scoreFiles,
-                                bool no_shuffle);
+                                bool no_shuffle,
+                                uint64_t memoryBudget = 0,
+                                const std::string& scratch = "/tmp/");
 
   virtual std::size_t num_dense() const;
 
@@ -92,16 +149,38 @@ public:
 
   virtual std::size_t cur_id();
   virtual std::size_t cur_size();
-  virtual const MiraFeatureVector& featuresAt(std::size_t i);
-  virtual const ScoreDataItem& scoresAt(std::size_t i);
+  virtual MiraFeatureView featuresAt(std::size_t i);
+  virtual ScoreDataView scoresAt(std::size_t i);
+
+  virtual void ScoreAll(const MiraWeightVector& wv, std::vector<ValType>* scores);
+  virtual void ScoreAll(const AvgWeightVector& wv, std::vector<ValType>* scores);
+
+  // Access to any sentence by its id, independent of the
+  // current position. Safe to call from several threads.
+  std::size_t num_sentences() const;
+  std::size_t size(std::size_t sentence) const;
+  MiraFeatureView featuresAt(std::size_t sentence, std::size_t i) const;
+  ScoreDataView scoresAt(std::size_t sentence, std::size_t i) const;
+  void ScoreAll(std::size_t sentence, const MiraWeightVector& wv, std::vector<ValType>* scores) const;
+  void ScoreAll(std::size_t sentence, const AvgWeightVector& wv, std::vector<ValType>* scores) const;
+
+  // Save or restore the shuffle order and random state, so
+  // that training can be resumed at an epoch boundary
+  void savebin(std::ostream* os) const;
+  void loadbin(std::istream* is);
 
 private:
+  template <class Weights> void ScoreSentence(std::size_t sentence, const Weights& wv,
+      std::vector<ValType>* scores) const;
+
   bool m_no_shuffle;
+  boost::mt19937 m_random;
   std::size_t m_cur_index;
   std::size_t m_num_dense;
   std::vector<std::size_t> m_indexes;
-  std::vector<std::vector<MiraFeatureVector> > m_features;
-  std::vector<std::vector<ScoreDataItem> > m_scores;
+  // Exactly one is set, m_pool for mapped files
+  boost::scoped_ptr<NbestPool> m_pool;
+  boost::scoped_ptr<SpillingNbestStore> m_spill;
 };
 
 }
@@ -16,16 +16,20 @@ You should have received a copy of the GNU Lesser General Public
 License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 ***********************************************************************/
+#include <algorithm>
 #include <iostream>
-#include <set>
+#include <limits>
 
 #include <boost/lexical_cast.hpp>
 
 #include "util/double-conversion/double-conversion.h"
 #include "util/string_piece.hh"
+#include "util/string_piece_hash.hh"
 #include "util/tokenize_piece.hh"
 
+#include "FeatureRegistry.h"
 #include "Hypergraph.h"
+#include "SparseFeatureCounts.h"
 
 using namespace std;
 static const string kBOS = "<s>";
@@ -56,13 +60,34 @@ const Vocab::Entry &Vocab::FindOrAdd(const StringPiece &str) {
   return *map_.insert(Entry(copied, map_.size())).first;
 }
 
+void Vocab::Add(const Vocab& other, WordVec* entries) {
+  WordVec words(other.map_.size());
+  for (Map::const_iterator i = other.map_.begin(); i != other.map_.end(); ++i) {
+    words[i->second] = &*i;
+  }
+  entries->resize(words.size());
+  for (size_t i = 0; i < words.size(); ++i) {
+    (*entries)[i] = &FindOrAdd(words[i]->first);
+  }
+}
+
+const size_t GraphFeatures::kDropped;
+
+size_t GraphFeatures::Name(const StringPiece& name) {
+  boost::unordered_map<string, size_t>::const_iterator found = FindStringPiece(ids_, name);
+  if (found != ids_.end()) return found->second;
+  names_.push_back(name.as_string());
+  ids_[names_.back()] = names_.size() - 1;
+  return names_.size() - 1;
+}
+
 double_conversion::StringToDoubleConverter converter(double_conversion::StringToDoubleConverter::NO_FLAGS, NAN, NAN, "inf", "nan");
 
 
 /**
  * Reads an incoming edge. Returns edge and source words covered.
 **/
-static pair<Edge*,size_t> ReadEdge(util::FilePiece &from, Graph &graph) {
+static pair<Edge*,size_t> ReadEdge(util::FilePiece &from, Graph &graph, GraphFeatures* features) {
   Edge* edge = graph.NewEdge();
   StringPiece line = NextLine(from);
   util::TokenIter<util::MultiCharacter> pipes(line, util::MultiCharacter(" ||| "));
@@ -95,7 +120,11 @@ static pair<Edge*,size_t> ReadEdge(util::FilePiece &from, Graph &graph) {
     int processed;
     float score = converter.StringToFloat(value.data(), value.length(), &processed);
     UTIL_THROW_IF(isnan(score), HypergraphException, "Failed to parse weight '" << value << "'");
-    edge->AddFeature(name,score);
+    if (features) {
+      features->Add(edge, name, score);
+    } else {
+      edge->AddFeature(name,score);
+    }
   }
   //Covered words
   ++pipes;
@@ -104,158 +133,385 @@ static pair<Edge*,size_t> ReadEdge(util::FilePiece &from, Graph &graph) {
 }
 
 void Graph::Prune(Graph* pNewGraph, const SparseVector& weights, size_t minEdgeCount) const {
+  FrozenGraph frozen, pruned;
+  frozen.Freeze(*this);
+  frozen.Prune(&pruned, weights, minEdgeCount);
+  pruned.Thaw(pNewGraph);
+}
 
-  Graph& newGraph = *pNewGraph;
-  //TODO: Optimise case where no pruning required
+static uint32_t CheckedIndex(size_t index) {
+  UTIL_THROW_IF(index > numeric_limits<uint32_t>::max(), HypergraphException,
+    "Too many vertices, edges or words to freeze a graph");
+  return static_cast<uint32_t>(index);
+}
 
-  //For debug
-  
-  /*
-  map<const Edge*, string> edgeIds;
-  for (size_t i = 0; i < edges_.Size(); ++i) {
-    stringstream str;
-    for (size_t j = 0; j < edges_[i].Words().size(); ++j) {
-      if (edges_[i].Words()[j]) str << edges_[i].Words()[j]->first;
+void FrozenGraph::Freeze(const Graph& graph) {
+  vocab_ = graph.vocab_;
+  incomingBegin_.assign(1, 0);
+  sourceCovered_.clear();
+  heads_.clear();
+  childrenBegin_.assign(1, 0);
+  children_.clear();
+  wordsBegin_.assign(1, 0);
+  words_.clear();
+  featuresBegin_.assign(1, 0);
+  featureIds_.clear();
+  featureValues_.clear();
+  sourceCovered_.reserve(graph.VertexSize());
+  heads_.reserve(graph.EdgeSize());
+  childrenBegin_.reserve(graph.EdgeSize() + 1);
+  wordsBegin_.reserve(graph.EdgeSize() + 1);
+  featuresBegin_.reserve(graph.EdgeSize() + 1);
+
+  for (size_t vi = 0; vi < graph.VertexSize(); ++vi) {
+    const Vertex& vertex = graph.vertices_[vi];
+    sourceCovered_.push_back(vertex.SourceCovered());
+    const vector<const Edge*>& incoming = vertex.GetIncoming();
+    for (size_t ei = 0; ei < incoming.size(); ++ei) {
+      const Edge& edge = *incoming[ei];
+      heads_.push_back(CheckedIndex(vi));
+      for (size_t i = 0; i < edge.Children().size(); ++i) {
+        children_.push_back(CheckedIndex(edge.Children()[i]));
+      }
+      childrenBegin_.push_back(CheckedIndex(children_.size()));
+      words_.insert(words_.end(), edge.Words().begin(), edge.Words().end());
+      wordsBegin_.push_back(CheckedIndex(words_.size()));
+      const SparseVector& features = *edge.Features();
+      featureIds_.insert(featureIds_.end(), features.ids(), features.ids() + features.size());
+      featureValues_.insert(featureValues_.end(), features.values(), features.values() + features.size());
+      featuresBegin_.push_back(CheckedIndex(featureIds_.size()));
+    }
+    incomingBegin_.push_back(CheckedIndex(heads_.size()));
+  }
+}
+
+void FrozenGraph::Thaw(Graph* graph) const {
+  UTIL_THROW_IF(graph->VertexSize() || graph->EdgeSize(), HypergraphException,
+    "Thawing into a graph which is not empty");
+  graph->SetCounts(VertexSize(), EdgeSize());
+  for (size_t vi = 0; vi < VertexSize(); ++vi) {
+    graph->NewVertex()->SetSourceCovered(sourceCovered_[vi]);
+  }
+  for (size_t ei = 0; ei < EdgeSize(); ++ei) {
+    Edge* edge = graph->NewEdge();
+    ArrayRange<const Vocab::Entry*> words = Words(ei);
+    for (size_t i = 0; i < words.size(); ++i) edge->AddWord(words[i]);
+    ArrayRange<uint32_t> children = Children(ei);
+    for (size_t i = 0; i < children.size(); ++i) edge->AddChild(children[i]);
+    AddFeatures(ei, edge->Features().get());
+    graph->vertices_[heads_[ei]].AddEdge(edge);
+  }
+}
+
+void FrozenGraph::AddFeatures(size_t edge, SparseVector* features) const {
+  ArrayRange<size_t> ids = FeatureIds(edge);
+  const FeatureStatsType* values = FeatureValues(edge);
+  if (!features->size()) {
+    for (size_t i = 0; i < ids.size(); ++i) features->set(ids[i], values[i]);
+    return;
+  }
+  SparseVector add;
+  for (size_t i = 0; i < ids.size(); ++i) add.set(ids[i], values[i]);
+  *features += add;
+}
+
+FeatureStatsType FrozenGraph::GetScore(size_t edge, const SparseVector& weights) const {
+  ArrayRange<size_t> ids = FeatureIds(edge);
+  const FeatureStatsType* values = FeatureValues(edge);
+  FeatureStatsType product = 0.0;
+  const size_t* weightIds = weights.ids();
+  const size_t* weightEnd = weights.ids() + weights.size();
+  // Against many more weights, search for each id rather than step to it
+  bool search = weights.size() > 8 * ids.size();
+  for (size_t i = 0; i < ids.size() && weightIds != weightEnd; ++i) {
+    if (search) {
+      weightIds = lower_bound(weightIds, weightEnd, ids[i]);
+    } else {
+      while (weightIds != weightEnd && *weightIds < ids[i]) ++weightIds;
     }
-    edgeIds[&(edges_[i])] = str.str();
-  }*/
+    if (weightIds != weightEnd && *weightIds == ids[i]) {
+      product += values[i] * weights.values()[weightIds - weights.ids()];
+    }
+  }
+  return product;
+}
 
-  //end For debug
+FeatureStatsType FrozenGraph::GetScore(size_t edge, const vector<FeatureStatsType>& weights) const {
+  ArrayRange<size_t> ids = FeatureIds(edge);
+  const FeatureStatsType* values = FeatureValues(edge);
+  FeatureStatsType product = 0.0;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (ids[i] < weights.size()) product += values[i] * weights[ids[i]];
+  }
+  return product;
+}
 
-  map<const Edge*, FeatureStatsType> edgeBackwardScores;
-  map<const Edge*, size_t> edgeHeads;
-  vector<FeatureStatsType> vertexBackwardScores(vertices_.Size(), kMinScore);
-  vector<vector<const Edge*> > outgoing(vertices_.Size());
+void FrozenGraph::Prune(FrozenGraph* pNewGraph, const SparseVector& weights, size_t minEdgeCount) const {
+
+  FrozenGraph& newGraph = *pNewGraph;
+  const size_t numVertices = VertexSize();
+  const size_t numEdges = EdgeSize();
+
+  vector<FeatureStatsType> edgeModelScores(numEdges);
+  vector<FeatureStatsType> edgeBackwardScores(numEdges);
+  vector<FeatureStatsType> vertexBackwardScores(numVertices, kMinScore);
+  //Edges out of each vertex, once per time it is a child, as offsets into outgoing
+  vector<size_t> outgoingBegin(numVertices + 1, 0);
 
   //Compute backward scores
-  for (size_t vi = 0; vi < vertices_.Size(); ++vi) {
-    //cerr << "Vertex " << vi << endl;
-    const Vertex& vertex = vertices_[vi];
-    const vector<const Edge*>& incoming = vertex.GetIncoming();
-    if (!incoming.size()) {
+  for (size_t vi = 0; vi < numVertices; ++vi) {
+    if (IncomingBegin(vi) == IncomingEnd(vi)) {
       vertexBackwardScores[vi] = 0;
-    } else {
-      for (size_t ei = 0; ei < incoming.size(); ++ei) {
-        //cerr << "Edge " << edgeIds[incoming[ei]] << endl;
-        edgeHeads[incoming[ei]]= vi;
-        FeatureStatsType incomingScore = incoming[ei]->GetScore(weights);
-        for (size_t i = 0; i < incoming[ei]->Children().size(); ++i) {
-       //   cerr << "\tChild " << incoming[ei]->Children()[i] << endl;
-          size_t childId = incoming[ei]->Children()[i];
-          UTIL_THROW_IF(vertexBackwardScores[childId] == kMinScore,
-            HypergraphException, "Graph was not topologically sorted. curr=" << vi << " prev=" << childId);
-          outgoing[childId].push_back(incoming[ei]);
-          incomingScore += vertexBackwardScores[childId];
-        }
-        edgeBackwardScores[incoming[ei]]= incomingScore;
-     //   cerr << "Backward score: " << incomingScore << endl;
-        if (incomingScore > vertexBackwardScores[vi]) vertexBackwardScores[vi] = incomingScore;
+      continue;
+    }
+    for (size_t edge = IncomingBegin(vi); edge < IncomingEnd(vi); ++edge) {
+      edgeModelScores[edge] = GetScore(edge, weights);
+      FeatureStatsType incomingScore = edgeModelScores[edge];
+      ArrayRange<uint32_t> children = Children(edge);
+      for (size_t i = 0; i < children.size(); ++i) {
+        size_t childId = children[i];
+        UTIL_THROW_IF(vertexBackwardScores[childId] == kMinScore,
+          HypergraphException, "Graph was not topologically sorted. curr=" << vi << " prev=" << childId);
+        ++outgoingBegin[childId + 1];
+        incomingScore += vertexBackwardScores[childId];
       }
+      edgeBackwardScores[edge] = incomingScore;
+      if (incomingScore > vertexBackwardScores[vi]) vertexBackwardScores[vi] = incomingScore;
     }
   }
 
-  //Compute forward scores
-  vector<FeatureStatsType> vertexForwardScores(vertices_.Size(), kMinScore);
-  map<const Edge*, FeatureStatsType> edgeForwardScores;
-  for (size_t i = 1; i <= vertices_.Size(); ++i) {
-    size_t vi = vertices_.Size() - i;
-    //cerr << "Vertex " << vi << endl;
-    if (!outgoing[vi].size()) {
+  for (size_t vi = 0; vi < numVertices; ++vi) outgoingBegin[vi + 1] += outgoingBegin[vi];
+  vector<size_t> outgoing(outgoingBegin[numVertices]);
+  vector<size_t> outgoingEnd(outgoingBegin.begin(), outgoingBegin.end() - 1);
+  for (size_t edge = 0; edge < numEdges; ++edge) {
+    ArrayRange<uint32_t> children = Children(edge);
+    for (size_t i = 0; i < children.size(); ++i) outgoing[outgoingEnd[children[i]]++] = edge;
+  }
+
+  //Compute forward scores. An edge with no children gets no forward score
+  //of its own, and takes that of its head.
+  vector<FeatureStatsType> vertexForwardScores(numVertices, kMinScore);
+  vector<FeatureStatsType> edgeForwardScores(numEdges, 0);
+  vector<bool> hasForwardScore(numEdges, false);
+  for (size_t i = 1; i <= numVertices; ++i) {
+    size_t vi = numVertices - i;
+    if (outgoingBegin[vi] == outgoingBegin[vi + 1]) {
       vertexForwardScores[vi] = 0;
-    } else {
-      for (size_t ei = 0; ei < outgoing[vi].size(); ++ei) {
-        //cerr << "Edge " << edgeIds[outgoing[vi][ei]] << endl;
-        FeatureStatsType outgoingScore = 0; 
-        //sum scores of siblings
-        for (size_t i = 0; i < outgoing[vi][ei]->Children().size(); ++i) {
-          size_t siblingId = outgoing[vi][ei]->Children()[i];
-          if (siblingId != vi) {
-         //   cerr << "\tSibling " << siblingId << endl;
-            outgoingScore += vertexBackwardScores[siblingId];
-          }
-        }
-        //add score of head
-        outgoingScore += vertexForwardScores[edgeHeads[outgoing[vi][ei]]];
-        //cerr << "Forward score " << outgoingScore << endl;
-        edgeForwardScores[outgoing[vi][ei]] = outgoingScore;
-        outgoingScore += outgoing[vi][ei]->GetScore(weights);
-        if (outgoingScore > vertexForwardScores[vi]) vertexForwardScores[vi] = outgoingScore;
+      continue;
+    }
+    for (size_t oi = outgoingBegin[vi]; oi < outgoingBegin[vi + 1]; ++oi) {
+      size_t edge = outgoing[oi];
+      FeatureStatsType outgoingScore = 0;
+      //sum scores of siblings
+      ArrayRange<uint32_t> children = Children(edge);
+      for (size_t i = 0; i < children.size(); ++i) {
+        if (children[i] != vi) outgoingScore += vertexBackwardScores[children[i]];
       }
+      //add score of head
+      outgoingScore += vertexForwardScores[heads_[edge]];
+      edgeForwardScores[edge] = outgoingScore;
+      hasForwardScore[edge] = true;
+      outgoingScore += edgeModelScores[edge];
+      if (outgoingScore > vertexForwardScores[vi]) vertexForwardScores[vi] = outgoingScore;
     }
   }
 
+  vector<FeatureStatsType> edgeScores(numEdges);
+  for (size_t edge = 0; edge < numEdges; ++edge) {
+    FeatureStatsType forward = hasForwardScore[edge] ?
+      edgeForwardScores[edge] : vertexForwardScores[heads_[edge]];
+    edgeScores[edge] = forward + edgeBackwardScores[edge];
+  }
+
+  //Keep every edge scoring at least the minEdgeCount'th best score, so
+  //all those tied with it too, or every edge if there are too few
+  size_t keep = max<size_t>(minEdgeCount, 1);
+  FeatureStatsType threshold = kMinScore;
+  bool keepAll = keep >= numEdges;
+  if (!keepAll) {
+    vector<FeatureStatsType> ranked(edgeScores);
+    nth_element(ranked.begin(), ranked.begin() + (numEdges - keep), ranked.end());
+    threshold = ranked[numEdges - keep];
+  }
+
+  vector<bool> retainedEdges(numEdges, false);
+  vector<bool> retainedVertices(numVertices, false);
+  for (size_t edge = 0; edge < numEdges; ++edge) {
+    if (!keepAll && !(edgeScores[edge] >= threshold)) continue;
+    retainedEdges[edge] = true;
+    retainedVertices[heads_[edge]] = true;
+    ArrayRange<uint32_t> children = Children(edge);
+    for (size_t i = 0; i < children.size(); ++i) retainedVertices[children[i]] = true;
+  }
 
+  vector<uint32_t> oldIdToNew(numVertices, 0);
+  uint32_t retainedVertexCount = 0;
+  for (size_t vi = 0; vi < numVertices; ++vi) {
+    if (retainedVertices[vi]) oldIdToNew[vi] = retainedVertexCount++;
+  }
 
-  multimap<FeatureStatsType, const Edge*> edgeScores;
-  for (size_t i = 0; i < edges_.Size(); ++i) {
-    const Edge* edge = &(edges_[i]);
-    if (edgeForwardScores.find(edge) == edgeForwardScores.end()) {
-      //This edge has no children, so didn't get a forward score. Its forward score
-      //is that of its head
-      edgeForwardScores[edge] = vertexForwardScores[edgeHeads[edge]];
+  //The kept edges of each kept vertex stay together and in order
+  newGraph.vocab_ = vocab_;
+  newGraph.incomingBegin_.assign(1, 0);
+  newGraph.sourceCovered_.clear();
+  newGraph.heads_.clear();
+  newGraph.childrenBegin_.assign(1, 0);
+  newGraph.children_.clear();
+  newGraph.wordsBegin_.assign(1, 0);
+  newGraph.words_.clear();
+  newGraph.featuresBegin_.assign(1, 0);
+  newGraph.featureIds_.clear();
+  newGraph.featureValues_.clear();
+  for (size_t vi = 0; vi < numVertices; ++vi) {
+    if (!retainedVertices[vi]) continue;
+    newGraph.sourceCovered_.push_back(sourceCovered_[vi]);
+    for (size_t edge = IncomingBegin(vi); edge < IncomingEnd(vi); ++edge) {
+      if (!retainedEdges[edge]) continue;
+      newGraph.heads_.push_back(oldIdToNew[vi]);
+      ArrayRange<uint32_t> children = Children(edge);
+      for (size_t i = 0; i < children.size(); ++i) {
+        newGraph.children_.push_back(oldIdToNew[children[i]]);
+      }
+      newGraph.childrenBegin_.push_back(newGraph.children_.size());
+      ArrayRange<const Vocab::Entry*> words = Words(edge);
+      newGraph.words_.insert(newGraph.words_.end(), words.begin(), words.end());
+      newGraph.wordsBegin_.push_back(newGraph.words_.size());
+      ArrayRange<size_t> ids = FeatureIds(edge);
+      newGraph.featureIds_.insert(newGraph.featureIds_.end(), ids.begin(), ids.end());
+      newGraph.featureValues_.insert(newGraph.featureValues_.end(), FeatureValues(edge),
+        FeatureValues(edge) + ids.size());
+      newGraph.featuresBegin_.push_back(newGraph.featureIds_.size());
     }
-    FeatureStatsType score = edgeForwardScores[edge] + edgeBackwardScores[edge];
-    edgeScores.insert(pair<FeatureStatsType, const Edge*>(score,edge));
-  //  cerr << edgeIds[edge] << " " << score << endl;
+    newGraph.incomingBegin_.push_back(newGraph.heads_.size());
   }
+}
 
+size_t FrozenGraph::MemoryUsage() const {
+  return (incomingBegin_.capacity() + heads_.capacity() + childrenBegin_.capacity() +
+          children_.capacity() + wordsBegin_.capacity() + featuresBegin_.capacity()) * sizeof(uint32_t) +
+         (sourceCovered_.capacity() + featureIds_.capacity()) * sizeof(size_t) +
+         words_.capacity() * sizeof(const Vocab::Entry*) +
+         featureValues_.capacity() * sizeof(FeatureStatsType);
+}
 
-  
-  multimap<FeatureStatsType, const Edge*>::const_reverse_iterator ei = edgeScores.rbegin();
-  size_t edgeCount = 1;
-  while(edgeCount < minEdgeCount && ei != edgeScores.rend()) {
-    ++ei;
-    ++edgeCount;
+void EdgeScores::Score(const SparseVector& weights) {
+  scores_.resize(graph_.EdgeSize());
+  for (size_t ei = 0; ei < scores_.size(); ++ei) {
+    scores_[ei] = graph_.GetScore(ei, weights);
   }
-  multimap<FeatureStatsType, const Edge*>::const_iterator lowest = edgeScores.begin();
-  if (ei != edgeScores.rend())  lowest = edgeScores.lower_bound(ei->first);
-
-  //cerr << "Retained edges" << endl;
-  set<size_t> retainedVertices;
-  set<const Edge*> retainedEdges;
-  for (; lowest != edgeScores.end(); ++lowest) {
-    //cerr << lowest->first << " " << edgeIds[lowest->second] << endl;
-    retainedEdges.insert(lowest->second);
-    retainedVertices.insert(edgeHeads[lowest->second]);
-    for (size_t i = 0; i < lowest->second->Children().size(); ++i) {
-      retainedVertices.insert(lowest->second->Children()[i]);
+  tracked_ = false;
+  rescored_ = scores_.size();
+}
+
+void EdgeScores::Index() {
+  for (size_t ei = 0; ei < graph_.EdgeSize(); ++ei) {
+    ArrayRange<size_t> ids = graph_.FeatureIds(ei);
+    ids_.insert(ids_.end(), ids.begin(), ids.end());
+  }
+  sort(ids_.begin(), ids_.end());
+  ids_.erase(unique(ids_.begin(), ids_.end()), ids_.end());
+  weights_.resize(ids_.size());
+
+  // Count the edges with each feature, then place them
+  edgesBegin_.assign(ids_.size() + 1, 0);
+  for (size_t ei = 0; ei < graph_.EdgeSize(); ++ei) {
+    ArrayRange<size_t> ids = graph_.FeatureIds(ei);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      ++edgesBegin_[lower_bound(ids_.begin(), ids_.end(), ids[i]) - ids_.begin() + 1];
     }
   }
-  newGraph.SetCounts(retainedVertices.size(), retainedEdges.size());
-
-  //cerr << "Retained vertices" << endl;
-  map<size_t,size_t> oldIdToNew;
-  size_t vi = 0;
-  for (set<size_t>::const_iterator i = retainedVertices.begin(); i != retainedVertices.end(); ++i, ++vi) {
-    //cerr << *i << endl;
-    oldIdToNew[*i] = vi;
-    Vertex* vertex = newGraph.NewVertex();
-    vertex->SetSourceCovered(vertices_[*i].SourceCovered()); 
+  common_.assign(ids_.size(), false);
+  for (size_t k = 0; k < ids_.size(); ++k) {
+    if (edgesBegin_[k + 1] * 2 > graph_.EdgeSize()) {
+      common_[k] = true;
+      edgesBegin_[k + 1] = 0;
+    }
+    edgesBegin_[k + 1] += edgesBegin_[k];
+  }
+  edges_.resize(edgesBegin_.back());
+  vector<uint32_t> next(edgesBegin_.begin(), edgesBegin_.end() - 1);
+  for (size_t ei = 0; ei < graph_.EdgeSize(); ++ei) {
+    ArrayRange<size_t> ids = graph_.FeatureIds(ei);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      size_t k = lower_bound(ids_.begin(), ids_.end(), ids[i]) - ids_.begin();
+      if (!common_[k]) edges_[next[k]++] = ei;
+    }
   }
+  rescoredEdge_.assign(graph_.EdgeSize(), false);
+}
 
-  for (set<const Edge*>::const_iterator i = retainedEdges.begin(); i != retainedEdges.end(); ++i) {
-    Edge* newEdge = newGraph.NewEdge();
-    const Edge* oldEdge = *i;
-    for (size_t j = 0; j < oldEdge->Words().size(); ++j) {
-      newEdge->AddWord(oldEdge->Words()[j]);
+void EdgeScores::Update(const SparseVector& weights) {
+  if (edgesBegin_.empty()) Index();
+
+  // Find the features whose weights changed, and how many edges have them
+  vector<size_t> changed;
+  size_t changedEdges = 0;
+  const size_t* weightIds = weights.ids();
+  const size_t* weightEnd = weights.ids() + weights.size();
+  for (size_t k = 0; k < ids_.size(); ++k) {
+    weightIds = lower_bound(weightIds, weightEnd, ids_[k]);
+    FeatureStatsType weight = 0;
+    if (weightIds != weightEnd && *weightIds == ids_[k]) {
+      weight = weights.values()[weightIds - weights.ids()];
     }
-    for (size_t j = 0; j < oldEdge->Children().size(); ++j) {
-      newEdge->AddChild(oldIdToNew[oldEdge->Children()[j]]);
+    if (!tracked_ || weight != weights_[k]) {
+      weights_[k] = weight;
+      changed.push_back(k);
+      changedEdges += common_[k] ? graph_.EdgeSize() : edgesBegin_[k + 1] - edgesBegin_[k];
     }
-    newEdge->SetFeatures(oldEdge->Features());
-    Vertex& newHead = newGraph.vertices_[oldIdToNew[edgeHeads[oldEdge]]];
-    newHead.AddEdge(newEdge);
   }
 
-  
+  // Rescoring every edge is no dearer than finding those to rescore
+  if (!tracked_ || changedEdges >= graph_.EdgeSize()) {
+    Score(weights);
+    tracked_ = true;
+    return;
+  }
+
+  rescored_ = 0;
+  for (size_t i = 0; i < changed.size(); ++i) {
+    for (size_t j = edgesBegin_[changed[i]]; j < edgesBegin_[changed[i] + 1]; ++j) {
+      size_t ei = edges_[j];
+      if (rescoredEdge_[ei]) continue;
+      rescoredEdge_[ei] = true;
+      scores_[ei] = graph_.GetScore(ei, weights);
+      ++rescored_;
+    }
+  }
+  for (size_t i = 0; i < changed.size(); ++i) {
+    for (size_t j = edgesBegin_[changed[i]]; j < edgesBegin_[changed[i] + 1]; ++j) {
+      rescoredEdge_[edges_[j]] = false;
+    }
+  }
+}
 
+size_t EdgeScores::MemoryUsage() const {
+  return scores_.capacity() * sizeof(FeatureStatsType) +
+         ids_.capacity() * sizeof(size_t) +
+         weights_.capacity() * sizeof(FeatureStatsType) +
+         (edgesBegin_.capacity() + edges_.capacity()) * sizeof(uint32_t) +
+         (common_.capacity() + rescoredEdge_.capacity()) / 8;
+}
 
+void Graph::Renumber(Vocab& vocab, const WordVec& entries, const GraphFeatures& features,
+                     const vector<size_t>& ids) {
+  vocab_ = &vocab;
+  for (size_t i = 0; i < edges_.Size(); ++i) {
+    edges_[i].RenumberWords(entries);
+  }
+  // In the order they were read, so each edge sets its features as AddFeature would have
+  const vector<GraphFeatures::Value>& values = features.Values();
+  for (size_t i = 0; i < values.size(); ++i) {
+    const GraphFeatures::Value& value = values[i];
+    size_t id = ids[value.name];
+    if (id != GraphFeatures::kDropped) value.edge->Features()->set(id, value.value);
+  }
 }
 
 /**
   * Read from "Kenneth's hypergraph" aka cdec target_graph format (with comments)
 **/
-void ReadGraph(util::FilePiece &from, Graph &graph) {
+void ReadGraph(util::FilePiece &from, Graph &graph, GraphFeatures* features) {
 
   //First line should contain field names
   StringPiece line = from.ReadLine();
@@ -274,7 +530,7 @@ void ReadGraph(util::FilePiece &from, Graph &graph) {
     unsigned long int edge_count = boost::lexical_cast<unsigned long int>(line);
     Vertex* vertex = graph.NewVertex();
     for (unsigned long int e = 0; e < edge_count; ++e) {
-      pair<Edge*,size_t> edge = ReadEdge(from, graph);
+      pair<Edge*,size_t> edge = ReadEdge(from, graph, features);
       vertex->AddEdge(edge.first);
       //Note: the file format attaches this to the edge, but it's really a property 
       //of the vertex.
@@ -283,4 +539,28 @@ void ReadGraph(util::FilePiece &from, Graph &graph) {
   }
 }
 
+void CountGraphFeatures(util::FilePiece &from, FeatureNameCounts* counts) {
+  StringPiece line = from.ReadLine();
+  UTIL_THROW_IF(line.compare("# target ||| features ||| source-covered") != 0, HypergraphException, "Incorrect format spec on first line: '" << line << "'");
+  line = NextLine(from);
+  util::TokenIter<util::SingleCharacter, false> i(line, util::SingleCharacter(' '));
+  unsigned long int vertices = boost::lexical_cast<unsigned long int>(*i);
+  for (size_t v = 0; v < vertices; ++v) {
+    line = NextLine(from);
+    unsigned long int edge_count = boost::lexical_cast<unsigned long int>(line);
+    for (unsigned long int e = 0; e < edge_count; ++e) {
+      line = NextLine(from);
+      util::TokenIter<util::MultiCharacter> pipes(line, util::MultiCharacter(" ||| "));
+      ++pipes;
+      for (util::TokenIter<util::SingleCharacter, true> f(*pipes, util::SingleCharacter(' ')); f; ++f) {
+        StringPiece fv = *f;
+        if (!fv.size()) break;
+        size_t equals = fv.find_last_of("=");
+        UTIL_THROW_IF(equals == fv.npos, HypergraphException, "Failed to parse feature '" << fv << "'");
+        counts->Add(fv.substr(0,equals));
+      }
+    }
+  }
+}
+
 };
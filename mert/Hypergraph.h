@@ -21,6 +21,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define MERT_HYPERGRAPH_H
 
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_array.hpp>
@@ -93,6 +95,14 @@ class Vocab {
 
     const Entry& Eos() const {return eos_;}
 
+    std::size_t Size() const {return map_.size();}
+
+    /**
+      * Add the words of other, in the order other numbered them, and set
+      * (*entries)[i] to the entry here of the word other numbered i.
+      **/
+    void Add(const Vocab& other, std::vector<const Entry*>* entries);
+
   private:
     util::Pool piece_backing_;
 
@@ -138,8 +148,14 @@ class Edge {
     }
 
     void AddFeature(const StringPiece& name, FeatureStatsType value) {
-      //TODO StringPiece interface
-      features_->set(name.as_string(),value);
+      features_->set(name,value);
+    }
+
+    /** Replace each word w with entries[w->second] */
+    void RenumberWords(const WordVec& entries) {
+      for (std::size_t i = 0; i < words_.size(); ++i) {
+        if (words_[i]) words_[i] = entries[words_[i]->second];
+      }
     }
 
 
@@ -163,6 +179,10 @@ class Edge {
       return inner_product(*(features_.get()), weights);
     }
 
+    FeatureStatsType GetScore(const std::vector<FeatureStatsType>& weights) const {
+      return inner_product(*(features_.get()), weights);
+    }
+
   private:
     // NULL for non-terminals.  
     std::vector<const Vocab::Entry*> words_;
@@ -191,16 +211,58 @@ class Vertex {
 };
 
 
+/**
+  * The sparse features of a graph read on a thread of its own. ReadGraph
+  * keeps each edge's features here, with the names numbered in the order
+  * it first saw them, rather than giving the names SparseVector ids. The
+  * ids can then be given afterwards, graph by graph, in the order a
+  * serial read would have given them.
+  **/
+class GraphFeatures {
+  public:
+    // Id of a feature to leave out
+    static const std::size_t kDropped = static_cast<std::size_t>(-1);
+
+    struct Value {
+      Edge* edge;
+      std::size_t name;
+      FeatureStatsType value;
+    };
+
+    /** The number of name, numbering it if it is new */
+    std::size_t Name(const StringPiece& name);
+
+    void Add(Edge* edge, std::size_t name, FeatureStatsType value) {
+      Value added = {edge, name, value};
+      values_.push_back(added);
+    }
+
+    void Add(Edge* edge, const StringPiece& name, FeatureStatsType value) {
+      Add(edge, Name(name), value);
+    }
+
+    /** The names, in the order they were first added */
+    const std::vector<std::string>& Names() const {return names_;}
+
+    /** The features, in the order they were added */
+    const std::vector<Value>& Values() const {return values_;}
+
+  private:
+    boost::unordered_map<std::string, std::size_t> ids_;
+    std::vector<std::string> names_;
+    std::vector<Value> values_;
+};
+
 class Graph : boost::noncopyable {
   public:
-    Graph(Vocab& vocab) : vocab_(vocab) {}
+    Graph(Vocab& vocab) : vocab_(&vocab) {}
 
     void SetCounts(std::size_t vertices, std::size_t edges) {
       vertices_.Init(vertices);
       edges_.Init(edges);
     }
 
-    Vocab &MutableVocab() { return vocab_; }
+    Vocab &MutableVocab() { return *vocab_; }
 
     Edge *NewEdge() {      
       return edges_.New();
@@ -218,22 +280,190 @@ class Graph : boost::noncopyable {
       return edges_[index];
     }
 
+    const Edge &GetEdge(std::size_t index) const {
+      return edges_[index];
+    }
+
+    std::size_t EdgeIndex(const Edge* edge) const {
+      return edge - &edges_[0];
+    }
+
     /* Created a pruned copy of this graph with minEdgeCount edges. Uses
     the scores in the max-product semiring to rank edges, as suggested by
     Colin Cherry */
     void Prune(Graph* newGraph, const SparseVector& weights, size_t minEdgeCount) const;
 
+    /**
+      * Move a graph read with GraphFeatures onto vocab, whose entries[w]
+      * is the word the graph's vocabulary numbered w, and give each edge
+      * its features, with ids[n] the id of the nth name of features.
+      **/
+    void Renumber(Vocab& vocab, const WordVec& entries, const GraphFeatures& features,
+                  const std::vector<std::size_t>& ids);
+
     std::size_t VertexSize() const { return vertices_.Size(); }
     std::size_t EdgeSize() const { return edges_.Size(); }
 
     bool IsBoundary(const Vocab::Entry* word) const {
-      return word->second == vocab_.Bos().second || word->second == vocab_.Eos().second;
+      return word->second == vocab_->Bos().second || word->second == vocab_->Eos().second;
     }
 
   private:
+    friend class FrozenGraph;
+
     FixedAllocator<Edge> edges_;    
     FixedAllocator<Vertex> vertices_;
-    Vocab& vocab_;
+    Vocab* vocab_;
+};
+
+/** A range of an array, which it doesn't own */
+template <class T> class ArrayRange {
+  public:
+    ArrayRange(const T* begin, const T* end) : begin_(begin), end_(end) {}
+
+    const T* begin() const {return begin_;}
+    const T* end() const {return end_;}
+    std::size_t size() const {return end_ - begin_;}
+    const T& operator[](std::size_t i) const {return begin_[i];}
+
+  private:
+    const T* begin_;
+    const T* end_;
+};
+
+/**
+  * A graph which no longer changes, laid out as arrays. The incoming edges
+  * of each vertex are numbered consecutively, and each edge's children,
+  * words and features are ranges of arrays shared by the whole graph, so
+  * decoding reads memory in order instead of chasing a few heap blocks
+  * per edge.
+  **/
+class FrozenGraph : boost::noncopyable {
+  public:
+    FrozenGraph() : vocab_(NULL) {}
+
+    /**
+      * Replace this with graph, numbering its edges in the order of the
+      * vertices' incoming edges. Edges with no head are left out.
+      **/
+    void Freeze(const Graph& graph);
+
+    /** Build graph, which must be empty, with the same vertices and edges */
+    void Thaw(Graph* graph) const;
+
+    std::size_t VertexSize() const {return sourceCovered_.size();}
+    std::size_t EdgeSize() const {return heads_.size();}
+
+    /** The edges into vertex are those from IncomingBegin up to IncomingEnd */
+    std::size_t IncomingBegin(std::size_t vertex) const {return incomingBegin_[vertex];}
+    std::size_t IncomingEnd(std::size_t vertex) const {return incomingBegin_[vertex + 1];}
+    std::size_t SourceCovered(std::size_t vertex) const {return sourceCovered_[vertex];}
+
+    std::size_t Head(std::size_t edge) const {return heads_[edge];}
+
+    ArrayRange<uint32_t> Children(std::size_t edge) const {
+      return ArrayRange<uint32_t>(Data(children_) + childrenBegin_[edge], Data(children_) + childrenBegin_[edge + 1]);
+    }
+
+    // NULL for non-terminals
+    ArrayRange<const Vocab::Entry*> Words(std::size_t edge) const {
+      return ArrayRange<const Vocab::Entry*>(Data(words_) + wordsBegin_[edge], Data(words_) + wordsBegin_[edge + 1]);
+    }
+
+    // The ids of the edge's features, in increasing order, and their values
+    ArrayRange<std::size_t> FeatureIds(std::size_t edge) const {
+      return ArrayRange<std::size_t>(Data(featureIds_) + featuresBegin_[edge], Data(featureIds_) + featuresBegin_[edge + 1]);
+    }
+    const FeatureStatsType* FeatureValues(std::size_t edge) const {
+      return Data(featureValues_) + featuresBegin_[edge];
+    }
+
+    /** Add the features of edge to features */
+    void AddFeatures(std::size_t edge, SparseVector* features) const;
+
+    // As Edge::GetScore, with the sums in the same order
+    FeatureStatsType GetScore(std::size_t edge, const SparseVector& weights) const;
+    FeatureStatsType GetScore(std::size_t edge, const std::vector<FeatureStatsType>& weights) const;
+
+    /** As Graph::Prune */
+    void Prune(FrozenGraph* newGraph, const SparseVector& weights, std::size_t minEdgeCount) const;
+
+    Vocab &MutableVocab() const { return *vocab_; }
+
+    bool IsBoundary(const Vocab::Entry* word) const {
+      return word->second == vocab_->Bos().second || word->second == vocab_->Eos().second;
+    }
+
+    /** Bytes held in the arrays */
+    std::size_t MemoryUsage() const;
+
+  private:
+    // The start of vec, which may be empty
+    template <class T> static const T* Data(const std::vector<T>& vec) {
+      return vec.empty() ? NULL : &vec[0];
+    }
+
+    Vocab* vocab_;
+    std::vector<uint32_t> incomingBegin_;
+    std::vector<std::size_t> sourceCovered_;
+    std::vector<uint32_t> heads_;
+    std::vector<uint32_t> childrenBegin_;
+    std::vector<uint32_t> children_;
+    std::vector<uint32_t> wordsBegin_;
+    std::vector<const Vocab::Entry*> words_;
+    std::vector<uint32_t> featuresBegin_;
+    std::vector<std::size_t> featureIds_;
+    std::vector<FeatureStatsType> featureValues_;
+};
+
+/**
+  * The model score of each edge of a frozen graph. Kept up to date as the
+  * weights change, by rescoring only the edges with a feature whose weight
+  * changed, found through an index from each of the graph's features to
+  * the edges which have it. Features on most edges, such as the dense
+  * ones, are left out of the index, as a change to one of those rescores
+  * every edge anyway.
+  **/
+class EdgeScores : boost::noncopyable {
+  public:
+    explicit EdgeScores(const FrozenGraph& graph) : graph_(graph), tracked_(false), rescored_(0) {}
+
+    /** Score every edge under weights, without keeping track of them */
+    void Score(const SparseVector& weights);
+
+    /**
+      * Bring the scores up to date with weights, rescoring only the edges
+      * whose features had their weights changed since the last Update.
+      * Each edge's score is worked out afresh, as FrozenGraph::GetScore
+      * would, rather than adjusted, so the scores never drift.
+      **/
+    void Update(const SparseVector& weights);
+
+    FeatureStatsType operator[](std::size_t edge) const {return scores_[edge];}
+
+    /** Edges rescored by the last Score or Update */
+    std::size_t Rescored() const {return rescored_;}
+
+    /** Bytes held in the scores and index */
+    std::size_t MemoryUsage() const;
+
+  private:
+    void Index();
+
+    const FrozenGraph& graph_;
+    std::vector<FeatureStatsType> scores_;
+    // Whether weights_ holds the weights the scores were worked out with
+    bool tracked_;
+    std::size_t rescored_;
+    // The graph's feature ids, in increasing order, with the weight of each at the last Update
+    std::vector<std::size_t> ids_;
+    std::vector<FeatureStatsType> weights_;
+    // The edges with each feature, as offsets into edges_, none for those left out
+    std::vector<bool> common_;
+    std::vector<uint32_t> edgesBegin_;
+    std::vector<uint32_t> edges_;
+    // Edges already rescored, while updating
+    std::vector<bool> rescoredEdge_;
 };
 
 class HypergraphException : public util::Exception {
@@ -243,7 +473,19 @@ class HypergraphException : public util::Exception {
 };
 
 
-void ReadGraph(util::FilePiece &from, Graph &graph);
+/**
+  * Read a graph. With features, the edges' sparse features go there
+  * rather than into the edges.
+  **/
+void ReadGraph(util::FilePiece &from, Graph &graph, GraphFeatures* features = NULL);
+
+class FeatureNameCounts;
+
+/**
+ * Reads a graph in the format of ReadGraph without building it, adding
+ * to counts the number of edges with each feature.
+**/
+void CountGraphFeatures(util::FilePiece &from, FeatureNameCounts* counts);
 
 
 };
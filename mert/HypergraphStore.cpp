@@ -0,0 +1,370 @@
+/*
+ *  HypergraphStore.cpp
+ *  mert - Minimum Error Rate Training
+ *
+ *  File layout, all in native byte order with each block starting on
+ *  an 8 byte boundary:
+ *    header
+ *    incoming offsets   (vertices+1) x uint32, into the incoming edges
+ *    incoming edges     incoming x uint32, edge indices
+ *    source covered     vertices x uint32
+ *    child offsets      (edges+1) x uint32, into the children
+ *    children           children x uint32, vertex indices
+ *    word offsets       (edges+1) x uint32, into the words
+ *    words              words x uint32, index into the word table, or
+ *                       kNonTerminal where a child goes
+ *    feature offsets    (edges+1) x uint32, into the features
+ *    feature names      features x uint32, index into the name table
+ *    feature values     features x float
+ *    text               the word table, then the feature name table,
+ *                       one per line
+ */
+
+#include "HypergraphStore.h"
+
+#include <cstring>
+#include <fstream>
+
+#include <boost/unordered_map.hpp>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+
+#include "FeatureRegistry.h"
+#include "SparseFeatureCounts.h"
+
+using namespace std;
+
+namespace
+{
+const char kMagic[8] = {'M','E','R','T','H','G','S','T'};
+const uint64_t kVersion = 1;
+const uint32_t kNonTerminal = static_cast<uint32_t>(-1);
+
+struct Header {
+  char magic[8];
+  uint64_t version;
+  uint64_t vertices;
+  uint64_t edges;
+  uint64_t incoming;
+  uint64_t children;
+  uint64_t words;
+  uint64_t features;
+  uint64_t vocab;
+  uint64_t names;
+  uint64_t text;
+};
+
+uint64_t Padded(uint64_t bytes)
+{
+  return (bytes + 7) & ~static_cast<uint64_t>(7);
+}
+
+template <class T> void Append(string* out, const vector<T>& vec)
+{
+  uint64_t bytes = vec.size() * sizeof(T);
+  if (bytes) out->append(reinterpret_cast<const char*>(&vec[0]), bytes);
+  out->append(Padded(bytes) - bytes, '\0');
+}
+
+/** Sizes of the blocks after the header, in file order */
+void BlockSizes(const Header& header, uint64_t* sizes)
+{
+  sizes[0] = Padded((header.vertices + 1) * sizeof(uint32_t));
+  sizes[1] = Padded(header.incoming * sizeof(uint32_t));
+  sizes[2] = Padded(header.vertices * sizeof(uint32_t));
+  sizes[3] = Padded((header.edges + 1) * sizeof(uint32_t));
+  sizes[4] = Padded(header.children * sizeof(uint32_t));
+  sizes[5] = Padded((header.edges + 1) * sizeof(uint32_t));
+  sizes[6] = Padded(header.words * sizeof(uint32_t));
+  sizes[7] = Padded((header.edges + 1) * sizeof(uint32_t));
+  sizes[8] = Padded(header.features * sizeof(uint32_t));
+  sizes[9] = Padded(header.features * sizeof(float));
+  sizes[10] = header.text;
+}
+
+const size_t kBlocks = 11;
+
+uint32_t Checked(size_t value)
+{
+  UTIL_THROW_IF(value >= kNonTerminal, util::Exception, "Hypergraph too large for a store");
+  return static_cast<uint32_t>(value);
+}
+
+/** Whether offsets[0..count] rise from 0 to total */
+bool Consistent(const uint32_t* offsets, size_t count, size_t total)
+{
+  if (offsets[0]) return false;
+  for (size_t i = 0; i < count; ++i) {
+    if (offsets[i + 1] < offsets[i]) return false;
+  }
+  return offsets[count] == total;
+}
+
+/** Whether every one of values[0..count) is below limit, or is allowed */
+bool InRange(const uint32_t* values, size_t count, size_t limit, uint32_t allowed = 0)
+{
+  for (size_t i = 0; i < count; ++i) {
+    if (values[i] >= limit && (!allowed || values[i] != allowed)) return false;
+  }
+  return true;
+}
+
+} // namespace
+
+namespace MosesTuning
+{
+
+
+void HypergraphStore::Write(const Graph& graph, const GraphFeatures* features, string* out)
+{
+  vector<uint32_t> incomingBegin(1, 0), incoming, sourceCovered;
+  for (size_t v = 0; v < graph.VertexSize(); ++v) {
+    const Vertex& vertex = graph.GetVertex(v);
+    for (size_t i = 0; i < vertex.GetIncoming().size(); ++i) {
+      incoming.push_back(Checked(graph.EdgeIndex(vertex.GetIncoming()[i])));
+    }
+    incomingBegin.push_back(Checked(incoming.size()));
+    sourceCovered.push_back(Checked(vertex.SourceCovered()));
+  }
+
+  // Words are numbered in the order they are first used
+  string text;
+  boost::unordered_map<const Vocab::Entry*, uint32_t> wordIds;
+  vector<uint32_t> childrenBegin(1, 0), children, wordsBegin(1, 0), words;
+  for (size_t e = 0; e < graph.EdgeSize(); ++e) {
+    const Edge& edge = graph.GetEdge(e);
+    for (size_t i = 0; i < edge.Children().size(); ++i) {
+      children.push_back(Checked(edge.Children()[i]));
+    }
+    childrenBegin.push_back(Checked(children.size()));
+    for (size_t i = 0; i < edge.Words().size(); ++i) {
+      const Vocab::Entry* word = edge.Words()[i];
+      if (!word) {
+        words.push_back(kNonTerminal);
+        continue;
+      }
+      pair<boost::unordered_map<const Vocab::Entry*, uint32_t>::iterator, bool> added =
+        wordIds.insert(make_pair(word, Checked(wordIds.size())));
+      if (added.second) text.append(word->first).append(1, '\n');
+      words.push_back(added.first->second);
+    }
+    wordsBegin.push_back(Checked(words.size()));
+  }
+
+  vector<uint32_t> featuresBegin(graph.EdgeSize() + 1, 0), featureNames;
+  vector<float> featureValues;
+  size_t numNames = 0;
+  if (features) {
+    // Grouped by edge, keeping the order in which each edge's were added
+    const vector<GraphFeatures::Value>& values = features->Values();
+    for (size_t i = 0; i < values.size(); ++i) {
+      ++featuresBegin[graph.EdgeIndex(values[i].edge) + 1];
+    }
+    for (size_t e = 0; e < graph.EdgeSize(); ++e) featuresBegin[e + 1] += featuresBegin[e];
+    vector<uint32_t> next(featuresBegin.begin(), featuresBegin.end() - 1);
+    featureNames.resize(values.size());
+    featureValues.resize(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      uint32_t at = next[graph.EdgeIndex(values[i].edge)]++;
+      featureNames[at] = Checked(values[i].name);
+      featureValues[at] = values[i].value;
+    }
+    numNames = features->Names().size();
+    for (size_t i = 0; i < numNames; ++i) text.append(features->Names()[i]).append(1, '\n');
+  } else {
+    boost::unordered_map<size_t, uint32_t> nameIds;
+    for (size_t e = 0; e < graph.EdgeSize(); ++e) {
+      const SparseVector& sparse = *graph.GetEdge(e).Features();
+      for (size_t i = 0; i < sparse.size(); ++i) {
+        pair<boost::unordered_map<size_t, uint32_t>::iterator, bool> added =
+          nameIds.insert(make_pair(sparse.ids()[i], Checked(nameIds.size())));
+        if (added.second) text.append(SparseVector::decode(sparse.ids()[i])).append(1, '\n');
+        featureNames.push_back(added.first->second);
+        featureValues.push_back(sparse.values()[i]);
+      }
+      featuresBegin[e + 1] = Checked(featureNames.size());
+    }
+    numNames = nameIds.size();
+  }
+
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.vertices = graph.VertexSize();
+  header.edges = graph.EdgeSize();
+  header.incoming = incoming.size();
+  header.children = children.size();
+  header.words = words.size();
+  header.features = featureNames.size();
+  header.vocab = wordIds.size();
+  header.names = numNames;
+  header.text = text.size();
+
+  uint64_t sizes[kBlocks];
+  BlockSizes(header, sizes);
+  uint64_t total = sizeof(Header);
+  for (size_t i = 0; i < kBlocks; ++i) total += sizes[i];
+
+  out->clear();
+  out->reserve(total);
+  out->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  Append(out, incomingBegin);
+  Append(out, incoming);
+  Append(out, sourceCovered);
+  Append(out, childrenBegin);
+  Append(out, children);
+  Append(out, wordsBegin);
+  Append(out, words);
+  Append(out, featuresBegin);
+  Append(out, featureNames);
+  Append(out, featureValues);
+  out->append(text);
+}
+
+void HypergraphStore::Write(const Graph& graph, const GraphFeatures* features, const string& file)
+{
+  string data;
+  Write(graph, features, &data);
+  util::scoped_fd fd(util::CreateOrThrow(file.c_str()));
+  util::WriteOrThrow(fd.get(), data.data(), data.size());
+}
+
+HypergraphStore::HypergraphStore(const string& file)
+{
+  util::scoped_fd fd(util::OpenReadOrThrow(file.c_str()));
+  uint64_t size = util::SizeOrThrow(fd.get());
+  UTIL_THROW_IF(size < sizeof(Header), util::Exception, file << " is too short to be a hypergraph store");
+  util::MapRead(util::LAZY, fd.get(), 0, size, m_mapped);
+  Init(static_cast<const char*>(m_mapped.get()), size, file);
+}
+
+HypergraphStore::HypergraphStore(string* buffer)
+{
+  m_buffer.swap(*buffer);
+  UTIL_THROW_IF(m_buffer.size() < sizeof(Header), util::Exception, "Truncated hypergraph store");
+  Init(m_buffer.data(), m_buffer.size(), "hypergraph store in memory");
+}
+
+bool HypergraphStore::IsStore(const string& file)
+{
+  ifstream in(file.c_str(), ios::binary);
+  char magic[sizeof(kMagic)];
+  in.read(magic, sizeof(magic));
+  return in && !memcmp(magic, kMagic, sizeof(kMagic));
+}
+
+void HypergraphStore::Init(const char* data, uint64_t size, const string& name)
+{
+  m_name = name;
+  Header header;
+  memcpy(&header, data, sizeof(header));
+  UTIL_THROW_IF(memcmp(header.magic, kMagic, sizeof(kMagic)), util::Exception,
+                name << " is not a hypergraph store");
+  UTIL_THROW_IF(header.version != kVersion, util::Exception, name << " has version "
+                << header.version << ", expected " << kVersion);
+  uint64_t sizes[kBlocks];
+  BlockSizes(header, sizes);
+  const char* blocks[kBlocks];
+  uint64_t offset = sizeof(Header);
+  for (size_t i = 0; i < kBlocks; ++i) {
+    blocks[i] = data + offset;
+    offset += sizes[i];
+  }
+  UTIL_THROW_IF(offset != size, util::Exception, name << " should be " << offset
+                << " bytes, but is " << size);
+
+  m_num_vertices = header.vertices;
+  m_num_edges = header.edges;
+  m_incoming_begin = reinterpret_cast<const uint32_t*>(blocks[0]);
+  m_incoming = reinterpret_cast<const uint32_t*>(blocks[1]);
+  m_source_covered = reinterpret_cast<const uint32_t*>(blocks[2]);
+  m_children_begin = reinterpret_cast<const uint32_t*>(blocks[3]);
+  m_children = reinterpret_cast<const uint32_t*>(blocks[4]);
+  m_words_begin = reinterpret_cast<const uint32_t*>(blocks[5]);
+  m_words = reinterpret_cast<const uint32_t*>(blocks[6]);
+  m_features_begin = reinterpret_cast<const uint32_t*>(blocks[7]);
+  m_feature_names = reinterpret_cast<const uint32_t*>(blocks[8]);
+  m_feature_values = reinterpret_cast<const float*>(blocks[9]);
+  UTIL_THROW_IF(!Consistent(m_incoming_begin, m_num_vertices, header.incoming) ||
+                !Consistent(m_children_begin, m_num_edges, header.children) ||
+                !Consistent(m_words_begin, m_num_edges, header.words) ||
+                !Consistent(m_features_begin, m_num_edges, header.features),
+                util::Exception, name << " has inconsistent offsets");
+  UTIL_THROW_IF(!InRange(m_incoming, header.incoming, m_num_edges) ||
+                !InRange(m_children, header.children, m_num_vertices) ||
+                !InRange(m_words, header.words, header.vocab, kNonTerminal) ||
+                !InRange(m_feature_names, header.features, header.names),
+                util::Exception, name << " refers past the end of its tables");
+
+  StringPiece text(blocks[10], header.text);
+  m_vocab.resize(header.vocab);
+  m_names.resize(header.names);
+  for (size_t i = 0; i < header.vocab + header.names; ++i) {
+    size_t end = text.find('\n');
+    UTIL_THROW_IF(end == StringPiece::npos, util::Exception, name << " has truncated word and name tables");
+    (i < header.vocab ? m_vocab[i] : m_names[i - header.vocab]) = text.substr(0, end);
+    text = text.substr(end + 1);
+  }
+}
+
+void HypergraphStore::Load(Graph* graph, GraphFeatures* features) const
+{
+  UTIL_THROW_IF(graph->VertexSize() || graph->EdgeSize(), util::Exception,
+                "Loading " << m_name << " into a graph which is not empty");
+  WordVec words(m_vocab.size());
+  for (size_t i = 0; i < m_vocab.size(); ++i) {
+    words[i] = &graph->MutableVocab().FindOrAdd(m_vocab[i]);
+  }
+  vector<size_t> names(m_names.size());
+  FeatureRegistry& registry = FeatureRegistry::Instance();
+  for (size_t i = 0; i < m_names.size(); ++i) {
+    if (features) {
+      names[i] = features->Name(m_names[i]);
+    } else if (!registry.EncodeKept(m_names[i], &names[i])) {
+      names[i] = GraphFeatures::kDropped;
+    }
+  }
+
+  graph->SetCounts(m_num_vertices, m_num_edges);
+  for (size_t e = 0; e < m_num_edges; ++e) {
+    Edge* edge = graph->NewEdge();
+    for (uint32_t i = m_children_begin[e]; i < m_children_begin[e + 1]; ++i) {
+      edge->AddChild(m_children[i]);
+    }
+    for (uint32_t i = m_words_begin[e]; i < m_words_begin[e + 1]; ++i) {
+      edge->AddWord(m_words[i] == kNonTerminal ? NULL : words[m_words[i]]);
+    }
+    for (uint32_t i = m_features_begin[e]; i < m_features_begin[e + 1]; ++i) {
+      size_t id = names[m_feature_names[i]];
+      if (features) {
+        features->Add(edge, id, m_feature_values[i]);
+      } else if (id != GraphFeatures::kDropped) {
+        edge->Features()->set(id, m_feature_values[i]);
+      }
+    }
+  }
+  for (size_t v = 0; v < m_num_vertices; ++v) {
+    Vertex* vertex = graph->NewVertex();
+    for (uint32_t i = m_incoming_begin[v]; i < m_incoming_begin[v + 1]; ++i) {
+      vertex->AddEdge(&graph->GetEdge(m_incoming[i]));
+    }
+    vertex->SetSourceCovered(m_source_covered[v]);
+  }
+}
+
+void HypergraphStore::CountFeatures(FeatureNameCounts* counts) const
+{
+  vector<size_t> byName(m_names.size(), 0);
+  for (size_t i = 0; i < m_features_begin[m_num_edges]; ++i) ++byName[m_feature_names[i]];
+  // The table holds the names in the order the text first used them
+  for (size_t i = 0; i < m_names.size(); ++i) counts->Add(m_names[i], byName[i]);
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
@@ -0,0 +1,97 @@
+/*
+ *  HypergraphStore.h
+ *  mert - Minimum Error Rate Training
+ *
+ *  Binary, memory-mappable form of a hypergraph. Words and feature
+ *  names are held once each, in tables, and edges refer to them by
+ *  index, so loading a graph costs a mmap and a pass over arrays
+ *  rather than a parse of the text format.
+ */
+
+#ifndef MERT_HYPERGRAPH_STORE_H
+#define MERT_HYPERGRAPH_STORE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "util/mmap.hh"
+#include "util/string_piece.hh"
+
+#include "Hypergraph.h"
+
+namespace MosesTuning
+{
+
+
+class HypergraphStore : boost::noncopyable
+{
+public:
+  /** Map the store in file */
+  explicit HypergraphStore(const std::string& file);
+
+  /** Take over the contents of buffer, as written by Write */
+  explicit HypergraphStore(std::string* buffer);
+
+  /** Whether file starts like a store, rather than a text hypergraph */
+  static bool IsStore(const std::string& file);
+
+  /**
+   * Lay out graph as a store in out. With features, where ReadGraph put
+   * the graph's sparse features, they are taken from there, keeping the
+   * order in which the text named them. Otherwise they are taken from
+   * the edges.
+   */
+  static void Write(const Graph& graph, const GraphFeatures* features, std::string* out);
+  static void Write(const Graph& graph, const GraphFeatures* features, const std::string& file);
+
+  std::size_t VertexSize() const {
+    return m_num_vertices;
+  }
+  std::size_t EdgeSize() const {
+    return m_num_edges;
+  }
+
+  /**
+   * Build graph, which must be empty, as ReadGraph would. With features,
+   * the edges' sparse features go there rather than into the edges.
+   */
+  void Load(Graph* graph, GraphFeatures* features = NULL) const;
+
+  /** Add to counts the number of edges with each feature */
+  void CountFeatures(FeatureNameCounts* counts) const;
+
+private:
+  void Init(const char* data, uint64_t size, const std::string& name);
+
+  util::scoped_memory m_mapped;
+  std::string m_buffer;
+  std::string m_name;
+
+  std::size_t m_num_vertices;
+  std::size_t m_num_edges;
+  const uint32_t* m_incoming_begin;
+  const uint32_t* m_incoming;
+  const uint32_t* m_source_covered;
+  const uint32_t* m_children_begin;
+  const uint32_t* m_children;
+  const uint32_t* m_words_begin;
+  const uint32_t* m_words;
+  const uint32_t* m_features_begin;
+  const uint32_t* m_feature_names;
+  const float* m_feature_values;
+  std::vector<StringPiece> m_vocab;
+  std::vector<StringPiece> m_names;
+};
+
+}
+
+#endif // MERT_HYPERGRAPH_STORE_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -4,6 +4,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include "Hypergraph.h"
+#include "HypergraphStore.h"
 
 using namespace std;
 using namespace MosesTuning;
@@ -149,3 +150,175 @@ BOOST_AUTO_TEST_CASE(prune)
   
 
 }
+
+BOOST_AUTO_TEST_CASE(renumber)
+{
+  // A graph read on its own vocabulary, and with its features set aside,
+  // ends up as if read straight into the shared vocabulary
+  Vocab shared;
+  shared.FindOrAdd("x");
+  Vocab local;
+  Graph graph(local);
+  graph.SetCounts(2,2);
+  GraphFeatures features;
+
+  Edge* e0 = graph.NewEdge();
+  e0->AddWord(&(local.FindOrAdd("a")));
+  features.Add(e0, "renumber_b", 1);
+  features.Add(e0, "renumber_a", 2);
+  graph.NewVertex()->AddEdge(e0);
+
+  Edge* e1 = graph.NewEdge();
+  e1->AddWord(NULL);
+  e1->AddChild(0);
+  e1->AddWord(&(local.FindOrAdd("x")));
+  features.Add(e1, "renumber_a", 3);
+  graph.NewVertex()->AddEdge(e1);
+
+  BOOST_CHECK_EQUAL(2, features.Names().size());
+  BOOST_CHECK_EQUAL("renumber_b", features.Names()[0]);
+
+  WordVec entries;
+  shared.Add(local, &entries);
+  BOOST_CHECK_EQUAL(local.Size(), entries.size());
+  vector<size_t> ids;
+  for (size_t i = 0; i < features.Names().size(); ++i) {
+    ids.push_back(SparseVector::encode(features.Names()[i]));
+  }
+  graph.Renumber(shared, entries, features, ids);
+
+  BOOST_CHECK_EQUAL(&(shared.FindOrAdd("a")), e0->Words()[0]);
+  BOOST_CHECK_EQUAL((Vocab::Entry*)NULL, e1->Words()[0]);
+  BOOST_CHECK_EQUAL(&(shared.FindOrAdd("x")), e1->Words()[1]);
+  BOOST_CHECK_EQUAL(&shared, &graph.MutableVocab());
+
+  SparseVector expected;
+  expected.set("renumber_b", 1);
+  expected.set("renumber_a", 2);
+  BOOST_CHECK(expected == *e0->Features());
+  BOOST_CHECK_EQUAL(3, e1->Features()->get("renumber_a"));
+  BOOST_CHECK_EQUAL(1, e1->Features()->size());
+}
+
+BOOST_AUTO_TEST_CASE(store)
+{
+  Vocab vocab;
+  Graph graph(vocab);
+  graph.SetCounts(2,3);
+  GraphFeatures features;
+
+  Edge* e0 = graph.NewEdge();
+  e0->AddWord(&(vocab.FindOrAdd("a")));
+  features.Add(e0, "store_b", 0.5);
+  Edge* e1 = graph.NewEdge();
+  e1->AddWord(&(vocab.FindOrAdd("b")));
+  Vertex* v0 = graph.NewVertex();
+  v0->AddEdge(e0);
+  v0->AddEdge(e1);
+  v0->SetSourceCovered(1);
+
+  Edge* e2 = graph.NewEdge();
+  e2->AddWord(&(vocab.FindOrAdd("a")));
+  e2->AddWord(NULL);
+  e2->AddChild(0);
+  features.Add(e2, "store_a", 2);
+  features.Add(e2, "store_b", -1);
+  Vertex* v1 = graph.NewVertex();
+  v1->AddEdge(e2);
+  v1->SetSourceCovered(2);
+
+  string buffer;
+  HypergraphStore::Write(graph, &features, &buffer);
+  HypergraphStore store(&buffer);
+  BOOST_CHECK_EQUAL(2, store.VertexSize());
+  BOOST_CHECK_EQUAL(3, store.EdgeSize());
+
+  Vocab loadedVocab;
+  Graph loaded(loadedVocab);
+  GraphFeatures loadedFeatures;
+  store.Load(&loaded, &loadedFeatures);
+  BOOST_REQUIRE_EQUAL(2, loaded.VertexSize());
+  BOOST_REQUIRE_EQUAL(3, loaded.EdgeSize());
+  BOOST_CHECK_EQUAL(2, loaded.GetVertex(1).SourceCovered());
+  BOOST_REQUIRE_EQUAL(2, loaded.GetVertex(0).GetIncoming().size());
+  BOOST_CHECK_EQUAL(&loaded.GetEdge(1), loaded.GetVertex(0).GetIncoming()[1]);
+  const Edge& l2 = loaded.GetEdge(2);
+  BOOST_REQUIRE_EQUAL(2, l2.Words().size());
+  BOOST_CHECK_EQUAL(&(loadedVocab.FindOrAdd("a")), l2.Words()[0]);
+  BOOST_CHECK_EQUAL((Vocab::Entry*)NULL, l2.Words()[1]);
+  BOOST_REQUIRE_EQUAL(1, l2.Children().size());
+  BOOST_CHECK_EQUAL(0, l2.Children()[0]);
+
+  // Names keep their order, values their edges
+  BOOST_REQUIRE_EQUAL(2, loadedFeatures.Names().size());
+  BOOST_CHECK_EQUAL("store_b", loadedFeatures.Names()[0]);
+  BOOST_REQUIRE_EQUAL(3, loadedFeatures.Values().size());
+  BOOST_CHECK_EQUAL(&loaded.GetEdge(2), loadedFeatures.Values()[1].edge);
+  BOOST_CHECK_EQUAL(1, loadedFeatures.Values()[1].name);
+  BOOST_CHECK_EQUAL(2, loadedFeatures.Values()[1].value);
+
+  // Without features to set them aside, they go on the edges
+  Vocab edgeVocab;
+  Graph withEdges(edgeVocab);
+  store.Load(&withEdges);
+  BOOST_CHECK_EQUAL(-1, withEdges.GetEdge(2).Features()->get("store_b"));
+  BOOST_CHECK_EQUAL(0, withEdges.GetEdge(1).Features()->size());
+}
+
+BOOST_AUTO_TEST_CASE(edge_scores)
+{
+  Vocab vocab;
+  Graph graph(vocab);
+  graph.SetCounts(2,3);
+
+  Edge* e0 = graph.NewEdge();
+  e0->AddWord(&(vocab.FindOrAdd("a")));
+  e0->AddFeature("edge_scores_a", 1);
+  Edge* e1 = graph.NewEdge();
+  e1->AddWord(&(vocab.FindOrAdd("b")));
+  e1->AddFeature("edge_scores_a", 2);
+  Vertex* v0 = graph.NewVertex();
+  v0->AddEdge(e0);
+  v0->AddEdge(e1);
+
+  Edge* e2 = graph.NewEdge();
+  e2->AddWord(NULL);
+  e2->AddChild(0);
+  e2->AddFeature("edge_scores_a", 3);
+  e2->AddFeature("edge_scores_b", -1);
+  graph.NewVertex()->AddEdge(e2);
+
+  FrozenGraph frozen;
+  frozen.Freeze(graph);
+  EdgeScores scores(frozen);
+  SparseVector weights;
+  weights.set("edge_scores_a", 1);
+  weights.set("edge_scores_b", 1);
+  scores.Update(weights);
+  BOOST_CHECK_EQUAL(3, scores.Rescored());
+  BOOST_CHECK_EQUAL(1, scores[0]);
+  BOOST_CHECK_EQUAL(2, scores[1]);
+  BOOST_CHECK_EQUAL(2, scores[2]);
+
+  // Only the edges with the changed feature are rescored
+  weights.set("edge_scores_b", 0.5);
+  scores.Update(weights);
+  BOOST_CHECK_EQUAL(1, scores.Rescored());
+  BOOST_CHECK_EQUAL(1, scores[0]);
+  BOOST_CHECK_EQUAL(2, scores[1]);
+  BOOST_CHECK_EQUAL(2.5, scores[2]);
+
+  // Unless it is on most of them
+  weights.set("edge_scores_a", 2);
+  scores.Update(weights);
+  BOOST_CHECK_EQUAL(3, scores.Rescored());
+  BOOST_CHECK_EQUAL(2, scores[0]);
+  BOOST_CHECK_EQUAL(4, scores[1]);
+  BOOST_CHECK_EQUAL(5.5, scores[2]);
+
+  scores.Update(weights);
+  BOOST_CHECK_EQUAL(0, scores.Rescored());
+  for (size_t i = 0; i < frozen.EdgeSize(); ++i) {
+    BOOST_CHECK_EQUAL(frozen.GetScore(i, weights), scores[i]);
+  }
+}
@@ -0,0 +1,83 @@
+/*
+ *  HypothesisDedup.cpp
+ *  mert - Minimum Error Rate Training
+ */
+
+#include "HypothesisDedup.h"
+
+#include <algorithm>
+
+#include "util/murmur_hash.hh"
+
+#include "FeatureStats.h"
+#include "ScoreStats.h"
+
+using namespace std;
+
+namespace
+{
+template <class T> uint64_t HashArray(const T* values, size_t size, uint64_t seed)
+{
+  return util::MurmurHashNative(values, size * sizeof(T), seed);
+}
+} // namespace
+
+namespace MosesTuning
+{
+
+
+// The sparse hash is (id,value) pairs chained through MurmurHashNative,
+// and seeds the hash of the dense values, which seeds that of the scores.
+
+uint64_t Fingerprint(const FeatureDataItem& features, const ScoreDataItem& scores)
+{
+  uint64_t hash = hash_value(features.sparse);
+  hash = HashArray(features.dense.empty() ? NULL : &features.dense[0], features.dense.size(), hash);
+  return HashArray(scores.empty() ? NULL : &scores[0], scores.size(), hash);
+}
+
+uint64_t Fingerprint(const FeatureStats& features, const ScoreStats& scores)
+{
+  uint64_t hash = hash_value(features.getSparse());
+  hash = HashArray(features.getArray(), features.size(), hash);
+  return HashArray(scores.getArray(), scores.size(), hash);
+}
+
+// Views are kept in NbestPool from run to run, so their fingerprints must
+// not depend on the ids this process gave the sparse features: each sparse
+// value is hashed alone, and the hashes summed. They are not comparable
+// with the fingerprints above.
+uint64_t Fingerprint(const MiraFeatureView& features, const ScoreDataView& scores)
+{
+  uint64_t sparse = features.num_sparse();
+  for (size_t i = 0; i < features.num_sparse(); ++i) {
+    sparse += util::MurmurHashNative(features.sparse_vals() + i, sizeof(ValType));
+  }
+  uint64_t hash = HashArray(features.dense(), features.num_dense(), sparse);
+  return HashArray(scores.begin(), scores.size(), hash);
+}
+
+bool SameHypothesis(const FeatureStats& features1, const ScoreStats& scores1,
+                    const FeatureStats& features2, const ScoreStats& scores2)
+{
+  return features1 == features2 && features1.getSparse() == features2.getSparse()
+         && scores1 == scores2;
+}
+
+bool SameHypothesis(const MiraFeatureView& features1, const ScoreDataView& scores1,
+                    const MiraFeatureView& features2, const ScoreDataView& scores2)
+{
+  if (features1.size() != features2.size() || scores1.size() != scores2.size()) return false;
+  for (size_t i = 0; i < features1.size(); ++i) {
+    if (features1.feat(i) != features2.feat(i) || features1.val(i) != features2.val(i)) return false;
+  }
+  return equal(scores1.begin(), scores1.end(), scores2.begin());
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
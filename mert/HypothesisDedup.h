@@ -0,0 +1,80 @@
+/*
+ *  HypothesisDedup.h
+ *  mert - Minimum Error Rate Training
+ *
+ *  Removal of duplicate hypotheses from an n-best list. Hypotheses are
+ *  compared by a 64 bit fingerprint of their dense features, sparse
+ *  features and score statistics, and only hypotheses with the same
+ *  fingerprint are compared exactly.
+ */
+
+#ifndef MERT_HYPOTHESIS_DEDUP_H
+#define MERT_HYPOTHESIS_DEDUP_H
+
+#include <utility>
+#include <stdint.h>
+
+#include <boost/unordered_map.hpp>
+
+#include "FeatureDataIterator.h"
+#include "MiraFeatureVector.h"
+#include "ScoreDataIterator.h"
+
+namespace MosesTuning
+{
+
+
+class FeatureStats;
+class ScoreStats;
+
+uint64_t Fingerprint(const FeatureDataItem& features, const ScoreDataItem& scores);
+uint64_t Fingerprint(const FeatureStats& features, const ScoreStats& scores);
+uint64_t Fingerprint(const MiraFeatureView& features, const ScoreDataView& scores);
+
+/** Exact comparison, including the sparse features */
+bool SameHypothesis(const FeatureStats& features1, const ScoreStats& scores1,
+                    const FeatureStats& features2, const ScoreStats& scores2);
+bool SameHypothesis(const MiraFeatureView& features1, const ScoreDataView& scores1,
+                    const MiraFeatureView& features2, const ScoreDataView& scores2);
+
+/**
+ * The hypotheses kept so far for one sentence, identified by the
+ * caller's index.
+ */
+class HypothesisDedup
+{
+public:
+  /**
+   * Whether the hypothesis with this fingerprint duplicates one kept
+   * before. same(i) compares it exactly with the kept hypothesis i, and
+   * is only called when the fingerprints match. If it is not a
+   * duplicate, the hypothesis is kept as index.
+   */
+  template <class Same> bool Duplicate(uint64_t fingerprint, std::size_t index, const Same& same) {
+    std::pair<Kept::const_iterator, Kept::const_iterator> range = m_kept.equal_range(fingerprint);
+    for (Kept::const_iterator i = range.first; i != range.second; ++i) {
+      if (same(i->second)) return true;
+    }
+    m_kept.insert(std::make_pair(fingerprint, index));
+    return false;
+  }
+
+  /** Forget the kept hypotheses, before starting the next sentence */
+  void clear() {
+    m_kept.clear();
+  }
+
+private:
+  typedef boost::unordered_multimap<uint64_t, std::size_t> Kept;
+  Kept m_kept;
+};
+
+}
+
+#endif // MERT_HYPOTHESIS_DEDUP_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -0,0 +1,198 @@
+#include "MiraCheckpoint.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+
+#include <boost/filesystem.hpp>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+
+#include "HopeFearDecoder.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace
+{
+const char kMagic[] = "KBMIRACK";
+const uint32_t kVersion = 2;
+const char kCheckpointName[] = "checkpoint";
+} // namespace
+
+namespace MosesTuning
+{
+
+
+template <class T> static void Write(ostream& os, const T& value)
+{
+  os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T> static void Read(istream& is, T* value)
+{
+  is.read(reinterpret_cast<char*>(value), sizeof(T));
+}
+
+static void WriteString(ostream& os, const string& str)
+{
+  Write<uint64_t>(os, str.size());
+  os.write(str.data(), str.size());
+}
+
+static void ReadString(istream& is, string* str)
+{
+  uint64_t size = 0;
+  Read(is, &size);
+  str->resize(size);
+  if (size) is.read(&(*str)[0], size);
+}
+
+static string CheckpointFile(const string& dir)
+{
+  return (fs::path(dir) / kCheckpointName).string();
+}
+
+/**
+ * Everything up to the decoder state. Reading the weights and names first
+ * means a warm start does not need a decoder.
+ */
+struct CheckpointContents {
+  MiraTrainingState state;
+  uint64_t numDense;
+  vector<string> names;
+  MiraWeightVector wv;
+  string decoderState;
+};
+
+static void ReadContents(const string& file, CheckpointContents* contents)
+{
+  ifstream in(file.c_str(), ios::binary);
+  UTIL_THROW_IF(!in, util::Exception, "Could not open checkpoint " << file);
+  char magic[sizeof(kMagic) - 1];
+  in.read(magic, sizeof(magic));
+  uint32_t version = 0;
+  Read(in, &version);
+  UTIL_THROW_IF(!in || string(magic, sizeof(magic)) != kMagic, util::Exception,
+                file << " is not a kbmira checkpoint");
+  UTIL_THROW_IF(version != kVersion, util::Exception, "Checkpoint " << file <<
+                " has version " << version << ", expected " << kVersion);
+
+  uint64_t epoch = 0;
+  Read(in, &epoch);
+  contents->state.epoch = epoch;
+  Read(in, &contents->state.bestBleu);
+  uint64_t bgSize = 0;
+  Read(in, &bgSize);
+  contents->state.bg.resize(bgSize);
+  for (size_t i = 0; i < bgSize; ++i) Read(in, &contents->state.bg[i]);
+
+  Read(in, &contents->numDense);
+  uint64_t numNames = 0;
+  Read(in, &numNames);
+  contents->names.resize(numNames);
+  for (size_t i = 0; i < numNames; ++i) ReadString(in, &contents->names[i]);
+
+  contents->wv.loadbin(&in);
+  ReadString(in, &contents->decoderState);
+  UTIL_THROW_IF(!in, util::Exception, "Checkpoint " << file << " is truncated");
+}
+
+void SaveCheckpoint(const string& dir, size_t numDense,
+                    const MiraTrainingState& state,
+                    const MiraWeightVector& wv,
+                    const HopeFearDecoder& decoder)
+{
+  ostringstream out(ios::binary);
+  out.write(kMagic, sizeof(kMagic) - 1);
+  Write(out, kVersion);
+
+  Write<uint64_t>(out, state.epoch);
+  Write(out, state.bestBleu);
+  Write<uint64_t>(out, state.bg.size());
+  for (size_t i = 0; i < state.bg.size(); ++i) Write(out, state.bg[i]);
+
+  // Sparse feature ids depend on the order features were first seen,
+  // so keep the names. Without dense features, ids are not offset
+  // consistently, so no names are stored.
+  Write<uint64_t>(out, numDense);
+  uint64_t numNames = numDense && wv.size() > numDense ? wv.size() - numDense : 0;
+  Write(out, numNames);
+  for (size_t i = 0; i < numNames; ++i) {
+    WriteString(out, SparseVector::decode(i));
+  }
+
+  wv.savebin(&out);
+  ostringstream decoderState(ios::binary);
+  decoder.SaveState(&decoderState);
+  WriteString(out, decoderState.str());
+
+  // Write alongside, then rename over the old checkpoint
+  fs::create_directories(dir);
+  const string file = CheckpointFile(dir);
+  const string tmpFile = file + ".tmp";
+  {
+    util::scoped_fd fd(util::CreateOrThrow(tmpFile.c_str()));
+    const string& data = out.str();
+    util::WriteOrThrow(fd.get(), data.data(), data.size());
+    util::FSyncOrThrow(fd.get());
+  }
+  UTIL_THROW_IF(rename(tmpFile.c_str(), file.c_str()), util::ErrnoException,
+                "while renaming " << tmpFile << " to " << file);
+}
+
+bool LoadCheckpoint(const string& dir, size_t numDense,
+                    MiraTrainingState* state,
+                    MiraWeightVector* wv,
+                    HopeFearDecoder* decoder)
+{
+  const string file = CheckpointFile(dir);
+  if (!fs::exists(file)) return false;
+  CheckpointContents contents;
+  ReadContents(file, &contents);
+  UTIL_THROW_IF(contents.numDense != numDense, util::Exception, "Checkpoint " << file << " has "
+                << contents.numDense << " dense features, but training has " << numDense);
+  for (size_t i = 0; i < contents.names.size(); ++i) {
+    UTIL_THROW_IF(SparseVector::encode(contents.names[i]) != i, util::Exception,
+                  "Sparse feature " << contents.names[i] << " in checkpoint " << file
+                  << " does not match the training data");
+  }
+  *state = contents.state;
+  *wv = contents.wv;
+  istringstream decoderState(contents.decoderState, ios::binary);
+  decoder->LoadState(&decoderState);
+  return true;
+}
+
+void LoadAveragedWeights(const string& dir, size_t numDense,
+                         vector<ValType>* weights)
+{
+  const string file = CheckpointFile(dir);
+  CheckpointContents contents;
+  ReadContents(file, &contents);
+  UTIL_THROW_IF(contents.numDense != numDense, util::Exception, "Checkpoint " << file << " has "
+                << contents.numDense << " dense features, but training has " << numDense);
+  AvgWeightVector avg = contents.wv.avg();
+  weights->resize(max(weights->size(), numDense));
+  for (size_t i = 0; i < numDense && i < avg.size(); ++i) {
+    (*weights)[i] = avg.weight(i);
+  }
+  for (size_t i = 0; i < contents.names.size(); ++i) {
+    ValType w = avg.weight(numDense + i);
+    if (abs(w) <= 1e-8) continue;
+    size_t id = SparseVector::encode(contents.names[i]) + numDense;
+    if (weights->size() <= id) weights->resize(id + 1, 0.0);
+    (*weights)[id] = w;
+  }
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
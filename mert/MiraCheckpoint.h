@@ -0,0 +1,69 @@
+/*
+ * MiraCheckpoint.h
+ * kbmira - k-best Batch MIRA
+ *
+ * Saves batch MIRA training state at epoch boundaries, so that
+ * an interrupted run can be resumed, and so that a later run can
+ * be warm-started from the averaged weights.
+ */
+
+#ifndef MERT_MIRA_CHECKPOINT_H
+#define MERT_MIRA_CHECKPOINT_H
+
+#include <string>
+#include <vector>
+
+#include "MiraFeatureVector.h"
+#include "MiraWeightVector.h"
+
+namespace MosesTuning
+{
+
+
+class HopeFearDecoder;
+
+/** Training state kept outside the weights and the decoder */
+struct MiraTrainingState {
+  MiraTrainingState() : epoch(0), bestBleu(0) {}
+
+  std::size_t epoch; // Number of epochs completed
+  ValType bestBleu;
+  std::vector<ValType> bg; // Background BLEU statistics
+};
+
+/**
+ * Atomically replace the checkpoint in dir, creating dir if necessary.
+ * Weights from index numDense on are sparse, and their names are saved
+ * with them.
+ */
+void SaveCheckpoint(const std::string& dir, std::size_t numDense,
+                    const MiraTrainingState& state,
+                    const MiraWeightVector& wv,
+                    const HopeFearDecoder& decoder);
+
+/**
+ * Restore training from the checkpoint in dir. The training data must be
+ * the same as when it was saved.
+ * \return false if there is no checkpoint in dir
+ */
+bool LoadCheckpoint(const std::string& dir, std::size_t numDense,
+                    MiraTrainingState* state,
+                    MiraWeightVector* wv,
+                    HopeFearDecoder* decoder);
+
+/**
+ * Replace initial weights with the averaged weights from the checkpoint in
+ * dir. Sparse weights are matched by name, so the training data may differ.
+ */
+void LoadAveragedWeights(const std::string& dir, std::size_t numDense,
+                         std::vector<ValType>* weights);
+
+}
+
+#endif // MERT_MIRA_CHECKPOINT_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
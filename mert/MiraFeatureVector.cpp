@@ -2,6 +2,7 @@
 #include <iomanip>
 
 #include "MiraFeatureVector.h"
+#include "MiraKernels.h"
 
 using namespace std;
 
@@ -40,6 +41,13 @@ MiraFeatureVector::MiraFeatureVector(const FeatureDataItem& vec)
   InitSparse(vec.sparse);
 }
 
+MiraFeatureVector::MiraFeatureVector(const MiraFeatureView& view)
+  : m_dense(view.m_dense, view.m_dense + view.m_numDense),
+    m_sparseFeats(view.m_sparseFeats, view.m_sparseFeats + view.m_numSparse),
+    m_sparseVals(view.m_sparseVals, view.m_sparseVals + view.m_numSparse)
+{
+}
+
 MiraFeatureVector::MiraFeatureVector(const SparseVector& sparse, size_t num_dense) {
   m_dense.resize(num_dense);
   //Assume that features with id [0,num_dense) are the dense features
@@ -96,31 +104,44 @@ size_t MiraFeatureVector::size() const
 
 ValType MiraFeatureVector::sqrNorm() const
 {
-  ValType toRet = 0.0;
-  for(size_t i=0; i<m_dense.size(); i++)
-    toRet += m_dense[i]*m_dense[i];
+  ValType toRet = m_dense.empty() ? 0 : SqrNormKernel(&m_dense[0], m_dense.size());
   for(size_t i=0; i<m_sparseVals.size(); i++)
     toRet += m_sparseVals[i] * m_sparseVals[i];
   return toRet;
 }
 
+MiraFeatureView MiraFeatureVector::view() const
+{
+  return MiraFeatureView(m_dense.empty() ? NULL : &m_dense[0], m_dense.size(),
+                         m_sparseFeats.empty() ? NULL : &m_sparseFeats[0],
+                         m_sparseVals.empty() ? NULL : &m_sparseVals[0],
+                         m_sparseVals.size());
+}
+
+void MiraFeatureVector::assign(const MiraFeatureView& view)
+{
+  m_dense.assign(view.m_dense, view.m_dense + view.m_numDense);
+  m_sparseFeats.assign(view.m_sparseFeats, view.m_sparseFeats + view.m_numSparse);
+  m_sparseVals.assign(view.m_sparseVals, view.m_sparseVals + view.m_numSparse);
+}
+
 MiraFeatureVector operator-(const MiraFeatureVector& a, const MiraFeatureVector& b)
 {
   // Dense subtraction
-  vector<ValType> dense;
   if(a.m_dense.size()!=b.m_dense.size()) {
     cerr << "Mismatching dense vectors passed to MiraFeatureVector subtraction" << endl;
     exit(1);
   }
-  for(size_t i=0; i<a.m_dense.size(); i++) {
-    dense.push_back(a.m_dense[i] - b.m_dense[i]);
-  }
+  vector<ValType> dense(a.m_dense.size());
+  if (!dense.empty()) SubKernel(&a.m_dense[0], &b.m_dense[0], &dense[0], dense.size());
 
   // Sparse subtraction
   size_t i=0;
   size_t j=0;
   vector<ValType> sparseVals;
   vector<size_t> sparseFeats;
+  sparseVals.reserve(a.m_sparseFeats.size() + b.m_sparseFeats.size());
+  sparseFeats.reserve(a.m_sparseFeats.size() + b.m_sparseFeats.size());
   while(i < a.m_sparseFeats.size() && j < b.m_sparseFeats.size()) {
 
     if(a.m_sparseFeats[i] < b.m_sparseFeats[j]) {
@@ -13,6 +13,7 @@
 #define MERT_MIRA_FEATURE_VECTOR_H
 
 #include <vector>
+#include <stdint.h>
 #include <iostream>
 
 #include "FeatureDataIterator.h"
@@ -23,11 +24,81 @@ namespace MosesTuning
 
 typedef FeatureStatsType ValType;
 
+/**
+ * Read-only view of a feature vector whose values are stored
+ * elsewhere, such as in the columnar store of
+ * RandomAccessHypPackEnumerator. Indexed like MiraFeatureVector.
+ */
+class MiraFeatureView
+{
+public:
+  MiraFeatureView()
+    : m_dense(NULL), m_numDense(0), m_sparseFeats(NULL),
+      m_sparseVals(NULL), m_numSparse(0) {}
+  MiraFeatureView(const ValType* dense, std::size_t numDense,
+                  const std::size_t* sparseFeats, const ValType* sparseVals,
+                  std::size_t numSparse)
+    : m_dense(dense), m_numDense(numDense), m_sparseFeats(sparseFeats),
+      m_sparseVals(sparseVals), m_numSparse(numSparse) {}
+
+  ValType val(std::size_t index) const {
+    return index < m_numDense ? m_dense[index] : m_sparseVals[index - m_numDense];
+  }
+  std::size_t feat(std::size_t index) const {
+    return index < m_numDense ? index : m_sparseFeats[index - m_numDense];
+  }
+  std::size_t size() const {
+    return m_numDense + m_numSparse;
+  }
+
+  // The dense values, then the sparse features, as stored
+  const ValType* dense() const {
+    return m_dense;
+  }
+  std::size_t num_dense() const {
+    return m_numDense;
+  }
+  const std::size_t* sparse_feats() const {
+    return m_sparseFeats;
+  }
+  const ValType* sparse_vals() const {
+    return m_sparseVals;
+  }
+  std::size_t num_sparse() const {
+    return m_numSparse;
+  }
+
+  friend class MiraFeatureVector;
+
+private:
+  const ValType* m_dense;
+  std::size_t m_numDense;
+  const std::size_t* m_sparseFeats;
+  const ValType* m_sparseVals;
+  std::size_t m_numSparse;
+};
+
+/**
+ * The features of consecutive hypotheses, laid out as in an NbestStore:
+ * the dense values row by row, numDense to a row, and the sparse values
+ * of hypothesis i at positions sparseBegin[i] to sparseBegin[i+1] of
+ * sparseFeats and sparseVals.
+ */
+struct MiraFeatureBlock {
+  const ValType* dense;
+  std::size_t numDense;
+  std::size_t size;
+  const uint64_t* sparseBegin;
+  const std::size_t* sparseFeats;
+  const ValType* sparseVals;
+};
+
 class MiraFeatureVector
 {
 public:
   MiraFeatureVector() {}
   MiraFeatureVector(const FeatureDataItem& vec);
+  MiraFeatureVector(const MiraFeatureView& view);
   //Assumes that features in sparse with id < num_dense are dense features
   MiraFeatureVector(const SparseVector& sparse, size_t num_dense);
   MiraFeatureVector(const MiraFeatureVector& other);
@@ -40,6 +111,17 @@ public:
   std::size_t size() const;
   ValType sqrNorm() const;
 
+  /**
+   * View of this vector, valid until it is modified or destroyed
+   */
+  MiraFeatureView view() const;
+
+  /**
+   * Copy the viewed vector into this one, reusing the storage already
+   * allocated where it is large enough
+   */
+  void assign(const MiraFeatureView& view);
+
   friend MiraFeatureVector operator-(const MiraFeatureVector& a,
                                      const MiraFeatureVector& b);
 
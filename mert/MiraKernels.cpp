@@ -0,0 +1,509 @@
+#include "MiraKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MERT_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace MosesTuning
+{
+
+namespace
+{
+const size_t kLanes = 8;
+
+/** The fixed order in which lanes are added */
+inline ValType Reduce(const ValType* acc)
+{
+  return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+// Scalar versions, which also finish the elements after the last full
+// block of the vector versions. Each starts at element i with lanes acc.
+
+inline void DotFrom(size_t i, const ValType* a, const ValType* b, size_t n, ValType* acc)
+{
+  for (; i < n; ++i) acc[i % kLanes] += a[i] * b[i];
+}
+
+inline void ScaledDotFrom(size_t i, const ValType* a, ValType divisor, const ValType* b, size_t n, ValType* acc)
+{
+  for (; i < n; ++i) acc[i % kLanes] += (a[i] / divisor) * b[i];
+}
+
+inline void SqrNormFrom(size_t i, const ValType* a, size_t n, ValType* acc)
+{
+  for (; i < n; ++i) acc[i % kLanes] += a[i] * a[i];
+}
+
+inline void SubFrom(size_t i, const ValType* a, const ValType* b, ValType* out, size_t n)
+{
+  for (; i < n; ++i) out[i] = a[i] - b[i];
+}
+
+inline void DivFrom(size_t i, const ValType* a, ValType divisor, ValType* out, size_t n)
+{
+  for (; i < n; ++i) out[i] = a[i] / divisor;
+}
+
+inline void DiffFrom(size_t i, const ValType* w, size_t nw, const ValType* a, const ValType* b,
+                     size_t n, ValType* dot, ValType* norm)
+{
+  for (; i < n; ++i) {
+    ValType diff = a[i] - b[i];
+    if (i < nw) dot[i % kLanes] += w[i] * diff;
+    norm[i % kLanes] += diff * diff;
+  }
+}
+
+ValType ScalarDot(const ValType* a, const ValType* b, size_t n)
+{
+  ValType acc[kLanes] = {0};
+  DotFrom(0, a, b, n, acc);
+  return Reduce(acc);
+}
+
+ValType ScalarScaledDot(const ValType* a, ValType divisor, const ValType* b, size_t n)
+{
+  ValType acc[kLanes] = {0};
+  ScaledDotFrom(0, a, divisor, b, n, acc);
+  return Reduce(acc);
+}
+
+ValType ScalarSqrNorm(const ValType* a, size_t n)
+{
+  ValType acc[kLanes] = {0};
+  SqrNormFrom(0, a, n, acc);
+  return Reduce(acc);
+}
+
+void ScalarSub(const ValType* a, const ValType* b, ValType* out, size_t n)
+{
+  SubFrom(0, a, b, out, n);
+}
+
+void ScalarDiv(const ValType* a, ValType divisor, ValType* out, size_t n)
+{
+  DivFrom(0, a, divisor, out, n);
+}
+
+void ScalarGemv(const ValType* w, const ValType* rows, size_t numRows, size_t n, size_t stride, ValType* out)
+{
+  for (size_t r = 0; r < numRows; ++r) out[r] = ScalarDot(w, rows + r * stride, n);
+}
+
+size_t ScalarArgMax(const ValType* a, size_t n)
+{
+  size_t best = 0;
+  for (size_t i = 1; i < n; ++i) {
+    if (a[i] > a[best]) best = i;
+  }
+  return best;
+}
+
+void ScalarDiff(const ValType* w, size_t nw, const ValType* a, const ValType* b,
+                size_t n, ValType* dot, ValType* sqrNorm)
+{
+  ValType dotAcc[kLanes] = {0};
+  ValType normAcc[kLanes] = {0};
+  DiffFrom(0, w, nw, a, b, n, dotAcc, normAcc);
+  *dot = Reduce(dotAcc);
+  *sqrNorm = Reduce(normAcc);
+}
+
+#ifdef MERT_KERNELS_X86
+
+// SSE2 keeps lanes 0-3 and 4-7 in two registers
+
+ValType SseDot(const ValType* a, const ValType* b, size_t n)
+{
+  __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  ValType acc[kLanes];
+  _mm_storeu_ps(acc, lo);
+  _mm_storeu_ps(acc + 4, hi);
+  DotFrom(blocks, a, b, n, acc);
+  return Reduce(acc);
+}
+
+ValType SseScaledDot(const ValType* a, ValType divisor, const ValType* b, size_t n)
+{
+  __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+  __m128 d = _mm_set1_ps(divisor);
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    lo = _mm_add_ps(lo, _mm_mul_ps(_mm_div_ps(_mm_loadu_ps(a + i), d), _mm_loadu_ps(b + i)));
+    hi = _mm_add_ps(hi, _mm_mul_ps(_mm_div_ps(_mm_loadu_ps(a + i + 4), d), _mm_loadu_ps(b + i + 4)));
+  }
+  ValType acc[kLanes];
+  _mm_storeu_ps(acc, lo);
+  _mm_storeu_ps(acc + 4, hi);
+  ScaledDotFrom(blocks, a, divisor, b, n, acc);
+  return Reduce(acc);
+}
+
+ValType SseSqrNorm(const ValType* a, size_t n)
+{
+  __m128 lo = _mm_setzero_ps(), hi = _mm_setzero_ps();
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    __m128 x = _mm_loadu_ps(a + i), y = _mm_loadu_ps(a + i + 4);
+    lo = _mm_add_ps(lo, _mm_mul_ps(x, x));
+    hi = _mm_add_ps(hi, _mm_mul_ps(y, y));
+  }
+  ValType acc[kLanes];
+  _mm_storeu_ps(acc, lo);
+  _mm_storeu_ps(acc + 4, hi);
+  SqrNormFrom(blocks, a, n, acc);
+  return Reduce(acc);
+}
+
+void SseSub(const ValType* a, const ValType* b, ValType* out, size_t n)
+{
+  size_t blocks = n - n % 4;
+  for (size_t i = 0; i < blocks; i += 4) {
+    _mm_storeu_ps(out + i, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+  SubFrom(blocks, a, b, out, n);
+}
+
+void SseDiv(const ValType* a, ValType divisor, ValType* out, size_t n)
+{
+  __m128 d = _mm_set1_ps(divisor);
+  size_t blocks = n - n % 4;
+  for (size_t i = 0; i < blocks; i += 4) {
+    _mm_storeu_ps(out + i, _mm_div_ps(_mm_loadu_ps(a + i), d));
+  }
+  DivFrom(blocks, a, divisor, out, n);
+}
+
+void SseGemv(const ValType* w, const ValType* rows, size_t numRows, size_t n, size_t stride, ValType* out)
+{
+  for (size_t r = 0; r < numRows; ++r) out[r] = SseDot(w, rows + r * stride, n);
+}
+
+size_t SseArgMax(const ValType* a, size_t n)
+{
+  if (n < 4) return ScalarArgMax(a, n);
+  size_t blocks = n - n % 4;
+  __m128 best = _mm_loadu_ps(a);
+  __m128 nan = _mm_cmpunord_ps(best, best);
+  for (size_t i = 4; i < blocks; i += 4) {
+    __m128 x = _mm_loadu_ps(a + i);
+    best = _mm_max_ps(best, x);
+    nan = _mm_or_ps(nan, _mm_cmpunord_ps(x, x));
+  }
+  // _mm_max_ps does not order NaNs as the scalar scan does
+  if (_mm_movemask_ps(nan)) return ScalarArgMax(a, n);
+  ValType lanes[4];
+  _mm_storeu_ps(lanes, best);
+  ValType max = lanes[ScalarArgMax(lanes, 4)];
+  for (size_t i = blocks; i < n; ++i) {
+    if (a[i] > max) max = a[i];
+  }
+  // Then the first place it occurs
+  const __m128 maxes = _mm_set1_ps(max);
+  for (size_t i = 0; i < blocks; i += 4) {
+    int found = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(a + i), maxes));
+    if (found) return i + __builtin_ctz(found);
+  }
+  for (size_t i = blocks; i < n; ++i) {
+    if (a[i] == max) return i;
+  }
+  return ScalarArgMax(a, n);
+}
+
+void SseDiff(const ValType* w, size_t nw, const ValType* a, const ValType* b,
+             size_t n, ValType* dot, ValType* sqrNorm)
+{
+  __m128 dotLo = _mm_setzero_ps(), dotHi = _mm_setzero_ps();
+  __m128 normLo = _mm_setzero_ps(), normHi = _mm_setzero_ps();
+  size_t covered = nw < n ? nw : n;
+  size_t blocks = covered - covered % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    __m128 lo = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 hi = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    dotLo = _mm_add_ps(dotLo, _mm_mul_ps(_mm_loadu_ps(w + i), lo));
+    dotHi = _mm_add_ps(dotHi, _mm_mul_ps(_mm_loadu_ps(w + i + 4), hi));
+    normLo = _mm_add_ps(normLo, _mm_mul_ps(lo, lo));
+    normHi = _mm_add_ps(normHi, _mm_mul_ps(hi, hi));
+  }
+  ValType dotAcc[kLanes], normAcc[kLanes];
+  _mm_storeu_ps(dotAcc, dotLo);
+  _mm_storeu_ps(dotAcc + 4, dotHi);
+  _mm_storeu_ps(normAcc, normLo);
+  _mm_storeu_ps(normAcc + 4, normHi);
+  DiffFrom(blocks, w, nw, a, b, n, dotAcc, normAcc);
+  *dot = Reduce(dotAcc);
+  *sqrNorm = Reduce(normAcc);
+}
+
+// AVX2 keeps all 8 lanes in one register. No FMA, which would round
+// differently from the other versions. The upper halves are cleared
+// before the scalar tail, which is not VEX encoded.
+
+__attribute__((target("avx2"))) ValType AvxDot(const ValType* a, const ValType* b, size_t n)
+{
+  __m256 sum = _mm256_setzero_ps();
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  }
+  ValType acc[kLanes];
+  _mm256_storeu_ps(acc, sum);
+  _mm256_zeroupper();
+  DotFrom(blocks, a, b, n, acc);
+  return Reduce(acc);
+}
+
+__attribute__((target("avx2"))) ValType AvxScaledDot(const ValType* a, ValType divisor, const ValType* b, size_t n)
+{
+  __m256 sum = _mm256_setzero_ps();
+  __m256 d = _mm256_set1_ps(divisor);
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_div_ps(_mm256_loadu_ps(a + i), d), _mm256_loadu_ps(b + i)));
+  }
+  ValType acc[kLanes];
+  _mm256_storeu_ps(acc, sum);
+  _mm256_zeroupper();
+  ScaledDotFrom(blocks, a, divisor, b, n, acc);
+  return Reduce(acc);
+}
+
+__attribute__((target("avx2"))) ValType AvxSqrNorm(const ValType* a, size_t n)
+{
+  __m256 sum = _mm256_setzero_ps();
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    __m256 x = _mm256_loadu_ps(a + i);
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(x, x));
+  }
+  ValType acc[kLanes];
+  _mm256_storeu_ps(acc, sum);
+  _mm256_zeroupper();
+  SqrNormFrom(blocks, a, n, acc);
+  return Reduce(acc);
+}
+
+__attribute__((target("avx2"))) void AvxSub(const ValType* a, const ValType* b, ValType* out, size_t n)
+{
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  }
+  _mm256_zeroupper();
+  SubFrom(blocks, a, b, out, n);
+}
+
+__attribute__((target("avx2"))) void AvxDiv(const ValType* a, ValType divisor, ValType* out, size_t n)
+{
+  __m256 d = _mm256_set1_ps(divisor);
+  size_t blocks = n - n % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    _mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_loadu_ps(a + i), d));
+  }
+  _mm256_zeroupper();
+  DivFrom(blocks, a, divisor, out, n);
+}
+
+// Two rows at a time, sharing the loads of w
+__attribute__((target("avx2"))) void AvxGemv(const ValType* w, const ValType* rows, size_t numRows, size_t n, size_t stride, ValType* out)
+{
+  size_t blocks = n - n % kLanes;
+  size_t r = 0;
+  for (; r + 1 < numRows; r += 2) {
+    const ValType* a = rows + r * stride;
+    const ValType* b = a + stride;
+    __m256 sumA = _mm256_setzero_ps(), sumB = _mm256_setzero_ps();
+    for (size_t i = 0; i < blocks; i += kLanes) {
+      __m256 wi = _mm256_loadu_ps(w + i);
+      sumA = _mm256_add_ps(sumA, _mm256_mul_ps(wi, _mm256_loadu_ps(a + i)));
+      sumB = _mm256_add_ps(sumB, _mm256_mul_ps(wi, _mm256_loadu_ps(b + i)));
+    }
+    ValType accA[kLanes], accB[kLanes];
+    _mm256_storeu_ps(accA, sumA);
+    _mm256_storeu_ps(accB, sumB);
+    _mm256_zeroupper();
+    DotFrom(blocks, w, a, n, accA);
+    DotFrom(blocks, w, b, n, accB);
+    out[r] = Reduce(accA);
+    out[r + 1] = Reduce(accB);
+  }
+  if (r < numRows) out[r] = AvxDot(w, rows + r * stride, n);
+}
+
+__attribute__((target("avx2"))) size_t AvxArgMax(const ValType* a, size_t n)
+{
+  if (n < kLanes) return ScalarArgMax(a, n);
+  size_t blocks = n - n % kLanes;
+  __m256 best = _mm256_loadu_ps(a);
+  __m256 nan = _mm256_cmp_ps(best, best, _CMP_UNORD_Q);
+  for (size_t i = kLanes; i < blocks; i += kLanes) {
+    __m256 x = _mm256_loadu_ps(a + i);
+    best = _mm256_max_ps(best, x);
+    nan = _mm256_or_ps(nan, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+  }
+  // _mm256_max_ps does not order NaNs as the scalar scan does
+  if (_mm256_movemask_ps(nan)) {
+    _mm256_zeroupper();
+    return ScalarArgMax(a, n);
+  }
+  ValType lanes[kLanes];
+  _mm256_storeu_ps(lanes, best);
+  ValType max = lanes[ScalarArgMax(lanes, kLanes)];
+  for (size_t i = blocks; i < n; ++i) {
+    if (a[i] > max) max = a[i];
+  }
+  // Then the first place it occurs
+  const __m256 maxes = _mm256_set1_ps(max);
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    int found = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(a + i), maxes, _CMP_EQ_OQ));
+    if (found) {
+      _mm256_zeroupper();
+      return i + __builtin_ctz(found);
+    }
+  }
+  _mm256_zeroupper();
+  for (size_t i = blocks; i < n; ++i) {
+    if (a[i] == max) return i;
+  }
+  return ScalarArgMax(a, n);
+}
+
+__attribute__((target("avx2"))) void AvxDiff(const ValType* w, size_t nw, const ValType* a, const ValType* b,
+    size_t n, ValType* dot, ValType* sqrNorm)
+{
+  __m256 dotSum = _mm256_setzero_ps(), normSum = _mm256_setzero_ps();
+  size_t covered = nw < n ? nw : n;
+  size_t blocks = covered - covered % kLanes;
+  for (size_t i = 0; i < blocks; i += kLanes) {
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    dotSum = _mm256_add_ps(dotSum, _mm256_mul_ps(_mm256_loadu_ps(w + i), diff));
+    normSum = _mm256_add_ps(normSum, _mm256_mul_ps(diff, diff));
+  }
+  ValType dotAcc[kLanes], normAcc[kLanes];
+  _mm256_storeu_ps(dotAcc, dotSum);
+  _mm256_storeu_ps(normAcc, normSum);
+  _mm256_zeroupper();
+  DiffFrom(blocks, w, nw, a, b, n, dotAcc, normAcc);
+  *dot = Reduce(dotAcc);
+  *sqrNorm = Reduce(normAcc);
+}
+
+#endif // MERT_KERNELS_X86
+
+struct Kernels {
+  const char* name;
+  ValType (*dot)(const ValType*, const ValType*, size_t);
+  ValType (*scaledDot)(const ValType*, ValType, const ValType*, size_t);
+  ValType (*sqrNorm)(const ValType*, size_t);
+  void (*sub)(const ValType*, const ValType*, ValType*, size_t);
+  void (*div)(const ValType*, ValType, ValType*, size_t);
+  void (*diff)(const ValType*, size_t, const ValType*, const ValType*, size_t, ValType*, ValType*);
+  void (*gemv)(const ValType*, const ValType*, size_t, size_t, size_t, ValType*);
+  size_t (*argMax)(const ValType*, size_t);
+};
+
+const Kernels kScalar = {"scalar", ScalarDot, ScalarScaledDot, ScalarSqrNorm, ScalarSub, ScalarDiv, ScalarDiff, ScalarGemv, ScalarArgMax};
+#ifdef MERT_KERNELS_X86
+const Kernels kSse = {"sse2", SseDot, SseScaledDot, SseSqrNorm, SseSub, SseDiv, SseDiff, SseGemv, SseArgMax};
+const Kernels kAvx = {"avx2", AvxDot, AvxScaledDot, AvxSqrNorm, AvxSub, AvxDiv, AvxDiff, AvxGemv, AvxArgMax};
+#endif
+
+/** The kernels for name, or NULL if this machine can't run them */
+const Kernels* Find(const string& name)
+{
+  if (name == kScalar.name) return &kScalar;
+#ifdef MERT_KERNELS_X86
+  __builtin_cpu_init();
+  if (name == kSse.name && __builtin_cpu_supports("sse2")) return &kSse;
+  if (name == kAvx.name && __builtin_cpu_supports("avx2")) return &kAvx;
+#endif
+  return NULL;
+}
+
+// Starts as scalar, so that it is usable during static initialization
+const Kernels* g_kernels = &kScalar;
+
+struct ChooseKernels {
+  ChooseKernels() {
+    const char* preferred[] = {"avx2", "sse2"};
+    for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); ++i) {
+      if (const Kernels* kernels = Find(preferred[i])) {
+        g_kernels = kernels;
+        return;
+      }
+    }
+  }
+} chooseKernels;
+} // namespace
+
+
+const char* KernelInstructionSet()
+{
+  return g_kernels->name;
+}
+
+bool UseKernelInstructionSet(const string& name)
+{
+  const Kernels* kernels = Find(name);
+  if (kernels) g_kernels = kernels;
+  return kernels != NULL;
+}
+
+ValType DotKernel(const ValType* a, const ValType* b, size_t n)
+{
+  return g_kernels->dot(a, b, n);
+}
+
+ValType ScaledDotKernel(const ValType* a, ValType divisor, const ValType* b, size_t n)
+{
+  return g_kernels->scaledDot(a, divisor, b, n);
+}
+
+ValType SqrNormKernel(const ValType* a, size_t n)
+{
+  return g_kernels->sqrNorm(a, n);
+}
+
+void SubKernel(const ValType* a, const ValType* b, ValType* out, size_t n)
+{
+  g_kernels->sub(a, b, out, n);
+}
+
+void DivKernel(const ValType* a, ValType divisor, ValType* out, size_t n)
+{
+  g_kernels->div(a, divisor, out, n);
+}
+
+void DiffKernel(const ValType* w, size_t nw, const ValType* a, const ValType* b,
+                size_t n, ValType* dot, ValType* sqrNorm)
+{
+  g_kernels->diff(w, nw, a, b, n, dot, sqrNorm);
+}
+
+void GemvKernel(const ValType* w, const ValType* rows, size_t numRows,
+                size_t n, size_t stride, ValType* out)
+{
+  g_kernels->gemv(w, rows, numRows, n, stride, out);
+}
+
+size_t ArgMaxKernel(const ValType* a, size_t n)
+{
+  return g_kernels->argMax(a, n);
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
@@ -0,0 +1,80 @@
+/*
+ * MiraKernels.h
+ * kbmira - k-best Batch MIRA
+ *
+ * Dot products and norms over the dense features, using AVX2 or SSE2
+ * where the machine has them. Sums are accumulated in 8 lanes, lane
+ * i % 8 taking element i, and the lanes are added in a fixed order, so
+ * every instruction set gives bit-identical results.
+ */
+
+#ifndef MERT_MIRA_KERNELS_H
+#define MERT_MIRA_KERNELS_H
+
+#include <string>
+
+#include "FeatureStats.h"
+
+namespace MosesTuning
+{
+
+
+typedef FeatureStatsType ValType;
+
+/** The instruction set in use: "avx2", "sse2" or "scalar" */
+const char* KernelInstructionSet();
+
+/**
+ * Switch to the named instruction set, for testing and benchmarking.
+ * \return false, leaving the kernels as they were, if this machine
+ * lacks it
+ */
+bool UseKernelInstructionSet(const std::string& name);
+
+/** Sum of a[i] * b[i] */
+ValType DotKernel(const ValType* a, const ValType* b, std::size_t n);
+
+/** Sum of (a[i] / divisor) * b[i] */
+ValType ScaledDotKernel(const ValType* a, ValType divisor, const ValType* b, std::size_t n);
+
+/** Sum of a[i] * a[i] */
+ValType SqrNormKernel(const ValType* a, std::size_t n);
+
+/** out[i] = a[i] - b[i] */
+void SubKernel(const ValType* a, const ValType* b, ValType* out, std::size_t n);
+
+/** out[i] = a[i] / divisor */
+void DivKernel(const ValType* a, ValType divisor, ValType* out, std::size_t n);
+
+/**
+ * out[r] = sum of w[i] * rows[r * stride + i] for i < n, for each of
+ * numRows rows. Same results as DotKernel on each row.
+ */
+void GemvKernel(const ValType* w, const ValType* rows, std::size_t numRows,
+                std::size_t n, std::size_t stride, ValType* out);
+
+/**
+ * Index of the first largest of a[0..n), 0 if n is 0. With NaNs, the
+ * same index as a scan keeping the first value that is greater than the
+ * best so far.
+ */
+std::size_t ArgMaxKernel(const ValType* a, std::size_t n);
+
+/**
+ * Dot product of w with a - b, and squared norm of a - b, in one pass
+ * without storing the difference. w has nw values, and is taken to be
+ * 0 beyond them. Same results as SubKernel then DotKernel and
+ * SqrNormKernel.
+ */
+void DiffKernel(const ValType* w, std::size_t nw, const ValType* a, const ValType* b,
+                std::size_t n, ValType* dot, ValType* sqrNorm);
+
+}
+
+#endif // MERT_MIRA_KERNELS_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
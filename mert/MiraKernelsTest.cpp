@@ -0,0 +1,213 @@
+#include "MiraKernels.h"
+
+#define BOOST_TEST_MODULE MertMiraKernels
+#include <boost/test/unit_test.hpp>
+
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace
+{
+
+// Longer than two AVX2 strides, so each length exercises full lanes and tails
+const size_t kMaxLength = 37;
+
+/** Deterministic values in [-4, 4), or whole numbers in [0, levels) to force ties */
+class Values
+{
+public:
+  explicit Values(uint32_t seed) : m_state(seed) {}
+
+  vector<ValType> Next(size_t n, size_t levels = 0) {
+    vector<ValType> values(n);
+    for (size_t i = 0; i < n; ++i) {
+      m_state = m_state * 1664525u + 1013904223u;
+      uint32_t bits = m_state >> 8;
+      if (levels) {
+        values[i] = static_cast<ValType>(bits % levels);
+      } else {
+        values[i] = static_cast<ValType>(bits) / static_cast<ValType>(1 << 24) * 8 - 4;
+      }
+    }
+    return values;
+  }
+
+private:
+  uint32_t m_state;
+};
+
+bool SameBits(ValType a, ValType b)
+{
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+const ValType* Data(const vector<ValType>& v)
+{
+  return v.empty() ? NULL : &v[0];
+}
+
+ValType* Data(vector<ValType>& v)
+{
+  return v.empty() ? NULL : &v[0];
+}
+
+/** The results of every kernel on one input, under the kernels in use */
+struct Results {
+  ValType dot, scaledDot, sqrNorm, diffDot, diffSqrNorm;
+  vector<ValType> sub, div, gemv;
+  size_t argMax;
+
+  Results(const vector<ValType>& a, const vector<ValType>& b, const vector<ValType>& w,
+          const vector<ValType>& rows, size_t numRows, size_t stride) {
+    size_t n = a.size();
+    dot = DotKernel(Data(a), Data(b), n);
+    scaledDot = ScaledDotKernel(Data(a), 3.0f, Data(b), n);
+    sqrNorm = SqrNormKernel(Data(a), n);
+    sub.resize(n);
+    SubKernel(Data(a), Data(b), Data(sub), n);
+    div.resize(n);
+    DivKernel(Data(a), 3.0f, Data(div), n);
+    gemv.resize(numRows);
+    GemvKernel(Data(a), Data(rows), numRows, n, stride, Data(gemv));
+    argMax = ArgMaxKernel(Data(a), n);
+    DiffKernel(Data(w), w.size(), Data(a), Data(b), n, &diffDot, &diffSqrNorm);
+  }
+
+  void CheckSame(const Results& scalar, const string& set, size_t n) const {
+    BOOST_CHECK_MESSAGE(SameBits(dot, scalar.dot), set << " DotKernel, n = " << n);
+    BOOST_CHECK_MESSAGE(SameBits(scaledDot, scalar.scaledDot), set << " ScaledDotKernel, n = " << n);
+    BOOST_CHECK_MESSAGE(SameBits(sqrNorm, scalar.sqrNorm), set << " SqrNormKernel, n = " << n);
+    BOOST_CHECK_MESSAGE(SameBits(diffDot, scalar.diffDot), set << " DiffKernel dot, n = " << n);
+    BOOST_CHECK_MESSAGE(SameBits(diffSqrNorm, scalar.diffSqrNorm), set << " DiffKernel norm, n = " << n);
+    BOOST_CHECK_MESSAGE(argMax == scalar.argMax, set << " ArgMaxKernel, n = " << n);
+    for (size_t i = 0; i < n; ++i) {
+      BOOST_CHECK_MESSAGE(SameBits(sub[i], scalar.sub[i]), set << " SubKernel, n = " << n);
+      BOOST_CHECK_MESSAGE(SameBits(div[i], scalar.div[i]), set << " DivKernel, n = " << n);
+    }
+    for (size_t r = 0; r < gemv.size(); ++r) {
+      BOOST_CHECK_MESSAGE(SameBits(gemv[r], scalar.gemv[r]), set << " GemvKernel, n = " << n);
+    }
+  }
+};
+
+/** Switches to an instruction set, and back to the best one on leaving */
+class KernelSet
+{
+public:
+  explicit KernelSet(const string& name) : m_available(UseKernelInstructionSet(name)) {}
+  ~KernelSet() {
+    if (!UseKernelInstructionSet("avx2")) UseKernelInstructionSet("sse2");
+  }
+  bool available() const {
+    return m_available;
+  }
+
+private:
+  bool m_available;
+};
+
+const char* kVectorSets[] = {"sse2", "avx2"};
+
+/** Checks that each vector instruction set agrees with scalar on every length */
+void CheckAgainstScalar(size_t levels)
+{
+  Values values(levels + 1);
+  for (size_t n = 0; n <= kMaxLength; ++n) {
+    vector<ValType> a = values.Next(n, levels);
+    vector<ValType> b = values.Next(n, levels);
+    // Weights shorter and longer than the difference, taken as 0 past their end
+    vector<ValType> w = values.Next(n % 2 ? n / 2 : n + 3);
+    size_t numRows = 3, stride = n + n % 3;
+    vector<ValType> rows = values.Next(numRows * stride + 1);
+
+    Results* scalar;
+    {
+      KernelSet set("scalar");
+      BOOST_REQUIRE(set.available());
+      scalar = new Results(a, b, w, rows, numRows, stride);
+    }
+    for (size_t s = 0; s < sizeof(kVectorSets) / sizeof(kVectorSets[0]); ++s) {
+      KernelSet set(kVectorSets[s]);
+      if (!set.available()) continue;
+      BOOST_CHECK_EQUAL(string(KernelInstructionSet()), kVectorSets[s]);
+      Results(a, b, w, rows, numRows, stride).CheckSame(*scalar, kVectorSets[s], n);
+    }
+    delete scalar;
+  }
+}
+
+size_t ScalarArgMax(const vector<ValType>& a)
+{
+  KernelSet set("scalar");
+  return ArgMaxKernel(Data(a), a.size());
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(scalar_always_available)
+{
+  KernelSet set("scalar");
+  BOOST_CHECK(set.available());
+  BOOST_CHECK_EQUAL(string(KernelInstructionSet()), "scalar");
+  BOOST_CHECK(!UseKernelInstructionSet("mmx"));
+  BOOST_CHECK_EQUAL(string(KernelInstructionSet()), "scalar");
+}
+
+BOOST_AUTO_TEST_CASE(vector_sets_match_scalar)
+{
+  CheckAgainstScalar(0);
+}
+
+BOOST_AUTO_TEST_CASE(vector_sets_match_scalar_with_ties)
+{
+  // Few distinct values, so the largest occurs in several lanes
+  CheckAgainstScalar(3);
+  CheckAgainstScalar(1);
+}
+
+BOOST_AUTO_TEST_CASE(arg_max_first_of_ties)
+{
+  vector<ValType> a(kMaxLength, 1.0f);
+  for (size_t first = 0; first < kMaxLength; ++first) {
+    for (size_t i = 0; i < kMaxLength; ++i) a[i] = i < first ? 1.0f : 2.0f;
+    for (size_t s = 0; s < sizeof(kVectorSets) / sizeof(kVectorSets[0]); ++s) {
+      KernelSet set(kVectorSets[s]);
+      if (!set.available()) continue;
+      BOOST_CHECK_EQUAL(ArgMaxKernel(&a[0], a.size()), first);
+    }
+    BOOST_CHECK_EQUAL(ScalarArgMax(a), first);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(arg_max_with_nans)
+{
+  const ValType nan = numeric_limits<ValType>::quiet_NaN();
+  Values values(7);
+  for (size_t n = 1; n <= kMaxLength; ++n) {
+    vector<ValType> base = values.Next(n);
+    for (size_t at = 0; at < n; ++at) {
+      vector<ValType> a(base);
+      a[at] = nan;
+      size_t expected = ScalarArgMax(a);
+      BOOST_REQUIRE_LT(expected, n);
+      for (size_t s = 0; s < sizeof(kVectorSets) / sizeof(kVectorSets[0]); ++s) {
+        KernelSet set(kVectorSets[s]);
+        if (!set.available()) continue;
+        BOOST_CHECK_EQUAL(ArgMaxKernel(&a[0], n), expected);
+      }
+    }
+    vector<ValType> allNan(n, nan);
+    for (size_t s = 0; s < sizeof(kVectorSets) / sizeof(kVectorSets[0]); ++s) {
+      KernelSet set(kVectorSets[s]);
+      if (!set.available()) continue;
+      BOOST_CHECK_EQUAL(ArgMaxKernel(&allNan[0], n), ScalarArgMax(allNan));
+    }
+  }
+}
+
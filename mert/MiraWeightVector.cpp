@@ -1,12 +1,85 @@
 #include "MiraWeightVector.h"
+#include "MiraKernels.h"
 
+#include <algorithm>
 #include <cmath>
+#include <stdint.h>
+
+#include "util/exception.hh"
 
 using namespace std;
 
 namespace MosesTuning
 {
 
+namespace
+{
+
+/** A feature vector as a block of one hypothesis */
+class SingleBlock
+{
+public:
+  explicit SingleBlock(const MiraFeatureView& fv) {
+    m_sparseBegin[0] = 0;
+    m_sparseBegin[1] = fv.num_sparse();
+    m_block.dense = fv.dense();
+    m_block.numDense = fv.num_dense();
+    m_block.size = 1;
+    m_block.sparseBegin = m_sparseBegin;
+    m_block.sparseFeats = fv.sparse_feats();
+    m_block.sparseVals = fv.sparse_vals();
+  }
+  operator const MiraFeatureBlock&() const {
+    return m_block;
+  }
+
+private:
+  uint64_t m_sparseBegin[2];
+  MiraFeatureBlock m_block;
+};
+
+/**
+ * Call op(feat, value) for each sparse feature of hope - fear, in order,
+ * dropping those which cancel out as operator- does
+ */
+template <class Op> void ForEachSparseDiff(const MiraFeatureView& hope,
+    const MiraFeatureView& fear, Op& op)
+{
+  const size_t* hopeFeats = hope.sparse_feats();
+  const ValType* hopeVals = hope.sparse_vals();
+  const size_t* fearFeats = fear.sparse_feats();
+  const ValType* fearVals = fear.sparse_vals();
+  size_t i = 0, j = 0;
+  while (i < hope.num_sparse() && j < fear.num_sparse()) {
+    if (hopeFeats[i] < fearFeats[j]) {
+      op(hopeFeats[i], hopeVals[i]);
+      i++;
+    } else if (fearFeats[j] < hopeFeats[i]) {
+      op(fearFeats[j], -fearVals[j]);
+      j++;
+    } else {
+      ValType diff = hopeVals[i] - fearVals[j];
+      if (abs(diff) > 1e-6) op(hopeFeats[i], diff);
+      i++;
+      j++;
+    }
+  }
+  for (; i < hope.num_sparse(); i++) op(hopeFeats[i], hopeVals[i]);
+  for (; j < fear.num_sparse(); j++) op(fearFeats[j], -fearVals[j]);
+}
+
+void CheckDense(const MiraFeatureView& hope, const MiraFeatureView& fear)
+{
+  UTIL_THROW_IF(hope.num_dense() != fear.num_dense(), util::Exception,
+                "Mismatching dense vectors for hope and fear: " << hope.num_dense()
+                << " and " << fear.num_dense() << " features");
+}
+
+// No limit on the ids held in arrays
+const size_t kNoDenseLimit = static_cast<size_t>(-1);
+
+} // namespace
+
 
 /**
  * Constructor, initializes to the zero vector
@@ -14,7 +87,8 @@ namespace MosesTuning
 MiraWeightVector::MiraWeightVector()
   : m_weights(),
     m_totals(),
-    m_lastUpdated()
+    m_lastUpdated(),
+    m_denseLimit(kNoDenseLimit)
 {
   m_numUpdates = 0;
 }
@@ -26,11 +100,27 @@ MiraWeightVector::MiraWeightVector()
 MiraWeightVector::MiraWeightVector(const vector<ValType>& init)
   : m_weights(init),
     m_totals(init),
-    m_lastUpdated(init.size(), 0)
+    m_lastUpdated(init.size(), 0),
+    m_denseLimit(kNoDenseLimit)
 {
   m_numUpdates = 0;
 }
 
+MiraWeightVector::MiraWeightVector(const vector<ValType>& init, size_t denseLimit)
+  : m_weights(init.begin(), init.begin() + min(init.size(), denseLimit)),
+    m_totals(m_weights),
+    m_lastUpdated(m_weights.size(), 0),
+    m_denseLimit(denseLimit)
+{
+  m_numUpdates = 0;
+  for (size_t i = m_weights.size(); i < init.size(); ++i) {
+    if (init[i] == 0) continue;
+    SparseWeight& w = m_sparse.FindOrInsert(i);
+    w.weight = init[i];
+    w.total = init[i];
+  }
+}
+
 /**
  * Update a the model
  * \param fv  Feature vector to be added to the weights
@@ -44,6 +134,59 @@ void MiraWeightVector::update(const MiraFeatureVector& fv, float tau)
   }
 }
 
+/** Adds each difference to the weights it was given, scaled by tau */
+class MiraWeightVector::UpdateOp
+{
+public:
+  UpdateOp(MiraWeightVector& wv, float tau) : m_wv(wv), m_tau(tau) {}
+  void operator()(size_t feat, ValType val) {
+    m_wv.update(feat, val * m_tau);
+  }
+private:
+  MiraWeightVector& m_wv;
+  float m_tau;
+};
+
+void MiraWeightVector::update(const MiraFeatureView& hope, const MiraFeatureView& fear, float tau)
+{
+  CheckDense(hope, fear);
+  m_numUpdates++;
+  const ValType* hopeDense = hope.dense();
+  const ValType* fearDense = fear.dense();
+  for (size_t i = 0; i < hope.num_dense(); i++) {
+    ValType diff = hopeDense[i] - fearDense[i];
+    update(i, diff * tau);
+  }
+  UpdateOp op(*this, tau);
+  ForEachSparseDiff(hope, fear, op);
+}
+
+/** Scores hope - fear, and sums its squares, one feature at a time */
+class MiraWeightVector::ScoreDiffOp
+{
+public:
+  ScoreDiffOp(const MiraWeightVector& wv, ValType score, ValType sqrNorm)
+    : m_wv(wv), m_score(score), m_sqrNorm(sqrNorm) {}
+  void operator()(size_t feat, ValType val) {
+    if (feat < m_wv.m_weights.size()) {
+      m_score += m_wv.m_weights[feat] * val;
+    } else if (const SparseWeight* w = m_wv.findSparse(feat)) {
+      m_score += w->weight * val;
+    }
+    m_sqrNorm += val * val;
+  }
+  ValType score() const {
+    return m_score;
+  }
+  ValType sqrNorm() const {
+    return m_sqrNorm;
+  }
+private:
+  const MiraWeightVector& m_wv;
+  ValType m_score;
+  ValType m_sqrNorm;
+};
+
 /**
  * Perform an empty update (affects averaging)
  */
@@ -58,13 +201,64 @@ void MiraWeightVector::tick()
  */
 ValType MiraWeightVector::score(const MiraFeatureVector& fv) const
 {
-  ValType toRet = 0.0;
-  for(size_t i=0; i<fv.size(); i++) {
-    toRet += weight(fv.feat(i)) * fv.val(i);
-  }
+  return score(fv.view());
+}
+
+ValType MiraWeightVector::score(const MiraFeatureView& fv) const
+{
+  ValType toRet;
+  scoreAll(SingleBlock(fv), &toRet);
   return toRet;
 }
 
+void MiraWeightVector::scoreAll(const MiraFeatureBlock& block, ValType* scores) const
+{
+  // Weights past the end of the arrays are in the table, or 0 and add nothing
+  size_t numWeights = m_weights.size();
+  size_t dense = min(block.numDense, numWeights);
+  if (dense) {
+    GemvKernel(&m_weights[0], block.dense, block.size, dense, block.numDense, scores);
+  } else {
+    fill(scores, scores + block.size, 0);
+  }
+  for (size_t h = 0; h < block.size; ++h) {
+    ValType toRet = scores[h];
+    const ValType* row = block.dense + h * block.numDense;
+    for(size_t i=dense; i<block.numDense && m_sparse.size(); i++) {
+      if (const SparseWeight* w = findSparse(i)) toRet += w->weight * row[i];
+    }
+    for(uint64_t i=block.sparseBegin[h]; i<block.sparseBegin[h+1]; i++) {
+      size_t feat = block.sparseFeats[i];
+      if (feat < numWeights) {
+        toRet += m_weights[feat] * block.sparseVals[i];
+      } else if (const SparseWeight* w = findSparse(feat)) {
+        toRet += w->weight * block.sparseVals[i];
+      }
+    }
+    scores[h] = toRet;
+  }
+}
+
+void MiraWeightVector::scoreDiff(const MiraFeatureView& hope, const MiraFeatureView& fear,
+                                 ValType* score, ValType* sqrNorm) const
+{
+  CheckDense(hope, fear);
+  ValType denseScore = 0, denseNorm = 0;
+  if (hope.num_dense()) {
+    DiffKernel(m_weights.empty() ? NULL : &m_weights[0], m_weights.size(),
+               hope.dense(), fear.dense(), hope.num_dense(), &denseScore, &denseNorm);
+  }
+  for (size_t i = m_weights.size(); i < hope.num_dense() && m_sparse.size(); i++) {
+    if (const SparseWeight* w = findSparse(i)) {
+      denseScore += w->weight * (hope.dense()[i] - fear.dense()[i]);
+    }
+  }
+  ScoreDiffOp op(*this, denseScore, denseNorm);
+  ForEachSparseDiff(hope, fear, op);
+  *score = op.score();
+  *sqrNorm = op.sqrNorm();
+}
+
 /**
  * Return an averaged view of this weight vector
  */
@@ -79,6 +273,13 @@ AvgWeightVector MiraWeightVector::avg()
  */
 void MiraWeightVector::update(size_t index, ValType delta)
 {
+  if (index >= m_denseLimit) {
+    SparseWeight& w = m_sparse.FindOrInsert(index);
+    w.total += (m_numUpdates - w.lastUpdated) * w.weight + delta;
+    w.weight += delta;
+    w.lastUpdated = m_numUpdates;
+    return;
+  }
 
   // Handle previously unseen weights
   while(index>=m_weights.size()) {
@@ -94,11 +295,109 @@ void MiraWeightVector::update(size_t index, ValType delta)
 }
 
 void MiraWeightVector::ToSparse(SparseVector* sparse) const {
+  vector<pair<size_t, ValType> > entries;
   for (size_t i = 0; i < m_weights.size(); ++i) {
     if(abs(m_weights[i])>1e-8) {
-      sparse->set(i,m_weights[i]);
+      entries.push_back(make_pair(i,m_weights[i]));
+    }
+  }
+  // The table's ids all lie above the dense ones, but come in hash order
+  size_t dense = entries.size();
+  const vector<SparseWeight>& buckets = m_sparse.buckets();
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (buckets[i].id != SparseWeightTable::kNoId && abs(buckets[i].weight)>1e-8) {
+      entries.push_back(make_pair(buckets[i].id,buckets[i].weight));
     }
   }
+  sort(entries.begin() + dense, entries.end());
+  sparse->assign(entries);
+}
+
+size_t MiraWeightVector::size() const
+{
+  size_t toRet = m_weights.size();
+  const vector<SparseWeight>& buckets = m_sparse.buckets();
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (buckets[i].id != SparseWeightTable::kNoId) toRet = max(toRet, buckets[i].id + 1);
+  }
+  return toRet;
+}
+
+template <class T> static void WriteVector(ostream* os, const vector<T>& vec)
+{
+  uint64_t size = vec.size();
+  os->write(reinterpret_cast<const char*>(&size), sizeof(size));
+  if (size) os->write(reinterpret_cast<const char*>(&vec[0]), size * sizeof(T));
+}
+
+template <class T> static void ReadVector(istream* is, vector<T>* vec)
+{
+  uint64_t size = 0;
+  is->read(reinterpret_cast<char*>(&size), sizeof(size));
+  vec->resize(size);
+  if (size) is->read(reinterpret_cast<char*>(&(*vec)[0]), size * sizeof(T));
+}
+
+void MiraWeightVector::savebin(ostream* os) const
+{
+  uint64_t numUpdates = m_numUpdates;
+  os->write(reinterpret_cast<const char*>(&numUpdates), sizeof(numUpdates));
+  WriteVector(os, m_weights);
+  WriteVector(os, m_totals);
+  vector<uint64_t> lastUpdated(m_lastUpdated.begin(), m_lastUpdated.end());
+  WriteVector(os, lastUpdated);
+
+  uint64_t denseLimit = m_denseLimit;
+  os->write(reinterpret_cast<const char*>(&denseLimit), sizeof(denseLimit));
+  vector<uint64_t> sparseIds, sparseLastUpdated;
+  vector<ValType> sparseWeights, sparseTotals;
+  const vector<SparseWeight>& buckets = m_sparse.buckets();
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (buckets[i].id == SparseWeightTable::kNoId) continue;
+    sparseIds.push_back(buckets[i].id);
+    sparseWeights.push_back(buckets[i].weight);
+    sparseTotals.push_back(buckets[i].total);
+    sparseLastUpdated.push_back(buckets[i].lastUpdated);
+  }
+  WriteVector(os, sparseIds);
+  WriteVector(os, sparseWeights);
+  WriteVector(os, sparseTotals);
+  WriteVector(os, sparseLastUpdated);
+}
+
+void MiraWeightVector::loadbin(istream* is)
+{
+  uint64_t numUpdates = 0;
+  is->read(reinterpret_cast<char*>(&numUpdates), sizeof(numUpdates));
+  m_numUpdates = numUpdates;
+  ReadVector(is, &m_weights);
+  ReadVector(is, &m_totals);
+  vector<uint64_t> lastUpdated;
+  ReadVector(is, &lastUpdated);
+  m_lastUpdated.assign(lastUpdated.begin(), lastUpdated.end());
+
+  uint64_t denseLimit = 0;
+  is->read(reinterpret_cast<char*>(&denseLimit), sizeof(denseLimit));
+  m_denseLimit = denseLimit;
+  vector<uint64_t> sparseIds, sparseLastUpdated;
+  vector<ValType> sparseWeights, sparseTotals;
+  ReadVector(is, &sparseIds);
+  ReadVector(is, &sparseWeights);
+  ReadVector(is, &sparseTotals);
+  ReadVector(is, &sparseLastUpdated);
+  if (!*is || m_totals.size() != m_weights.size() || m_lastUpdated.size() != m_weights.size()
+      || m_weights.size() > m_denseLimit || sparseWeights.size() != sparseIds.size()
+      || sparseTotals.size() != sparseIds.size() || sparseLastUpdated.size() != sparseIds.size()) {
+    cerr << "Error: Corrupt weight vector" << endl;
+    exit(1);
+  }
+  m_sparse = SparseWeightTable();
+  for (size_t i = 0; i < sparseIds.size(); ++i) {
+    SparseWeight& w = m_sparse.FindOrInsert(sparseIds[i]);
+    w.weight = sparseWeights[i];
+    w.total = sparseTotals[i];
+    w.lastUpdated = sparseLastUpdated[i];
+  }
 }
 
 /**
@@ -107,6 +406,12 @@ void MiraWeightVector::ToSparse(SparseVector* sparse) const {
 void MiraWeightVector::fixTotals()
 {
   for(size_t i=0; i<m_weights.size(); i++) update(i,0);
+  vector<SparseWeight>& buckets = m_sparse.buckets();
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (buckets[i].id == SparseWeightTable::kNoId) continue;
+    buckets[i].total += (m_numUpdates - buckets[i].lastUpdated) * buckets[i].weight;
+    buckets[i].lastUpdated = m_numUpdates;
+  }
 }
 
 /**
@@ -116,6 +421,8 @@ ValType MiraWeightVector::weight(size_t index) const
 {
   if(index < m_weights.size()) {
     return m_weights[index];
+  } else if (const SparseWeight* w = findSparse(index)) {
+    return w->weight;
   } else {
     return 0;
   }
@@ -123,16 +430,31 @@ ValType MiraWeightVector::weight(size_t index) const
 
 ValType MiraWeightVector::sqrNorm() const
 {
-  ValType toRet = 0;
-  for(size_t i=0; i<m_weights.size(); i++) {
-    toRet += weight(i) * weight(i);
+  ValType toRet = m_weights.empty() ? 0 : SqrNormKernel(&m_weights[0], m_weights.size());
+  const vector<SparseWeight>& buckets = m_sparse.buckets();
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (buckets[i].id != SparseWeightTable::kNoId) toRet += buckets[i].weight * buckets[i].weight;
   }
   return toRet;
 }
 
 AvgWeightVector::AvgWeightVector(const MiraWeightVector& wv)
-  :m_wv(wv)
-{}
+  : m_weights(wv.m_totals.size())
+{
+  if(wv.m_numUpdates==0) {
+    m_weights = wv.m_weights;
+  } else if(!m_weights.empty()) {
+    DivKernel(&wv.m_totals[0], wv.m_numUpdates, &m_weights[0], m_weights.size());
+  }
+  const vector<SparseWeight>& buckets = wv.m_sparse.buckets();
+  m_sparse.reserve(wv.m_sparse.size());
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (buckets[i].id == SparseWeightTable::kNoId) continue;
+    ValType w = wv.m_numUpdates ? buckets[i].total / wv.m_numUpdates : buckets[i].weight;
+    m_sparse.push_back(make_pair(buckets[i].id, w));
+  }
+  sort(m_sparse.begin(), m_sparse.end());
+}
 
 ostream& operator<<(ostream& o, const MiraWeightVector& e)
 {
@@ -142,40 +464,92 @@ ostream& operator<<(ostream& o, const MiraWeightVector& e)
       cerr << i << ":" << e.m_weights[i];
     }
   }
+  SparseVector sparse;
+  for (size_t i = 0; i < e.m_sparse.buckets().size(); ++i) {
+    const SparseWeight& w = e.m_sparse.buckets()[i];
+    if (w.id != SparseWeightTable::kNoId && abs(w.weight)>1e-8) sparse.set(w.id, w.weight);
+  }
+  for (SparseVector::const_iterator i = sparse.begin(); i != sparse.end(); ++i) {
+    cerr << " " << i->first << ":" << i->second;
+  }
   return o;
 }
 
+/** Orders sparse weights by id */
+static bool IdLess(const pair<size_t, ValType>& a, size_t id)
+{
+  return a.first < id;
+}
+
+const ValType* AvgWeightVector::findSparse(size_t index) const
+{
+  vector<pair<size_t, ValType> >::const_iterator i =
+    lower_bound(m_sparse.begin(), m_sparse.end(), index, IdLess);
+  return i != m_sparse.end() && i->first == index ? &i->second : NULL;
+}
+
 ValType AvgWeightVector::weight(size_t index) const
 {
-  if(m_wv.m_numUpdates==0) return m_wv.weight(index);
-  else {
-    if(index < m_wv.m_totals.size()) {
-      return m_wv.m_totals[index] / m_wv.m_numUpdates;
-    } else {
-      return 0;
-    }
-  }
+  if (index < m_weights.size()) return m_weights[index];
+  const ValType* w = findSparse(index);
+  return w ? *w : 0;
 }
 
 ValType AvgWeightVector::score(const MiraFeatureVector& fv) const
 {
-  ValType toRet = 0.0;
-  for(size_t i=0; i<fv.size(); i++) {
-    toRet += weight(fv.feat(i)) * fv.val(i);
-  }
+  return score(fv.view());
+}
+
+ValType AvgWeightVector::score(const MiraFeatureView& fv) const
+{
+  ValType toRet;
+  scoreAll(SingleBlock(fv), &toRet);
   return toRet;
 }
 
+void AvgWeightVector::scoreAll(const MiraFeatureBlock& block, ValType* scores) const
+{
+  size_t numWeights = m_weights.size();
+  size_t dense = min(block.numDense, numWeights);
+  if (dense) {
+    GemvKernel(&m_weights[0], block.dense, block.size, dense, block.numDense, scores);
+  } else {
+    fill(scores, scores + block.size, 0);
+  }
+  for (size_t h = 0; h < block.size; ++h) {
+    ValType toRet = scores[h];
+    const ValType* row = block.dense + h * block.numDense;
+    for(size_t i=dense; i<block.numDense && !m_sparse.empty(); i++) {
+      if (const ValType* w = findSparse(i)) toRet += *w * row[i];
+    }
+    for(uint64_t i=block.sparseBegin[h]; i<block.sparseBegin[h+1]; i++) {
+      size_t feat = block.sparseFeats[i];
+      if (feat < numWeights) {
+        toRet += m_weights[feat] * block.sparseVals[i];
+      } else if (m_sparse.empty()) {
+        continue;
+      } else if (const ValType* w = findSparse(feat)) {
+        toRet += *w * block.sparseVals[i];
+      }
+    }
+    scores[h] = toRet;
+  }
+}
+
 size_t AvgWeightVector::size() const
 {
-  return m_wv.m_weights.size();
+  return m_sparse.empty() ? m_weights.size() : m_sparse.back().first + 1;
 }
 
 void AvgWeightVector::ToSparse(SparseVector* sparse) const {
-  for (size_t i = 0; i < size(); ++i) {
-    ValType w = weight(i);
-    if(abs(w)>1e-8) {
-      sparse->set(i,w);
+  for (size_t i = 0; i < m_weights.size(); ++i) {
+    if(abs(m_weights[i])>1e-8) {
+      sparse->set(i,m_weights[i]);
+    }
+  }
+  for (size_t i = 0; i < m_sparse.size(); ++i) {
+    if(abs(m_sparse[i].second)>1e-8) {
+      sparse->set(m_sparse[i].first,m_sparse[i].second);
     }
   }
 }
@@ -12,8 +12,10 @@
 
 #include <vector>
 #include <iostream>
+#include <utility>
 
 #include "MiraFeatureVector.h"
+#include "SparseWeightTable.h"
 
 namespace MosesTuning
 {
@@ -35,6 +37,15 @@ public:
    */
   MiraWeightVector(const std::vector<ValType>& init);
 
+  /**
+   * Constructor keeping the weights of features with ids from denseLimit
+   * on in a hash table rather than in arrays, so that memory grows with
+   * the number of features seen rather than with the largest id
+   * \param init       Initial feature values
+   * \param denseLimit Features with lower ids are held in arrays
+   */
+  MiraWeightVector(const std::vector<ValType>& init, std::size_t denseLimit);
+
   /**
    * Update a the model
    * \param fv  Feature vector to be added to the weights
@@ -42,6 +53,12 @@ public:
    */
   void update(const MiraFeatureVector& fv, float tau);
 
+  /**
+   * Update the model by hope - fear, without building the difference.
+   * Same result as update(hope - fear, tau).
+   */
+  void update(const MiraFeatureView& hope, const MiraFeatureView& fear, float tau);
+
   /**
    * Perform an empty update (affects averaging)
    */
@@ -52,6 +69,20 @@ public:
    * \param fv Feature vector to be scored
    */
   ValType score(const MiraFeatureVector& fv) const;
+  ValType score(const MiraFeatureView& fv) const;
+
+  /**
+   * Score every hypothesis of a block into scores, with one pass over
+   * the dense values and one over the sparse. Same results as score.
+   */
+  void scoreAll(const MiraFeatureBlock& block, ValType* scores) const;
+
+  /**
+   * Score and squared norm of hope - fear in one pass, without building
+   * the difference. Same results as score and sqrNorm of hope - fear.
+   */
+  void scoreDiff(const MiraFeatureView& hope, const MiraFeatureView& fear,
+                 ValType* score, ValType* sqrNorm) const;
 
   /**
    * Squared norm of the weight vector
@@ -65,14 +96,35 @@ public:
 
   /**
     * Convert to sparse vector, interpreting all features as sparse.
+    * Replaces whatever the sparse vector held.
    **/
   void ToSparse(SparseVector* sparse) const;
 
+  /**
+   * One more than the largest feature id with a stored weight
+   */
+  std::size_t size() const;
+
+  /**
+   * Write or read the complete state, including the averaging
+   * book-keeping, in binary
+   */
+  void savebin(std::ostream* os) const;
+  void loadbin(std::istream* is);
+
   friend class AvgWeightVector;
 
   friend std::ostream& operator<<(std::ostream& o, const MiraWeightVector& e);
 
 private:
+  class UpdateOp;
+  class ScoreDiffOp;
+
+  /** Weight of a feature held in the hash table, or NULL if none is */
+  const SparseWeight* findSparse(std::size_t index) const {
+    return m_sparse.Find(index);
+  }
+
   /**
    * Updates a weight and lazily updates its total
    */
@@ -92,21 +144,42 @@ private:
   std::vector<ValType> m_totals;
   std::vector<std::size_t> m_lastUpdated;
   std::size_t m_numUpdates;
+
+  // Features with ids from here on are in m_sparse
+  std::size_t m_denseLimit;
+  SparseWeightTable m_sparse;
 };
 
 /**
- * Averaged view of a weight vector
+ * Snapshot of the averaged weights of a weight vector, computed once
+ * when taken. It does not refer back to the weight vector, so it may be
+ * read by several threads while training carries on.
  */
 class AvgWeightVector
 {
 public:
+  /** Snapshot of wv, whose totals must be up-to-date, as avg() makes them */
   AvgWeightVector(const MiraWeightVector& wv);
   ValType score(const MiraFeatureVector& fv) const;
+  ValType score(const MiraFeatureView& fv) const;
+  void scoreAll(const MiraFeatureBlock& block, ValType* scores) const;
   ValType weight(std::size_t index) const;
   std::size_t size() const;
   void ToSparse(SparseVector* sparse) const;
+
+  /** The averaged weights held in arrays, for ids from 0 */
+  const std::vector<ValType>& dense() const {
+    return m_weights;
+  }
+  /** The rest, which were in a hash table, in order of id */
+  const std::vector<std::pair<std::size_t, ValType> >& sparse() const {
+    return m_sparse;
+  }
 private:
-  const MiraWeightVector& m_wv;
+  const ValType* findSparse(std::size_t index) const;
+
+  std::vector<ValType> m_weights;
+  std::vector<std::pair<std::size_t, ValType> > m_sparse;
 };
 
 
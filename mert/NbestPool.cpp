@@ -0,0 +1,317 @@
+/*
+ *  NbestPool.cpp
+ *  mert - Minimum Error Rate Training
+ *
+ *  File layout, a sequence of segments each starting on an 8 byte
+ *  boundary:
+ *    header
+ *    sources            the feature and score file of each pair added
+ *                       by the segment, tab separated, one per line
+ *    store              an n-best store of the hypotheses added
+ *    fingerprints       hypotheses x uint64, the Fingerprint of each
+ *                       hypothesis of the store, in its order
+ */
+
+#include "NbestPool.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+
+#include "HypPackEnumerator.h"
+#include "HypothesisDedup.h"
+
+using namespace std;
+
+namespace
+{
+const char kMagic[8] = {'M','E','R','T','P','O','O','L'};
+
+struct SegmentHeader {
+  char magic[8];
+  uint64_t sources;
+  uint64_t store;
+  uint64_t fingerprints;
+};
+
+uint64_t Padded(uint64_t bytes)
+{
+  return (bytes + 7) & ~static_cast<uint64_t>(7);
+}
+
+string Source(const string& featureFile, const string& scoreFile)
+{
+  return featureFile + '\t' + scoreFile;
+}
+
+using namespace MosesTuning;
+
+/** Compares a new hypothesis with those of the sentence already pooled */
+class SameAsPooled
+{
+public:
+  SameAsPooled(const NbestPool& pool, size_t sentence, size_t pooled,
+               const MiraFeatureView& features, const ScoreDataView& scores)
+    : m_pool(pool), m_sentence(sentence), m_pooled(pooled),
+      m_features(features), m_scores(scores) {}
+
+  bool operator()(size_t k) const {
+    // New hypotheses are unique among themselves already
+    return k < m_pooled && SameHypothesis(m_features, m_scores,
+                                          m_pool.featuresAt(m_sentence, k),
+                                          m_pool.scoresAt(m_sentence, k));
+  }
+
+private:
+  const NbestPool& m_pool;
+  size_t m_sentence;
+  size_t m_pooled;
+  const MiraFeatureView& m_features;
+  const ScoreDataView& m_scores;
+};
+
+struct NeverSame {
+  bool operator()(size_t) const {
+    return false;
+  }
+};
+} // namespace
+
+namespace MosesTuning
+{
+
+
+NbestPool::NbestPool(const string& file, vector<vector<string> >* names)
+  : m_file(file), m_names(names)
+{
+  Map();
+}
+
+NbestPool::NbestPool(NbestStore* store) : m_names(NULL)
+{
+  m_segments.push_back(store);
+  m_fingerprints.push_back(NULL);
+}
+
+bool NbestPool::IsPool(const string& file)
+{
+  ifstream in(file.c_str(), ios::binary);
+  char magic[sizeof(kMagic)];
+  in.read(magic, sizeof(magic));
+  return in && !memcmp(magic, kMagic, sizeof(kMagic));
+}
+
+bool NbestPool::Contains(const string& featureFile, const string& scoreFile) const
+{
+  return m_sources.count(Source(featureFile, scoreFile)) > 0;
+}
+
+void NbestPool::Map()
+{
+  m_segments.clear();
+  m_fingerprints.clear();
+  m_sources.clear();
+  m_mapped.reset();
+  if (m_names) m_names->clear();
+  if (!boost::filesystem::exists(m_file)) return;
+
+  util::scoped_fd fd(util::OpenReadOrThrow(m_file.c_str()));
+  uint64_t size = util::SizeOrThrow(fd.get());
+  if (!size) return;
+  util::MapRead(util::LAZY, fd.get(), 0, size, m_mapped);
+  const char* data = static_cast<const char*>(m_mapped.get());
+
+  uint64_t offset = 0;
+  while (offset < size) {
+    SegmentHeader header;
+    UTIL_THROW_IF(size - offset < sizeof(header), util::Exception,
+                  m_file << " ends in a partly written segment");
+    memcpy(&header, data + offset, sizeof(header));
+    UTIL_THROW_IF(memcmp(header.magic, kMagic, sizeof(kMagic)), util::Exception,
+                  m_file << " is not an n-best pool, or is corrupt at byte " << offset);
+    offset += sizeof(header);
+    UTIL_THROW_IF(header.sources > size || header.store > size || header.fingerprints > size / sizeof(uint64_t) ||
+                  size - offset < Padded(header.sources) + Padded(header.store) + header.fingerprints * sizeof(uint64_t),
+                  util::Exception, m_file << " ends in a partly written segment");
+
+    istringstream sources(string(data + offset, header.sources));
+    for (string source; getline(sources, source); ) {
+      m_sources.insert(source);
+    }
+    offset += Padded(header.sources);
+
+    ostringstream name;
+    name << "segment " << m_segments.size() << " of " << m_file;
+    vector<string>* names = NULL;
+    if (m_names) {
+      m_names->push_back(vector<string>());
+      names = &m_names->back();
+    }
+    m_segments.push_back(new NbestStore(data + offset, header.store, name.str(), false, names));
+    offset += Padded(header.store);
+    UTIL_THROW_IF(header.fingerprints != m_segments.back().num_hypotheses(), util::Exception,
+                  name.str() << " has " << header.fingerprints << " fingerprints for "
+                  << m_segments.back().num_hypotheses() << " hypotheses");
+    m_fingerprints.push_back(reinterpret_cast<const uint64_t*>(data + offset));
+    offset += header.fingerprints * sizeof(uint64_t);
+
+    const NbestStore& first = m_segments.front();
+    const NbestStore& last = m_segments.back();
+    UTIL_THROW_IF(last.num_sentences() != first.num_sentences() ||
+                  last.num_dense() != first.num_dense() ||
+                  last.num_stats() != first.num_stats(), util::Exception,
+                  name.str() << " has " << last.num_sentences() << " sentences, " << last.num_dense()
+                  << " dense features and " << last.num_stats() << " score statistics, but segment 0 has "
+                  << first.num_sentences() << ", " << first.num_dense() << " and " << first.num_stats());
+  }
+}
+
+size_t NbestPool::Add(const vector<string>& featureFiles, const vector<string>& scoreFiles)
+{
+  UTIL_THROW_IF(m_file.empty(), util::Exception, "Can only add to a pool kept in a file");
+  UTIL_THROW_IF(featureFiles.size() != scoreFiles.size(), util::Exception,
+                "Give the same number of feature and score files");
+  vector<string> newFeatures, newScores;
+  set<string> sources;
+  for (size_t i = 0; i < featureFiles.size(); ++i) {
+    string source = Source(featureFiles[i], scoreFiles[i]);
+    if (!m_sources.count(source) && sources.insert(source).second) {
+      newFeatures.push_back(featureFiles[i]);
+      newScores.push_back(scoreFiles[i]);
+    }
+  }
+  if (newFeatures.empty()) return 0;
+
+  StreamingHypPackEnumerator train(newFeatures, newScores);
+  boost::scoped_ptr<NbestStoreWriter> writer;
+  if (!m_segments.empty()) writer.reset(new NbestStoreWriter(num_dense(), num_stats()));
+  // Sentences passed before the first hypothesis, when the pool is empty
+  size_t emptySentences = 0;
+  size_t sentence = 0, added = 0;
+  HypothesisDedup dedup;
+  vector<uint64_t> fingerprints;
+  for (train.reset(); !train.finished(); train.next(), ++sentence) {
+    UTIL_THROW_IF(!m_segments.empty() && sentence >= num_sentences(), util::Exception,
+                  "The files added to " << m_file << " have more than its " << num_sentences() << " sentences");
+    // The pooled hypotheses' fingerprints were kept when they were added
+    size_t pooled = 0;
+    dedup.clear();
+    for (size_t s = 0; s < m_segments.size(); ++s) {
+      const uint64_t* kept = m_fingerprints[s] + m_segments[s].first(sentence);
+      for (size_t k = 0; k < m_segments[s].size(sentence); ++k, ++pooled) {
+        dedup.Duplicate(kept[k], pooled, NeverSame());
+      }
+    }
+    for (size_t j = 0; j < train.cur_size(); ++j) {
+      MiraFeatureView features = train.featuresAt(j);
+      ScoreDataView scores = train.scoresAt(j);
+      SameAsPooled same(*this, sentence, pooled, features, scores);
+      uint64_t fingerprint = Fingerprint(features, scores);
+      if (dedup.Duplicate(fingerprint, pooled + j, same)) continue;
+      UTIL_THROW_IF(!m_segments.empty() && train.num_dense() != num_dense(), util::Exception,
+                    "The files added to " << m_file << " have " << train.num_dense()
+                    << " dense features, but it has " << num_dense());
+      if (!writer) {
+        writer.reset(new NbestStoreWriter(train.num_dense(), scores.size()));
+        for (; emptySentences; --emptySentences) writer->EndSentence();
+      }
+      writer->AddHypothesis(features, scores);
+      fingerprints.push_back(fingerprint);
+      ++added;
+    }
+    if (writer) writer->EndSentence();
+    else ++emptySentences;
+  }
+  UTIL_THROW_IF(!writer, util::Exception, "No hypotheses in " << newFeatures[0]);
+  UTIL_THROW_IF(!m_segments.empty() && sentence != num_sentences(), util::Exception,
+                "The files added to " << m_file << " have " << sentence << " sentences, but it has "
+                << num_sentences());
+
+  string store;
+  writer->Write(&store);
+  writer.reset();
+  string text;
+  for (size_t i = 0; i < newFeatures.size(); ++i) {
+    text += Source(newFeatures[i], newScores[i]) + '\n';
+  }
+  SegmentHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.sources = text.size();
+  header.store = store.size();
+  header.fingerprints = fingerprints.size();
+  string segment(reinterpret_cast<const char*>(&header), sizeof(header));
+  segment += text;
+  segment.append(Padded(text.size()) - text.size(), '\0');
+  segment += store;
+  segment.append(Padded(store.size()) - store.size(), '\0');
+  segment.append(reinterpret_cast<const char*>(fingerprints.data()), fingerprints.size() * sizeof(uint64_t));
+
+  {
+    util::scoped_fd fd(open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666));
+    UTIL_THROW_IF(fd.get() == -1, util::ErrnoException, "while opening " << m_file << " to append");
+    util::WriteOrThrow(fd.get(), segment.data(), segment.size());
+    util::FSyncOrThrow(fd.get());
+  }
+  Map();
+  return added;
+}
+
+size_t NbestPool::num_sentences() const
+{
+  return m_segments.empty() ? 0 : m_segments.front().num_sentences();
+}
+size_t NbestPool::num_dense() const
+{
+  return m_segments.empty() ? 0 : m_segments.front().num_dense();
+}
+size_t NbestPool::num_stats() const
+{
+  return m_segments.empty() ? 0 : m_segments.front().num_stats();
+}
+
+size_t NbestPool::size(size_t sentence) const
+{
+  size_t total = 0;
+  for (size_t s = 0; s < m_segments.size(); ++s) {
+    total += m_segments[s].size(sentence);
+  }
+  return total;
+}
+
+const NbestStore& NbestPool::Locate(size_t sentence, size_t* i) const
+{
+  size_t s = 0;
+  for (; s + 1 < m_segments.size(); ++s) {
+    size_t size = m_segments[s].size(sentence);
+    if (*i < size) break;
+    *i -= size;
+  }
+  return m_segments[s];
+}
+
+MiraFeatureView NbestPool::featuresAt(size_t sentence, size_t i) const
+{
+  const NbestStore& store = Locate(sentence, &i);
+  return store.featuresAt(sentence, i);
+}
+
+ScoreDataView NbestPool::scoresAt(size_t sentence, size_t i) const
+{
+  const NbestStore& store = Locate(sentence, &i);
+  return store.scoresAt(sentence, i);
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
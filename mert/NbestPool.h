@@ -0,0 +1,102 @@
+/*
+ *  NbestPool.h
+ *  mert - Minimum Error Rate Training
+ *
+ *  A file of n-best stores, one appended for each tuning iteration.
+ *  Each holds only the hypotheses its feature and score files added to
+ *  those already in the pool, so an iteration reads its own files once
+ *  and the earlier ones are mapped rather than read again.
+ */
+
+#ifndef MERT_NBEST_POOL_H
+#define MERT_NBEST_POOL_H
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include "util/mmap.hh"
+
+#include "NbestStore.h"
+
+namespace MosesTuning
+{
+
+
+/**
+ * The hypotheses of sentence s are those of sentence s in each segment,
+ * in the order they were added. Safe to read from several threads.
+ */
+class NbestPool : boost::noncopyable
+{
+public:
+  /**
+   * Map the pool in file. If there is no such file, the pool starts empty.
+   * If names, the segments' sparse feature names go there, a table for
+   * each, as for an NbestStore.
+   */
+  explicit NbestPool(const std::string& file,
+                     std::vector<std::vector<std::string> >* names = NULL);
+
+  /** A pool held in memory, with store as its only segment */
+  explicit NbestPool(NbestStore* store);
+
+  /** Whether file starts like a pool */
+  static bool IsPool(const std::string& file);
+
+  /** Whether this pair of files was added before */
+  bool Contains(const std::string& featureFile, const std::string& scoreFile) const;
+
+  /**
+   * Append to the pool file the hypotheses of the pairs of files not
+   * yet in it, leaving out those already in the pool.
+   * \return The number of hypotheses added
+   */
+  std::size_t Add(const std::vector<std::string>& featureFiles,
+                  const std::vector<std::string>& scoreFiles);
+
+  std::size_t num_segments() const {
+    return m_segments.size();
+  }
+  std::size_t num_sentences() const;
+  std::size_t num_dense() const;
+  std::size_t num_stats() const;
+
+  std::size_t size(std::size_t sentence) const;
+  MiraFeatureView featuresAt(std::size_t sentence, std::size_t i) const;
+  ScoreDataView scoresAt(std::size_t sentence, std::size_t i) const;
+  /**
+   * The hypotheses of a sentence added with one segment. Those of all
+   * the segments, in order, are numbered as by featuresAt.
+   */
+  MiraFeatureBlock block(std::size_t segment, std::size_t sentence) const {
+    return m_segments[segment].block(sentence);
+  }
+
+private:
+  void Map();
+  /** Find the segment holding hypothesis i, and its index there */
+  const NbestStore& Locate(std::size_t sentence, std::size_t* i) const;
+
+  std::string m_file;
+  std::vector<std::vector<std::string> >* m_names;
+  util::scoped_memory m_mapped;
+  boost::ptr_vector<NbestStore> m_segments;
+  // The fingerprint of each hypothesis of each segment, in store order,
+  // or NULL for a pool held in memory
+  std::vector<const uint64_t*> m_fingerprints;
+  std::set<std::string> m_sources;
+};
+
+}
+
+#endif // MERT_NBEST_POOL_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -0,0 +1,368 @@
+/*
+ *  NbestStore.cpp
+ *  mert - Minimum Error Rate Training
+ *
+ *  File layout, all in native byte order with each block starting on
+ *  an 8 byte boundary:
+ *    header
+ *    sentence offsets   (sentences+1) x uint64, into the hypotheses
+ *    dense features     hypotheses x dense floats, row-major
+ *    sparse offsets     (hypotheses+1) x uint64, into the sparse blocks
+ *    sparse ids         sparse x uint64, dense + index into name table
+ *    sparse values      sparse x float
+ *    score statistics   hypotheses x stats floats, row-major
+ *    text               dense names, score type, then the sparse
+ *                       feature name table, one per line. Local
+ *                       stores have no name table, and their ids are
+ *                       SparseVector ids offset by the dense features.
+ */
+
+#include "NbestStore.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+
+#include "FeatureRegistry.h"
+#include "FeatureStats.h"
+
+using namespace std;
+
+namespace
+{
+const char kMagic[8] = {'M','E','R','T','N','B','S','T'};
+const uint64_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  uint64_t version;
+  uint64_t sentences;
+  uint64_t hypotheses;
+  uint64_t dense;
+  uint64_t stats;
+  uint64_t sparse;
+  uint64_t names;
+  uint64_t text;
+};
+
+uint64_t Padded(uint64_t bytes)
+{
+  return (bytes + 7) & ~static_cast<uint64_t>(7);
+}
+
+template <class T> void Append(string* out, const vector<T>& vec)
+{
+  uint64_t bytes = vec.size() * sizeof(T);
+  if (bytes) out->append(reinterpret_cast<const char*>(&vec[0]), bytes);
+  out->append(Padded(bytes) - bytes, '\0');
+}
+
+/** Sizes of the blocks after the header, in file order */
+void BlockSizes(const Header& header, uint64_t* sizes)
+{
+  sizes[0] = (header.sentences + 1) * sizeof(uint64_t);
+  sizes[1] = Padded(header.hypotheses * header.dense * sizeof(float));
+  sizes[2] = (header.hypotheses + 1) * sizeof(uint64_t);
+  sizes[3] = header.sparse * sizeof(uint64_t);
+  sizes[4] = Padded(header.sparse * sizeof(float));
+  sizes[5] = Padded(header.hypotheses * header.stats * sizeof(float));
+  sizes[6] = header.text;
+}
+
+const size_t kBlocks = 7;
+
+/** Whether count items of width bytes could fit in size bytes */
+bool Fits(uint64_t count, uint64_t width, uint64_t size)
+{
+  return !width || count <= size / width;
+}
+
+/** Whether offsets[0..count] rise from 0 to total */
+bool Consistent(const uint64_t* offsets, uint64_t count, uint64_t total)
+{
+  if (offsets[0]) return false;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (offsets[i + 1] < offsets[i]) return false;
+  }
+  return offsets[count] == total;
+}
+
+/** Whether every one of values[0..count) is at least begin and below end */
+bool InRange(const uint64_t* values, uint64_t count, uint64_t begin, uint64_t end)
+{
+  for (uint64_t i = 0; i < count; ++i) {
+    if (values[i] < begin || values[i] >= end) return false;
+  }
+  return true;
+}
+} // namespace
+
+namespace MosesTuning
+{
+
+
+NbestStoreWriter::NbestStoreWriter(size_t numDense, size_t numStats,
+                                   const string& featureNames, const string& scoreType)
+  : m_num_dense(numDense),
+    m_num_stats(numStats),
+    m_feature_names(featureNames),
+    m_score_type(scoreType),
+    m_num_names(0)
+{
+  m_sentence_begin.push_back(0);
+  m_sparse_begin.push_back(0);
+}
+
+void NbestStoreWriter::AddHypothesis(const MiraFeatureView& features, const ScoreDataView& scores)
+{
+  UTIL_THROW_IF(scores.size() != m_num_stats, util::Exception,
+                "Expected " << m_num_stats << " score statistics, found " << scores.size());
+  UTIL_THROW_IF(features.size() < m_num_dense, util::Exception,
+                "Expected " << m_num_dense << " dense features, found " << features.size());
+  for (size_t i = 0; i < m_num_dense; ++i) {
+    m_dense.push_back(features.val(i));
+  }
+  for (size_t i = m_num_dense; i < features.size(); ++i) {
+    size_t feat = features.feat(i);
+    m_sparse_feats.push_back(feat);
+    m_sparse_vals.push_back(features.val(i));
+    m_num_names = max(m_num_names, feat - m_num_dense + 1);
+  }
+  m_sparse_begin.push_back(m_sparse_feats.size());
+  m_stats.insert(m_stats.end(), scores.begin(), scores.end());
+}
+
+void NbestStoreWriter::EndSentence()
+{
+  m_sentence_begin.push_back(m_sparse_begin.size() - 1);
+}
+
+uint64_t NbestStoreWriter::bytes() const
+{
+  return (m_sentence_begin.size() + m_sparse_begin.size() + m_sparse_feats.size()) * sizeof(uint64_t)
+         + (m_dense.size() + m_sparse_vals.size() + m_stats.size()) * sizeof(ValType);
+}
+
+void NbestStoreWriter::Write(string* out, bool local) const
+{
+  UTIL_THROW_IF(m_sentence_begin.back() != m_sparse_begin.size() - 1, util::Exception,
+                "The last sentence of the store was not finished");
+  ostringstream text;
+  text << m_feature_names << '\n' << m_score_type << '\n';
+  for (size_t i = 0; !local && i < m_num_names; ++i) {
+    text << SparseVector::decode(i) << '\n';
+  }
+
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.sentences = m_sentence_begin.size() - 1;
+  header.hypotheses = m_sparse_begin.size() - 1;
+  header.dense = m_num_dense;
+  header.stats = m_num_stats;
+  header.sparse = m_sparse_feats.size();
+  header.names = m_num_names;
+  header.text = text.str().size();
+
+  uint64_t sizes[kBlocks];
+  BlockSizes(header, sizes);
+  uint64_t total = sizeof(Header);
+  for (size_t i = 0; i < kBlocks; ++i) total += sizes[i];
+
+  out->clear();
+  out->reserve(total);
+  out->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  Append(out, m_sentence_begin);
+  Append(out, m_dense);
+  Append(out, m_sparse_begin);
+  Append(out, m_sparse_feats);
+  Append(out, m_sparse_vals);
+  Append(out, m_stats);
+  out->append(text.str());
+}
+
+void NbestStoreWriter::Write(const string& file) const
+{
+  string data;
+  Write(&data);
+  util::scoped_fd fd(util::CreateOrThrow(file.c_str()));
+  util::WriteOrThrow(fd.get(), data.data(), data.size());
+}
+
+NbestStore::NbestStore(const string& file, vector<string>* names)
+{
+  util::scoped_fd fd(util::OpenReadOrThrow(file.c_str()));
+  uint64_t size = util::SizeOrThrow(fd.get());
+  UTIL_THROW_IF(size < sizeof(Header), util::Exception, file << " is too short to be an n-best store");
+  util::MapRead(util::LAZY, fd.get(), 0, size, m_mapped);
+  Init(static_cast<const char*>(m_mapped.get()), size, file, false, names);
+}
+
+NbestStore::NbestStore(string* buffer, bool local)
+{
+  m_buffer.swap(*buffer);
+  UTIL_THROW_IF(m_buffer.size() < sizeof(Header), util::Exception, "Truncated n-best store");
+  Init(m_buffer.data(), m_buffer.size(), "n-best store in memory", local, NULL);
+}
+
+NbestStore::NbestStore(const char* data, uint64_t size, const string& name, bool local,
+                       vector<string>* names)
+{
+  UTIL_THROW_IF(size < sizeof(Header), util::Exception, name << " is too short to be an n-best store");
+  Init(data, size, name, local, names);
+}
+
+bool NbestStore::IsStore(const string& file)
+{
+  ifstream in(file.c_str(), ios::binary);
+  char magic[sizeof(kMagic)];
+  in.read(magic, sizeof(magic));
+  return in && !memcmp(magic, kMagic, sizeof(kMagic));
+}
+
+void NbestStore::Init(const char* data, uint64_t size, const string& name, bool local,
+                      vector<string>* names)
+{
+  Header header;
+  memcpy(&header, data, sizeof(header));
+  UTIL_THROW_IF(memcmp(header.magic, kMagic, sizeof(kMagic)), util::Exception,
+                name << " is not an n-best store");
+  UTIL_THROW_IF(header.version != kVersion, util::Exception, name << " has version "
+                << header.version << ", expected " << kVersion);
+  // So that working out the block sizes cannot overflow
+  UTIL_THROW_IF(!Fits(header.sentences, sizeof(uint64_t), size) ||
+                !Fits(header.hypotheses, sizeof(uint64_t), size) ||
+                !Fits(header.dense, sizeof(float), size) ||
+                !Fits(header.hypotheses, header.dense * sizeof(float), size) ||
+                !Fits(header.stats, sizeof(float), size) ||
+                !Fits(header.hypotheses, header.stats * sizeof(float), size) ||
+                !Fits(header.sparse, sizeof(uint64_t), size) ||
+                // A local store has no table, so may refer to more names than bytes
+                (!local && header.names > size) || header.text > size,
+                util::Exception, name << " is too short for the sizes in its header");
+  uint64_t sizes[kBlocks];
+  BlockSizes(header, sizes);
+  const char* blocks[kBlocks];
+  uint64_t offset = sizeof(Header);
+  for (size_t i = 0; i < kBlocks; ++i) {
+    blocks[i] = data + offset;
+    offset += sizes[i];
+  }
+  UTIL_THROW_IF(offset != size, util::Exception, name << " should be " << offset
+                << " bytes, but is " << size);
+
+  m_num_sentences = header.sentences;
+  m_num_dense = header.dense;
+  m_num_stats = header.stats;
+  m_sentence_begin = reinterpret_cast<const uint64_t*>(blocks[0]);
+  m_dense = reinterpret_cast<const ValType*>(blocks[1]);
+  m_sparse_begin = reinterpret_cast<const uint64_t*>(blocks[2]);
+  m_sparse_vals = reinterpret_cast<const ValType*>(blocks[4]);
+  m_stats = reinterpret_cast<const float*>(blocks[5]);
+  const uint64_t* feats = reinterpret_cast<const uint64_t*>(blocks[3]);
+  UTIL_THROW_IF(!Consistent(m_sentence_begin, m_num_sentences, header.hypotheses) ||
+                !Consistent(m_sparse_begin, header.hypotheses, header.sparse),
+                util::Exception, name << " has inconsistent offsets");
+  UTIL_THROW_IF(!InRange(feats, header.sparse, m_num_dense, m_num_dense + header.names),
+                util::Exception, name << " refers past the end of its name table");
+
+  istringstream text(string(blocks[6], header.text));
+  getline(text, m_feature_names);
+  getline(text, m_score_type);
+  // Sparse ids in the file index its name table. They can be used
+  // directly if this process gives each name the same id, as it does
+  // for a local store, which has no table, and none has been dropped.
+  // They are also used directly if the caller takes the table.
+  if (names) {
+    names->resize(local ? 0 : header.names);
+    for (size_t i = 0; i < names->size(); ++i) getline(text, (*names)[i]);
+  }
+  vector<size_t> ids(local || names ? 0 : header.names);
+  vector<bool> kept(ids.size());
+  bool same = sizeof(size_t) == sizeof(uint64_t);
+  // Whether mapping the ids keeps each hypothesis's in order, and apart
+  bool increasing = true;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    string feature;
+    getline(text, feature);
+    kept[i] = FeatureRegistry::Instance().EncodeKept(feature, &ids[i]);
+    same = same && ids[i] == i;
+    increasing = increasing && kept[i] && (i == 0 || ids[i - 1] < ids[i]);
+  }
+  UTIL_THROW_IF(!text, util::Exception, name << " has a truncated feature name table");
+  if (same && increasing) {
+    m_sparse_feats = reinterpret_cast<const size_t*>(feats);
+  } else if (increasing) {
+    m_remapped_feats.resize(header.sparse);
+    for (size_t i = 0; i < header.sparse; ++i) {
+      m_remapped_feats[i] = ids.empty() ? feats[i] : m_num_dense + ids[feats[i] - m_num_dense];
+    }
+    m_sparse_feats = m_remapped_feats.empty() ? NULL : &m_remapped_feats[0];
+  } else {
+    // Another process may have given the names ids in another order, or
+    // hashed several into one id, or features may have been dropped (see
+    // FeatureRegistry::Drop), so sort each hypothesis's features again,
+    // adding the values of those which now share an id
+    m_remapped_sparse_begin.resize(header.hypotheses + 1);
+    m_remapped_feats.reserve(header.sparse);
+    m_remapped_sparse_vals.reserve(header.sparse);
+    vector<pair<size_t, ValType> > sparse;
+    for (size_t h = 0; h < header.hypotheses; ++h) {
+      sparse.clear();
+      for (uint64_t i = m_sparse_begin[h]; i < m_sparse_begin[h + 1]; ++i) {
+        size_t index = feats[i] - m_num_dense;
+        if (kept[index]) sparse.push_back(make_pair(m_num_dense + ids[index], m_sparse_vals[i]));
+      }
+      sort(sparse.begin(), sparse.end());
+      size_t begin = m_remapped_feats.size();
+      m_remapped_sparse_begin[h] = begin;
+      for (size_t j = 0; j < sparse.size(); ++j) {
+        if (m_remapped_feats.size() > begin && m_remapped_feats.back() == sparse[j].first) {
+          m_remapped_sparse_vals.back() += sparse[j].second;
+        } else {
+          m_remapped_feats.push_back(sparse[j].first);
+          m_remapped_sparse_vals.push_back(sparse[j].second);
+        }
+      }
+    }
+    m_remapped_sparse_begin[header.hypotheses] = m_remapped_feats.size();
+    m_sparse_begin = &m_remapped_sparse_begin[0];
+    m_sparse_vals = m_remapped_sparse_vals.empty() ? NULL : &m_remapped_sparse_vals[0];
+    m_sparse_feats = m_remapped_feats.empty() ? NULL : &m_remapped_feats[0];
+  }
+}
+
+MiraFeatureView NbestStore::featuresAt(size_t sentence, size_t i) const
+{
+  size_t hyp = m_sentence_begin[sentence] + i;
+  size_t sparse = m_sparse_begin[hyp];
+  return MiraFeatureView(m_dense + hyp * m_num_dense, m_num_dense,
+                         m_sparse_feats + sparse, m_sparse_vals + sparse,
+                         m_sparse_begin[hyp+1] - sparse);
+}
+
+MiraFeatureBlock NbestStore::block(size_t sentence) const
+{
+  size_t first = m_sentence_begin[sentence];
+  MiraFeatureBlock block = {m_dense + first * m_num_dense, m_num_dense, size(sentence),
+                            m_sparse_begin + first, m_sparse_feats, m_sparse_vals};
+  return block;
+}
+
+ScoreDataView NbestStore::scoresAt(size_t sentence, size_t i) const
+{
+  size_t hyp = m_sentence_begin[sentence] + i;
+  return ScoreDataView(m_stats + hyp * m_num_stats, m_num_stats);
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
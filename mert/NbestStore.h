@@ -0,0 +1,178 @@
+/*
+ *  NbestStore.h
+ *  mert - Minimum Error Rate Training
+ *
+ *  Binary, memory-mappable store of the feature and score data of
+ *  a set of n-best lists. The columns are laid out as in memory, so
+ *  opening a store costs a mmap rather than a parse.
+ *
+ *  A store holds both features and scores, so the same file is given
+ *  as the feature and the score file.
+ */
+
+#ifndef MERT_NBEST_STORE_H
+#define MERT_NBEST_STORE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "util/mmap.hh"
+
+#include "MiraFeatureVector.h"
+#include "ScoreDataIterator.h"
+
+namespace MosesTuning
+{
+
+
+/**
+ * Collects n-best lists in memory, then writes them as an NbestStore.
+ * Sparse feature ids are SparseVector ids offset by the number of
+ * dense features, as in MiraFeatureVector.
+ */
+class NbestStoreWriter
+{
+public:
+  /**
+   * \param featureNames Dense feature names, as in the text header
+   * \param scoreType    Name of the scorer that produced the statistics
+   */
+  NbestStoreWriter(std::size_t numDense, std::size_t numStats,
+                   const std::string& featureNames = "",
+                   const std::string& scoreType = "");
+
+  /** Add a hypothesis to the current sentence */
+  void AddHypothesis(const MiraFeatureView& features, const ScoreDataView& scores);
+
+  /** Finish the current sentence, and start the next */
+  void EndSentence();
+
+  std::size_t num_sentences() const {
+    return m_sentence_begin.size() - 1;
+  }
+
+  /** Memory held by the hypotheses added so far */
+  uint64_t bytes() const;
+
+  void Write(const std::string& file) const;
+  /**
+   * Lay out the store in out. A local store leaves out the sparse feature
+   * name table and keeps this process's ids, so it is smaller and quicker
+   * to open, but only this process can read it, as a local NbestStore.
+   */
+  void Write(std::string* out, bool local = false) const;
+
+private:
+  std::size_t m_num_dense;
+  std::size_t m_num_stats;
+  std::string m_feature_names;
+  std::string m_score_type;
+  std::size_t m_num_names;
+  std::vector<uint64_t> m_sentence_begin;
+  std::vector<ValType> m_dense;
+  std::vector<uint64_t> m_sparse_begin;
+  std::vector<uint64_t> m_sparse_feats;
+  std::vector<ValType> m_sparse_vals;
+  std::vector<float> m_stats;
+};
+
+/**
+ * Read-only access to a store. Views returned point straight into the
+ * mapped file. The sparse features are copied instead if this process
+ * gives their names other ids, when they are sorted again, or if some
+ * have been dropped from the FeatureRegistry, when they are left out.
+ * Safe to read from several threads.
+ */
+class NbestStore : boost::noncopyable
+{
+public:
+  /**
+   * Map the store in file. If names, the store's sparse feature names go
+   * there instead of being given ids, and the views' sparse ids, less
+   * num_dense(), index them.
+   */
+  explicit NbestStore(const std::string& file, std::vector<std::string>* names = NULL);
+
+  /** Take over the contents of buffer, as written by NbestStoreWriter */
+  explicit NbestStore(std::string* buffer, bool local = false);
+
+  /**
+   * Read the size bytes at data, which must stay valid and 8 byte aligned.
+   * names as for a file.
+   */
+  NbestStore(const char* data, uint64_t size, const std::string& name, bool local = false,
+             std::vector<std::string>* names = NULL);
+
+  /** Whether file starts like a store, rather than text data */
+  static bool IsStore(const std::string& file);
+
+  std::size_t num_sentences() const {
+    return m_num_sentences;
+  }
+  std::size_t num_dense() const {
+    return m_num_dense;
+  }
+  std::size_t num_stats() const {
+    return m_num_stats;
+  }
+  std::size_t size(std::size_t sentence) const {
+    return m_sentence_begin[sentence+1] - m_sentence_begin[sentence];
+  }
+  /** The number of hypotheses of all the sentences */
+  std::size_t num_hypotheses() const {
+    return m_sentence_begin[m_num_sentences];
+  }
+  /** The index of the first hypothesis of sentence among all the store's */
+  std::size_t first(std::size_t sentence) const {
+    return m_sentence_begin[sentence];
+  }
+  MiraFeatureView featuresAt(std::size_t sentence, std::size_t i) const;
+  ScoreDataView scoresAt(std::size_t sentence, std::size_t i) const;
+  /** The features of all the hypotheses of a sentence */
+  MiraFeatureBlock block(std::size_t sentence) const;
+
+  const std::string& feature_names() const {
+    return m_feature_names;
+  }
+  const std::string& score_type() const {
+    return m_score_type;
+  }
+
+private:
+  void Init(const char* data, uint64_t size, const std::string& name, bool local,
+            std::vector<std::string>* names);
+
+  util::scoped_memory m_mapped;
+  std::string m_buffer;
+
+  std::size_t m_num_sentences;
+  std::size_t m_num_dense;
+  std::size_t m_num_stats;
+  std::string m_feature_names;
+  std::string m_score_type;
+  const uint64_t* m_sentence_begin;
+  const ValType* m_dense;
+  const uint64_t* m_sparse_begin;
+  const std::size_t* m_sparse_feats;
+  const ValType* m_sparse_vals;
+  const float* m_stats;
+  // Used when the ids in the file differ from this process's SparseVector ids
+  std::vector<std::size_t> m_remapped_feats;
+  // Used when the features had to be sorted again, with m_remapped_feats,
+  // in place of the file's offsets and values
+  std::vector<uint64_t> m_remapped_sparse_begin;
+  std::vector<ValType> m_remapped_sparse_vals;
+};
+
+}
+
+#endif // MERT_NBEST_STORE_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
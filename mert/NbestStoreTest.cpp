@@ -0,0 +1,190 @@
+#include "NbestStore.h"
+
+#define BOOST_TEST_MODULE MertNbestStore
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "FeatureRegistry.h"
+#include "FeatureStats.h"
+#include "NbestPool.h"
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace
+{
+
+const size_t kDense = 2;
+
+/** One hypothesis: dense values, then sparse SparseVector ids and values */
+struct Hypothesis {
+  Hypothesis(ValType d0, ValType d1) {
+    dense.push_back(d0);
+    dense.push_back(d1);
+    stats.push_back(d0);
+    stats.push_back(d1);
+  }
+  Hypothesis& Sparse(size_t id, ValType value) {
+    feats.push_back(kDense + id);
+    vals.push_back(value);
+    return *this;
+  }
+  MiraFeatureView features() const {
+    return MiraFeatureView(&dense[0], dense.size(), feats.empty() ? NULL : &feats[0],
+                           vals.empty() ? NULL : &vals[0], feats.size());
+  }
+
+  vector<ValType> dense;
+  vector<size_t> feats;
+  vector<ValType> vals;
+  vector<float> stats;
+};
+
+/** Lays out sentences of hypotheses as a store, in buffer */
+void Write(const vector<vector<Hypothesis> >& sentences, string* buffer)
+{
+  NbestStoreWriter writer(kDense, 2);
+  for (size_t s = 0; s < sentences.size(); ++s) {
+    for (size_t i = 0; i < sentences[s].size(); ++i) {
+      const Hypothesis& h = sentences[s][i];
+      writer.AddHypothesis(h.features(), ScoreDataView(&h.stats[0], h.stats.size()));
+    }
+    writer.EndSentence();
+  }
+  writer.Write(buffer);
+}
+
+/** Checks the features of a view against a hypothesis, without the ids left out */
+void CheckView(const MiraFeatureView& view, const Hypothesis& h, size_t leftOut)
+{
+  BOOST_REQUIRE_EQUAL(view.num_dense(), kDense);
+  BOOST_CHECK_EQUAL(view.dense()[0], h.dense[0]);
+  BOOST_CHECK_EQUAL(view.dense()[1], h.dense[1]);
+  vector<size_t> feats;
+  vector<ValType> vals;
+  for (size_t j = 0; j < h.feats.size(); ++j) {
+    if (h.feats[j] == kDense + leftOut) continue;
+    feats.push_back(h.feats[j]);
+    vals.push_back(h.vals[j]);
+  }
+  BOOST_REQUIRE_EQUAL(view.num_sparse(), feats.size());
+  for (size_t j = 0; j < feats.size(); ++j) {
+    BOOST_CHECK_EQUAL(view.sparse_feats()[j], feats[j]);
+    BOOST_CHECK_EQUAL(view.sparse_vals()[j], vals[j]);
+  }
+}
+
+/** Checks the sparse features of a block against the views of its sentence */
+void CheckBlock(const NbestStore& store, size_t sentence)
+{
+  MiraFeatureBlock block = store.block(sentence);
+  BOOST_REQUIRE_EQUAL(block.size, store.size(sentence));
+  for (size_t i = 0; i < block.size; ++i) {
+    MiraFeatureView view = store.featuresAt(sentence, i);
+    uint64_t begin = block.sparseBegin[i];
+    BOOST_REQUIRE_EQUAL(block.sparseBegin[i + 1] - begin, view.num_sparse());
+    for (size_t j = 0; j < view.num_sparse(); ++j) {
+      BOOST_CHECK_EQUAL(block.sparseFeats[begin + j], view.sparse_feats()[j]);
+      BOOST_CHECK_EQUAL(block.sparseVals[begin + j], view.sparse_vals()[j]);
+    }
+  }
+}
+
+vector<vector<Hypothesis> > Sentences(size_t a, size_t b, size_t c)
+{
+  vector<vector<Hypothesis> > sentences(2);
+  sentences[0].push_back(Hypothesis(1, 2).Sparse(a, 0.5).Sparse(b, 1.5));
+  sentences[0].push_back(Hypothesis(3, 4).Sparse(b, 2.5));
+  sentences[0].push_back(Hypothesis(5, 6));
+  sentences[1].push_back(Hypothesis(7, 8).Sparse(a, 3.5).Sparse(b, 4.5).Sparse(c, 5.5));
+  sentences[1].push_back(Hypothesis(9, 10).Sparse(c, 6.5));
+  return sentences;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+  size_t a = SparseVector::encode("round_trip_a");
+  size_t b = SparseVector::encode("round_trip_b");
+  size_t c = SparseVector::encode("round_trip_c");
+  vector<vector<Hypothesis> > sentences = Sentences(a, b, c);
+  string buffer;
+  Write(sentences, &buffer);
+  NbestStore store(&buffer);
+
+  BOOST_REQUIRE_EQUAL(store.num_sentences(), 2);
+  BOOST_CHECK_EQUAL(store.num_hypotheses(), 5);
+  for (size_t s = 0; s < sentences.size(); ++s) {
+    BOOST_REQUIRE_EQUAL(store.size(s), sentences[s].size());
+    for (size_t i = 0; i < sentences[s].size(); ++i) {
+      CheckView(store.featuresAt(s, i), sentences[s][i], SparseVector::encode("no_such_feature"));
+      ScoreDataView scores = store.scoresAt(s, i);
+      BOOST_REQUIRE_EQUAL(scores.size(), 2);
+      BOOST_CHECK_EQUAL(scores[0], sentences[s][i].stats[0]);
+    }
+    CheckBlock(store, s);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(dropped_features_left_out)
+{
+  size_t a = SparseVector::encode("dropped_a");
+  size_t b = SparseVector::encode("dropped_b");
+  size_t c = SparseVector::encode("dropped_c");
+  vector<vector<Hypothesis> > sentences = Sentences(a, b, c);
+  string buffer;
+  Write(sentences, &buffer);
+  FeatureRegistry::Instance().Drop(vector<size_t>(1, b));
+
+  // Read as a pool's segment too, which reads it as a store
+  string poolBuffer(buffer);
+  NbestStore store(&buffer);
+  NbestPool pool(new NbestStore(&poolBuffer));
+  for (size_t s = 0; s < sentences.size(); ++s) {
+    BOOST_REQUIRE_EQUAL(store.size(s), sentences[s].size());
+    for (size_t i = 0; i < sentences[s].size(); ++i) {
+      CheckView(store.featuresAt(s, i), sentences[s][i], b);
+      CheckView(pool.featuresAt(s, i), sentences[s][i], b);
+      ScoreDataView scores = store.scoresAt(s, i);
+      BOOST_CHECK_EQUAL(scores[1], sentences[s][i].stats[1]);
+    }
+    CheckBlock(store, s);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(names_in_another_order)
+{
+  size_t x = SparseVector::encode("order_x");
+  size_t y = SparseVector::encode("order_y");
+  size_t z = SparseVector::encode("order_z");
+  vector<vector<Hypothesis> > sentences(1);
+  sentences[0].push_back(Hypothesis(1, 2).Sparse(x, 1).Sparse(y, 2).Sparse(z, 3));
+  sentences[0].push_back(Hypothesis(3, 4).Sparse(y, 4));
+  sentences[0].push_back(Hypothesis(5, 6).Sparse(x, 5).Sparse(z, 6));
+  string buffer;
+  Write(sentences, &buffer);
+
+  // As if written by a process which gave x and y each other's names,
+  // and z that of x, as hashing them into one id would
+  size_t xName = buffer.find("order_x\n");
+  size_t yName = buffer.find("order_y\n");
+  size_t zName = buffer.find("order_z\n");
+  BOOST_REQUIRE(xName != string::npos && yName != string::npos && zName != string::npos);
+  buffer[xName + 6] = 'y';
+  buffer[yName + 6] = 'x';
+  buffer[zName + 6] = 'x';
+  NbestStore store(&buffer);
+
+  vector<Hypothesis> expected;
+  expected.push_back(Hypothesis(1, 2).Sparse(x, 2 + 3).Sparse(y, 1));
+  expected.push_back(Hypothesis(3, 4).Sparse(x, 4));
+  expected.push_back(Hypothesis(5, 6).Sparse(x, 6).Sparse(y, 5));
+  BOOST_REQUIRE_EQUAL(store.size(0), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    CheckView(store.featuresAt(0, i), expected[i], z);
+  }
+  CheckBlock(store, 0);
+}
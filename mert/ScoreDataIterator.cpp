@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "util/file_piece.hh"
 #include "util/tokenize_piece.hh"
 
+#include "NbestStore.h"
 #include "ScoreArray.h"
 #include "ScoreDataIterator.h"
 
@@ -31,11 +32,15 @@ namespace MosesTuning
 {
 
 
-ScoreDataIterator::ScoreDataIterator() {}
+ScoreDataIterator::ScoreDataIterator() : m_sentence(0) {}
 
-ScoreDataIterator::ScoreDataIterator(const string& filename)
+ScoreDataIterator::ScoreDataIterator(const string& filename) : m_sentence(0)
 {
-  m_in.reset(new FilePiece(filename.c_str()));
+  if (NbestStore::IsStore(filename)) {
+    m_store.reset(new NbestStore(filename));
+  } else {
+    m_in.reset(new FilePiece(filename.c_str()));
+  }
   readNext();
 }
 
@@ -44,6 +49,10 @@ ScoreDataIterator::~ScoreDataIterator() {}
 void ScoreDataIterator::readNext()
 {
   m_next.clear();
+  if (m_store) {
+    readStore();
+    return;
+  }
   try {
     StringPiece marker = m_in->ReadDelimited();
     if (marker != StringPiece(SCORES_TXT_BEGIN)) {
@@ -73,6 +82,20 @@ void ScoreDataIterator::readNext()
   }
 }
 
+void ScoreDataIterator::readStore()
+{
+  if (m_sentence == m_store->num_sentences()) {
+    m_store.reset();
+    m_sentence = 0;
+    return;
+  }
+  for (size_t i = 0; i < m_store->size(m_sentence); ++i) {
+    ScoreDataView scores = m_store->scoresAt(m_sentence, i);
+    m_next.push_back(ScoreDataItem(scores.begin(), scores.end()));
+  }
+  ++m_sentence;
+}
+
 void ScoreDataIterator::increment()
 {
   readNext();
@@ -81,7 +104,9 @@ void ScoreDataIterator::increment()
 
 bool ScoreDataIterator::equal(const ScoreDataIterator& rhs) const
 {
-  if (!m_in && !rhs.m_in) {
+  if (m_store || rhs.m_store) {
+    return m_store == rhs.m_store && m_sentence == rhs.m_sentence;
+  } else if (!m_in && !rhs.m_in) {
     return true;
   } else if (!m_in) {
     return false;
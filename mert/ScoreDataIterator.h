@@ -42,8 +42,38 @@ namespace MosesTuning
 {
 
 
+class NbestStore;
+
 typedef std::vector<float> ScoreDataItem;
 
+/**
+ * Read-only view of the score statistics of one hypothesis
+ */
+class ScoreDataView
+{
+public:
+  ScoreDataView(const float* data, std::size_t size) : m_data(data), m_size(size) {}
+  explicit ScoreDataView(const ScoreDataItem& item)
+    : m_data(item.empty() ? NULL : &item[0]), m_size(item.size()) {}
+
+  const float* begin() const {
+    return m_data;
+  }
+  const float* end() const {
+    return m_data + m_size;
+  }
+  std::size_t size() const {
+    return m_size;
+  }
+  float operator[](std::size_t i) const {
+    return m_data[i];
+  }
+
+private:
+  const float* m_data;
+  std::size_t m_size;
+};
+
 class ScoreDataIterator :
   public boost::iterator_facade<ScoreDataIterator,
   const std::vector<ScoreDataItem>,
@@ -51,6 +81,7 @@ class ScoreDataIterator :
 {
 public:
   ScoreDataIterator();
+  /** Reads text score data, or the scores of an NbestStore */
   explicit ScoreDataIterator(const std::string& filename);
 
   ~ScoreDataIterator();
@@ -67,8 +98,12 @@ private:
   const std::vector<ScoreDataItem>& dereference() const;
 
   void readNext();
+  void readStore();
 
   boost::shared_ptr<util::FilePiece> m_in;
+  // Set instead of m_in when reading an NbestStore
+  boost::shared_ptr<NbestStore> m_store;
+  std::size_t m_sentence;
   std::vector<ScoreDataItem> m_next;
 };
 
@@ -0,0 +1,215 @@
+#include "SparseFeatureCounts.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_piece.hh"
+#include "util/string_piece_hash.hh"
+#include "util/tokenize_piece.hh"
+
+#include "FeatureArray.h"
+#include "FeatureDataIterator.h"
+#include "FeatureRegistry.h"
+#include "Hypergraph.h"
+#include "HypergraphStore.h"
+#include "NbestPool.h"
+#include "NbestStore.h"
+#include "WorkerPool.h"
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+namespace MosesTuning
+{
+
+
+namespace
+{
+
+class NbestCountTask : public WorkerTask
+{
+public:
+  explicit NbestCountTask(const string& file) : m_file(file) {}
+
+  void Run() {
+    if (NbestPool::IsPool(m_file)) {
+      // Counted by each segment's name table
+      vector<vector<string> > names;
+      NbestPool pool(m_file, &names);
+      vector<vector<size_t> > counts(names.size());
+      for (size_t s = 0; s < names.size(); ++s) counts[s].resize(names[s].size(), 0);
+      size_t numDense = pool.num_dense();
+      for (size_t sentence = 0; sentence < pool.num_sentences(); ++sentence) {
+        for (size_t segment = 0; segment < pool.num_segments(); ++segment) {
+          MiraFeatureBlock block = pool.block(segment, sentence);
+          for (uint64_t i = block.sparseBegin[0]; i < block.sparseBegin[block.size]; ++i) {
+            ++counts[segment][block.sparseFeats[i] - numDense];
+          }
+        }
+      }
+      for (size_t s = 0; s < names.size(); ++s) AddAll(names[s], counts[s]);
+    } else if (NbestStore::IsStore(m_file)) {
+      vector<string> names;
+      NbestStore store(m_file, &names);
+      vector<size_t> counts(names.size(), 0);
+      for (size_t sentence = 0; sentence < store.num_sentences(); ++sentence) {
+        MiraFeatureBlock block = store.block(sentence);
+        for (uint64_t i = block.sparseBegin[0]; i < block.sparseBegin[block.size]; ++i) {
+          ++counts[block.sparseFeats[i] - store.num_dense()];
+        }
+      }
+      AddAll(names, counts);
+    } else {
+      CountText();
+    }
+  }
+
+  const FeatureNameCounts& counts() const {
+    return m_counts;
+  }
+
+private:
+  /** The text format of FeatureDataIterator, reading only the sparse names */
+  void CountText() {
+    util::FilePiece in(m_file.c_str());
+    try {
+      while (true) {
+        StringPiece marker = in.ReadDelimited();
+        if (marker != StringPiece(FEATURES_TXT_BEGIN)) {
+          throw FileFormatException(m_file, marker.as_string());
+        }
+        in.ReadULong();
+        size_t count = in.ReadULong();
+        in.ReadLine();
+        for (size_t i = 0; i < count; ++i) {
+          StringPiece line = in.ReadLine();
+          for (util::TokenIter<util::AnyCharacter, true> token(line, util::AnyCharacter(" \t")); token; ++token) {
+            util::TokenIter<util::AnyCharacterLast, false> value(*token, util::AnyCharacterLast("="));
+            if (!value) throw FileFormatException(m_file, line.as_string());
+            StringPiece name = *value;
+            if (++value) m_counts.Add(name);
+          }
+        }
+        StringPiece line = in.ReadLine();
+        if (line != StringPiece(FEATURES_TXT_END)) {
+          throw FileFormatException(m_file, line.as_string());
+        }
+      }
+    } catch (util::EndOfFileException&) {}
+  }
+
+  /** Add counts[i] for names[i], in the order of the table */
+  void AddAll(const vector<string>& names, const vector<size_t>& counts) {
+    for (size_t i = 0; i < names.size(); ++i) m_counts.Add(names[i], counts[i]);
+  }
+
+  string m_file;
+  FeatureNameCounts m_counts;
+};
+
+class HypergraphCountTask : public WorkerTask
+{
+public:
+  explicit HypergraphCountTask(const string& file) : m_file(file) {}
+
+  void Run() {
+    if (HypergraphStore::IsStore(m_file)) {
+      HypergraphStore(m_file).CountFeatures(&m_counts);
+      return;
+    }
+    util::FilePiece file(util::OpenReadOrThrow(m_file.c_str()));
+    CountGraphFeatures(file, &m_counts);
+  }
+
+  const FeatureNameCounts& counts() const {
+    return m_counts;
+  }
+
+private:
+  string m_file;
+  FeatureNameCounts m_counts;
+};
+
+template <class Task> void RunAll(boost::ptr_vector<Task>& tasks, WorkerPool& pool,
+                                  vector<size_t>* counts)
+{
+  vector<WorkerTask*> run;
+  for (size_t i = 0; i < tasks.size(); ++i) run.push_back(&tasks[i]);
+  pool.Run(run);
+  // Only now, on this thread and file by file, are the names given ids
+  for (size_t i = 0; i < tasks.size(); ++i) tasks[i].counts().AddTo(counts);
+}
+
+} // namespace
+
+void FeatureNameCounts::Add(const StringPiece& name, size_t count)
+{
+  boost::unordered_map<string, size_t>::const_iterator found = FindStringPiece(m_numbers, name);
+  if (found != m_numbers.end()) {
+    m_counts[found->second] += count;
+    return;
+  }
+  m_names.push_back(name.as_string());
+  m_counts.push_back(count);
+  m_numbers[m_names.back()] = m_names.size() - 1;
+}
+
+void FeatureNameCounts::AddTo(vector<size_t>* counts) const
+{
+  FeatureRegistry& registry = FeatureRegistry::Instance();
+  for (size_t i = 0; i < m_names.size(); ++i) {
+    size_t id = registry.Encode(m_names[i]);
+    if (counts->size() <= id) counts->resize(id + 1, 0);
+    (*counts)[id] += m_counts[i];
+  }
+}
+
+void CountNbestFeatures(const vector<string>& featureFiles, WorkerPool& pool,
+                        vector<size_t>* counts)
+{
+  boost::ptr_vector<NbestCountTask> tasks;
+  for (size_t i = 0; i < featureFiles.size(); ++i) {
+    tasks.push_back(new NbestCountTask(featureFiles[i]));
+  }
+  RunAll(tasks, pool, counts);
+}
+
+void CountHypergraphFeatures(const string& hypergraphDir, WorkerPool& pool,
+                             vector<size_t>* counts)
+{
+  UTIL_THROW_IF(!fs::exists(hypergraphDir), HypergraphException, "Directory '" << hypergraphDir << "' does not exist");
+  // As HypergraphHopeFearDecoder, which skips the weights
+  static const string kWeights = "weights";
+  boost::ptr_vector<HypergraphCountTask> tasks;
+  fs::directory_iterator dend;
+  for (fs::directory_iterator di(hypergraphDir); di != dend; ++di) {
+    if (di->path().filename() == kWeights) continue;
+    tasks.push_back(new HypergraphCountTask(di->path().string()));
+  }
+  RunAll(tasks, pool, counts);
+}
+
+DroppedFeatures DropRareFeatures(const vector<size_t>& counts, size_t minCount,
+                                 size_t keepBelow)
+{
+  DroppedFeatures dropped;
+  vector<size_t> ids;
+  for (size_t id = keepBelow; id < counts.size(); ++id) {
+    if (!counts[id] || counts[id] >= minCount) continue;
+    ids.push_back(id);
+    dropped.occurrences += counts[id];
+  }
+  dropped.features = ids.size();
+  FeatureRegistry::Instance().Drop(ids);
+  return dropped;
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
@@ -0,0 +1,80 @@
+/*
+ * SparseFeatureCounts.h
+ * kbmira - k-best Batch MIRA
+ *
+ * Counts how many hypotheses, or hypergraph edges, each sparse feature
+ * appears in, so that rare features can be dropped before the training
+ * data is loaded. Each file is read on its own task, counting by name,
+ * and the names are given ids afterwards, file by file, in the order a
+ * serial read would have given them.
+ */
+
+#ifndef MERT_SPARSE_FEATURE_COUNTS_H
+#define MERT_SPARSE_FEATURE_COUNTS_H
+
+#include <string>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+#include "util/string_piece.hh"
+
+namespace MosesTuning
+{
+
+
+class WorkerPool;
+
+/** Counts of sparse features by name, read on a thread of their own */
+class FeatureNameCounts
+{
+public:
+  /** Add count to that of name, numbering it if it is new */
+  void Add(const StringPiece& name, std::size_t count = 1);
+
+  /**
+   * Give the names ids, in the order they were first added, and add
+   * their counts to counts[id]
+   */
+  void AddTo(std::vector<std::size_t>* counts) const;
+
+private:
+  boost::unordered_map<std::string, std::size_t> m_numbers;
+  std::vector<std::string> m_names;
+  std::vector<std::size_t> m_counts;
+};
+
+/** counts[id] is the number of hypotheses with the feature with that id */
+void CountNbestFeatures(const std::vector<std::string>& featureFiles,
+                        WorkerPool& pool,
+                        std::vector<std::size_t>* counts);
+
+/** counts[id] is the number of edges with the feature with that id */
+void CountHypergraphFeatures(const std::string& hypergraphDir,
+                             WorkerPool& pool,
+                             std::vector<std::size_t>* counts);
+
+struct DroppedFeatures {
+  DroppedFeatures() : features(0), occurrences(0) {}
+  std::size_t features;
+  // Values no longer stored, summed over hypotheses or edges
+  std::size_t occurrences;
+};
+
+/**
+ * Drops from the FeatureRegistry the features counted fewer than
+ * minCount times, except those with ids below keepBelow.
+ */
+DroppedFeatures DropRareFeatures(const std::vector<std::size_t>& counts,
+                                 std::size_t minCount,
+                                 std::size_t keepBelow);
+
+}
+
+#endif // MERT_SPARSE_FEATURE_COUNTS_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -0,0 +1,234 @@
+#include "FeatureStats.h"
+
+#define BOOST_TEST_MODULE MertSparseVector
+#include <boost/test/unit_test.hpp>
+
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace
+{
+
+SparseVector Make(const size_t* ids, const FeatureStatsType* values, size_t n)
+{
+  SparseVector v;
+  for (size_t i = 0; i < n; ++i) v.set(ids[i], values[i]);
+  return v;
+}
+
+void CheckIncreasing(const SparseVector& v)
+{
+  for (size_t i = 1; i < v.size(); ++i) {
+    BOOST_CHECK_LT(v.ids()[i - 1], v.ids()[i]);
+  }
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(set_out_of_order)
+{
+  size_t ids[] = {7, 2, 9, 0, 5, 2};
+  FeatureStatsType values[] = {1, 2, 3, 4, 5, 6};
+  SparseVector v = Make(ids, values, 6);
+  BOOST_CHECK_EQUAL(v.size(), 5);
+  CheckIncreasing(v);
+  BOOST_CHECK_EQUAL(v.get(0), 4);
+  BOOST_CHECK_EQUAL(v.get(2), 6);
+  BOOST_CHECK_EQUAL(v.get(5), 5);
+  BOOST_CHECK_EQUAL(v.get(7), 1);
+  BOOST_CHECK_EQUAL(v.get(9), 3);
+  BOOST_CHECK_EQUAL(v.get(3), 0);
+  BOOST_CHECK_EQUAL(v.get(10), 0);
+}
+
+BOOST_AUTO_TEST_CASE(growth_past_inline)
+{
+  SparseVector v;
+  for (size_t i = 0; i < 40; ++i) {
+    // Alternate ends so that both appending and inserting grow the vector
+    size_t id = (i % 2) ? 100 + i : 100 - i;
+    v.set(id, static_cast<FeatureStatsType>(i + 1));
+  }
+  BOOST_CHECK_EQUAL(v.size(), 40);
+  CheckIncreasing(v);
+  for (size_t i = 0; i < 40; ++i) {
+    size_t id = (i % 2) ? 100 + i : 100 - i;
+    BOOST_CHECK_EQUAL(v.get(id), static_cast<FeatureStatsType>(i + 1));
+  }
+
+  SparseVector copy(v);
+  BOOST_CHECK(copy == v);
+  SparseVector small;
+  small.set(1, 1);
+  small = v;
+  BOOST_CHECK(small == v);
+  v = SparseVector();
+  BOOST_CHECK_EQUAL(v.size(), 0);
+  BOOST_CHECK_EQUAL(copy.size(), 40);
+}
+
+BOOST_AUTO_TEST_CASE(assign_sorted)
+{
+  vector<pair<size_t, FeatureStatsType> > entries;
+  for (size_t i = 0; i < 10; ++i) entries.push_back(make_pair(3 * i, i + 0.5f));
+  SparseVector v;
+  v.set(1, 1);
+  v.assign(entries);
+  BOOST_CHECK_EQUAL(v.size(), 10);
+  BOOST_CHECK_EQUAL(v.get(1), 0);
+  BOOST_CHECK_EQUAL(v.get(27), 9.5);
+
+  entries.resize(2);
+  v.assign(entries);
+  BOOST_CHECK_EQUAL(v.size(), 2);
+  BOOST_CHECK_EQUAL(v.get(3), 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(merge_disjoint)
+{
+  size_t aIds[] = {1, 5, 9};
+  FeatureStatsType aValues[] = {1, 2, 3};
+  size_t bIds[] = {0, 3, 7, 11, 12};
+  FeatureStatsType bValues[] = {4, 5, 6, 7, 8};
+  SparseVector a = Make(aIds, aValues, 3);
+  SparseVector b = Make(bIds, bValues, 5);
+
+  SparseVector sum(a);
+  sum += b;
+  BOOST_CHECK_EQUAL(sum.size(), 8);
+  CheckIncreasing(sum);
+  for (size_t i = 0; i < 3; ++i) BOOST_CHECK_EQUAL(sum.get(aIds[i]), aValues[i]);
+  for (size_t i = 0; i < 5; ++i) BOOST_CHECK_EQUAL(sum.get(bIds[i]), bValues[i]);
+
+  SparseVector difference(a);
+  difference -= b;
+  BOOST_CHECK_EQUAL(difference.size(), 8);
+  CheckIncreasing(difference);
+  for (size_t i = 0; i < 3; ++i) BOOST_CHECK_EQUAL(difference.get(aIds[i]), aValues[i]);
+  for (size_t i = 0; i < 5; ++i) BOOST_CHECK_EQUAL(difference.get(bIds[i]), -bValues[i]);
+
+  SparseVector empty;
+  empty -= a;
+  BOOST_CHECK_EQUAL(empty.size(), 3);
+  BOOST_CHECK_EQUAL(empty.get(9), -3);
+}
+
+BOOST_AUTO_TEST_CASE(merge_overlapping)
+{
+  size_t aIds[] = {1, 4, 6, 8};
+  FeatureStatsType aValues[] = {1, 2, 3, 4};
+  size_t bIds[] = {2, 4, 8, 10};
+  FeatureStatsType bValues[] = {10, 20, 30, 40};
+  SparseVector a = Make(aIds, aValues, 4);
+  SparseVector b = Make(bIds, bValues, 4);
+
+  SparseVector sum(a);
+  sum += b;
+  BOOST_CHECK_EQUAL(sum.size(), 6);
+  CheckIncreasing(sum);
+  BOOST_CHECK_EQUAL(sum.get(1), 1);
+  BOOST_CHECK_EQUAL(sum.get(2), 10);
+  BOOST_CHECK_EQUAL(sum.get(4), 22);
+  BOOST_CHECK_EQUAL(sum.get(6), 3);
+  BOOST_CHECK_EQUAL(sum.get(8), 34);
+  BOOST_CHECK_EQUAL(sum.get(10), 40);
+
+  SparseVector difference = a - b;
+  BOOST_CHECK_EQUAL(difference.size(), 6);
+  CheckIncreasing(difference);
+  BOOST_CHECK_EQUAL(difference.get(2), -10);
+  BOOST_CHECK_EQUAL(difference.get(4), -18);
+  BOOST_CHECK_EQUAL(difference.get(8), -26);
+  BOOST_CHECK_EQUAL(difference.get(10), -40);
+}
+
+BOOST_AUTO_TEST_CASE(merge_cancelling)
+{
+  size_t ids[] = {3, 6, 9, 12, 15};
+  FeatureStatsType values[] = {1, 2, 3, 4, 5};
+  SparseVector a = Make(ids, values, 5);
+
+  // Cancelled ids keep their entries, holding 0
+  SparseVector difference(a);
+  difference -= a;
+  BOOST_CHECK_EQUAL(difference.size(), 5);
+  for (size_t i = 0; i < 5; ++i) BOOST_CHECK_EQUAL(difference.get(ids[i]), 0);
+
+  SparseVector sum(a);
+  sum += a;
+  sum -= a;
+  BOOST_CHECK(sum == a);
+}
+
+BOOST_AUTO_TEST_CASE(inner_product_step_and_search)
+{
+  size_t ids[] = {2, 30, 31, 77};
+  FeatureStatsType values[] = {1, 2, 3, 4};
+  SparseVector shortVector = Make(ids, values, 4);
+
+  // Of about the same length, so the product steps through both
+  SparseVector stepVector;
+  stepVector.set(2, 10);
+  stepVector.set(31, 100);
+  stepVector.set(50, 1000);
+  stepVector.set(77, 10000);
+  FeatureStatsType stepExpected = 1 * 10 + 3 * 100 + 4 * 10000;
+  BOOST_CHECK_EQUAL(inner_product(shortVector, stepVector), stepExpected);
+  BOOST_CHECK_EQUAL(inner_product(stepVector, shortVector), stepExpected);
+  BOOST_CHECK_EQUAL(shortVector.inner_product(stepVector), stepExpected);
+
+  // More than eight times longer, so the product searches it
+  SparseVector searchVector;
+  for (size_t id = 0; id < 100; ++id) {
+    searchVector.set(id, static_cast<FeatureStatsType>(id));
+  }
+  FeatureStatsType searchExpected = 1 * 2 + 2 * 30 + 3 * 31 + 4 * 77;
+  BOOST_CHECK_EQUAL(shortVector.inner_product(searchVector), searchExpected);
+  BOOST_CHECK_EQUAL(inner_product(shortVector, searchVector), searchExpected);
+  BOOST_CHECK_EQUAL(inner_product(searchVector, shortVector), searchExpected);
+
+  // Ids past the end of the longer vector
+  SparseVector past;
+  past.set(500, 1);
+  past.set(600, 1);
+  BOOST_CHECK_EQUAL(past.inner_product(searchVector), 0);
+  SparseVector empty;
+  BOOST_CHECK_EQUAL(empty.inner_product(searchVector), 0);
+  BOOST_CHECK_EQUAL(searchVector.inner_product(empty), 0);
+
+  vector<FeatureStatsType> dense(50, 1);
+  BOOST_CHECK_EQUAL(inner_product(shortVector, dense), 1 + 2 + 3);
+}
+
+BOOST_AUTO_TEST_CASE(equality_and_hash)
+{
+  size_t ids[] = {4, 1, 8};
+  FeatureStatsType values[] = {1, 2, 3};
+  SparseVector a = Make(ids, values, 3);
+
+  size_t sortedIds[] = {1, 4, 8};
+  FeatureStatsType sortedValues[] = {2, 1, 3};
+  SparseVector b = Make(sortedIds, sortedValues, 3);
+  BOOST_CHECK(a == b);
+  BOOST_CHECK_EQUAL(hash_value(a), hash_value(b));
+
+  SparseVector differentValue(b);
+  differentValue.set(8, 4);
+  BOOST_CHECK(!(a == differentValue));
+  BOOST_CHECK(hash_value(a) != hash_value(differentValue));
+
+  SparseVector differentId = Make(ids, values, 2);
+  differentId.set(9, 3);
+  BOOST_CHECK(!(a == differentId));
+  BOOST_CHECK(hash_value(a) != hash_value(differentId));
+
+  SparseVector shorter = Make(ids, values, 2);
+  BOOST_CHECK(!(a == shorter));
+  BOOST_CHECK(!(shorter == a));
+
+  BOOST_CHECK(SparseVector() == SparseVector());
+  BOOST_CHECK_EQUAL(hash_value(SparseVector()), hash_value(SparseVector()));
+}
@@ -0,0 +1,78 @@
+#include "SparseWeightTable.h"
+
+using namespace std;
+
+namespace
+{
+// Buckets when the first weight is added
+const size_t kInitialBuckets = 64;
+} // namespace
+
+namespace MosesTuning
+{
+
+
+const size_t SparseWeightTable::kNoId;
+
+SparseWeightTable::SparseWeightTable() : m_size(0) {}
+
+SparseWeightTable::SparseWeightTable(const SparseWeightTable& other)
+  : m_buckets(other.m_buckets), m_size(other.m_size)
+{
+  Attach();
+}
+
+SparseWeightTable& SparseWeightTable::operator=(const SparseWeightTable& other)
+{
+  m_buckets = other.m_buckets;
+  m_size = other.m_size;
+  Attach();
+  return *this;
+}
+
+void SparseWeightTable::Attach()
+{
+  // The table counts its own entries, but only to refuse more than it
+  // has buckets, which doubling at half full never lets happen
+  if (m_buckets.empty()) {
+    m_table = Table();
+  } else {
+    m_table = Table(&m_buckets[0], m_buckets.size() * sizeof(SparseWeight), kNoId);
+  }
+}
+
+const SparseWeight* SparseWeightTable::Find(size_t id) const
+{
+  if (!m_size) return NULL;
+  Table::ConstIterator it;
+  return m_table.Find(id, it) ? it : NULL;
+}
+
+SparseWeight& SparseWeightTable::FindOrInsert(size_t id)
+{
+  if (m_buckets.empty()) {
+    SparseWeight unused;
+    unused.SetKey(kNoId);
+    m_buckets.resize(kInitialBuckets, unused);
+    Attach();
+  } else if (2 * (m_size + 1) > m_buckets.size()) {
+    m_buckets.resize(2 * m_buckets.size());
+    m_table.Double(&m_buckets[0]);
+  }
+  SparseWeight entry;
+  entry.id = id;
+  entry.weight = 0;
+  entry.total = 0;
+  entry.lastUpdated = 0;
+  Table::MutableIterator it;
+  if (!m_table.FindOrInsert(entry, it)) ++m_size;
+  return *it;
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
@@ -0,0 +1,98 @@
+/*
+ * SparseWeightTable.h
+ * kbmira - k-best Batch MIRA
+ *
+ * Weights of sparse features, with their averaging book-keeping, in an
+ * open addressing hash table which doubles as features are added. Memory
+ * is proportional to the number of features seen, not to the largest id.
+ */
+
+#ifndef MERT_SPARSE_WEIGHT_TABLE_H
+#define MERT_SPARSE_WEIGHT_TABLE_H
+
+#include <vector>
+
+#include "util/probing_hash_table.hh"
+
+#include "FeatureStats.h"
+
+namespace MosesTuning
+{
+
+
+typedef FeatureStatsType ValType;
+
+struct SparseWeight {
+  typedef std::size_t Key;
+  Key GetKey() const {
+    return id;
+  }
+  void SetKey(Key to) {
+    id = to;
+  }
+
+  std::size_t id;
+  ValType weight;
+  ValType total;
+  std::size_t lastUpdated;
+};
+
+class SparseWeightTable
+{
+public:
+  // Id of the unused buckets
+  static const std::size_t kNoId = static_cast<std::size_t>(-1);
+
+  SparseWeightTable();
+  SparseWeightTable(const SparseWeightTable& other);
+  SparseWeightTable& operator=(const SparseWeightTable& other);
+
+  /** The entry for id, or NULL if it has none */
+  const SparseWeight* Find(std::size_t id) const;
+
+  /** The entry for id, added with everything 0 if it has none */
+  SparseWeight& FindOrInsert(std::size_t id);
+
+  std::size_t size() const {
+    return m_size;
+  }
+
+  /**
+   * All the buckets, in no particular order. Those with id kNoId are
+   * unused. Only the values, not the ids, may be changed.
+   */
+  std::vector<SparseWeight>& buckets() {
+    return m_buckets;
+  }
+  const std::vector<SparseWeight>& buckets() const {
+    return m_buckets;
+  }
+
+private:
+  // Spreads consecutive ids, which linear probing would otherwise pile up
+  struct Hash {
+    std::size_t operator()(std::size_t id) const {
+      uint64_t x = id;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      return static_cast<std::size_t>(x ^ (x >> 31));
+    }
+  };
+  typedef util::ProbingHashTable<SparseWeight, Hash> Table;
+
+  void Attach();
+
+  std::vector<SparseWeight> m_buckets;
+  Table m_table;
+  std::size_t m_size;
+};
+
+}
+
+#endif // MERT_SPARSE_WEIGHT_TABLE_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -0,0 +1,123 @@
+/*
+ *  SpillingNbestStore.cpp
+ *  mert - Minimum Error Rate Training
+ */
+
+#include "SpillingNbestStore.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "util/exception.hh"
+
+using namespace std;
+
+namespace
+{
+// Sentences are spilled in chunks of about this many bytes
+const uint64_t kChunkBytes = 16 << 20;
+
+uint64_t Padded(uint64_t bytes)
+{
+  return (bytes + 7) & ~static_cast<uint64_t>(7);
+}
+} // namespace
+
+namespace MosesTuning
+{
+
+
+SpillingNbestStore::SpillingNbestStore(size_t numDense, size_t numStats,
+                                       uint64_t budget, const string& scratch)
+  : m_num_dense(numDense),
+    m_num_stats(numStats),
+    m_budget(budget),
+    m_scratch_prefix(scratch),
+    m_num_resident(0),
+    m_spilling(false),
+    m_scratch_size(0)
+{
+  NewWriter();
+}
+
+void SpillingNbestStore::NewWriter()
+{
+  m_writer.reset(new NbestStoreWriter(m_num_dense, m_num_stats));
+}
+
+void SpillingNbestStore::AddHypothesis(const MiraFeatureView& features, const ScoreDataView& scores)
+{
+  UTIL_THROW_IF(!m_writer, util::Exception, "Adding to a finished store");
+  m_writer->AddHypothesis(features, scores);
+}
+
+void SpillingNbestStore::EndSentence()
+{
+  UTIL_THROW_IF(!m_writer, util::Exception, "Adding to a finished store");
+  m_writer->EndSentence();
+  if (!m_spilling) {
+    m_store_of.push_back(0);
+    ++m_num_resident;
+    if (m_budget && m_writer->bytes() > m_budget) {
+      // The sentences so far stay in memory, the rest are spilled
+      string buffer;
+      m_writer->Write(&buffer, true);
+      NewWriter();
+      m_stores.push_back(new NbestStore(&buffer, true));
+      m_first.push_back(0);
+      m_spilling = true;
+    }
+  } else {
+    m_store_of.push_back(m_stores.size() + m_chunks.size());
+    if (m_writer->bytes() > min(m_budget, kChunkBytes)) Spill();
+  }
+}
+
+void SpillingNbestStore::Spill()
+{
+  if (!m_writer->num_sentences()) return;
+  m_first.push_back(m_store_of.size() - m_writer->num_sentences());
+  string chunk;
+  m_writer->Write(&chunk, true);
+  NewWriter();
+  if (m_scratch.get() == -1) {
+    string prefix(m_scratch_prefix);
+    util::NormalizeTempPrefix(prefix);
+    m_scratch.reset(util::MakeTemp(prefix));
+  }
+  m_chunks.push_back(make_pair(m_scratch_size, static_cast<uint64_t>(chunk.size())));
+  chunk.append(Padded(chunk.size()) - chunk.size(), '\0');
+  util::WriteOrThrow(m_scratch.get(), chunk.data(), chunk.size());
+  m_scratch_size += chunk.size();
+}
+
+void SpillingNbestStore::Finish()
+{
+  UTIL_THROW_IF(!m_writer, util::Exception, "Store already finished");
+  if (!m_spilling) {
+    string buffer;
+    m_writer->Write(&buffer, true);
+    m_writer.reset();
+    m_stores.push_back(new NbestStore(&buffer, true));
+    m_first.push_back(0);
+    return;
+  }
+  Spill();
+  m_writer.reset();
+  if (m_chunks.empty()) return;
+  util::MapRead(util::LAZY, m_scratch.get(), 0, m_scratch_size, m_mapped);
+  const char* data = static_cast<const char*>(m_mapped.get());
+  for (size_t i = 0; i < m_chunks.size(); ++i) {
+    ostringstream name;
+    name << "chunk " << i << " of the scratch file";
+    m_stores.push_back(new NbestStore(data + m_chunks[i].first, m_chunks[i].second, name.str(), true));
+  }
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
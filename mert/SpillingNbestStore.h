@@ -0,0 +1,114 @@
+/*
+ *  SpillingNbestStore.h
+ *  mert - Minimum Error Rate Training
+ *
+ *  N-best lists built in memory up to a budget. The sentences that do
+ *  not fit are written in chunks to an unlinked scratch file, which is
+ *  mapped once all are added, so the operating system pages them in
+ *  as they are used.
+ */
+
+#ifndef MERT_SPILLING_NBEST_STORE_H
+#define MERT_SPILLING_NBEST_STORE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "util/file.hh"
+#include "util/mmap.hh"
+
+#include "NbestStore.h"
+
+namespace MosesTuning
+{
+
+
+/**
+ * Add all hypotheses, then call Finish before reading. Reading is safe
+ * from several threads. The stores never leave this process, so are
+ * written without a feature name table.
+ */
+class SpillingNbestStore : boost::noncopyable
+{
+public:
+  /**
+   * \param budget  Bytes of hypotheses to keep in memory, 0 for no limit
+   * \param scratch Prefix of the scratch file, as for util::MakeTemp
+   */
+  SpillingNbestStore(std::size_t numDense, std::size_t numStats,
+                     uint64_t budget, const std::string& scratch);
+
+  void AddHypothesis(const MiraFeatureView& features, const ScoreDataView& scores);
+  void EndSentence();
+  void Finish();
+
+  std::size_t num_sentences() const {
+    return m_store_of.size();
+  }
+  std::size_t num_dense() const {
+    return m_num_dense;
+  }
+  std::size_t num_stats() const {
+    return m_num_stats;
+  }
+  /** Sentences held in memory, rather than in the scratch file */
+  std::size_t num_resident() const {
+    return m_num_resident;
+  }
+
+  std::size_t size(std::size_t sentence) const {
+    return m_stores[m_store_of[sentence]].size(sentence - m_first[m_store_of[sentence]]);
+  }
+  MiraFeatureView featuresAt(std::size_t sentence, std::size_t i) const {
+    std::size_t s = m_store_of[sentence];
+    return m_stores[s].featuresAt(sentence - m_first[s], i);
+  }
+  ScoreDataView scoresAt(std::size_t sentence, std::size_t i) const {
+    std::size_t s = m_store_of[sentence];
+    return m_stores[s].scoresAt(sentence - m_first[s], i);
+  }
+  MiraFeatureBlock block(std::size_t sentence) const {
+    std::size_t s = m_store_of[sentence];
+    return m_stores[s].block(sentence - m_first[s]);
+  }
+
+private:
+  void NewWriter();
+  void Spill();
+
+  std::size_t m_num_dense;
+  std::size_t m_num_stats;
+  uint64_t m_budget;
+  std::string m_scratch_prefix;
+
+  // Sentences being added, not yet in a store
+  boost::scoped_ptr<NbestStoreWriter> m_writer;
+  std::size_t m_num_resident;
+  bool m_spilling;
+
+  util::scoped_fd m_scratch;
+  uint64_t m_scratch_size;
+  // Offset and size of each chunk in the scratch file
+  std::vector<std::pair<uint64_t, uint64_t> > m_chunks;
+  util::scoped_memory m_mapped;
+
+  // The resident store, if any, then one for each chunk
+  boost::ptr_vector<NbestStore> m_stores;
+  std::vector<std::size_t> m_first; // First sentence in each store
+  std::vector<std::size_t> m_store_of; // Store holding each sentence
+};
+
+}
+
+#endif // MERT_SPILLING_NBEST_STORE_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
@@ -0,0 +1,65 @@
+#include <stdexcept>
+
+#include "WorkerPool.h"
+
+using namespace std;
+
+namespace MosesTuning
+{
+
+
+WorkerPool::WorkerPool(size_t threads)
+  : m_threads(threads ? threads : 1),
+    m_pending(0)
+{
+  if (m_threads > 1) {
+    m_pool.reset(new util::ThreadPool<Handler>(m_threads * 2, m_threads, Handler(*this), NULL));
+  }
+}
+
+void WorkerPool::Run(const vector<WorkerTask*>& tasks)
+{
+  if (!m_pool) {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      tasks[i]->Run();
+    }
+    return;
+  }
+  {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    m_pending += tasks.size();
+    m_error.clear();
+  }
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    m_pool->Produce(tasks[i]);
+  }
+  string error;
+  {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_pending) m_done.wait(lock);
+    error.swap(m_error);
+  }
+  // The worker threads would abort on it, so it is carried back here
+  if (!error.empty()) throw runtime_error(error);
+}
+
+bool WorkerPool::Failed()
+{
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  return !m_error.empty();
+}
+
+void WorkerPool::Finished(const string& error)
+{
+  boost::unique_lock<boost::mutex> lock(m_mutex);
+  if (m_error.empty()) m_error = error;
+  if (--m_pending == 0) m_done.notify_all();
+}
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
+
+}
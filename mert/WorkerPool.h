@@ -0,0 +1,103 @@
+/*
+ * WorkerPool.h
+ * kbmira - k-best Batch MIRA
+ *
+ * Runs batches of independent tasks on a fixed set of
+ * threads, and waits for each batch to complete.
+ */
+
+#ifndef MERT_WORKER_POOL_H
+#define MERT_WORKER_POOL_H
+
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "util/thread_pool.hh"
+
+namespace MosesTuning
+{
+
+
+/** A unit of work for a WorkerPool */
+class WorkerTask
+{
+public:
+  virtual ~WorkerTask() {}
+  virtual void Run() = 0;
+};
+
+class WorkerPool : boost::noncopyable
+{
+public:
+  /**
+   * \param threads Number of worker threads. With 0 or 1, tasks
+   *                are run in the calling thread.
+   */
+  explicit WorkerPool(std::size_t threads);
+
+  /**
+   * Run all the tasks, returning once every one has completed.
+   * Tasks must not depend on each other. If a task throws, the tasks
+   * not yet started are skipped, and the first exception's message is
+   * thrown again here, as a std::runtime_error when on threads.
+   */
+  void Run(const std::vector<WorkerTask*>& tasks);
+
+  std::size_t Size() const {
+    return m_threads;
+  }
+
+private:
+  class Handler
+  {
+  public:
+    typedef WorkerTask* Request;
+
+    explicit Handler(WorkerPool& owner) : m_owner(owner) {}
+
+    void operator()(WorkerTask* task) {
+      std::string error;
+      if (!m_owner.Failed()) {
+        try {
+          task->Run();
+        } catch (const std::exception& e) {
+          error = e.what();
+          if (error.empty()) error = "Task threw an exception";
+        } catch (...) {
+          error = "Task threw an exception";
+        }
+      }
+      m_owner.Finished(error);
+    }
+
+  private:
+    WorkerPool& m_owner;
+  };
+
+  bool Failed();
+  // Record the end of a task, with the message it threw, if any
+  void Finished(const std::string& error);
+
+  std::size_t m_threads;
+  std::size_t m_pending;
+  // Message of the first exception thrown in this Run, empty if none
+  std::string m_error;
+  boost::mutex m_mutex;
+  boost::condition_variable m_done;
+  boost::scoped_ptr<util::ThreadPool<Handler> > m_pool;
+};
+
+}
+
+#endif // MERT_WORKER_POOL_H
+
+// --Emacs trickery--
+// Local Variables:
+// mode:c++
+// c-basic-offset:2
+// End:
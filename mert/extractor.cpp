@@ -39,6 +39,7 @@ void usage()
   cerr << "[--factors|-f] list of factors passed to the scorer (e.g. 0|2)" << endl;
   cerr << "[--filter|-l] filter command used to preprocess the sentences" << endl;
   cerr << "[--allow-duplicates|-d] omit the duplicate removal step" << endl;
+  cerr << "[--store|-B] also write features and scores to this binary n-best store" << endl;
   cerr << "[-v] verbose level" << endl;
   cerr << "[--help|-h] print this message and exit" << endl;
   exit(1);
@@ -59,6 +60,7 @@ static struct option long_options[] = {
   {"verbose", required_argument, 0, 'v'},
   {"help", no_argument, 0, 'h'},
   {"allow-duplicates", no_argument, 0, 'd'},
+  {"store", required_argument, 0, 'B'},
   {0, 0, 0, 0}
 };
 
@@ -74,6 +76,7 @@ struct ProgramOption {
   string featureDataFile;
   string prevScoreDataFile;
   string prevFeatureDataFile;
+  string storeFile;
   bool binmode;
   bool allowDuplicates;
   int verbosity;
@@ -89,6 +92,7 @@ struct ProgramOption {
       featureDataFile("features.data"),
       prevScoreDataFile(""),
       prevFeatureDataFile(""),
+      storeFile(""),
       binmode(false),
       allowDuplicates(false),
       verbosity(0) { }
@@ -99,7 +103,7 @@ void ParseCommandOptions(int argc, char** argv, ProgramOption* opt)
   int c;
   int option_index;
 
-  while ((c = getopt_long(argc, argv, "s:r:f:l:n:S:F:R:E:v:hbd", long_options, &option_index)) != -1) {
+  while ((c = getopt_long(argc, argv, "s:r:f:l:n:S:F:R:E:B:v:hbd", long_options, &option_index)) != -1) {
     switch (c) {
     case 's':
       opt->scorerType = string(optarg);
@@ -134,6 +138,9 @@ void ParseCommandOptions(int argc, char** argv, ProgramOption* opt)
     case 'R':
       opt->prevScoreDataFile = string(optarg);
       break;
+    case 'B':
+      opt->storeFile = string(optarg);
+      break;
     case 'v':
       opt->verbosity = atoi(optarg);
       break;
@@ -239,6 +246,9 @@ int main(int argc, char** argv)
     //END_ADDED
 
     data.save(option.featureDataFile, option.scoreDataFile, option.binmode);
+    if (!option.storeFile.empty()) {
+      data.saveStore(option.storeFile);
+    }
     PrintUserTime("Stopping...");
 
     return EXIT_SUCCESS;
@@ -0,0 +1,230 @@
+/**
+ * Benchmark of Graph::Prune on a directory of hypergraphs. Compares it
+ * with the implementation on maps and sets which it replaced, and checks
+ * that both keep the same vertices and edges. Also times FrozenGraph::Prune,
+ * which Graph::Prune freezes and thaws around.
+ **/
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_piece.hh"
+
+#include "Hypergraph.h"
+#include "HypergraphStore.h"
+#include "Timer.h"
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+/** Graph::Prune as it was, keyed on edge pointers */
+void MapPrune(const Graph& graph, Graph* pNewGraph, const SparseVector& weights, size_t minEdgeCount)
+{
+  Graph& newGraph = *pNewGraph;
+  map<const Edge*, FeatureStatsType> edgeBackwardScores;
+  map<const Edge*, size_t> edgeHeads;
+  vector<FeatureStatsType> vertexBackwardScores(graph.VertexSize(), kMinScore);
+  vector<vector<const Edge*> > outgoing(graph.VertexSize());
+
+  for (size_t vi = 0; vi < graph.VertexSize(); ++vi) {
+    const vector<const Edge*>& incoming = graph.GetVertex(vi).GetIncoming();
+    if (!incoming.size()) {
+      vertexBackwardScores[vi] = 0;
+    } else {
+      for (size_t ei = 0; ei < incoming.size(); ++ei) {
+        edgeHeads[incoming[ei]]= vi;
+        FeatureStatsType incomingScore = incoming[ei]->GetScore(weights);
+        for (size_t i = 0; i < incoming[ei]->Children().size(); ++i) {
+          size_t childId = incoming[ei]->Children()[i];
+          outgoing[childId].push_back(incoming[ei]);
+          incomingScore += vertexBackwardScores[childId];
+        }
+        edgeBackwardScores[incoming[ei]]= incomingScore;
+        if (incomingScore > vertexBackwardScores[vi]) vertexBackwardScores[vi] = incomingScore;
+      }
+    }
+  }
+
+  vector<FeatureStatsType> vertexForwardScores(graph.VertexSize(), kMinScore);
+  map<const Edge*, FeatureStatsType> edgeForwardScores;
+  for (size_t i = 1; i <= graph.VertexSize(); ++i) {
+    size_t vi = graph.VertexSize() - i;
+    if (!outgoing[vi].size()) {
+      vertexForwardScores[vi] = 0;
+    } else {
+      for (size_t ei = 0; ei < outgoing[vi].size(); ++ei) {
+        FeatureStatsType outgoingScore = 0;
+        for (size_t i = 0; i < outgoing[vi][ei]->Children().size(); ++i) {
+          size_t siblingId = outgoing[vi][ei]->Children()[i];
+          if (siblingId != vi) {
+            outgoingScore += vertexBackwardScores[siblingId];
+          }
+        }
+        outgoingScore += vertexForwardScores[edgeHeads[outgoing[vi][ei]]];
+        edgeForwardScores[outgoing[vi][ei]] = outgoingScore;
+        outgoingScore += outgoing[vi][ei]->GetScore(weights);
+        if (outgoingScore > vertexForwardScores[vi]) vertexForwardScores[vi] = outgoingScore;
+      }
+    }
+  }
+
+  multimap<FeatureStatsType, const Edge*> edgeScores;
+  for (size_t i = 0; i < graph.EdgeSize(); ++i) {
+    const Edge* edge = &(graph.GetEdge(i));
+    if (edgeForwardScores.find(edge) == edgeForwardScores.end()) {
+      edgeForwardScores[edge] = vertexForwardScores[edgeHeads[edge]];
+    }
+    FeatureStatsType score = edgeForwardScores[edge] + edgeBackwardScores[edge];
+    edgeScores.insert(pair<FeatureStatsType, const Edge*>(score,edge));
+  }
+
+  multimap<FeatureStatsType, const Edge*>::const_reverse_iterator ei = edgeScores.rbegin();
+  size_t edgeCount = 1;
+  while(edgeCount < minEdgeCount && ei != edgeScores.rend()) {
+    ++ei;
+    ++edgeCount;
+  }
+  multimap<FeatureStatsType, const Edge*>::const_iterator lowest = edgeScores.begin();
+  if (ei != edgeScores.rend())  lowest = edgeScores.lower_bound(ei->first);
+
+  set<size_t> retainedVertices;
+  set<const Edge*> retainedEdges;
+  for (; lowest != edgeScores.end(); ++lowest) {
+    retainedEdges.insert(lowest->second);
+    retainedVertices.insert(edgeHeads[lowest->second]);
+    for (size_t i = 0; i < lowest->second->Children().size(); ++i) {
+      retainedVertices.insert(lowest->second->Children()[i]);
+    }
+  }
+  newGraph.SetCounts(retainedVertices.size(), retainedEdges.size());
+
+  // The new graph's vertices can't be reached once made, so they are
+  // made after the edges, each with the edges it had
+  map<size_t,size_t> oldIdToNew;
+  size_t vi = 0;
+  for (set<size_t>::const_iterator i = retainedVertices.begin(); i != retainedVertices.end(); ++i, ++vi) {
+    oldIdToNew[*i] = vi;
+  }
+  vector<vector<Edge*> > newIncoming(retainedVertices.size());
+  for (set<const Edge*>::const_iterator i = retainedEdges.begin(); i != retainedEdges.end(); ++i) {
+    Edge* newEdge = newGraph.NewEdge();
+    const Edge* oldEdge = *i;
+    for (size_t j = 0; j < oldEdge->Words().size(); ++j) {
+      newEdge->AddWord(oldEdge->Words()[j]);
+    }
+    for (size_t j = 0; j < oldEdge->Children().size(); ++j) {
+      newEdge->AddChild(oldIdToNew[oldEdge->Children()[j]]);
+    }
+    newEdge->SetFeatures(oldEdge->Features());
+    newIncoming[oldIdToNew[edgeHeads[oldEdge]]].push_back(newEdge);
+  }
+  for (set<size_t>::const_iterator i = retainedVertices.begin(); i != retainedVertices.end(); ++i) {
+    Vertex* vertex = newGraph.NewVertex();
+    vertex->SetSourceCovered(graph.GetVertex(*i).SourceCovered());
+    const vector<Edge*>& incoming = newIncoming[oldIdToNew[*i]];
+    for (size_t j = 0; j < incoming.size(); ++j) vertex->AddEdge(incoming[j]);
+  }
+}
+
+bool SameGraph(const Graph& a, const Graph& b)
+{
+  if (a.VertexSize() != b.VertexSize() || a.EdgeSize() != b.EdgeSize()) return false;
+  for (size_t v = 0; v < a.VertexSize(); ++v) {
+    const Vertex& va = a.GetVertex(v);
+    const Vertex& vb = b.GetVertex(v);
+    if (va.SourceCovered() != vb.SourceCovered()) return false;
+    if (va.GetIncoming().size() != vb.GetIncoming().size()) return false;
+    for (size_t i = 0; i < va.GetIncoming().size(); ++i) {
+      if (a.EdgeIndex(va.GetIncoming()[i]) != b.EdgeIndex(vb.GetIncoming()[i])) return false;
+    }
+  }
+  for (size_t e = 0; e < a.EdgeSize(); ++e) {
+    const Edge& ea = a.GetEdge(e);
+    const Edge& eb = b.GetEdge(e);
+    if (ea.Words() != eb.Words() || ea.Children() != eb.Children() || !(*ea.Features() == *eb.Features())) return false;
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  if (argc > 5) {
+    cerr << "Usage: " << argv[0] << " [hgdir [weights [edges [repeats]]]]" << endl;
+    return 1;
+  }
+  string hgDir = argc > 1 ? argv[1] : "test_data/hypergraph";
+  string weightsFile = argc > 2 ? argv[2] : "test_data/weights";
+  size_t edgeCount = argc > 3 ? atoi(argv[3]) : 1000;
+  size_t repeats = argc > 4 ? atoi(argv[4]) : 5;
+
+  SparseVector weights;
+  weights.load(weightsFile);
+
+  Vocab vocab;
+  boost::ptr_vector<Graph> graphs;
+  size_t edges = 0;
+  fs::directory_iterator dend;
+  for (fs::directory_iterator di(hgDir); di != dend; ++di) {
+    if (di->path().filename() == "weights") continue;
+    graphs.push_back(new Graph(vocab));
+    const string path = di->path().string();
+    if (HypergraphStore::IsStore(path)) {
+      HypergraphStore(path).Load(&graphs.back());
+    } else {
+      util::FilePiece file(util::OpenReadOrThrow(path.c_str()));
+      ReadGraph(file, graphs.back());
+    }
+    edges += graphs.back().EdgeSize();
+  }
+  cout << graphs.size() << " hypergraphs with " << edges << " edges, pruned to " << edgeCount
+       << " edges, " << repeats << " repeats" << endl;
+
+  double seconds[3] = {0, 0, 0};
+  size_t kept = 0;
+  for (size_t i = 0; i < graphs.size(); ++i) {
+    FrozenGraph frozen;
+    frozen.Freeze(graphs[i]);
+    for (size_t r = 0; r < repeats; ++r) {
+      Graph byMap(vocab), byArray(vocab);
+      Timer timer;
+      timer.start();
+      MapPrune(graphs[i], &byMap, weights, edgeCount);
+      seconds[0] += timer.get_elapsed_wall_time();
+      timer.restart();
+      graphs[i].Prune(&byArray, weights, edgeCount);
+      seconds[1] += timer.get_elapsed_wall_time();
+      FrozenGraph frozenPruned;
+      timer.restart();
+      frozen.Prune(&frozenPruned, weights, edgeCount);
+      seconds[2] += timer.get_elapsed_wall_time();
+      UTIL_THROW_IF(!SameGraph(byMap, byArray), util::Exception,
+                    "Pruning graph " << i << " kept different vertices or edges");
+      if (!r) kept += byArray.EdgeSize();
+    }
+  }
+  const char* names[] = {"maps and sets", "Graph::Prune", "FrozenGraph::Prune"};
+  for (size_t i = 0; i < 3; ++i) {
+    cout << setw(20) << left << names[i] << setw(10) << right << fixed << setprecision(1)
+         << seconds[i] * 1e9 / (repeats * edges) << " ns/edge " << setw(6) << setprecision(2)
+         << seconds[0] / seconds[i] << "x" << endl;
+  }
+  cout << "Both kept the same " << kept << " edges" << endl;
+  return 0;
+}
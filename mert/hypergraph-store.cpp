@@ -0,0 +1,115 @@
+/**
+ * Convert a directory of text hypergraphs, as read by kbmira --hgdir,
+ * into binary hypergraph stores that kbmira can map instead of parse.
+ * The weights file, if there is one, is copied across unchanged.
+ **/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_piece.hh"
+
+#include "Hypergraph.h"
+#include "HypergraphStore.h"
+#include "Util.h"
+#include "WorkerPool.h"
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+class ConvertTask : public WorkerTask
+{
+public:
+  ConvertTask(const fs::path& from, const fs::path& to) : m_from(from), m_to(to) {}
+
+  void Run() {
+    Vocab vocab;
+    Graph graph(vocab);
+    GraphFeatures features;
+    util::FilePiece file(util::OpenReadOrThrow(m_from.string().c_str()));
+    ReadGraph(file, graph, &features);
+    HypergraphStore::Write(graph, &features, m_to.string());
+  }
+
+private:
+  fs::path m_from;
+  fs::path m_to;
+};
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  ResetUserTime();
+
+  bool help;
+  string hgDir;
+  string outputDir;
+  size_t threads = 1;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+  ("help,h", po::value(&help)->zero_tokens()->default_value(false), "Print this help message and exit")
+  ("hgdir,H", po::value<string>(&hgDir), "Directory containing text hypergraphs")
+  ("output-dir,o", po::value<string>(&outputDir), "Directory to write the stores to, one per hypergraph")
+  ("threads", po::value<size_t>(&threads), "Number of hypergraphs to convert at once (default 1)")
+  ;
+
+  po::options_description cmdline_options;
+  cmdline_options.add(desc);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc,argv).
+            options(cmdline_options).run(), vm);
+  po::notify(vm);
+  if (help) {
+    cout << "Usage: " + string(argv[0]) +  " [options]" << endl;
+    cout << desc << endl;
+    exit(0);
+  }
+
+  if (hgDir.empty() || outputDir.empty()) {
+    cerr << "Error: Give both a hypergraph directory and an output directory" << endl;
+    exit(1);
+  }
+
+  try {
+    UTIL_THROW_IF(!fs::is_directory(hgDir), util::Exception, "Directory '" << hgDir << "' does not exist");
+    fs::create_directories(outputDir);
+    // Stores are named by the id kbmira takes from the file name
+    static const string kWeights = "weights";
+    boost::ptr_vector<ConvertTask> tasks;
+    fs::directory_iterator dend;
+    for (fs::directory_iterator di(hgDir); di != dend; ++di) {
+      if (di->path().filename() == kWeights) {
+        fs::copy_file(di->path(), fs::path(outputDir) / kWeights, fs::copy_option::overwrite_if_exists);
+        continue;
+      }
+      fs::path to = fs::path(outputDir) / (di->path().stem().string() + ".hg");
+      tasks.push_back(new ConvertTask(di->path(), to));
+    }
+    vector<WorkerTask*> run;
+    for (size_t i = 0; i < tasks.size(); ++i) run.push_back(&tasks[i]);
+    WorkerPool pool(threads);
+    pool.Run(run);
+    cerr << "Converted " << tasks.size() << " hypergraphs" << endl;
+    PrintUserTime("Stopping...");
+  } catch (const exception& e) {
+    cerr << "Exception: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -31,26 +31,213 @@ de recherches du Canada
 #include <ctime>
 #include <cassert>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <utility>
 #include <algorithm>
 
 #include <boost/program_options.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/random_number_generator.hpp>
 #include <boost/scoped_ptr.hpp>
 
 #include "util/exception.hh"
 
 #include "BleuScorer.h"
+#include "FeatureRegistry.h"
 #include "HopeFearDecoder.h"
+#include "MiraCheckpoint.h"
 #include "MiraFeatureVector.h"
 #include "MiraWeightVector.h"
+#include "NbestPool.h"
+#include "SparseFeatureCounts.h"
+#include "Timer.h"
+#include "WorkerPool.h"
 
 using namespace std;
 using namespace MosesTuning;
 
 namespace po = boost::program_options;
 
+/** Totals for the training epoch summary */
+struct EpochStats {
+  EpochStats() : examples(0), updates(0), totalLoss(0) {}
+  int examples;
+  int updates;
+  ValType totalLoss;
+};
+
+/**
+  * Apply the MIRA update for one sentence's hope and fear, then
+  * decay the background BLEU corpus and add this sentence to it
+  **/
+static void MiraUpdate(const HopeFearData& hfd, float c, float decay, bool model_bg,
+                       bool verbose, size_t sentenceIndex, MiraWeightVector* wv,
+                       vector<ValType>* bg, EpochStats* stats)
+{
+  // Update weights
+  if (!hfd.hopeFearEqual && hfd.hopeBleu  > hfd.fearBleu) { 
+    // Bleu difference
+    //assert(hfd.hopeBleu + 1e-8 >= hfd.fearBleu);
+    ValType delta = hfd.hopeBleu - hfd.fearBleu;
+    // Loss and update, straight from hope and fear without the difference vector
+    ValType diff_score, diff_sqrNorm;
+    wv->scoreDiff(hfd.hopeFeatures, hfd.fearFeatures, &diff_score, &diff_sqrNorm);
+    ValType loss = delta - diff_score;
+    if(verbose) {
+      MiraFeatureVector hope(hfd.hopeFeatures), fear(hfd.fearFeatures);
+      cerr << "Updating sent " << sentenceIndex << endl;
+      cerr << "Wght: " << *wv << endl;
+      cerr << "Hope: " << hope << " BLEU:" << hfd.hopeBleu << " Score:" << wv->score(hope) << endl;
+      cerr << "Fear: " << fear << " BLEU:" << hfd.fearBleu << " Score:" << wv->score(fear) << endl;
+      cerr << "Diff: " << (hope - fear) << " BLEU:" << delta << " Score:" << diff_score << endl;
+      cerr << "Loss: " << loss <<  " Scale: " << 1 << endl;
+      cerr << endl;
+    }
+    if(loss > 0) {
+      ValType eta = min(c, loss / diff_sqrNorm);
+      wv->update(hfd.hopeFeatures,hfd.fearFeatures,eta);
+      stats->totalLoss+=loss;
+      stats->updates++;
+    }
+    // Update BLEU statistics
+    for(size_t k=0; k<bg->size(); k++) {
+      (*bg)[k]*=decay;
+      if(model_bg)
+        (*bg)[k]+=hfd.modelStats[k];
+      else
+        (*bg)[k]+=hfd.hopeStats[k];
+    }
+  }
+  stats->examples++;
+}
+
+/**
+ * Write the weight of a sparse feature, once under each name it has, as
+ * hashed names which collided share it
+ */
+static void WriteSparseWeight(ostream& out, const FeatureRegistry& registry, size_t id, ValType weight)
+{
+  const vector<string> names = registry.DecodeAll(id);
+  for (size_t i = 0; i < names.size(); ++i) {
+    out << names[i] << " " << weight << endl;
+  }
+}
+
+/** Write averaged weights to outputFile, or to stdout if it is empty */
+static void WriteWeights(const AvgWeightVector& avg, size_t initDenseSize, const string& outputFile)
+{
+  ostream* out;
+  ofstream outFile;
+  if (!outputFile.empty() ) {
+    outFile.open(outputFile.c_str());
+    if (!(outFile)) {
+      cerr << "Error: Failed to open " << outputFile << endl;
+      exit(1);
+    }
+    out = &outFile;
+  } else {
+    out = &cout;
+  }
+  // Only features which have not been dropped
+  const FeatureRegistry& registry = FeatureRegistry::Instance();
+  const vector<ValType>& dense = avg.dense();
+  for(size_t i=0; i<dense.size(); i++) {
+    if(i<initDenseSize)
+      *out << "F" << i << " " << dense[i] << endl;
+    else {
+      if(abs(dense[i])>1e-8 && !registry.Dropped(i-initDenseSize))
+        WriteSparseWeight(*out, registry, i-initDenseSize, dense[i]);
+    }
+  }
+  // Any in the hash table have ids past those of the dense features
+  const vector<pair<size_t, ValType> >& sparse = avg.sparse();
+  for(size_t i=0; i<sparse.size(); i++) {
+    if(abs(sparse[i].second)>1e-8 && !registry.Dropped(sparse[i].first-initDenseSize))
+      WriteSparseWeight(*out, registry, sparse[i].first-initDenseSize, sparse[i].second);
+  }
+  outFile.close();
+}
+
+/** One setting of the hyperparameters in a sweep, and its result */
+struct SweepConfig {
+  SweepConfig(float c_, float decay_, int seed_, const string& outputFile_) :
+    c(c_), decay(decay_), seed(seed_), outputFile(outputFile_), bestBleu(0), bestEpoch(0) {}
+  float c;
+  float decay;
+  int seed;
+  string outputFile;
+  ValType bestBleu;
+  int bestEpoch;
+};
+
+/**
+  * Trains with one sweep configuration. All configurations share the
+  * decoder's data, but each has its own weights, background and order.
+  **/
+class SweepTask : public WorkerTask
+{
+public:
+  SweepTask(const HopeFearDecoder& decoder, const MiraWeightVector& initWeights,
+            const vector<ValType>& bg, size_t initDenseSize, int n_iters,
+            bool no_shuffle, bool model_bg, size_t configId, SweepConfig* config) :
+    m_decoder(decoder), m_initWeights(initWeights), m_bg(bg), m_initDenseSize(initDenseSize),
+    m_n_iters(n_iters), m_no_shuffle(no_shuffle), m_model_bg(model_bg), m_configId(configId),
+    m_config(config) {}
+
+  virtual void Run() {
+    MiraWeightVector wv(m_initWeights);
+    vector<ValType> bg(m_bg);
+    boost::mt19937 random(m_config->seed);
+    boost::random_number_generator<boost::mt19937> gen(random);
+    vector<size_t> order(m_decoder.NumSentences());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    for (int j = 0; j < m_n_iters; ++j) {
+      if (!m_no_shuffle) random_shuffle(order.begin(), order.end(), gen);
+      EpochStats stats;
+      HopeFearData hfd;
+      for (size_t i = 0; i < order.size(); ++i) {
+        m_decoder.HopeFear(order[i], bg, wv, &hfd);
+        MiraUpdate(hfd, m_config->c, m_config->decay, m_model_bg, false, i, &wv, &bg, &stats);
+      }
+
+      // Evaluate current average weights
+      AvgWeightVector avg = wv.avg();
+      vector<ValType> totals(kBleuNgramOrder*2+1,0);
+      vector<ValType> sent;
+      for (size_t i = 0; i < order.size(); ++i) {
+        m_decoder.MaxModel(i, avg, &sent);
+        for (size_t k = 0; k < sent.size(); ++k) totals[k] += sent[k];
+      }
+      ValType bleu = unsmoothedBleu(totals);
+      // Write whole lines, as other configurations are logging too
+      ostringstream msg;
+      msg << "[" << m_configId << "] " << stats.updates << "/" << stats.examples << " updates"
+          << ", avg loss = " << (stats.totalLoss / stats.examples) << ", BLEU = " << bleu << endl;
+      cerr << msg.str();
+      if (bleu > m_config->bestBleu) {
+        WriteWeights(avg, m_initDenseSize, m_config->outputFile);
+        m_config->bestBleu = bleu;
+        m_config->bestEpoch = j+1;
+      }
+    }
+  }
+
+private:
+  const HopeFearDecoder& m_decoder;
+  const MiraWeightVector& m_initWeights;
+  const vector<ValType>& m_bg;
+  size_t m_initDenseSize;
+  int m_n_iters;
+  bool m_no_shuffle;
+  bool m_model_bg;
+  size_t m_configId;
+  SweepConfig* m_config;
+};
+
 int main(int argc, char** argv)
 {
   bool help;
@@ -67,19 +254,37 @@ int main(int argc, char** argv)
   float decay = 0.999; // Pseudo-corpus decay \gamma
   int n_iters = 60;    // Max epochs J
   bool streaming = false; // Stream all k-best lists?
+  size_t prefetch = 8; // Sentences read ahead when streaming
+  string poolFile; // Accumulate hypotheses across runs in this pool
+  size_t memoryBudget = 0; // Megabytes of n-best lists to hold in memory
+  string scratch = "/tmp/"; // Where to put those that do not fit
   bool no_shuffle = false; // Don't shuffle, even for in memory version
   bool model_bg = false; // Use model for background corpus
   bool verbose = false; // Verbose updates
   bool safe_hope = false; // Model score cannot have more than BLEU_RATIO times more influence than BLEU
+  bool approximateBleu = false; // Approximate log and exp in sentence BLEU
   size_t hgPruning = 50; //prune hypergraphs to have this many edges per reference word 
+  string prunedDir; // Save the pruned hypergraphs here, as stores
+  bool hashSparse = false; // Keep sparse feature weights in a hash table
+  size_t featureHashBits = 0; // Hash sparse feature names into 2^bits ids
+  bool keepFeatureNames = false; // Keep names of hashed features to write weights under
+  size_t minFeatureCount = 0; // Drop sparse features seen less often than this
+  size_t threads = 1; // Threads for hope/fear decoding
+  size_t batchSize = 1; // Sentences decoded against the same weights before updating
+  string checkpointDir; // Save training state here after each epoch
+  bool resume = false; // Continue from the checkpoint in checkpointDir
+  string warmStartDir; // Start from the averaged weights of this checkpoint
+  vector<float> sweepC; // Values of C to sweep over
+  vector<float> sweepDecay; // Values of decay to sweep over
+  vector<int> sweepSeed; // Random seeds to sweep over
 
   // Command-line processing follows pro.cpp
   po::options_description desc("Allowed options");
   desc.add_options()
   ("help,h", po::value(&help)->zero_tokens()->default_value(false), "Print this help message and exit")
   ("type,t", po::value<string>(&type), "Either nbest or hypergraph")
-  ("scfile,S", po::value<vector<string> >(&scoreFiles), "Scorer data files")
-  ("ffile,F", po::value<vector<string> > (&featureFiles), "Feature data files")
+  ("scfile,S", po::value<vector<string> >(&scoreFiles), "Scorer data files, or n-best stores")
+  ("ffile,F", po::value<vector<string> > (&featureFiles), "Feature data files, or n-best stores (given as both feature and scorer file)")
   ("hgdir,H", po::value<string> (&hgDir), "Directory containing hypergraphs")
   ("reference,R", po::value<vector<string> > (&referenceFiles), "Reference files, only required for hypergraph mira")
   ("random-seed,r", po::value<int>(&seed), "Seed for random number generation")
@@ -90,11 +295,29 @@ int main(int argc, char** argv)
   ("dense-init,d", po::value<string>(&denseInitFile), "Weight file for dense features. This should have 'name= value' on each line, or (legacy) should be the Moses mert 'init.opt' format.")
   ("sparse-init,s", po::value<string>(&sparseInitFile), "Weight file for sparse features")
   ("streaming", po::value(&streaming)->zero_tokens()->default_value(false), "Stream n-best lists to save memory, implies --no-shuffle")
+  ("prefetch", po::value<size_t>(&prefetch), "When streaming, read up to this many sentences ahead in the background, 0 to read in turn (default 8)")
+  ("pool", po::value<string>(&poolFile), "Add the feature and scorer files not already in this n-best pool to it, then train on the whole pool")
+  ("memory-budget", po::value<size_t>(&memoryBudget), "Hold at most this many megabytes of n-best lists in memory, and the rest in a scratch file (default 0, no limit)")
+  ("scratch", po::value<string>(&scratch), "Directory or file prefix for the scratch file of --memory-budget (default /tmp/)")
   ("no-shuffle", po::value(&no_shuffle)->zero_tokens()->default_value(false), "Don't shuffle hypotheses before each epoch")
   ("model-bg", po::value(&model_bg)->zero_tokens()->default_value(false), "Use model instead of hope for BLEU background")
   ("verbose", po::value(&verbose)->zero_tokens()->default_value(false), "Verbose updates")
   ("safe-hope", po::value(&safe_hope)->zero_tokens()->default_value(false), "Mode score's influence on hope decoding is limited")
-  ("hg-prune", po::value<size_t>(&hgPruning), "Prune hypergraphs to have this many edges per reference word")
+  ("approximate-bleu", po::value(&approximateBleu)->zero_tokens()->default_value(false), "With n-best lists, compute sentence BLEU with fast approximations of log and exp, which differ from the exact values in the last digits")
+  ("hg-prune", po::value<size_t>(&hgPruning), "Prune hypergraphs to have this many edges per reference word, or 0 not to prune (default 50)")
+  ("save-pruned-hypergraphs", po::value<string>(&prunedDir), "Write the pruned hypergraphs to this directory as binary stores, which a later run can give as --hgdir with --hg-prune 0")
+  ("feature-hash-bits", po::value<size_t>(&featureHashBits), "Hash the names of sparse features into 2^K ids, K at most 24, bounding memory at the price of collisions")
+  ("keep-feature-names", po::value(&keepFeatureNames)->zero_tokens()->default_value(false), "With --feature-hash-bits, remember which names hashed to each id, and write weights under them rather than the ids")
+  ("min-feature-count", po::value<size_t>(&minFeatureCount), "Drop sparse features which occur in fewer than this many hypotheses (or hypergraph edges) before loading the training data")
+  ("hash-sparse-weights", po::value(&hashSparse)->zero_tokens()->default_value(false), "Keep the weights of sparse features in a hash table rather than in arrays indexed by feature id, saving memory when there are very many")
+  ("threads", po::value<size_t>(&threads), "Number of threads for hope/fear decoding, and for reading hypergraphs (default 1)")
+  ("batch-size", po::value<size_t>(&batchSize), "Decode this many sentences in parallel against the same weights, then apply their updates in order (default 1)")
+  ("checkpoint-dir", po::value<string>(&checkpointDir), "Save the training state to this directory after each epoch")
+  ("resume", po::value(&resume)->zero_tokens()->default_value(false), "Resume training from the checkpoint in --checkpoint-dir, if there is one")
+  ("warm-start", po::value<string>(&warmStartDir), "Initialise weights from the averaged weights of the checkpoint in this directory")
+  ("sweep-cparam", po::value<vector<float> >(&sweepC)->multitoken(), "Sweep: train concurrently with each of these C values")
+  ("sweep-decay", po::value<vector<float> >(&sweepDecay)->multitoken(), "Sweep: train concurrently with each of these decay rates")
+  ("sweep-seed", po::value<vector<int> >(&sweepSeed)->multitoken(), "Sweep: train concurrently with each of these random seeds")
   ;
 
   po::options_description cmdline_options;
@@ -110,6 +333,26 @@ int main(int argc, char** argv)
   }
 
   cerr << "kbmira with c=" << c << " decay=" << decay << " no_shuffle=" << no_shuffle << endl;
+  if (batchSize < 1) {
+    cerr << "Error: batch size must be at least 1" << endl;
+    exit(1);
+  }
+  bool sweeping = !sweepC.empty() || !sweepDecay.empty() || !sweepSeed.empty();
+  if (sweeping && outputFile.empty()) {
+    cerr << "Error: a sweep requires --output-file, to name the weight files" << endl;
+    exit(1);
+  }
+  if (sweeping && !checkpointDir.empty()) {
+    cerr << "Error: checkpoints are not supported for sweeps" << endl;
+    exit(1);
+  }
+  if (resume && checkpointDir.empty()) {
+    cerr << "Error: --resume requires --checkpoint-dir" << endl;
+    exit(1);
+  }
+  if (threads > batchSize) {
+    cerr << "WARN: only " << batchSize << " of " << threads << " threads can be used with batch size " << batchSize << endl;
+  }
 
   if (vm.count("random-seed")) {
     cerr << "Initialising random seed to " << seed << endl;
@@ -123,6 +366,7 @@ int main(int argc, char** argv)
   ///
   // Dense
   vector<parameter_t> initParams;
+  size_t denseNames = 0; // Dense features given by name, which have the first ids
   if(!denseInitFile.empty()) {
     ifstream opt(denseInitFile.c_str());
     string buffer;
@@ -172,6 +416,7 @@ int main(int argc, char** argv)
 
 
       //Make sure that SparseVector encodes dense feature names as 0..n-1.
+      denseNames = names.size();
       for (size_t i = 0; i < names.size(); ++i) {
         size_t id = SparseVector::encode(names[i]);
         assert(id == i);     
@@ -183,6 +428,10 @@ int main(int argc, char** argv)
     opt.close();
   }
   size_t initDenseSize = initParams.size();
+  // Dense feature names keep the ids they have been given above
+  if (featureHashBits) {
+    FeatureRegistry::Instance().HashNames(featureHashBits, keepFeatureNames);
+  }
   // Sparse
   if(!sparseInitFile.empty()) {
     if(initDenseSize==0) {
@@ -206,8 +455,27 @@ int main(int argc, char** argv)
     cerr << "Found " << sparseCount << " initial sparse features" << endl;
     opt.close();
   }
+  // Warm start
+  if(!warmStartDir.empty()) {
+    if(initDenseSize==0) {
+      cerr << "warm start requires dense initialization" << endl;
+      exit(3);
+    }
+    cerr << "Initialising weights from checkpoint in " << warmStartDir << endl;
+    LoadAveragedWeights(warmStartDir, initDenseSize, &initParams);
+  }
+  // Every sparse feature id is known, so the weights need never grow,
+  // unless sparse weights go in a hash table anyway
+  if(featureHashBits && initDenseSize && !hashSparse) {
+    initParams.resize(max(initParams.size(), initDenseSize + FeatureRegistry::Instance().size()), 0.0);
+  }
 
-  MiraWeightVector wv(initParams);
+  if(hashSparse && initDenseSize==0) {
+    cerr << "hashing sparse weights requires dense initialization" << endl;
+    exit(3);
+  }
+  size_t denseLimit = hashSparse ? initDenseSize : numeric_limits<size_t>::max();
+  MiraWeightVector wv(initParams, denseLimit);
 
   // Initialize background corpus
   vector<ValType> bg;
@@ -217,73 +485,129 @@ int main(int argc, char** argv)
   }
   bg.push_back(kBleuNgramOrder);
 
+  if (!poolFile.empty()) {
+    UTIL_THROW_IF(type != "nbest" || streaming, util::Exception,
+                  "An n-best pool is only for n-best training in memory");
+    NbestPool pool(poolFile);
+    size_t added = pool.Add(featureFiles, scoreFiles);
+    cerr << "Added " << added << " hypotheses to " << poolFile << ", which now has "
+         << pool.num_segments() << " segments" << endl;
+    featureFiles.assign(1, poolFile);
+    scoreFiles.assign(1, poolFile);
+  }
+
+  if (minFeatureCount > 1) {
+    Timer timer;
+    timer.start();
+    WorkerPool countPool(threads);
+    vector<size_t> counts;
+    if (type == "hypergraph") {
+      CountHypergraphFeatures(hgDir, countPool, &counts);
+    } else {
+      CountNbestFeatures(featureFiles, countPool, &counts);
+    }
+    DroppedFeatures dropped = DropRareFeatures(counts, minFeatureCount, denseNames);
+    size_t savedBytes = dropped.occurrences * (sizeof(size_t) + sizeof(ValType));
+    cerr << "Dropped " << dropped.features << " sparse features seen fewer than " << minFeatureCount
+         << " times, leaving out " << dropped.occurrences << " values (" << (savedBytes >> 10)
+         << " KB), after counting for " << timer.get_elapsed_wall_time() << "s" << endl;
+  }
+
   boost::scoped_ptr<HopeFearDecoder> decoder;
   if (type == "nbest") {
-    decoder.reset(new NbestHopeFearDecoder(featureFiles, scoreFiles, streaming, no_shuffle, safe_hope));
+    decoder.reset(new NbestHopeFearDecoder(featureFiles, scoreFiles, streaming, no_shuffle, safe_hope, prefetch,
+                                           static_cast<uint64_t>(memoryBudget) << 20, scratch, approximateBleu));
   } else if (type == "hypergraph") {
-    decoder.reset(new HypergraphHopeFearDecoder(hgDir, referenceFiles, initDenseSize, streaming, no_shuffle, safe_hope, hgPruning, wv));
+    decoder.reset(new HypergraphHopeFearDecoder(hgDir, referenceFiles, initDenseSize, streaming, no_shuffle, safe_hope, hgPruning, wv, threads, prunedDir));
   } else {
     UTIL_THROW(util::Exception, "Unknown batch mira type: '" << type << "'");
   }
 
-  // Training loop
-  cerr << "Initial BLEU = " << decoder->Evaluate(wv.avg()) << endl;
+  if (sweeping) {
+    // Every combination of the swept values, with the others left as given
+    if (sweepC.empty()) sweepC.push_back(c);
+    if (sweepDecay.empty()) sweepDecay.push_back(decay);
+    if (sweepSeed.empty()) sweepSeed.push_back(vm.count("random-seed") ? seed : rand());
+    vector<SweepConfig> configs;
+    for (size_t ci = 0; ci < sweepC.size(); ++ci) {
+      for (size_t di = 0; di < sweepDecay.size(); ++di) {
+        for (size_t si = 0; si < sweepSeed.size(); ++si) {
+          ostringstream file;
+          file << outputFile << "." << configs.size();
+          configs.push_back(SweepConfig(sweepC[ci], sweepDecay[di], sweepSeed[si], file.str()));
+        }
+      }
+    }
+    UTIL_THROW_IF(decoder->NumSentences() == 0, util::Exception, "Sweeps require random access to the training data, so cannot stream");
+    boost::ptr_vector<SweepTask> tasks;
+    vector<WorkerTask*> taskPtrs;
+    for (size_t i = 0; i < configs.size(); ++i) {
+      tasks.push_back(new SweepTask(*decoder, wv, bg, initDenseSize, n_iters,
+                                    no_shuffle, model_bg, i, &configs[i]));
+      taskPtrs.push_back(&tasks.back());
+    }
+    cerr << "Sweeping " << configs.size() << " configurations" << endl;
+    WorkerPool sweepPool(vm.count("threads") ? threads : configs.size());
+    sweepPool.Run(taskPtrs);
+
+    // Summary table
+    const string summaryFile = outputFile + ".sweep";
+    ofstream summary(summaryFile.c_str());
+    if (!summary) {
+      cerr << "Error: Failed to open " << summaryFile << endl;
+      exit(1);
+    }
+    summary << "config\tC\tdecay\tseed\tbest_bleu\tbest_epoch\tweights" << endl;
+    for (size_t i = 0; i < configs.size(); ++i) {
+      summary << i << "\t" << configs[i].c << "\t" << configs[i].decay << "\t" << configs[i].seed
+              << "\t" << configs[i].bestBleu << "\t" << configs[i].bestEpoch
+              << "\t" << configs[i].outputFile << endl;
+    }
+    cerr << "Sweep results written to " << summaryFile << endl;
+    return 0;
+  }
+
+  WorkerPool pool(threads);
+
+  int firstEpoch = 0;
   ValType bestBleu = 0;
-  for(int j=0; j<n_iters; j++) {
+  if (resume) {
+    MiraTrainingState state;
+    if (LoadCheckpoint(checkpointDir, initDenseSize, &state, &wv, decoder.get())) {
+      firstEpoch = state.epoch;
+      bestBleu = state.bestBleu;
+      bg = state.bg;
+      cerr << "Resuming from checkpoint after epoch " << firstEpoch
+           << ", best BLEU = " << bestBleu << endl;
+    } else {
+      cerr << "No checkpoint in " << checkpointDir << ", starting from the beginning" << endl;
+    }
+  }
+
+  // Training loop
+  if (!firstEpoch) cerr << "Initial BLEU = " << decoder->Evaluate(wv.avg(),pool) << endl;
+  // Kept between batches and epochs, so the hope and fear storage is reused
+  vector<HopeFearData> batch;
+  for(int j=firstEpoch; j<n_iters; j++) {
     // MIRA train for one epoch
-    int iNumExamples = 0;
-    int iNumUpdates = 0;
-    ValType totalLoss = 0.0;
+    EpochStats stats;
     size_t sentenceIndex = 0;
-    for(decoder->reset();!decoder->finished(); decoder->next()) {
-      HopeFearData hfd;
-      decoder->HopeFear(bg,wv,&hfd);
-    
-      // Update weights
-      if (!hfd.hopeFearEqual && hfd.hopeBleu  > hfd.fearBleu) { 
-        // Vector difference
-        MiraFeatureVector diff = hfd.hopeFeatures - hfd.fearFeatures;
-        // Bleu difference
-        //assert(hfd.hopeBleu + 1e-8 >= hfd.fearBleu);
-        ValType delta = hfd.hopeBleu - hfd.fearBleu;
-        // Loss and update
-        ValType diff_score = wv.score(diff);
-        ValType loss = delta - diff_score;
-        if(verbose) {
-          cerr << "Updating sent " << sentenceIndex << endl;
-          cerr << "Wght: " << wv << endl;
-          cerr << "Hope: " << hfd.hopeFeatures << " BLEU:" << hfd.hopeBleu << " Score:" << wv.score(hfd.hopeFeatures) << endl;
-          cerr << "Fear: " << hfd.fearFeatures << " BLEU:" << hfd.fearBleu << " Score:" << wv.score(hfd.fearFeatures) << endl;
-          cerr << "Diff: " << diff << " BLEU:" << delta << " Score:" << diff_score << endl;
-          cerr << "Loss: " << loss <<  " Scale: " << 1 << endl;
-          cerr << endl;
-        }
-        if(loss > 0) {
-          ValType eta = min(c, loss / diff.sqrNorm());
-          wv.update(diff,eta);
-          totalLoss+=loss;
-          iNumUpdates++;
-        }
-        // Update BLEU statistics
-        for(size_t k=0; k<bg.size(); k++) {
-          bg[k]*=decay;
-          if(model_bg)
-            bg[k]+=hfd.modelStats[k];
-          else
-            bg[k]+=hfd.hopeStats[k];
-        }
+    for(decoder->reset();!decoder->finished();) {
+      // Decode a batch against the current weights, then update in order
+      size_t decoded = decoder->HopeFearBatch(bg,wv,batchSize,pool,&batch);
+      for(size_t b=0; b<decoded; b++) {
+        MiraUpdate(batch[b], c, decay, model_bg, verbose, sentenceIndex, &wv, &bg, &stats);
+        ++sentenceIndex;
       }
-      iNumExamples++;
-      ++sentenceIndex;
     }
     // Training Epoch summary
-    cerr << iNumUpdates << "/" << iNumExamples << " updates"
-         << ", avg loss = " << (totalLoss / iNumExamples);
+    cerr << stats.updates << "/" << stats.examples << " updates"
+         << ", avg loss = " << (stats.totalLoss / stats.examples);
 
 
     // Evaluate current average weights
     AvgWeightVector avg = wv.avg();
-    ValType bleu = decoder->Evaluate(avg);
+    ValType bleu = decoder->Evaluate(avg,pool);
     cerr << ", BLEU = " << bleu << endl;
     if(bleu > bestBleu) {
       /*
@@ -294,29 +618,16 @@ int main(int argc, char** argv)
         exit(1);
       }*/
       // Write to a file
-      ostream* out;
-      ofstream outFile;
-      if (!outputFile.empty() ) {
-        outFile.open(outputFile.c_str());
-        if (!(outFile)) {
-          cerr << "Error: Failed to open " << outputFile << endl;
-          exit(1);
-        }
-        out = &outFile;
-      } else {
-        out = &cout;
-      }
-      for(size_t i=0; i<avg.size(); i++) {
-        if(i<initDenseSize)
-          *out << "F" << i << " " << avg.weight(i) << endl;
-        else {
-          if(abs(avg.weight(i))>1e-8)
-            *out << SparseVector::decode(i-initDenseSize) << " " << avg.weight(i) << endl;
-        }
-      }
-      outFile.close();
+      WriteWeights(avg, initDenseSize, outputFile);
       bestBleu = bleu;
     }
+    if (!checkpointDir.empty()) {
+      MiraTrainingState state;
+      state.epoch = j+1;
+      state.bestBleu = bestBleu;
+      state.bg = bg;
+      SaveCheckpoint(checkpointDir, initDenseSize, state, wv, *decoder);
+    }
   }
   cerr << "Best BLEU = " << bestBleu << endl;
 }
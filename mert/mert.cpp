@@ -111,8 +111,8 @@ void usage(int ret)
   cerr<<"[-r] the random seed (defaults to system clock)"<<endl;
   cerr<<"[--sctype|-s] the scorer type (default BLEU)"<<endl;
   cerr<<"[--scconfig|-c] configuration string passed to scorer"<<endl;
-  cerr<<"[--scfile|-S] comma separated list of scorer data files (default score.data)"<<endl;
-  cerr<<"[--ffile|-F] comma separated list of feature data files (default feature.data)"<<endl;
+  cerr<<"[--scfile|-S] comma separated list of scorer data files or n-best stores (default score.data)"<<endl;
+  cerr<<"[--ffile|-F] comma separated list of feature data files or n-best stores (default feature.data)"<<endl;
   cerr<<"[--ifile|-i] the starting point data file (default init.opt)"<<endl;
   cerr<<"[--sparse-weights|-p] required for merging sparse features"<<endl;
 #ifdef WITH_THREADS
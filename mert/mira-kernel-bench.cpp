@@ -0,0 +1,293 @@
+/**
+ * Microbenchmark of the kernels kbmira uses to score hypotheses, on the
+ * hypotheses of an n-best list. Compares the kernels of each instruction
+ * set this machine has with the element by element loop they replaced,
+ * and checks that all give the same results.
+ **/
+
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "BleuScorer.h"
+#include "HypPackEnumerator.h"
+#include "MiraKernels.h"
+#include "MiraWeightVector.h"
+#include "Timer.h"
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace
+{
+
+/** The loop MiraWeightVector::score used before the kernels */
+ValType ElementWiseScore(const vector<ValType>& weights, const MiraFeatureView& fv)
+{
+  ValType toRet = 0.0;
+  for (size_t i = 0; i < fv.size(); i++) {
+    size_t feat = fv.feat(i);
+    toRet += (feat < weights.size() ? weights[feat] : 0) * fv.val(i);
+  }
+  return toRet;
+}
+
+/** The difference as kbmira computed it before: subtract, then score and norm */
+void ElementWiseDiff(const vector<ValType>& weights, const MiraFeatureView& a,
+                     const MiraFeatureView& b, ValType* score, ValType* sqrNorm)
+{
+  MiraFeatureVector diff = MiraFeatureVector(a) - MiraFeatureVector(b);
+  *score = ElementWiseScore(weights, diff.view());
+  *sqrNorm = 0;
+  for (size_t i = 0; i < diff.size(); i++) *sqrNorm += diff.val(i) * diff.val(i);
+}
+
+struct Result {
+  double seconds;
+  double checksum;
+};
+
+template <class Scorer> Result Time(const vector<MiraFeatureView>& hyps, size_t repeats, const Scorer& scorer)
+{
+  Timer timer;
+  timer.start();
+  Result result;
+  result.checksum = 0;
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i + 1 < hyps.size(); ++i) {
+      result.checksum += scorer(hyps[i], hyps[i + 1]);
+    }
+  }
+  result.seconds = timer.get_elapsed_wall_time();
+  return result;
+}
+
+struct OldScore {
+  explicit OldScore(const vector<ValType>& weights) : m_weights(weights) {}
+  ValType operator()(const MiraFeatureView& a, const MiraFeatureView&) const {
+    return ElementWiseScore(m_weights, a);
+  }
+  const vector<ValType>& m_weights;
+};
+
+struct KernelScore {
+  explicit KernelScore(const MiraWeightVector& wv) : m_wv(wv) {}
+  ValType operator()(const MiraFeatureView& a, const MiraFeatureView&) const {
+    return m_wv.score(a);
+  }
+  const MiraWeightVector& m_wv;
+};
+
+struct OldDiff {
+  explicit OldDiff(const vector<ValType>& weights) : m_weights(weights) {}
+  ValType operator()(const MiraFeatureView& a, const MiraFeatureView& b) const {
+    ValType score, sqrNorm;
+    ElementWiseDiff(m_weights, a, b, &score, &sqrNorm);
+    return score + sqrNorm;
+  }
+  const vector<ValType>& m_weights;
+};
+
+// Dense features only, as in the test data
+struct KernelDiff {
+  explicit KernelDiff(const vector<ValType>& weights) : m_weights(weights) {}
+  ValType operator()(const MiraFeatureView& a, const MiraFeatureView& b) const {
+    ValType score, sqrNorm;
+    DiffKernel(&m_weights[0], m_weights.size(), a.dense(), b.dense(), a.num_dense(), &score, &sqrNorm);
+    return score + sqrNorm;
+  }
+  const vector<ValType>& m_weights;
+};
+
+/** Scores every hypothesis of every sentence, and finds the best of each */
+template <class Scorer> Result TimeLists(const RandomAccessHypPackEnumerator& train, size_t repeats,
+                                         const Scorer& scorer)
+{
+  Timer timer;
+  timer.start();
+  Result result;
+  result.checksum = 0;
+  vector<ValType> scores;
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t s = 0; s < train.num_sentences(); ++s) {
+      scorer(train, s, &scores);
+      if (scores.empty()) continue;
+      size_t best = ArgMaxKernel(&scores[0], scores.size());
+      result.checksum += scores[best] + best;
+    }
+  }
+  result.seconds = timer.get_elapsed_wall_time();
+  return result;
+}
+
+/** One hypothesis at a time, as the decoders did before ScoreAll */
+struct EachScore {
+  explicit EachScore(const MiraWeightVector& wv) : m_wv(wv) {}
+  void operator()(const RandomAccessHypPackEnumerator& train, size_t s, vector<ValType>* scores) const {
+    scores->resize(train.size(s));
+    for (size_t i = 0; i < scores->size(); ++i) (*scores)[i] = m_wv.score(train.featuresAt(s, i));
+  }
+  const MiraWeightVector& m_wv;
+};
+
+struct AllScore {
+  explicit AllScore(const MiraWeightVector& wv) : m_wv(wv) {}
+  void operator()(const RandomAccessHypPackEnumerator& train, size_t s, vector<ValType>* scores) const {
+    train.ScoreAll(s, m_wv, scores);
+  }
+  const MiraWeightVector& m_wv;
+};
+
+/** The BLEU statistics of each sentence, statistic by statistic, as the decoder lays them out */
+struct SentenceStats {
+  vector<float> stats;
+  BleuStatsBlock block;
+};
+
+/** Background BLEU of every hypothesis of every sentence, into bleu */
+template <class Bleu> Result TimeBleu(const vector<SentenceStats>& sentences, const vector<float>& bg,
+                                      size_t repeats, const Bleu& bleu, vector<float>* out)
+{
+  Timer timer;
+  timer.start();
+  Result result;
+  result.checksum = 0;
+  for (size_t r = 0; r < repeats; ++r) {
+    float* o = &(*out)[0];
+    for (size_t s = 0; s < sentences.size(); ++s) {
+      bleu(sentences[s].block, bg, o);
+      o += sentences[s].block.size;
+    }
+  }
+  result.seconds = timer.get_elapsed_wall_time();
+  for (size_t i = 0; i < out->size(); ++i) result.checksum += (*out)[i];
+  return result;
+}
+
+/** One hypothesis at a time, as the decoder did before */
+struct EachBleu {
+  void operator()(const BleuStatsBlock& block, const vector<float>& bg, float* out) const {
+    float sent[kBleuNgramOrder * 2 + 1];
+    for (size_t i = 0; i < block.size; ++i) {
+      for (size_t k = 0; k < bg.size(); ++k) sent[k] = block.stats[k][i];
+      out[i] = sentenceLevelBackgroundBleu(sent, bg);
+    }
+  }
+};
+
+struct AllBleu {
+  explicit AllBleu(bool approximate) : m_approximate(approximate) {}
+  void operator()(const BleuStatsBlock& block, const vector<float>& bg, float* out) const {
+    sentenceLevelBackgroundBleu(block, bg, out, m_approximate);
+  }
+  bool m_approximate;
+};
+
+void Report(const string& name, const Result& result, const Result& baseline, size_t calls)
+{
+  cout << setw(24) << left << name << setw(10) << right << fixed << setprecision(1)
+       << result.seconds * 1e9 / calls << " ns/call " << setw(6) << setprecision(2)
+       << baseline.seconds / result.seconds << "x  checksum " << setprecision(6) << result.checksum << endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  if (argc != 1 && argc != 3 && argc != 4) {
+    cerr << "Usage: " << argv[0] << " [features scores [repeats]]" << endl;
+    return 1;
+  }
+  vector<string> featureFiles(1, argc > 1 ? argv[1] : "test_data/features.dat");
+  vector<string> scoreFiles(1, argc > 1 ? argv[2] : "test_data/scores.dat");
+  size_t repeats = argc > 3 ? atoi(argv[3]) : 200;
+
+  RandomAccessHypPackEnumerator train(featureFiles, scoreFiles, true);
+  vector<MiraFeatureView> hyps;
+  bool sparse = false;
+  for (size_t s = 0; s < train.num_sentences(); ++s) {
+    for (size_t i = 0; i < train.size(s); ++i) {
+      hyps.push_back(train.featuresAt(s, i));
+      sparse = sparse || hyps.back().num_sparse();
+    }
+  }
+  if (hyps.size() < 2) {
+    cerr << "Need at least two hypotheses" << endl;
+    return 1;
+  }
+  vector<ValType> weights(train.num_dense());
+  for (size_t i = 0; i < weights.size(); ++i) weights[i] = 0.1 * (i % 7) - 0.3;
+  MiraWeightVector wv(weights);
+  size_t calls = repeats * (hyps.size() - 1);
+  cout << hyps.size() << " hypotheses with " << train.num_dense() << " dense features, "
+       << repeats << " repeats" << endl;
+
+  const char* sets[] = {"scalar", "sse2", "avx2"};
+  size_t numSets = sizeof(sets) / sizeof(sets[0]);
+
+  cout << "score" << endl;
+  Result oldScore = Time(hyps, repeats, OldScore(weights));
+  Report("element-wise", oldScore, oldScore, calls);
+  for (size_t i = 0; i < numSets; ++i) {
+    if (!UseKernelInstructionSet(sets[i])) continue;
+    Report(string("kernel ") + sets[i], Time(hyps, repeats, KernelScore(wv)), oldScore, calls);
+  }
+
+  cout << "score whole n-best lists and find the best" << endl;
+  Result eachScore = TimeLists(train, repeats, EachScore(wv));
+  Report("one at a time", eachScore, eachScore, calls);
+  for (size_t i = 0; i < numSets; ++i) {
+    if (!UseKernelInstructionSet(sets[i])) continue;
+    Report(string("ScoreAll ") + sets[i], TimeLists(train, repeats, AllScore(wv)), eachScore, calls);
+  }
+
+  if (train.scoresAt(0, 0).size() == kBleuNgramOrder * 2 + 1) {
+    // The background is the sum of the first hypothesis of each sentence
+    vector<float> bg(kBleuNgramOrder * 2 + 1);
+    vector<SentenceStats> sentences(train.num_sentences());
+    size_t numHyps = 0;
+    for (size_t s = 0; s < train.num_sentences(); ++s) {
+      size_t size = train.size(s);
+      SentenceStats& sentence = sentences[s];
+      sentence.block.size = size;
+      if (!size) continue;
+      sentence.stats.resize(size * bg.size());
+      for (size_t k = 0; k < bg.size(); ++k) sentence.block.stats[k] = &sentence.stats[k * size];
+      for (size_t i = 0; i < size; ++i) {
+        ScoreDataView stats = train.scoresAt(s, i);
+        for (size_t k = 0; k < bg.size(); ++k) sentence.stats[k * size + i] = stats[k];
+        if (i == 0) for (size_t k = 0; k < bg.size(); ++k) bg[k] += stats[k];
+      }
+      numHyps += size;
+    }
+    cout << "background BLEU of whole n-best lists" << endl;
+    vector<float> exact(numHyps), approximate(numHyps);
+    Result eachBleu = TimeBleu(sentences, bg, repeats, EachBleu(), &exact);
+    Report("one at a time", eachBleu, eachBleu, repeats * numHyps);
+    Report("batch exact", TimeBleu(sentences, bg, repeats, AllBleu(false), &exact), eachBleu, repeats * numHyps);
+    Report("batch approximate", TimeBleu(sentences, bg, repeats, AllBleu(true), &approximate), eachBleu,
+           repeats * numHyps);
+    double maxError = 0;
+    for (size_t i = 0; i < numHyps; ++i) {
+      if (exact[i]) maxError = max(maxError, fabs(static_cast<double>(approximate[i]) / exact[i] - 1));
+    }
+    cout << "largest relative error of the approximation " << scientific << setprecision(2) << maxError << endl;
+    cout.unsetf(ios::floatfield);
+  }
+
+  if (sparse) {
+    cout << "Skipping the difference, which is benchmarked on dense features only" << endl;
+    return 0;
+  }
+  cout << "hope - fear score and squared norm" << endl;
+  Result oldDiff = Time(hyps, repeats, OldDiff(weights));
+  Report("subtract, score, norm", oldDiff, oldDiff, calls);
+  for (size_t i = 0; i < numSets; ++i) {
+    if (!UseKernelInstructionSet(sets[i])) continue;
+    Report(string("fused kernel ") + sets[i], Time(hyps, repeats, KernelDiff(weights)), oldDiff, calls);
+  }
+  return 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * Convert text feature and score data, as written by the extractor, into
+ * a binary n-best store that kbmira, mert and pro can map instead of
+ * parse. Several pairs of files are merged sentence by sentence.
+ **/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "Data.h"
+#include "Scorer.h"
+#include "ScorerFactory.h"
+#include "Timer.h"
+
+using namespace std;
+using namespace MosesTuning;
+
+namespace po = boost::program_options;
+
+int main(int argc, char** argv)
+{
+  ResetUserTime();
+
+  bool help;
+  vector<string> scoreFiles;
+  vector<string> featureFiles;
+  string outputFile;
+  string scorerType("BLEU");
+  string scorerConfig;
+  bool allowDuplicates;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+  ("help,h", po::value(&help)->zero_tokens()->default_value(false), "Print this help message and exit")
+  ("scfile,S", po::value<vector<string> >(&scoreFiles), "Scorer data files")
+  ("ffile,F", po::value<vector<string> > (&featureFiles), "Feature data files")
+  ("output-file,o", po::value<string>(&outputFile), "N-best store to write")
+  ("sctype,s", po::value<string>(&scorerType), "Scorer type that produced the scorer data (default BLEU)")
+  ("scconfig,c", po::value<string>(&scorerConfig), "Configuration string passed to the scorer")
+  ("allow-duplicates,d", po::value(&allowDuplicates)->zero_tokens()->default_value(false), "Omit the duplicate removal step")
+  ;
+
+  po::options_description cmdline_options;
+  cmdline_options.add(desc);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc,argv).
+            options(cmdline_options).run(), vm);
+  po::notify(vm);
+  if (help) {
+    cout << "Usage: " + string(argv[0]) +  " [options]" << endl;
+    cout << desc << endl;
+    exit(0);
+  }
+
+  if (featureFiles.size() == 0 || featureFiles.size() != scoreFiles.size()) {
+    cerr << "Error: Give the same number of feature and scorer data files" << endl;
+    exit(1);
+  }
+  if (outputFile.empty()) {
+    cerr << "Error: No output file given" << endl;
+    exit(1);
+  }
+
+  try {
+    boost::scoped_ptr<Scorer> scorer(ScorerFactory::getScorer(scorerType, scorerConfig));
+    Data data(scorer.get());
+    for (size_t i = 0; i < featureFiles.size(); ++i) {
+      data.load(featureFiles[i], scoreFiles[i]);
+    }
+    if (!allowDuplicates) {
+      data.removeDuplicates();
+    }
+    data.saveStore(outputFile);
+    PrintUserTime("Stopping...");
+  } catch (const exception& e) {
+    cerr << "Exception: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -120,8 +120,8 @@ int main(int argc, char** argv)
   po::options_description desc("Allowed options");
   desc.add_options()
   ("help,h", po::value(&help)->zero_tokens()->default_value(false), "Print this help message and exit")
-  ("scfile,S", po::value<vector<string> >(&scoreFiles), "Scorer data files")
-  ("ffile,F", po::value<vector<string> > (&featureFiles), "Feature data files")
+  ("scfile,S", po::value<vector<string> >(&scoreFiles), "Scorer data files, or n-best stores")
+  ("ffile,F", po::value<vector<string> > (&featureFiles), "Feature data files, or n-best stores (given as both feature and scorer file)")
   ("random-seed,r", po::value<int>(&seed), "Seed for random number generation")
   ("output-file,o", po::value<string>(&outputFile), "Output file")
   ("smooth-brevity-penalty,b", po::value(&smoothBP)->zero_tokens()->default_value(false), "Smooth the brevity penalty, as in Nakov et al. (Coling 2012)")